@@ -578,6 +578,30 @@ class CIVETWEB_CXX_API CivetServer
 	 */
 	static std::string getPostData(struct mg_connection *conn);
 
+	/**
+	 * setOutputBuffering(struct mg_connection *, size_t)
+	 *
+	 * Collects the output of a handler in a buffer, so many small
+	 * mg_printf/mg_write calls result in few send calls.
+	 * The buffer is sent when it is full, at the end of the request,
+	 * or when flush() is called. A size of 0 disables buffering.
+	 *
+	 * @param conn - the connection information
+	 * @param size - size of the output buffer in bytes
+	 * @return true on success, false if buffered data could not be sent
+	 */
+	static bool setOutputBuffering(struct mg_connection *conn, size_t size);
+
+	/**
+	 * flush(struct mg_connection *)
+	 *
+	 * Sends all buffered output (see setOutputBuffering) to the client.
+	 *
+	 * @param conn - the connection information
+	 * @return true on success, false on error
+	 */
+	static bool flush(struct mg_connection *conn);
+
 	/**
 	 * urlDecode(const std::string &, std::string &, bool)
 	 *
@@ -394,7 +394,8 @@ struct mg_callbacks {
 	 * Parameters:
 	 *   ctx: context handle
 	 *   thread_type:
-	 *     0 indicates the master thread
+	 *     0 indicates the master thread (or an additional acceptor thread,
+	 *       see the "acceptor_threads" option)
 	 *     1 indicates a worker thread handling client connections
 	 *     2 indicates an internal helper thread (timer thread)
 	 * Return value:
@@ -561,6 +562,22 @@ CIVETWEB_API void mg_set_request_handler(struct mg_context *ctx,
          1: keep this websocket connection open.
          0: close this websocket connection.
 
+   mg_websocket_stream_handler
+       Is called instead of the data handler, if the handlers have been set
+       using mg_set_websocket_stream_handler. The payload of a data frame is
+       not collected in one buffer, it is passed in slices as soon as they
+       have been received. Control frames and compressed frames are passed
+       in one slice.
+       Parameters:
+         bits: first byte of the websocket frame, like for the data handler
+         data, data_len: slice of the payload, with mask (if any) already
+               applied. The data is only valid until the handler returns.
+         offset: position of the slice in the payload of the frame.
+         final: 1 for the last slice of the frame, 0 for all others.
+       Return value:
+         1: keep this websocket connection open.
+         0: close this websocket connection.
+
    mg_connection_close_handler
        Is called, when the connection is closed.*/
 typedef int (*mg_websocket_connect_handler)(const struct mg_connection *,
@@ -571,6 +588,13 @@ typedef int (*mg_websocket_data_handler)(struct mg_connection *,
                                          char *,
                                          size_t,
                                          void *);
+typedef int (*mg_websocket_stream_handler)(struct mg_connection *,
+                                           int,
+                                           char *,
+                                           size_t,
+                                           unsigned long long,
+                                           int,
+                                           void *);
 typedef void (*mg_websocket_close_handler)(const struct mg_connection *,
                                            void *);
 
@@ -611,6 +635,21 @@ CIVETWEB_API void mg_set_websocket_handler_with_subprotocols(
     void *cbdata);
 
 
+/* mg_set_websocket_stream_handler
+
+   Set or remove handler functions for websocket connections, receiving
+   the payload of large frames in slices (see mg_websocket_stream_handler).
+   This function works similar to mg_set_websocket_handler - see there. */
+CIVETWEB_API void
+mg_set_websocket_stream_handler(struct mg_context *ctx,
+                                const char *uri,
+                                mg_websocket_connect_handler connect_handler,
+                                mg_websocket_ready_handler ready_handler,
+                                mg_websocket_stream_handler stream_handler,
+                                mg_websocket_close_handler close_handler,
+                                void *cbdata);
+
+
 /* mg_authorization_handler
 
    Callback function definition for mg_set_auth_handler
@@ -827,24 +866,138 @@ mg_get_response_info(const struct mg_connection *);
 CIVETWEB_API int mg_write(struct mg_connection *, const void *buf, size_t len);
 
 
+/* Buffer for mg_writev */
+struct mg_iovec {
+	const void *buf;
+	size_t len;
+};
+
+
+/* Send data from several buffers to the client. For plain (non TLS)
+   connections, all buffers are passed to the operating system in one
+   call (gather write), e.g., to send a header and a payload in one TCP
+   segment. For TLS connections, small buffers are combined into one
+   TLS record.
+   Return:
+    0   when the connection has been closed
+    -1  on error
+    >0  number of bytes written on success */
+CIVETWEB_API int
+mg_writev(struct mg_connection *conn, const struct mg_iovec *iov, int iovcnt);
+
+
+/* Buffer the output of a connection. Data written by mg_write, mg_writev
+   and mg_printf is collected in a buffer of the given size and sent when
+   the buffer is full, at the end of a chunk (mg_send_chunk), at the end
+   of the request, before mg_read waits for data from the client, or when
+   mg_flush is called. A size of 0 sends all
+   buffered data and disables buffering.
+   For server connections, buffering starts with the size set in the
+   "output_buffer_size" option for every request, and ends with the
+   request.
+   Return:
+    0   on success
+    -1  on error (buffered data could not be sent) */
+CIVETWEB_API int mg_set_output_buffering(struct mg_connection *conn,
+                                         size_t size);
+
+
+/* Send all buffered data (see mg_set_output_buffering) to the client.
+   If the "tcp_cork" option is set, a partial TCP segment is sent as well.
+   Return:
+    0   on success
+    -1  on error */
+CIVETWEB_API int mg_flush(struct mg_connection *conn);
+
+
 /* Send data to a websocket client wrapped in a websocket frame.  Uses
    mg_lock_connection to ensure that the transmission is not interrupted,
    i.e., when the application is proactively communicating and responding to
    a request simultaneously.
 
    Send data to a websocket client wrapped in a websocket frame.
+   If websocket_send_queue_size is set, the frame is queued and sent in the
+   background, so this function does not wait for slow clients. Then it
+   returns 0 if the frame has been dropped (websocket_send_queue_policy
+   "drop"), and -1 if the connection has been closed because the queue is
+   full.
    This function is available when civetweb is compiled with -DUSE_WEBSOCKET
 
    Return:
     0   when the connection has been closed
     -1  on error
-    >0  number of bytes written on success */
+    >0  number of bytes written (or queued) on success */
 CIVETWEB_API int mg_websocket_write(struct mg_connection *conn,
                                     int opcode,
                                     const char *data,
                                     size_t data_len);
 
 
+/* Send the same data to several websocket clients.
+   The websocket frame is created (and compressed) only once, and written
+   to all clients at the same time. Clients that accept only a part of the
+   frame within websocket_broadcast_timeout_ms are closed ("slow consumers"),
+   clients that could not get any data in this time miss the message.
+   All connections must be websocket connections of the same server, and
+   must not be closed while this function is running. Do not call this
+   function while holding mg_lock_connection() of another connection.
+   This function is available when civetweb is compiled with -DUSE_WEBSOCKET
+
+   Return:
+    -1  on error
+    >=0 number of clients the data has been sent to */
+CIVETWEB_API int mg_websocket_broadcast(struct mg_connection **conns,
+                                        unsigned int num_conns,
+                                        int opcode,
+                                        const char *data,
+                                        size_t data_len);
+
+
+/* Named groups of websocket connections of a server ("channels").
+   A channel exists as long as it has members. Closed connections leave all
+   channels automatically. mg_websocket_channel_broadcast sends data to all
+   members of a channel, like mg_websocket_broadcast, and may be called by
+   any thread. Do not call these functions while holding
+   mg_lock_connection().
+   These functions are available when civetweb is compiled with
+   -DUSE_WEBSOCKET
+
+   Return:
+    mg_websocket_channel_join: 0 on success, -1 on error
+    mg_websocket_channel_leave: 0 on success, -1 if not a member
+    mg_websocket_channel_broadcast: like mg_websocket_broadcast */
+CIVETWEB_API int mg_websocket_channel_join(struct mg_connection *conn,
+                                           const char *channel);
+CIVETWEB_API int mg_websocket_channel_leave(struct mg_connection *conn,
+                                            const char *channel);
+CIVETWEB_API int mg_websocket_channel_broadcast(struct mg_context *ctx,
+                                                const char *channel,
+                                                int opcode,
+                                                const char *data,
+                                                size_t data_len);
+
+
+/* State of the send queue of a websocket connection
+   (see websocket_send_queue_size). */
+struct mg_websocket_send_queue_info {
+	size_t queued_bytes;               /* Bytes not sent yet */
+	unsigned queued_frames;            /* Frames not sent completely yet */
+	size_t high_water;                 /* websocket_send_queue_size */
+	unsigned long long dropped_frames; /* Frames dropped (queue full) */
+};
+
+
+/* Get the state of the send queue of a websocket server connection.
+   This function is available when civetweb is compiled with -DUSE_WEBSOCKET
+
+   Return:
+    0   on success
+    -1  on error, or if send queues are disabled */
+CIVETWEB_API int
+mg_websocket_get_send_queue_info(struct mg_connection *conn,
+                                 struct mg_websocket_send_queue_info *info);
+
+
 /* Send data to a websocket server wrapped in a masked websocket frame.  Uses
    mg_lock_connection to ensure that the transmission is not interrupted,
    i.e., when the application is proactively communicating and responding to
@@ -695,6 +695,18 @@ CivetServer::getPostData(struct mg_connection *conn)
 	return postdata;
 }
 
+bool
+CivetServer::setOutputBuffering(struct mg_connection *conn, size_t size)
+{
+	return mg_set_output_buffering(conn, size) == 0;
+}
+
+bool
+CivetServer::flush(struct mg_connection *conn)
+{
+	return mg_flush(conn) == 0;
+}
+
 void
 CivetServer::urlEncode(const char *src, std::string &dst, bool append)
 {
@@ -149,6 +149,62 @@ mg_static_assert(sizeof(void *) >= sizeof(int), "data type size check");
 /* Use a default implementation */
 #define NO_ALTERNATIVE_QUEUE
 #endif
+/* LOCKFREE_QUEUE replaces the mutex protected ring buffer of the default
+ * queue implementation by a bounded lock-free ring. Worker threads only
+ * take the thread mutex to go to sleep if the queue is empty, the master
+ * thread only takes it to wake them up again. */
+#if defined(LOCKFREE_QUEUE) && defined(ALTERNATIVE_QUEUE)
+#error "LOCKFREE_QUEUE can not be combined with ALTERNATIVE_QUEUE"
+#endif
+
+/* Parking of idle keep-alive connections requires epoll, so it is only
+ * available for Linux. Use NO_KEEP_ALIVE_PARKING to remove it from the
+ * build. If it is compiled in, it is still disabled by default and must be
+ * activated using the "enable_keep_alive_parking" configuration option. */
+#if defined(__linux__) && !defined(NO_KEEP_ALIVE_PARKING)                     \
+    && !defined(USE_KEEP_ALIVE_PARKING)
+#define USE_KEEP_ALIVE_PARKING
+#endif
+
+/* Additional acceptor threads with their own SO_REUSEPORT listening sockets
+ * rely on the Linux kernel to distribute new connections among them. Use
+ * NO_REUSEPORT_ACCEPTORS to remove them from the build. They are configured
+ * using the "acceptor_threads" option. */
+#if defined(__linux__) && !defined(NO_REUSEPORT_ACCEPTORS)                    \
+    && !defined(USE_REUSEPORT_ACCEPTORS)
+#define USE_REUSEPORT_ACCEPTORS
+#endif
+
+/* Event loop for websocket connections (see websocket_reactor.inl), so a
+ * websocket does not block a worker thread for its whole lifetime. It
+ * requires epoll, so it is only available for Linux. Use
+ * NO_WEBSOCKET_REACTOR to remove it from the build. If it is compiled in,
+ * it is still disabled by default and must be activated using the
+ * "websocket_dispatch_threads" configuration option. */
+#if defined(USE_WEBSOCKET) && defined(__linux__)                              \
+    && !defined(NO_WEBSOCKET_REACTOR) && !defined(USE_WEBSOCKET_REACTOR)
+#define USE_WEBSOCKET_REACTOR
+#endif
+
+/* Vector kernels for masking websocket payloads (see websocket_mask.inl).
+ * SSE2 and NEON are used if the compiler targets them. AVX2 is compiled in
+ * for x86 as well, but only used if the CPU supports it (checked at
+ * runtime). Use NO_WEBSOCKET_SIMD to remove them from the build. */
+#if defined(USE_WEBSOCKET) && !defined(NO_WEBSOCKET_SIMD)
+#if defined(__SSE2__) || defined(_M_X64)                                       \
+    || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define USE_WEBSOCKET_SSE2
+#if defined(__clang__)                                                         \
+    || (defined(__GNUC__)                                                      \
+        && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9))))    \
+    || (defined(_MSC_VER) && (_MSC_VER >= 1800))
+#define USE_WEBSOCKET_AVX2
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)     \
+    || defined(_M_ARM64)
+#define USE_WEBSOCKET_NEON
+#endif
+#endif
 
 #if defined(NO_FILESYSTEMS) && !defined(NO_FILES)
 /* File system access:
@@ -168,6 +224,34 @@ mg_static_assert(sizeof(void *) >= sizeof(int), "data type size check");
 #error "Inconsistent build flags, NO_FILESYSTEMS requires NO_FILES"
 #endif
 
+/* Cache for file status information and open files (see file_cache.inl).
+ * Use NO_FILE_CACHE to remove it from the build. If it is compiled in, it
+ * is still disabled by default and must be activated using the
+ * "static_file_cache_entries" configuration option. */
+#if !defined(NO_FILESYSTEMS) && !defined(NO_FILE_CACHE) && !defined(_WIN32)   \
+    && !defined(__ZEPHYR__) && !defined(USE_FILE_CACHE)
+#define USE_FILE_CACHE
+#endif
+
+/* Cache for complete responses of small static files (see
+ * response_cache.inl). Use NO_RESPONSE_CACHE to remove it from the build.
+ * It is disabled by default and must be activated using the
+ * "response_cache_size" configuration option. */
+#if !defined(NO_FILESYSTEMS) && !defined(NO_RESPONSE_CACHE)                    \
+    && !defined(NO_RESPONSE_BUFFERING) && !defined(USE_RESPONSE_CACHE)
+#define USE_RESPONSE_CACHE
+#endif
+
+/* USE_MMAP: large static files are sent from memory mapped windows of the
+ * file, if sendfile cannot be used (TLS, throttling, allow_sendfile_call=no).
+ * Not enabled by default: if a file is truncated while it is mapped, the
+ * access to the missing pages raises SIGBUS and terminates the server.
+ * Only use it if served files are never truncated while they are sent. */
+#if defined(USE_MMAP)                                                          \
+    && (defined(NO_FILESYSTEMS) || defined(_WIN32) || defined(__ZEPHYR__))
+#undef USE_MMAP
+#endif
+
 /* DTL -- including winsock2.h works better if lean and mean */
 #if !defined(WIN32_LEAN_AND_MEAN)
 #define WIN32_LEAN_AND_MEAN
@@ -450,6 +534,20 @@ _civet_safe_clock_gettime(int clk_id, struct timespec *t)
 #include "zlib-ng.h"
 #endif
 
+/* Brotli and Zstandard are additional encodings for on the fly compression.
+ * Precompressed files (*.br, *.zst) can be used without them. */
+#if (defined(USE_BROTLI) || defined(USE_ZSTD)) && !defined(USE_ZLIB)
+#error "USE_BROTLI and USE_ZSTD require USE_ZLIB"
+#endif
+
+#if defined(USE_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+#if defined(USE_ZSTD)
+#include <zstd.h>
+#endif
+
 /********************************************************************/
 /* CivetWeb configuration defines */
 /********************************************************************/
@@ -504,6 +602,17 @@ _civet_safe_clock_gettime(int clk_id, struct timespec *t)
 
 #include <stdint.h>
 
+/* Vector kernels for websocket masking */
+#if defined(USE_WEBSOCKET_AVX2) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(USE_WEBSOCKET_SSE2) || defined(USE_WEBSOCKET_AVX2)
+#include <immintrin.h>
+#endif
+#if defined(USE_WEBSOCKET_NEON)
+#include <arm_neon.h>
+#endif
+
 /* Standard defines */
 #if !defined(INT64_MAX)
 #define INT64_MAX (9223372036854775807)
@@ -810,6 +919,7 @@ clock_gettime(clockid_t clk_id, struct timespec *tp)
 
 static int pthread_mutex_lock(pthread_mutex_t *);
 static int pthread_mutex_unlock(pthread_mutex_t *);
+static int pthread_mutex_trylock(pthread_mutex_t *);
 static void path_to_unicode(const struct mg_connection *conn,
                             const char *path,
                             wchar_t *wbuf,
@@ -887,6 +997,15 @@ typedef unsigned short int in_port_t;
 #if defined(USE_X_DOM_SOCKET)
 #include <sys/un.h>
 #endif
+#if defined(USE_KEEP_ALIVE_PARKING) || defined(USE_WEBSOCKET_REACTOR)
+#include <sys/epoll.h>
+#endif
+#if defined(USE_WEBSOCKET_REACTOR)
+#include <sys/eventfd.h>
+#endif
+#if defined(USE_MMAP)
+#include <sys/mman.h>
+#endif
 #endif
 
 #define vsnprintf_impl vsnprintf
@@ -910,8 +1029,14 @@ typedef unsigned short int in_port_t;
 #define O_BINARY (0)
 #endif /* O_BINARY */
 #define closesocket(a) (close(a))
+#if defined(USE_FILE_CACHE)
+/* Remove modified paths from the file cache */
+#define mg_mkdir(conn, path, mode) (file_cache_mkdir(conn, path, mode))
+#define mg_remove(conn, x) (file_cache_remove(conn, x))
+#else
 #define mg_mkdir(conn, path, mode) (mkdir(path, mode))
 #define mg_remove(conn, x) (remove(x))
+#endif
 #define mg_sleep(x) (usleep((x)*1000))
 #define mg_opendir(conn, x) (opendir(x))
 #define mg_closedir(x) (closedir(x))
@@ -1157,7 +1282,7 @@ mg_atomic_dec(volatile ptrdiff_t *addr)
 }
 
 
-#if defined(USE_SERVER_STATS) || defined(STOP_FLAG_NEEDS_LOCK)
+FUNCTION_MAY_BE_UNUSED
 static ptrdiff_t
 mg_atomic_add(volatile ptrdiff_t *addr, ptrdiff_t value)
 {
@@ -1209,6 +1334,9 @@ mg_atomic_compare_and_swap(volatile ptrdiff_t *addr,
 }
 
 
+#if defined(USE_SERVER_STATS) || defined(STOP_FLAG_NEEDS_LOCK)              \
+    || defined(LOCKFREE_QUEUE)
+FUNCTION_MAY_BE_UNUSED
 static void
 mg_atomic_max(volatile ptrdiff_t *addr, ptrdiff_t value)
 {
@@ -1238,6 +1366,7 @@ mg_atomic_max(volatile ptrdiff_t *addr, ptrdiff_t value)
 }
 
 
+FUNCTION_MAY_BE_UNUSED
 static int64_t
 mg_atomic_add64(volatile int64_t *addr, int64_t value)
 {
@@ -1586,6 +1715,9 @@ struct mg_workerTLS {
 #if defined(MG_ALLOW_USING_GET_REQUEST_INFO_FOR_RESPONSE)
 	char txtbuf[4];
 #endif
+#if defined(USE_IO_URING)
+	struct mg_uring *uring; /* io_uring of a worker thread, or NULL */
+#endif
 };
 
 
@@ -1807,6 +1939,16 @@ typedef struct SSL_CTX SSL_CTX;
 #endif /* Various SSL bindings */
 
 
+/* Kernel TLS (OpenSSL 3.0 on Linux): the TLS record layer of a connection
+ * is handled by the kernel, so files can be sent using sendfile also for
+ * HTTPS connections. */
+#if defined(__linux__) && !defined(NO_SSL) && !defined(USE_MBEDTLS)          \
+    && defined(OPENSSL_API_3_0) && defined(SSL_OP_ENABLE_KTLS)                \
+    && !defined(NO_KTLS)
+#define USE_KTLS
+#endif
+
+
 #if !defined(NO_CACHING)
 static const char month_names[][4] = {"Jan",
                                       "Feb",
@@ -1862,20 +2004,50 @@ struct vec {
 	size_t len;
 };
 
+/* Content encodings of static files, in ascending order of preference */
+enum {
+	MG_ENCODING_IDENTITY = 0,
+	MG_ENCODING_GZIP,
+	MG_ENCODING_ZSTD,
+	MG_ENCODING_BR,
+	MG_ENCODING_COUNT
+};
+
+static const struct {
+	const char *name; /* Token for Accept-Encoding and Content-Encoding */
+	const char *ext;  /* Extension of precompressed files */
+} content_encodings[MG_ENCODING_COUNT] = {{"identity", ""},
+                                          {"gzip", ".gz"},
+                                          {"zstd", ".zst"},
+                                          {"br", ".br"}};
+
 struct mg_file_stat {
 	/* File properties filled by mg_stat: */
 	uint64_t size;
 	time_t last_modified;
 	int is_directory; /* Set to 1 if mg_stat is called for a directory */
-	int is_gzipped;   /* Set to 1 if the content is gzipped, in which
-	                   * case we need a "Content-Eencoding: gzip" header */
+	int encoding;     /* Set to MG_ENCODING_* for a precompressed variant
+	                   * of the requested file, in which case we need a
+	                   * "Content-Encoding" header */
 	int location;     /* 0 = nowhere, 1 = on disk, 2 = in memory */
 };
 
 
+#if defined(USE_FILE_CACHE)
+struct mg_file_cache;
+struct mg_file_cache_entry;
+#endif
+
 struct mg_file_access {
 	/* File properties filled by mg_fopen: */
 	FILE *fp;
+#if defined(USE_FILE_CACHE)
+	/* Filled by file_cache_open (instead of fp), or by mg_fopen for files
+	 * opened for writing: */
+	struct mg_file_cache *cache;
+	struct mg_file_cache_entry *cached; /* Open file from the cache */
+	char *written_path; /* Remove from the cache in mg_fclose */
+#endif
 };
 
 struct mg_file {
@@ -1888,10 +2060,16 @@ struct mg_file {
 	{                                                                          \
 		{(uint64_t)0, (time_t)0, 0, 0, 0},                                     \
 		{                                                                      \
-			(FILE *)NULL                                                       \
+			(FILE *)NULL FILE_CACHE_ACCESS_INITIALIZER                         \
 		}                                                                      \
 	}
 
+#if defined(USE_FILE_CACHE)
+#define FILE_CACHE_ACCESS_INITIALIZER , NULL, NULL, NULL
+#else
+#define FILE_CACHE_ACCESS_INITIALIZER
+#endif
+
 
 /* Describes listening socket, or socket which was accept()-ed by the master
  * thread and queued for future handling by the worker thread. */
@@ -1903,7 +2081,54 @@ struct socket {
 	unsigned char ssl_redir; /* Is port supposed to redirect everything to SSL
 	                          * port */
 	unsigned char in_use;    /* 0: invalid, 1: valid, 2: free */
+	unsigned char client_counted; /* Counted in the client table */
+#if defined(USE_KEEP_ALIVE_PARKING)
+	struct mg_parked_conn *parked; /* Saved connection state, if the socket
+	                                * comes back from the keep-alive reactor,
+	                                * NULL for a newly accepted socket */
+#endif
+};
+
+
+#if defined(USE_KEEP_ALIVE_PARKING)
+/* Idle keep-alive connection, waiting in the reactor of the master thread
+ * for the next request to arrive. */
+struct mg_parked_conn {
+	struct socket client;      /* Connected client */
+	void *conn_data;           /* User defined connection data */
+	time_t conn_birth_time;    /* Time when the connection was established */
+	int handled_requests;      /* Requests handled so far */
+	int expired;               /* 1: keep_alive_timeout_ms elapsed */
+	struct timespec park_time; /* Time (since system start) of parking */
+	struct mg_parked_conn *prev;
+	struct mg_parked_conn *next;
+};
+#endif
+
+
+#if defined(USE_REUSEPORT_ACCEPTORS)
+/* Additional acceptor thread. It accepts connections from its own
+ * SO_REUSEPORT twins of the listening sockets of the master thread. */
+struct mg_acceptor {
+	struct mg_context *ctx;
+	pthread_t threadid;
+	unsigned int index;      /* 1 .. cfg_acceptor_threads - 1 */
+	struct socket *socks;    /* Twins of ctx->listening_sockets */
+	struct mg_pollfd *pfd;   /* One entry for every socket */
+	unsigned int num_socks;
+};
+#endif
+
+
+#if defined(LOCKFREE_QUEUE)
+/* Cell of the lock-free socket queue. The sequence number tells producers
+ * and consumers, if the cell is free for a position or if it holds the
+ * socket produced for a position (see sq_try_push and sq_try_pop). */
+struct mg_queue_cell {
+	volatile ptrdiff_t seq;
+	struct socket sock;
 };
+#endif
 
 
 /* Enum const for all options must be in sync with
@@ -1922,19 +2147,52 @@ enum {
 	LINGER_TIMEOUT,
 	CONNECTION_QUEUE_SIZE,
 	LISTEN_BACKLOG_SIZE,
+#if defined(USE_REUSEPORT_ACCEPTORS)
+	ACCEPTOR_THREADS,
+#endif
 #if defined(__linux__)
 	ALLOW_SENDFILE_CALL,
+	CONFIG_TCP_CORK, /* Prepended CONFIG_ to avoid conflict with the
+	                  * socket option TCP_CORK. */
 #endif
 #if defined(_WIN32)
 	CASE_SENSITIVE_FILES,
 #endif
 	THROTTLE,
+	MAX_CONNECTIONS_PER_IP,
+	MAX_REQUEST_RATE_PER_IP,
+	OUTPUT_BUFFER_SIZE,
+#if defined(USE_FILE_CACHE)
+	STATIC_FILE_CACHE_ENTRIES,
+	STATIC_FILE_CACHE_TTL,
+#endif
+#if defined(USE_RESPONSE_CACHE)
+	RESPONSE_CACHE_SIZE,
+	RESPONSE_CACHE_MAX_FILE_SIZE,
+#endif
+#if !defined(NO_FILESYSTEMS)
+	DIRECTORY_LISTING_CACHE_SIZE,
+#endif
+#if defined(USE_ZLIB)
+	COMPRESSION_LEVEL,
+	COMPRESSION_CACHE_SIZE,
+#endif
 	ENABLE_KEEP_ALIVE,
 	REQUEST_TIMEOUT,
 	KEEP_ALIVE_TIMEOUT,
+#if defined(USE_KEEP_ALIVE_PARKING)
+	ENABLE_KEEP_ALIVE_PARKING,
+#endif
 #if defined(USE_WEBSOCKET)
 	WEBSOCKET_TIMEOUT,
 	ENABLE_WEBSOCKET_PING_PONG,
+	WEBSOCKET_BROADCAST_TIMEOUT,
+	WEBSOCKET_SEND_QUEUE_SIZE,
+	WEBSOCKET_SEND_QUEUE_POLICY,
+	WEBSOCKET_MAX_MESSAGE_SIZE,
+#endif
+#if defined(USE_WEBSOCKET_REACTOR)
+	WEBSOCKET_DISPATCH_THREADS,
 #endif
 	DECODE_URL,
 #if defined(USE_LUA)
@@ -2060,19 +2318,51 @@ static const struct mg_option config_options[] = {
     {"linger_timeout_ms", MG_CONFIG_TYPE_NUMBER, NULL},
     {"connection_queue", MG_CONFIG_TYPE_NUMBER, "20"},
     {"listen_backlog", MG_CONFIG_TYPE_NUMBER, "200"},
+#if defined(USE_REUSEPORT_ACCEPTORS)
+    {"acceptor_threads", MG_CONFIG_TYPE_NUMBER, "1"},
+#endif
 #if defined(__linux__)
     {"allow_sendfile_call", MG_CONFIG_TYPE_BOOLEAN, "yes"},
+    {"tcp_cork", MG_CONFIG_TYPE_BOOLEAN, "no"},
 #endif
 #if defined(_WIN32)
     {"case_sensitive", MG_CONFIG_TYPE_BOOLEAN, "no"},
 #endif
     {"throttle", MG_CONFIG_TYPE_STRING_LIST, NULL},
+    {"max_connections_per_ip", MG_CONFIG_TYPE_NUMBER, "0"},
+    {"max_request_rate_per_ip", MG_CONFIG_TYPE_NUMBER, "0"},
+    {"output_buffer_size", MG_CONFIG_TYPE_NUMBER, "0"},
+#if defined(USE_FILE_CACHE)
+    {"static_file_cache_entries", MG_CONFIG_TYPE_NUMBER, "0"},
+    {"static_file_cache_ttl_ms", MG_CONFIG_TYPE_NUMBER, "1000"},
+#endif
+#if defined(USE_RESPONSE_CACHE)
+    {"response_cache_size", MG_CONFIG_TYPE_NUMBER, "0"},
+    {"response_cache_max_file_size", MG_CONFIG_TYPE_NUMBER, "16384"},
+#endif
+#if !defined(NO_FILESYSTEMS)
+    {"directory_listing_cache_size", MG_CONFIG_TYPE_NUMBER, "0"},
+#endif
+#if defined(USE_ZLIB)
+    {"compression_level", MG_CONFIG_TYPE_NUMBER, "9"},
+    {"compression_cache_size", MG_CONFIG_TYPE_NUMBER, "0"},
+#endif
     {"enable_keep_alive", MG_CONFIG_TYPE_BOOLEAN, "no"},
     {"request_timeout_ms", MG_CONFIG_TYPE_NUMBER, "30000"},
     {"keep_alive_timeout_ms", MG_CONFIG_TYPE_NUMBER, "500"},
+#if defined(USE_KEEP_ALIVE_PARKING)
+    {"enable_keep_alive_parking", MG_CONFIG_TYPE_BOOLEAN, "no"},
+#endif
 #if defined(USE_WEBSOCKET)
     {"websocket_timeout_ms", MG_CONFIG_TYPE_NUMBER, NULL},
     {"enable_websocket_ping_pong", MG_CONFIG_TYPE_BOOLEAN, "no"},
+    {"websocket_broadcast_timeout_ms", MG_CONFIG_TYPE_NUMBER, "1000"},
+    {"websocket_send_queue_size", MG_CONFIG_TYPE_NUMBER, "0"},
+    {"websocket_send_queue_policy", MG_CONFIG_TYPE_STRING, "block"},
+    {"websocket_max_message_size", MG_CONFIG_TYPE_NUMBER, "0"},
+#endif
+#if defined(USE_WEBSOCKET_REACTOR)
+    {"websocket_dispatch_threads", MG_CONFIG_TYPE_NUMBER, "0"},
 #endif
     {"decode_url", MG_CONFIG_TYPE_BOOLEAN, "yes"},
 #if defined(USE_LUA)
@@ -2205,6 +2495,24 @@ mg_static_assert((sizeof(config_options) / sizeof(config_options[0]))
                  "config_options and enum not sync");
 
 
+/* Patterns (see match_prefix) compiled to a sequence of tokens, terminated
+ * by PATTERN_END. Alternatives are separated by PATTERN_OR. */
+enum {
+	PATTERN_END,   /* end of the pattern */
+	PATTERN_OR,    /* '|': next alternative */
+	PATTERN_CHAR,  /* character, compared case insensitive */
+	PATTERN_ANY,   /* '?': any character */
+	PATTERN_STAR,  /* '*': any number of characters except '/' */
+	PATTERN_DSTAR, /* '**': any number of characters */
+	PATTERN_EOS    /* '$': end of string */
+};
+
+struct mg_pattern_token {
+	unsigned char type;
+	unsigned char ch; /* lower case character for PATTERN_CHAR */
+};
+
+
 enum { REQUEST_HANDLER, WEBSOCKET_HANDLER, AUTH_HANDLER };
 
 
@@ -2218,13 +2526,13 @@ struct mg_handler_info {
 
 	/* Handler for http/https or authorization requests. */
 	mg_request_handler handler;
-	unsigned int refcount;
-	int removing;
+	volatile ptrdiff_t refcount; /* requests currently using the handler */
 
 	/* Handler for ws/wss (websocket) requests. */
 	mg_websocket_connect_handler connect_handler;
 	mg_websocket_ready_handler ready_handler;
 	mg_websocket_data_handler data_handler;
+	mg_websocket_stream_handler stream_handler;
 	mg_websocket_close_handler close_handler;
 
 	/* accepted subprotocols for ws/wss requests. */
@@ -2241,6 +2549,36 @@ struct mg_handler_info {
 };
 
 
+/* Handler lookup table, compiled from the handler list of a domain.
+ * All URIs are stored in a radix tree (keys in lower case, to support the
+ * case insensitive prefix match of match_prefix). URIs containing pattern
+ * characters are additionally stored in an ordered list of glob patterns.
+ * A table is never modified after it has been built: changing a handler
+ * builds and publishes a new table (see mg_set_handler_type). */
+struct mg_handler_entry {
+	struct mg_handler_info *rh;
+	size_t order; /* position in the handler list */
+	int is_glob;  /* URI contains pattern characters */
+	const struct mg_pattern_token *pattern; /* compiled URI, if is_glob */
+	struct mg_handler_entry *next; /* next entry with the same key */
+};
+
+struct mg_handler_node {
+	const char *key; /* lower case edge label (not 0 terminated) */
+	size_t key_len;
+	struct mg_handler_entry *entries; /* entries ending at this node */
+	struct mg_handler_node *children;
+	struct mg_handler_node *sibling;
+};
+
+struct mg_handler_table {
+	struct mg_handler_node *root[3]; /* one tree per handler type */
+	struct mg_handler_entry **globs[3];
+	size_t num_globs[3];
+	struct mg_handler_node *free_node; /* node allocator while building */
+};
+
+
 enum {
 	CONTEXT_INVALID,
 	CONTEXT_SERVER,
@@ -2249,12 +2587,75 @@ enum {
 };
 
 
+/* Token bucket used to limit the bandwidth (see throttle.inl) */
+struct mg_throttle_bucket {
+	double tokens;    /* Bytes that may be sent without waiting */
+	uint64_t last_ns; /* Time of the last refill, 0 if not used yet */
+};
+
+struct mg_throttle;
+struct mg_throttle_rule;
+
+
+/* Configuration values required on hot paths (for every request, read or
+ * write), converted from the configuration strings once, when a context or
+ * domain is created (see init_domain_config). */
+struct mg_domain_config {
+	int request_timeout_ms;    /* REQUEST_TIMEOUT, or its default */
+	int keep_alive_timeout_ms; /* KEEP_ALIVE_TIMEOUT, if has_keep_alive_t. */
+	int linger_timeout_ms;     /* LINGER_TIMEOUT, -2 if not set */
+	int static_file_max_age;   /* STATIC_FILE_MAX_AGE, 0 if not set */
+	int output_buffer_size;    /* OUTPUT_BUFFER_SIZE, 0 = not buffered */
+#if defined(USE_WEBSOCKET)
+	int websocket_timeout_ms; /* WEBSOCKET_TIMEOUT, 0 if not set */
+#endif
+#if defined(USE_TIMERS)
+	/* CGI_TIMEOUT, CGI2_TIMEOUT, ... in seconds (REQUEST_TIMEOUT default) */
+	double cgi_timeout[(PUT_DELETE_PASSWORDS_FILE - CGI_EXTENSIONS)
+	                   / (CGI2_EXTENSIONS - CGI_EXTENSIONS)];
+#endif
+	unsigned char has_request_timeout;    /* REQUEST_TIMEOUT is set */
+	unsigned char has_keep_alive_timeout; /* KEEP_ALIVE_TIMEOUT is set */
+	unsigned char enable_keep_alive;
+	unsigned char decode_url;
+	unsigned char tcp_nodelay;
+	unsigned char enable_directory_listing;
+	unsigned char allow_index_script_sub_res;
+	unsigned char enable_auth_domain_check;
+	unsigned char ssl_short_trust;
+#if defined(__linux__)
+	unsigned char allow_sendfile_call;
+	unsigned char tcp_cork;
+#endif
+#if defined(_WIN32)
+	unsigned char case_sensitive_files;
+#endif
+#if defined(USE_WEBSOCKET)
+	unsigned char enable_websocket_ping_pong;
+#endif
+
+	/* Compiled MG_CONFIG_TYPE_EXT_PATTERN options, NULL if not set */
+	struct mg_pattern_token *pattern[NUM_OPTIONS];
+
+	/* Compiled THROTTLE option, NULL if not set */
+	struct mg_throttle *throttle;
+};
+
+
 struct mg_domain_context {
 	SSL_CTX *ssl_ctx;                 /* SSL context */
 	char *config[NUM_OPTIONS];        /* Civetweb configuration parameters */
+	struct mg_domain_config cfg;      /* Pre-parsed configuration values */
 	struct mg_handler_info *handlers; /* linked list of uri handlers */
 	int64_t ssl_cert_last_mtime;
 
+	/* Compiled handler lookup tables. Readers use
+	 * handler_table[handler_gen & 1] and announce themselves in
+	 * handler_readers, so lookups do not need the context lock. */
+	struct mg_handler_table *handler_table[2];
+	volatile ptrdiff_t handler_gen;
+	volatile ptrdiff_t handler_readers[2];
+
 	/* Server nonce */
 	uint64_t auth_nonce_mask;  /* Mask for all nonce values */
 	unsigned long nonce_count; /* Used nonces, used for authentication */
@@ -2324,6 +2725,11 @@ struct mg_context {
 	struct mg_pollfd *listening_socket_fds;
 	unsigned int num_listening_sockets;
 
+#if defined(USE_REUSEPORT_ACCEPTORS)
+	unsigned int cfg_acceptor_threads; /* Including the master thread */
+	struct mg_acceptor *acceptors;     /* cfg_acceptor_threads - 1 entries */
+#endif
+
 	struct mg_connection *worker_connections; /* The connection struct, pre-
 	                                           * allocated for each worker */
 
@@ -2350,19 +2756,74 @@ struct mg_context {
 #if defined(ALTERNATIVE_QUEUE)
 	struct socket *client_socks;
 	void **client_wait_events;
+#elif defined(LOCKFREE_QUEUE)
+	struct mg_queue_cell *sq_cells; /* Ring of sq_size cells */
+	volatile ptrdiff_t sq_enqueue_pos; /* Next cell to be produced */
+	char sq_padding[64]; /* Keep producer and consumer on own cache lines */
+	volatile ptrdiff_t sq_dequeue_pos;        /* Next cell to be consumed */
+	volatile ptrdiff_t sq_sleeping_consumers; /* Workers waiting in sq_full */
+	volatile ptrdiff_t sq_sleeping_producers; /* Waiting in sq_empty */
 #else
 	struct socket *squeue; /* Socket queue (sq) : accepted sockets waiting for a
 	                       worker thread */
 	volatile int sq_head;  /* Head of the socket queue */
 	volatile int sq_tail;  /* Tail of the socket queue */
+#endif /* ALTERNATIVE_QUEUE */
+#if !defined(ALTERNATIVE_QUEUE)
 	pthread_cond_t sq_full;  /* Signaled when socket is produced */
 	pthread_cond_t sq_empty; /* Signaled when socket is consumed */
 	volatile int sq_blocked; /* Status information: sq is full */
 	int sq_size;             /* No of elements in socket queue */
 #if defined(USE_SERVER_STATS)
-	int sq_max_fill;
+	volatile ptrdiff_t sq_max_fill;
+	volatile ptrdiff_t sq_consumer_waits;   /* Workers found queue empty */
+	volatile int64_t sq_consumer_wait_time; /* Time spent idle, in ns */
+	volatile ptrdiff_t sq_producer_waits;   /* Producer found queue full */
+	volatile int64_t sq_producer_wait_time; /* Time spent blocked, in ns */
 #endif /* USE_SERVER_STATS */
-#endif /* ALTERNATIVE_QUEUE */
+#endif /* !ALTERNATIVE_QUEUE */
+
+#if defined(USE_KEEP_ALIVE_PARKING)
+	/* Reactor for idle keep-alive connections, owned by the master thread */
+	int park_epfd;                      /* epoll descriptor, -1 if disabled */
+	int park_timeout_ms;                /* keep_alive_timeout_ms */
+	pthread_mutex_t park_mutex;         /* Protects the parked list */
+	struct mg_parked_conn *parked_head; /* Oldest parked connection */
+	struct mg_parked_conn *parked_tail; /* Most recently parked connection */
+	volatile ptrdiff_t parked_connections;
+#endif
+
+#if defined(USE_WEBSOCKET_REACTOR)
+	struct mg_ws_reactor *ws_reactor; /* NULL if disabled */
+#endif
+#if defined(USE_WEBSOCKET)
+	struct mg_ws_channel *ws_channels; /* Channels for broadcasts */
+	pthread_mutex_t ws_channel_mutex;  /* Protects ws_channels */
+	pthread_cond_t ws_channel_cond;    /* Signaled when a broadcast ends */
+	unsigned int ws_broadcast_timeout_ms;
+	struct mg_ws_sender *ws_sender; /* NULL if send queues are disabled */
+	uint64_t ws_max_message_size;   /* 0 = unlimited */
+#endif
+
+	struct mg_acl *acl;                   /* NULL if not set */
+	struct mg_client_table *client_table; /* NULL if not limited */
+
+#if defined(USE_FILE_CACHE)
+	struct mg_file_cache *file_cache; /* NULL if disabled */
+#endif
+
+#if defined(USE_RESPONSE_CACHE)
+	struct mg_response_cache *response_cache; /* NULL if disabled */
+#endif
+
+#if !defined(NO_FILESYSTEMS)
+	struct mg_dir_index_cache *dir_index_cache; /* NULL if disabled */
+#endif
+
+#if defined(USE_ZLIB)
+	int compression_level; /* compression_level */
+	struct mg_compression_cache *compression_cache; /* NULL if disabled */
+#endif
 
 	/* Memory related */
 	unsigned int max_request_size; /* The max request size */
@@ -2446,6 +2907,19 @@ struct mg_http2_connection {
 #endif
 
 
+#if defined(USE_WEBSOCKET)
+/* Frame passed to a mg_websocket_stream_handler in slices */
+struct mg_ws_stream {
+	int active;         /* 1 while the payload is received */
+	unsigned char mop;  /* FIN flag and opcode */
+	int masked;
+	unsigned char mask[4];
+	uint64_t size;      /* Payload length */
+	uint64_t offset;    /* Payload bytes passed to the handler */
+};
+#endif
+
+
 struct mg_connection {
 	int connection_type; /* see CONNECTION_TYPE_* above */
 	int protocol_type;   /* see PROTOCOL_TYPE_*: 0=http/1.x, 1=ws, 2=http/2 */
@@ -2468,6 +2942,9 @@ struct mg_connection {
 #endif
 
 	SSL *ssl;               /* SSL descriptor */
+#if defined(USE_KTLS)
+	int ssl_ktls_send; /* 1 if the kernel encrypts data sent via ssl */
+#endif
 	struct socket client;   /* Connected client */
 	time_t conn_birth_time; /* Time (wall clock) when connection was
 	                         * established */
@@ -2498,10 +2975,26 @@ struct mg_connection {
 
 	int must_close;       /* 1 if connection must be closed */
 	int accept_gzip;      /* 1 if gzip encoding is accepted */
+	unsigned char accept_encodings[MG_ENCODING_COUNT]; /* Accepted content
+	                       * encodings, best first, terminated by
+	                       * MG_ENCODING_IDENTITY */
 	int in_error_handler; /* 1 if in handler for user defined error
 	                       * pages */
 #if defined(USE_WEBSOCKET)
 	int in_websocket_handling; /* 1 if in read_websocket */
+	unsigned int ws_num_channels; /* Number of channels joined */
+	unsigned int ws_broadcast_refs; /* Channel broadcasts using the
+	                                 * connection (ws_channel_mutex) */
+	struct mg_ws_send_queue *ws_queue; /* NULL if not used */
+	mg_websocket_stream_handler ws_stream_handler; /* NULL if not used */
+	struct mg_ws_stream ws_stream;
+	uint64_t ws_message_len; /* Payload of the current message so far */
+	uint64_t ws_inflated_len; /* Same, after inflating it */
+	int ws_message_deflated;  /* 1 if the current message is compressed */
+#endif
+#if defined(USE_WEBSOCKET_REACTOR)
+	int ws_detached; /* 1 if the websocket reactor took over the connection
+	                  * from this worker thread */
 #endif
 #if defined(USE_ZLIB) && defined(USE_WEBSOCKET)                                \
     && defined(MG_EXPERIMENTAL_INTERFACES)
@@ -2521,11 +3014,16 @@ struct mg_connection {
 	int request_len;      /* Size of the request + headers in a buffer */
 	int data_len;         /* Total size of data in a buffer */
 	int status_code;      /* HTTP reply status code, e.g. 200 */
-	int throttle;         /* Throttling, bytes/sec. <= 0 means no
-	                       * throttle */
-
-	time_t last_throttle_time; /* Last time throttled data was sent */
-	int last_throttle_bytes;   /* Bytes sent this second */
+	struct mg_throttle_rule *throttle; /* Speed limit, NULL if unlimited */
+	struct mg_throttle_bucket throttle_bucket; /* Used for a limit per
+	                                            * connection */
+	char *out_buf;             /* Output buffer (allocated on first use) */
+	int out_buf_alloc;         /* Allocated size of out_buf */
+	int out_buf_size;          /* Output buffer size, 0 = not buffered */
+	int out_buf_len;           /* Bytes waiting in out_buf */
+#if defined(__linux__)
+	int tcp_corked; /* 1 if TCP_CORK is set for the client socket */
+#endif
 	pthread_mutex_t mutex;     /* Used by mg_(un)lock_connection to ensure
 	                            * atomic transmissions for websockets */
 #if defined(USE_LUA) && defined(USE_WEBSOCKET)
@@ -2821,15 +3319,51 @@ is_file_opened(const struct mg_file_access *fileacc)
 		return 0;
 	}
 
+#if defined(USE_FILE_CACHE)
+	if (fileacc->cached != NULL) {
+		return 1;
+	}
+#endif
 	return (fileacc->fp != NULL);
 }
 
 
+/* FNV-1a hash of len bytes, start with h = MG_FNV1A_INIT */
+#define MG_FNV1A_INIT (2166136261u)
+
+static uint32_t
+mg_fnv1a(uint32_t h, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+#if !defined(NO_FILESYSTEMS) || defined(USE_ZLIB)
+#include "lru_cache.inl"
+#endif
+
+
 #if !defined(NO_FILESYSTEMS)
 static int mg_stat(const struct mg_connection *conn,
                    const char *path,
                    struct mg_file_stat *filep);
 
+#if defined(USE_FILE_CACHE)
+static int mg_stat_fs(const struct mg_connection *conn,
+                      const char *path,
+                      struct mg_file_stat *filep);
+
+#include "file_cache.inl"
+#else
+#define mg_stat_fs mg_stat
+#endif
+
 
 /* Reject files with special characters (for Windows) */
 static int
@@ -2888,6 +3422,11 @@ mg_fopen(const struct mg_connection *conn,
 		return 0;
 	}
 	filep->access.fp = NULL;
+#if defined(USE_FILE_CACHE)
+	filep->access.cache = NULL;
+	filep->access.cached = NULL;
+	filep->access.written_path = NULL;
+#endif
 
 	if (mg_path_suspicious(conn, path)) {
 		return 0;
@@ -2941,6 +3480,12 @@ mg_fopen(const struct mg_connection *conn,
 		(void)found;
 	}
 
+#if defined(USE_FILE_CACHE)
+	if ((mode != MG_FOPEN_MODE_READ) && (filep->access.fp != NULL)) {
+		file_cache_begin_write(conn, path, &(filep->access));
+	}
+#endif
+
 	/* return OK if file is opened */
 	return (filep->access.fp != NULL);
 }
@@ -2955,6 +3500,15 @@ mg_fclose(struct mg_file_access *fileacc)
 		if (fileacc->fp != NULL) {
 			ret = fclose(fileacc->fp);
 		}
+#if defined(USE_FILE_CACHE)
+		if (fileacc->cached != NULL) {
+			file_cache_close(fileacc->cache, fileacc->cached);
+			ret = 0;
+		}
+		if (fileacc->written_path != NULL) {
+			file_cache_end_write(fileacc);
+		}
+#endif
 		/* reset all members of fileacc */
 		memset(fileacc, 0, sizeof(*fileacc));
 	}
@@ -3319,28 +3873,146 @@ sockaddr_to_string(char *buf, size_t len, const union usa *usa)
 }
 
 
+/* Cache for formatted time strings.
+ * Every response has a "Date" header, static files have a "Last-Modified"
+ * header, and every access log line has a time stamp. Formatting them
+ * requires gmtime/localtime and strftime, and localtime takes a lock in
+ * the C library. Most strings are formatted for the current second, or for
+ * the modification time of a frequently requested file, so the results are
+ * stored in a small process wide table with one slot per second (modulo
+ * MG_TIME_STRING_SLOTS).
+ * Every slot is protected by a sequence number, which is odd while the
+ * slot is written. Readers never wait: a reader copies the string and
+ * checks that the sequence number did not change. A writer only writes a
+ * slot if no other thread is writing it. */
+#if !defined(MG_TIME_STRING_SLOTS)
+#define MG_TIME_STRING_SLOTS (16)
+#endif
+
+struct mg_time_string_slot {
+	volatile ptrdiff_t seq; /* odd while the slot is written */
+	time_t t;
+	char str[40];
+};
+
+static struct mg_time_string_slot gmt_time_strings[MG_TIME_STRING_SLOTS];
+static struct mg_time_string_slot local_time_strings[MG_TIME_STRING_SLOTS];
+
+
+/* Copy the string for time t from the cache into buf.
+ * Return 1 if the string was found, 0 otherwise. */
+static int
+time_string_cache_get(struct mg_time_string_slot *cache,
+                      time_t t,
+                      char *buf,
+                      size_t buf_len)
+{
+	struct mg_time_string_slot *slot =
+	    &cache[(size_t)t % MG_TIME_STRING_SLOTS];
+	ptrdiff_t seq = mg_atomic_add(&slot->seq, 0);
+
+	if ((seq & 1) || (slot->t != t) || (slot->str[0] == 0)) {
+		return 0;
+	}
+	mg_strlcpy(buf, slot->str, buf_len);
+
+	/* The slot must not have been modified while it was read */
+	return mg_atomic_add(&slot->seq, 0) == seq;
+}
+
+
+/* Store the string for time t in the cache, unless another thread is
+ * writing the same slot. */
+static void
+time_string_cache_put(struct mg_time_string_slot *cache,
+                      time_t t,
+                      const char *str)
+{
+	struct mg_time_string_slot *slot =
+	    &cache[(size_t)t % MG_TIME_STRING_SLOTS];
+	ptrdiff_t seq = slot->seq;
+
+	if ((seq & 1) || (strlen(str) >= sizeof(slot->str))
+	    || (mg_atomic_compare_and_swap(&slot->seq, seq, seq + 1) != seq)) {
+		return;
+	}
+	slot->t = t;
+	mg_strlcpy(slot->str, str, sizeof(slot->str));
+	mg_atomic_add(&slot->seq, 1);
+}
+
+
 /* Convert time_t to a string. According to RFC2616, Sec 14.18, this must be
  * included in all responses other than 100, 101, 5xx. */
 static void
 gmt_time_string(char *buf, size_t buf_len, time_t *t)
 {
+	char str[64];
 #if !defined(REENTRANT_TIME)
 	struct tm *tm;
-
-	tm = ((t != NULL) ? gmtime(t) : NULL);
-	if (tm != NULL) {
 #else
 	struct tm _tm;
 	struct tm *tm = &_tm;
+#endif
+
+	if (buf_len == 0) {
+		return;
+	}
+	if (t == NULL) {
+		mg_strlcpy(buf, "Thu, 01 Jan 1970 00:00:00 GMT", buf_len);
+		return;
+	}
+	if (time_string_cache_get(gmt_time_strings, *t, buf, buf_len)) {
+		return;
+	}
 
-	if (t != NULL) {
-		gmtime_r(t, tm);
+#if !defined(REENTRANT_TIME)
+	tm = gmtime(t);
+#else
+	tm = gmtime_r(t, tm);
 #endif
-		strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", tm);
-	} else {
+	if ((tm == NULL)
+	    || (strftime(str, sizeof(str), "%a, %d %b %Y %H:%M:%S GMT", tm)
+	        == 0)) {
 		mg_strlcpy(buf, "Thu, 01 Jan 1970 00:00:00 GMT", buf_len);
-		buf[buf_len - 1] = '\0';
+		return;
+	}
+	time_string_cache_put(gmt_time_strings, *t, str);
+	mg_strlcpy(buf, str, buf_len);
+}
+
+
+/* Convert time_t to a local time string, as used in the access log */
+static void
+log_time_string(char *buf, size_t buf_len, time_t t)
+{
+	char str[64];
+#if !defined(REENTRANT_TIME)
+	struct tm *tm;
+#else
+	struct tm _tm;
+	struct tm *tm = &_tm;
+#endif
+
+	if (buf_len == 0) {
+		return;
+	}
+	if (time_string_cache_get(local_time_strings, t, buf, buf_len)) {
+		return;
+	}
+
+#if !defined(REENTRANT_TIME)
+	tm = localtime(&t);
+#else
+	tm = localtime_r(&t, tm);
+#endif
+	if ((tm == NULL)
+	    || (strftime(str, sizeof(str), "%d/%b/%Y:%H:%M:%S %z", tm) == 0)) {
+		mg_strlcpy(buf, "01/Jan/1970:00:00:00 +0000", buf_len);
+		return;
 	}
+	time_string_cache_put(local_time_strings, t, str);
+	mg_strlcpy(buf, str, buf_len);
 }
 
 
@@ -3651,9 +4323,7 @@ mg_construct_local_link(const struct mg_connection *conn,
 			int is_ipv6 = (conn->client.lsa.sa.sa_family == AF_INET6);
 #endif
 			int auth_domain_check_enabled =
-			    conn->dom_ctx->config[ENABLE_AUTH_DOMAIN_CHECK]
-			    && (!mg_strcasecmp(
-			           conn->dom_ctx->config[ENABLE_AUTH_DOMAIN_CHECK], "yes"));
+			    conn->dom_ctx->cfg.enable_auth_domain_check;
 
 			const char *server_domain =
 			    conn->dom_ctx->config[AUTHENTICATION_DOMAIN];
@@ -3935,69 +4605,355 @@ header_has_option(const char *header, const char *option)
 }
 
 
-/* Perform case-insensitive match of string against pattern */
-static ptrdiff_t
-match_prefix(const char *pattern, size_t pattern_len, const char *str)
+/* Compile a pattern into tok, which must have space for pattern_len + 1
+ * tokens. */
+static void
+compile_pattern(const char *pattern,
+                size_t pattern_len,
+                struct mg_pattern_token *tok)
 {
-	const char *or_str;
-	ptrdiff_t i, j, len, res;
-
-	if ((or_str = (const char *)memchr(pattern, '|', pattern_len)) != NULL) {
-		res = match_prefix(pattern, (size_t)(or_str - pattern), str);
-		return (res > 0) ? res
-		                 : match_prefix(or_str + 1,
-		                                (size_t)((pattern + pattern_len)
-		                                         - (or_str + 1)),
-		                                str);
-	}
+	size_t i;
 
-	for (i = 0, j = 0; (i < (ptrdiff_t)pattern_len); i++, j++) {
-		if ((pattern[i] == '?') && (str[j] != '\0')) {
-			continue;
+	for (i = 0; i < pattern_len; i++, tok++) {
+		tok->ch = 0;
+		if (pattern[i] == '|') {
+			tok->type = PATTERN_OR;
+		} else if (pattern[i] == '?') {
+			tok->type = PATTERN_ANY;
 		} else if (pattern[i] == '$') {
-			return (str[j] == '\0') ? j : -1;
+			tok->type = PATTERN_EOS;
 		} else if (pattern[i] == '*') {
-			i++;
-			if (pattern[i] == '*') {
+			if ((i + 1 < pattern_len) && (pattern[i + 1] == '*')) {
+				tok->type = PATTERN_DSTAR;
 				i++;
-				len = (ptrdiff_t)strlen(str + j);
 			} else {
-				len = (ptrdiff_t)strcspn(str + j, "/");
-			}
-			if (i == (ptrdiff_t)pattern_len) {
-				return j + len;
+				tok->type = PATTERN_STAR;
 			}
-			do {
-				res = match_prefix(pattern + i,
-				                   (pattern_len - (size_t)i),
-				                   str + j + len);
-			} while (res == -1 && len-- > 0);
-			return (res == -1) ? -1 : j + res + len;
-		} else if (lowercase(&pattern[i]) != lowercase(&str[j])) {
-			return -1;
+		} else {
+			tok->type = PATTERN_CHAR;
+			tok->ch = (unsigned char)lowercase(pattern + i);
 		}
 	}
-	return (ptrdiff_t)j;
+	tok->type = PATTERN_END;
+	tok->ch = 0;
 }
 
 
-static ptrdiff_t
-match_prefix_strlen(const char *pattern, const char *str)
+/* Add state k of an alternative with n tokens, and all states reachable
+ * from k without consuming a character, to a state list. States already
+ * added for the same string position (mark[] == gen) are skipped: they have
+ * been reached with a higher priority before. State n is "matched". */
+static void
+pattern_add_state(const struct mg_pattern_token *tok,
+                  size_t n,
+                  unsigned *list,
+                  size_t *count,
+                  unsigned *mark,
+                  unsigned gen,
+                  size_t k,
+                  int at_end)
 {
-	if (pattern == NULL) {
-		return -1;
+	for (;;) {
+		if (mark[k] == gen) {
+			return;
+		}
+		mark[k] = gen;
+		if (k == n) {
+			list[(*count)++] = (unsigned)n;
+			return;
+		}
+		if ((tok[k].type == PATTERN_STAR) || (tok[k].type == PATTERN_DSTAR)) {
+			/* Consuming one more character has a higher priority than
+			 * continuing with the next token. */
+			list[(*count)++] = (unsigned)k;
+			k++;
+		} else if (tok[k].type == PATTERN_EOS) {
+			if (!at_end) {
+				return;
+			}
+			/* '$' matches, ignoring the rest of the pattern */
+			k = n;
+		} else {
+			list[(*count)++] = (unsigned)k;
+			return;
+		}
 	}
-	return match_prefix(pattern, strlen(pattern), str);
 }
 
 
-/* HTTP 1.1 assumes keep alive if "Connection:" header is not set
- * This function must tolerate situations when connection info is not
- * set up, for example if request parsing failed. */
-static int
-should_keep_alive(const struct mg_connection *conn)
-{
-	const char *http_version;
+/* Match one alternative of n tokens. The state lists are kept in the
+ * order of the backtracking matcher (longest '*' first), so the result is
+ * the match it would find first, but the time is O(n * strlen(str)).
+ * buf must have space for 3 * (n + 1) elements. */
+static ptrdiff_t
+match_pattern_alternative(const struct mg_pattern_token *tok,
+                          size_t n,
+                          const char *str,
+                          unsigned *buf)
+{
+	unsigned *clist = buf, *nlist = buf + n + 1, *mark = buf + 2 * (n + 1);
+	unsigned *tmp;
+	size_t ccount = 0, ncount, i, j, k;
+	ptrdiff_t res = -1;
+
+	memset(mark, 0, (n + 1) * sizeof(unsigned));
+	pattern_add_state(tok, n, clist, &ccount, mark, 1, 0, (str[0] == '\0'));
+
+	for (j = 0; ccount > 0; j++) {
+		ncount = 0;
+		for (i = 0; i < ccount; i++) {
+			k = clist[i];
+			if (k == n) {
+				/* Match: drop all states with a lower priority */
+				res = (ptrdiff_t)j;
+				break;
+			}
+			if (str[j] == '\0') {
+				continue;
+			}
+			if (tok[k].type == PATTERN_CHAR) {
+				if (lowercase(str + j) != tok[k].ch) {
+					continue;
+				}
+				k++;
+			} else if (tok[k].type == PATTERN_ANY) {
+				k++;
+			} else if ((tok[k].type == PATTERN_STAR) && (str[j] == '/')) {
+				continue;
+			}
+			pattern_add_state(tok,
+			                  n,
+			                  nlist,
+			                  &ncount,
+			                  mark,
+			                  (unsigned)(j + 2),
+			                  k,
+			                  (str[j + 1] == '\0'));
+		}
+		if (str[j] == '\0') {
+			break;
+		}
+		tmp = clist;
+		clist = nlist;
+		nlist = tmp;
+		ccount = ncount;
+	}
+	return res;
+}
+
+
+/* Match a compiled pattern: Returns the length of the matched prefix of
+ * the first alternative with a match longer than 0 characters, otherwise
+ * the result of the last alternative (0 or -1). */
+static ptrdiff_t
+match_pattern(const struct mg_pattern_token *tok, const char *str)
+{
+	unsigned stack_buf[3 * 64];
+	unsigned *buf;
+	size_t n;
+	ptrdiff_t res;
+
+	for (;;) {
+		for (n = 0; (tok[n].type != PATTERN_END) && (tok[n].type != PATTERN_OR);
+		     n++) {
+		}
+		if (n < 64) {
+			buf = stack_buf;
+		} else {
+			buf = (unsigned *)mg_malloc(3 * (n + 1) * sizeof(unsigned));
+			if (buf == NULL) {
+				return -1;
+			}
+		}
+		res = match_pattern_alternative(tok, n, str, buf);
+		if (buf != stack_buf) {
+			mg_free(buf);
+		}
+		if ((res > 0) || (tok[n].type == PATTERN_END)) {
+			return res;
+		}
+		tok += n + 1;
+	}
+}
+
+
+/* Perform case-insensitive match of string against pattern */
+static ptrdiff_t
+match_prefix(const char *pattern, size_t pattern_len, const char *str)
+{
+	struct mg_pattern_token stack_tok[64];
+	struct mg_pattern_token *tok = stack_tok;
+	ptrdiff_t res;
+
+	if (pattern_len >= 64) {
+		tok = (struct mg_pattern_token *)mg_malloc((pattern_len + 1)
+		                                           * sizeof(tok[0]));
+		if (tok == NULL) {
+			return -1;
+		}
+	}
+	compile_pattern(pattern, pattern_len, tok);
+	res = match_pattern(tok, str);
+	if (tok != stack_tok) {
+		mg_free(tok);
+	}
+	return res;
+}
+
+
+static ptrdiff_t
+match_prefix_strlen(const char *pattern, const char *str)
+{
+	if (pattern == NULL) {
+		return -1;
+	}
+	return match_prefix(pattern, strlen(pattern), str);
+}
+
+
+/* Value of a boolean configuration option: only "yes" is true. */
+static unsigned char
+config_is_yes(const char *value)
+{
+	return (unsigned char)((value != NULL) && !mg_strcasecmp(value, "yes"));
+}
+
+
+static struct mg_throttle *throttle_create(const char *spec);
+static void throttle_destroy(struct mg_throttle *throttle);
+static int throttle_reserve(struct mg_connection *conn, int want);
+static void throttle_refund(struct mg_connection *conn, int unused);
+
+
+/* Free the compiled patterns and throttle rules of dom_ctx->cfg */
+static void
+free_domain_config(struct mg_domain_context *dom_ctx)
+{
+	int i;
+
+	for (i = 0; i < NUM_OPTIONS; i++) {
+		mg_free(dom_ctx->cfg.pattern[i]);
+		dom_ctx->cfg.pattern[i] = NULL;
+	}
+	throttle_destroy(dom_ctx->cfg.throttle);
+	dom_ctx->cfg.throttle = NULL;
+}
+
+
+/* Fill dom_ctx->cfg from the configuration strings. This must be called
+ * after all default values have been set, and again whenever
+ * dom_ctx->config is changed. */
+static void
+init_domain_config(struct mg_domain_context *dom_ctx)
+{
+	struct mg_domain_config *cfg = &(dom_ctx->cfg);
+	char **config = dom_ctx->config;
+	size_t len;
+	int i;
+
+	free_domain_config(dom_ctx);
+	memset(cfg, 0, sizeof(*cfg));
+
+	for (i = 0; config_options[i].name != NULL; i++) {
+		if ((config_options[i].type == MG_CONFIG_TYPE_EXT_PATTERN)
+		    && (config[i] != NULL)) {
+			len = strlen(config[i]);
+			cfg->pattern[i] = (struct mg_pattern_token *)mg_malloc(
+			    (len + 1) * sizeof(struct mg_pattern_token));
+			if (cfg->pattern[i] != NULL) {
+				compile_pattern(config[i], len, cfg->pattern[i]);
+			}
+		}
+	}
+
+	cfg->has_request_timeout = (config[REQUEST_TIMEOUT] != NULL);
+	cfg->request_timeout_ms =
+	    atoi(cfg->has_request_timeout
+	             ? config[REQUEST_TIMEOUT]
+	             : config_options[REQUEST_TIMEOUT].default_value);
+	cfg->has_keep_alive_timeout = (config[KEEP_ALIVE_TIMEOUT] != NULL);
+	if (cfg->has_keep_alive_timeout) {
+		cfg->keep_alive_timeout_ms = atoi(config[KEEP_ALIVE_TIMEOUT]);
+	}
+	cfg->linger_timeout_ms =
+	    (config[LINGER_TIMEOUT] != NULL) ? atoi(config[LINGER_TIMEOUT]) : -2;
+#if defined(USE_TIMERS)
+	for (i = 0; i < (int)ARRAY_SIZE(cfg->cgi_timeout); i++) {
+		const char *cgi_timeout =
+		    config[CGI_TIMEOUT + i * (CGI2_EXTENSIONS - CGI_EXTENSIONS)];
+		cfg->cgi_timeout[i] =
+		    atof(cgi_timeout ? cgi_timeout
+		                     : config_options[REQUEST_TIMEOUT].default_value)
+		    * 0.001;
+	}
+#endif
+#if !defined(NO_CACHING)
+	if (config[STATIC_FILE_MAX_AGE] != NULL) {
+		cfg->static_file_max_age = atoi(config[STATIC_FILE_MAX_AGE]);
+	}
+#endif
+#if defined(USE_WEBSOCKET)
+	if (config[WEBSOCKET_TIMEOUT] != NULL) {
+		cfg->websocket_timeout_ms = atoi(config[WEBSOCKET_TIMEOUT]);
+	}
+	cfg->enable_websocket_ping_pong =
+	    config_is_yes(config[ENABLE_WEBSOCKET_PING_PONG]);
+#endif
+
+	cfg->enable_keep_alive = config_is_yes(config[ENABLE_KEEP_ALIVE]);
+	cfg->decode_url = config_is_yes(config[DECODE_URL]);
+	cfg->tcp_nodelay = (unsigned char)((config[CONFIG_TCP_NODELAY] != NULL)
+	                                   && !strcmp(config[CONFIG_TCP_NODELAY],
+	                                              "1"));
+	cfg->enable_directory_listing =
+	    config_is_yes(config[ENABLE_DIRECTORY_LISTING]);
+	cfg->allow_index_script_sub_res =
+	    config_is_yes(config[ALLOW_INDEX_SCRIPT_SUB_RES]);
+	cfg->enable_auth_domain_check =
+	    config_is_yes(config[ENABLE_AUTH_DOMAIN_CHECK]);
+	cfg->ssl_short_trust = config_is_yes(config[SSL_SHORT_TRUST]);
+#if defined(__linux__)
+	cfg->allow_sendfile_call = config_is_yes(config[ALLOW_SENDFILE_CALL]);
+	cfg->tcp_cork = config_is_yes(config[CONFIG_TCP_CORK]);
+#endif
+	if (config[OUTPUT_BUFFER_SIZE] != NULL) {
+		cfg->output_buffer_size = atoi(config[OUTPUT_BUFFER_SIZE]);
+		if (cfg->output_buffer_size < 0) {
+			cfg->output_buffer_size = 0;
+		}
+	}
+#if defined(_WIN32)
+	cfg->case_sensitive_files = config_is_yes(config[CASE_SENSITIVE_FILES]);
+#endif
+	if (config[THROTTLE] != NULL) {
+		cfg->throttle = throttle_create(config[THROTTLE]);
+	}
+}
+
+
+/* Match a MG_CONFIG_TYPE_EXT_PATTERN option, like match_prefix_strlen */
+static ptrdiff_t
+match_config_pattern(const struct mg_connection *conn,
+                     int option,
+                     const char *str)
+{
+	const struct mg_pattern_token *tok = conn->dom_ctx->cfg.pattern[option];
+
+	if (tok != NULL) {
+		return match_pattern(tok, str);
+	}
+	/* Not set, or out of memory while compiling */
+	return match_prefix_strlen(conn->dom_ctx->config[option], str);
+}
+
+
+/* HTTP 1.1 assumes keep alive if "Connection:" header is not set
+ * This function must tolerate situations when connection info is not
+ * set up, for example if request parsing failed. */
+static int
+should_keep_alive(const struct mg_connection *conn)
+{
+	const char *http_version;
 	const char *header;
 
 	/* First satisfy needs of the server */
@@ -4006,7 +4962,7 @@ should_keep_alive(const struct mg_connection *conn)
 		return 0;
 	}
 
-	if (mg_strcasecmp(conn->dom_ctx->config[ENABLE_KEEP_ALIVE], "yes") != 0) {
+	if (!conn->dom_ctx->cfg.enable_keep_alive) {
 		/* Close, if keep alive is not enabled */
 		return 0;
 	}
@@ -4040,7 +4996,7 @@ should_decode_url(const struct mg_connection *conn)
 		return 0;
 	}
 
-	return (mg_strcasecmp(conn->dom_ctx->config[DECODE_URL], "yes") == 0);
+	return conn->dom_ctx->cfg.decode_url;
 }
 
 
@@ -4090,7 +5046,7 @@ send_static_cache_header(struct mg_connection *conn)
 
 	/* Read the server config to check how long a file may be cached.
 	 * The configuration is in seconds. */
-	max_age = atoi(conn->dom_ctx->config[STATIC_FILE_MAX_AGE]);
+	max_age = conn->dom_ctx->cfg.static_file_max_age;
 	if (max_age <= 0) {
 		/* 0 means "do not cache". All values <0 are reserved
 		 * and may be used differently in the future. */
@@ -4736,6 +5692,14 @@ pthread_mutex_lock(pthread_mutex_t *mutex)
 }
 
 
+FUNCTION_MAY_BE_UNUSED
+static int
+pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+	return TryEnterCriticalSection(&mutex->sec) ? 0 : EBUSY;
+}
+
+
 static int
 pthread_mutex_unlock(pthread_mutex_t *mutex)
 {
@@ -4988,9 +5952,7 @@ path_to_unicode(const struct mg_connection *conn,
 	 * As a default, Windows is not case sensitive, but the case sensitive
 	 * file name check can be activated by an additional configuration. */
 	if (conn) {
-		if (conn->dom_ctx->config[CASE_SENSITIVE_FILES]
-		    && !mg_strcasecmp(conn->dom_ctx->config[CASE_SENSITIVE_FILES],
-		                      "yes")) {
+		if (conn->dom_ctx->cfg.case_sensitive_files) {
 			/* Use case sensitive compare function */
 			fcompare = wcscmp;
 		}
@@ -5624,9 +6586,9 @@ set_non_blocking_mode(SOCKET sock)
 
 #if !defined(NO_FILESYSTEMS)
 static int
-mg_stat(const struct mg_connection *conn,
-        const char *path,
-        struct mg_file_stat *filep)
+mg_stat_fs(const struct mg_connection *conn,
+           const char *path,
+           struct mg_file_stat *filep)
 {
 	struct stat st;
 	if (!filep) {
@@ -5966,6 +6928,20 @@ mg_poll(struct mg_pollfd *pfd,
 }
 
 
+#if defined(USE_IO_URING)
+#include "mod_io_uring.inl"
+
+/* Get the io_uring of the current thread. Only worker threads have one. */
+static struct mg_uring *
+get_thread_uring(void)
+{
+	struct mg_workerTLS *tls =
+	    (struct mg_workerTLS *)pthread_getspecific(sTlsKey);
+	return ((tls != NULL) && (tls->is_master == 0)) ? tls->uring : NULL;
+}
+#endif
+
+
 /* Write data to the IO channel - opened file descriptor, socket or SSL
  * descriptor.
  * Return value:
@@ -5985,6 +6961,10 @@ push_inner(struct mg_context *ctx,
 	uint64_t start = 0, now = 0, timeout_ns = 0;
 	int n, err;
 	unsigned ms_wait = SOCKET_TIMEOUT_QUANTUM; /* Sleep quantum in ms */
+#if defined(USE_IO_URING)
+	struct mg_uring *ring =
+	    ((fp == NULL) && (ssl == NULL)) ? get_thread_uring() : NULL;
+#endif
 
 #if defined(_WIN32)
 	typedef int len_t;
@@ -6060,8 +7040,21 @@ push_inner(struct mg_context *ctx,
 				err = 0;
 			}
 		} else {
+#if defined(USE_IO_URING)
+			if (ring != NULL) {
+				/* Send, or wait up to ms_wait for the socket, with one
+				 * system call */
+				n = mg_uring_sock_io(
+				    ring, IORING_OP_SEND, sock, (void *)buf, len, (int)ms_wait);
+				err = (n < 0) ? -n : 0;
+			} else {
+				n = (int)send(sock, buf, (len_t)len, MSG_NOSIGNAL);
+				err = (n < 0) ? ERRNO : 0;
+			}
+#else
 			n = (int)send(sock, buf, (len_t)len, MSG_NOSIGNAL);
 			err = (n < 0) ? ERRNO : 0;
+#endif
 #if defined(_WIN32)
 			if (err == WSAEWOULDBLOCK) {
 				err = 0;
@@ -6107,6 +7100,10 @@ push_inner(struct mg_context *ctx,
 			/* For files, just wait a fixed time.
 			 * Maybe it helps, maybe not. */
 			mg_sleep(5);
+#if defined(USE_IO_URING)
+		} else if (ring != NULL) {
+			/* mg_uring_sock_io did already wait for the socket */
+#endif
 		} else {
 			/* For sockets, wait for the socket using poll */
 			struct mg_pollfd pfd[1];
@@ -6154,9 +7151,7 @@ push_all(struct mg_context *ctx,
 		return -1;
 	}
 
-	if (ctx->dd.config[REQUEST_TIMEOUT]) {
-		timeout = atoi(ctx->dd.config[REQUEST_TIMEOUT]) / 1000.0;
-	}
+	timeout = ctx->dd.cfg.request_timeout_ms / 1000.0;
 	if (timeout <= 0.0) {
 		timeout = atof(config_options[REQUEST_TIMEOUT].default_value) / 1000.0;
 	}
@@ -6180,6 +7175,176 @@ push_all(struct mg_context *ctx,
 }
 
 
+/* Maximum number of buffers passed to one sendmsg/WSASend call */
+#define MG_MAX_IOV (16)
+
+
+/* Write several buffers to a socket or SSL connection. For sockets, up to
+ * MG_MAX_IOV buffers are sent with one system call. For SSL, buffers are
+ * combined into one SSL_write if they fit into MG_BUF_LEN.
+ * Return value: like push_all */
+static int
+push_all_vec(struct mg_context *ctx,
+             SOCKET sock,
+             SSL *ssl,
+             const struct mg_iovec *iov,
+             int iovcnt)
+{
+	double timeout;
+	uint64_t start, timeout_ns;
+	size_t skip = 0; /* Bytes of iov[0] already sent */
+	int n, cnt, err, nwritten = 0;
+	unsigned ms_wait = SOCKET_TIMEOUT_QUANTUM;
+#if defined(_WIN32)
+	WSABUF vec[MG_MAX_IOV];
+	DWORD sent;
+#else
+	struct iovec vec[MG_MAX_IOV];
+	struct msghdr msg;
+#endif
+
+	if (ctx == NULL) {
+		return -1;
+	}
+
+	if (ssl != NULL) {
+		char buf[MG_BUF_LEN];
+		size_t len = 0;
+
+		for (cnt = 0; cnt < iovcnt; cnt++) {
+			if (iov[cnt].len > sizeof(buf) - len) {
+				break;
+			}
+			memcpy(buf + len, iov[cnt].buf, iov[cnt].len);
+			len += iov[cnt].len;
+		}
+		if (cnt == iovcnt) {
+			/* One TLS record for all buffers */
+			return push_all(ctx, NULL, sock, ssl, buf, (int)len);
+		}
+		for (cnt = 0; cnt < iovcnt; cnt++) {
+			n = push_all(ctx,
+			             NULL,
+			             sock,
+			             ssl,
+			             (const char *)iov[cnt].buf,
+			             (int)iov[cnt].len);
+			if (n < 0) {
+				return (nwritten > 0) ? nwritten : n;
+			}
+			nwritten += n;
+			if (n != (int)iov[cnt].len) {
+				break;
+			}
+		}
+		return nwritten;
+	}
+
+	timeout = ctx->dd.cfg.request_timeout_ms / 1000.0;
+	if (timeout <= 0.0) {
+		timeout = atof(config_options[REQUEST_TIMEOUT].default_value) / 1000.0;
+	}
+	timeout_ns = (uint64_t)(timeout * 1.0E9);
+	start = mg_get_current_time_ns();
+
+	while (STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		/* Skip buffers already sent completely */
+		while ((iovcnt > 0) && (iov[0].len == skip)) {
+			iov++;
+			iovcnt--;
+			skip = 0;
+		}
+		if (iovcnt == 0) {
+			break;
+		}
+
+		for (cnt = 0; (cnt < iovcnt) && (cnt < MG_MAX_IOV); cnt++) {
+			const char *ptr = (const char *)iov[cnt].buf;
+			size_t len = iov[cnt].len;
+			if (cnt == 0) {
+				ptr += skip;
+				len -= skip;
+			}
+#if defined(_WIN32)
+			vec[cnt].buf = (CHAR *)ptr;
+			vec[cnt].len = (ULONG)len;
+#else
+			vec[cnt].iov_base = (void *)ptr;
+			vec[cnt].iov_len = len;
+#endif
+		}
+
+#if defined(_WIN32)
+		n = (WSASend(sock, vec, (DWORD)cnt, &sent, 0, NULL, NULL) == 0)
+		        ? (int)sent
+		        : -1;
+		err = (n < 0) ? ERRNO : 0;
+		if (err == WSAEWOULDBLOCK) {
+			err = 0;
+			n = 0;
+		}
+#else
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = vec;
+		msg.msg_iovlen = (size_t)cnt;
+		n = (int)sendmsg(sock, &msg, MSG_NOSIGNAL);
+		err = (n < 0) ? ERRNO : 0;
+		if (ERROR_TRY_AGAIN(err)) {
+			err = 0;
+			n = 0;
+		}
+#endif
+		if (n < 0) {
+			DEBUG_TRACE("sendmsg() failed, error %d", err);
+			if (nwritten == 0) {
+				nwritten = -1; /* Propagate the error */
+			}
+			break;
+		}
+
+		if (n > 0) {
+			nwritten += n;
+			while (n > 0) {
+				if ((size_t)n >= iov[0].len - skip) {
+					n -= (int)(iov[0].len - skip);
+					iov++;
+					iovcnt--;
+					skip = 0;
+				} else {
+					skip += (size_t)n;
+					n = 0;
+				}
+			}
+			continue;
+		}
+
+		/* Socket buffer full: wait until it is writable again */
+		{
+			struct mg_pollfd pfd[1];
+			int pollres;
+
+			pfd[0].fd = sock;
+			pfd[0].events = POLLOUT;
+			pollres = mg_poll(pfd, 1, (int)(ms_wait), &(ctx->stop_flag));
+			if (pollres > 0) {
+				continue;
+			}
+		}
+		if ((timeout > 0) && ((mg_get_current_time_ns() - start) > timeout_ns)) {
+			/* Timeout */
+			if (nwritten == 0) {
+				nwritten = -1;
+			}
+			break;
+		}
+	}
+
+	(void)err; /* Avoid unused warning if DEBUG_TRACE is not used */
+
+	return nwritten;
+}
+
+
 /* Read from IO channel - opened file descriptor, socket, or SSL descriptor.
  * Return value:
  *  >=0 .. number of bytes successfully read
@@ -6194,6 +7359,9 @@ pull_inner(FILE *fp,
            double timeout)
 {
 	int nread, err = 0;
+#if defined(USE_IO_URING)
+	struct mg_uring *ring;
+#endif
 
 #if defined(_WIN32)
 	typedef int len_t;
@@ -6329,6 +7497,34 @@ pull_inner(FILE *fp,
 		}
 #endif
 
+#if defined(USE_IO_URING)
+	} else if ((ring = get_thread_uring()) != NULL) {
+		/* Wait for data and receive it with one system call. Like mg_poll,
+		 * wait in steps of SOCKET_TIMEOUT_QUANTUM to check the stop flag. */
+		int ms_total = (int)(timeout * 1000.0);
+		do {
+			int ms_now = SOCKET_TIMEOUT_QUANTUM;
+			if ((ms_total >= 0) && (ms_total < ms_now)) {
+				ms_now = ms_total;
+			}
+			nread = mg_uring_sock_io(
+			    ring, IORING_OP_RECV, conn->client.sock, buf, len, ms_now);
+			if (ms_total > 0) {
+				ms_total -= ms_now;
+			}
+		} while ((nread == -ETIMEDOUT) && (ms_total > 0)
+		         && STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag));
+		if (!STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)) {
+			return -2;
+		}
+		if (nread == -ETIMEDOUT) {
+			nread = 0;
+		} else if (nread <= 0) {
+			/* shutdown of the socket at client side, or error */
+			return -2;
+		}
+#endif
+
 	} else {
 		struct mg_pollfd pfd[1];
 		int pollres;
@@ -6422,9 +7618,7 @@ pull_all(FILE *fp, struct mg_connection *conn, char *buf, int len)
 	double timeout = -1.0;
 	uint64_t start_time = 0, now = 0, timeout_ns = 0;
 
-	if (conn->dom_ctx->config[REQUEST_TIMEOUT]) {
-		timeout = atoi(conn->dom_ctx->config[REQUEST_TIMEOUT]) / 1000.0;
-	}
+	timeout = conn->dom_ctx->cfg.request_timeout_ms / 1000.0;
 	if (timeout <= 0.0) {
 		timeout = atof(config_options[REQUEST_TIMEOUT].default_value) / 1000.0;
 	}
@@ -6459,18 +7653,83 @@ pull_all(FILE *fp, struct mg_connection *conn, char *buf, int len)
 }
 
 
+/* Set or clear TCP_CORK for the client socket. While a socket is corked,
+ * the kernel only sends full TCP segments. */
 static void
-discard_unread_request_data(struct mg_connection *conn)
+set_tcp_cork(struct mg_connection *conn, int cork_on)
 {
-	char buf[MG_BUF_LEN];
+#if defined(__linux__)
+	if ((conn->tcp_corked != cork_on) && (conn->client.sock != INVALID_SOCKET)
+	    && ((conn->client.lsa.sa.sa_family == AF_INET)
+	        || (conn->client.lsa.sa.sa_family == AF_INET6))) {
+		if (setsockopt(conn->client.sock,
+		               IPPROTO_TCP,
+		               TCP_CORK,
+		               (SOCK_OPT_TYPE)&cork_on,
+		               sizeof(cork_on))
+		    == 0) {
+			conn->tcp_corked = cork_on;
+		}
+	}
+#else
+	(void)conn;
+	(void)cork_on;
+#endif
+}
 
-	while (mg_read(conn, buf, sizeof(buf)) > 0)
-		;
+
+/* Output buffering is not used for throttled connections and for HTTP/2,
+ * since mg_write must frame or pace every block of data. */
+static int
+is_output_buffered(const struct mg_connection *conn)
+{
+	return (conn->out_buf_size > 0) && (conn->throttle == NULL)
+#if defined(USE_HTTP2)
+	       && (conn->protocol_type != PROTOCOL_TYPE_HTTP2)
+#endif
+	    ;
 }
 
 
+/* Send all data waiting in the output buffer.
+ * Return: 0 on success, -1 on error. */
 static int
-mg_read_inner(struct mg_connection *conn, void *buf, size_t len)
+flush_output_buffer(struct mg_connection *conn)
+{
+	int n;
+
+	if (conn->out_buf_len <= 0) {
+		return 0;
+	}
+	n = push_all(conn->phys_ctx,
+	             NULL,
+	             conn->client.sock,
+	             conn->ssl,
+	             conn->out_buf,
+	             conn->out_buf_len);
+	if (n != conn->out_buf_len) {
+		/* The response is incomplete: do not reuse the connection */
+		conn->out_buf_len = 0;
+		conn->must_close = 1;
+		return -1;
+	}
+	conn->out_buf_len = 0;
+	return 0;
+}
+
+
+static void
+discard_unread_request_data(struct mg_connection *conn)
+{
+	char buf[MG_BUF_LEN];
+
+	while (mg_read(conn, buf, sizeof(buf)) > 0)
+		;
+}
+
+
+static int
+mg_read_inner(struct mg_connection *conn, void *buf, size_t len)
 {
 	int64_t content_len, n, buffered_len, nread;
 	int64_t len64 =
@@ -6518,8 +7777,12 @@ mg_read_inner(struct mg_connection *conn, void *buf, size_t len)
 		}
 
 		/* We have returned all buffered data. Read new data from the remote
-		 * socket.
+		 * socket. The client might wait for the response header before it
+		 * sends more data, so send the output buffer first.
 		 */
+		if ((len64 > 0) && (flush_output_buffer(conn) != 0)) {
+			return (nread > 0) ? (int)nread : -1;
+		}
 		if ((n = pull_all(NULL, conn, (char *)buf, (int)len64)) >= 0) {
 			conn->consumed_content += n;
 			nread += n;
@@ -6533,6 +7796,8 @@ mg_read_inner(struct mg_connection *conn, void *buf, size_t len)
 
 /* Forward declarations */
 static void handle_request(struct mg_connection *);
+static void begin_output_buffering(struct mg_connection *);
+static void end_output_buffering(struct mg_connection *);
 static void log_access(const struct mg_connection *);
 
 
@@ -6545,7 +7810,9 @@ handle_request_stat_log(struct mg_connection *conn)
 	conn->conn_state = 4; /* processing */
 #endif
 
+	begin_output_buffering(conn);
 	handle_request(conn);
+	end_output_buffering(conn);
 
 
 #if defined(USE_SERVER_STATS)
@@ -6696,11 +7963,150 @@ mg_read(struct mg_connection *conn, void *buf, size_t len)
 }
 
 
+/* Change the output buffer size. Data already buffered is sent first.
+ * Return: 0 on success, -1 on error. */
+static int
+set_output_buffering(struct mg_connection *conn, int size)
+{
+	int ret = flush_output_buffer(conn);
+
+	if ((conn->out_buf != NULL) && (size > 0) && (size != conn->out_buf_alloc)) {
+		/* The buffer is allocated with the new size on first use */
+		mg_free(conn->out_buf);
+		conn->out_buf = NULL;
+	}
+	conn->out_buf_size = (size > 0) ? size : 0;
+	return ret;
+}
+
+
+/* Write data to the output buffer. Data that does not fit is sent together
+ * with the buffer content in one gather write.
+ * Return: like mg_writev */
+static int
+write_buffered(struct mg_connection *conn,
+               const struct mg_iovec *iov,
+               int iovcnt,
+               size_t len)
+{
+	struct mg_iovec vec[MG_MAX_IOV];
+	int i, n;
+
+	if (conn->out_buf == NULL) {
+		conn->out_buf =
+		    (char *)mg_malloc_ctx((size_t)conn->out_buf_size, conn->phys_ctx);
+		conn->out_buf_alloc = conn->out_buf_size;
+		if (conn->out_buf == NULL) {
+			/* Out of memory: continue without buffering */
+			conn->out_buf_size = 0;
+			n = push_all_vec(
+			    conn->phys_ctx, conn->client.sock, conn->ssl, iov, iovcnt);
+			goto write_buffered_done;
+		}
+	}
+
+	if (len <= (size_t)(conn->out_buf_size - conn->out_buf_len)) {
+		for (i = 0; i < iovcnt; i++) {
+			memcpy(conn->out_buf + conn->out_buf_len, iov[i].buf, iov[i].len);
+			conn->out_buf_len += (int)iov[i].len;
+		}
+		n = (int)len;
+		goto write_buffered_done;
+	}
+
+	if ((conn->out_buf_len > 0) && (iovcnt < MG_MAX_IOV)) {
+		vec[0].buf = conn->out_buf;
+		vec[0].len = (size_t)conn->out_buf_len;
+		memcpy(vec + 1, iov, (size_t)iovcnt * sizeof(iov[0]));
+		n = push_all_vec(
+		    conn->phys_ctx, conn->client.sock, conn->ssl, vec, iovcnt + 1);
+		if (n != conn->out_buf_len + (int)len) {
+			conn->out_buf_len = 0;
+			conn->must_close = 1;
+			return -1;
+		}
+		conn->out_buf_len = 0;
+		n = (int)len;
+		goto write_buffered_done;
+	}
+
+	if (flush_output_buffer(conn) != 0) {
+		return -1;
+	}
+	n = push_all_vec(conn->phys_ctx, conn->client.sock, conn->ssl, iov, iovcnt);
+
+write_buffered_done:
+	if (n > 0) {
+		conn->num_bytes_sent += n;
+	}
+	return n;
+}
+
+
+int
+mg_set_output_buffering(struct mg_connection *conn, size_t size)
+{
+	if (conn == NULL) {
+		return -1;
+	}
+	if (size > INT_MAX) {
+		return -1;
+	}
+	return set_output_buffering(conn, (int)size);
+}
+
+
+int
+mg_flush(struct mg_connection *conn)
+{
+	int ret;
+
+	if (conn == NULL) {
+		return -1;
+	}
+	ret = flush_output_buffer(conn);
+#if defined(__linux__)
+	if (conn->tcp_corked) {
+		/* Uncorking sends a partial segment immediately */
+		set_tcp_cork(conn, 0);
+		set_tcp_cork(conn, 1);
+	}
+#endif
+	return ret;
+}
+
+
+/* Start buffering the response of a request, according to the
+ * output_buffer_size and tcp_cork configuration. */
+static void
+begin_output_buffering(struct mg_connection *conn)
+{
+	const struct mg_domain_config *cfg = &(conn->dom_ctx->cfg);
+
+	(void)set_output_buffering(conn, cfg->output_buffer_size);
+#if defined(__linux__)
+	if (cfg->tcp_cork) {
+		set_tcp_cork(conn, 1);
+	}
+#endif
+}
+
+
+/* Send all buffered data at the end of a request, or before the
+ * connection is used for something else (e.g., websocket frames). */
+static void
+end_output_buffering(struct mg_connection *conn)
+{
+	(void)set_output_buffering(conn, 0);
+	set_tcp_cork(conn, 0);
+}
+
+
 int
 mg_write(struct mg_connection *conn, const void *buf, size_t len)
 {
-	time_t now;
 	int n, total, allowed;
+	struct mg_iovec iov;
 
 	if (conn == NULL) {
 		return 0;
@@ -6709,6 +8115,17 @@ mg_write(struct mg_connection *conn, const void *buf, size_t len)
 		return -1;
 	}
 
+	if (is_output_buffered(conn)) {
+		/* Mark connection as "data sent" */
+		conn->request_state = 10;
+		iov.buf = buf;
+		iov.len = len;
+		return write_buffered(conn, &iov, 1, len);
+	}
+	if (flush_output_buffer(conn) != 0) {
+		return -1;
+	}
+
 	/* Mark connection as "data sent" */
 	conn->request_state = 10;
 #if defined(USE_HTTP2)
@@ -6717,49 +8134,29 @@ mg_write(struct mg_connection *conn, const void *buf, size_t len)
 	}
 #endif
 
-	if (conn->throttle > 0) {
-		if ((now = time(NULL)) != conn->last_throttle_time) {
-			conn->last_throttle_time = now;
-			conn->last_throttle_bytes = 0;
-		}
-		allowed = conn->throttle - conn->last_throttle_bytes;
-		if (allowed > (int)len) {
-			allowed = (int)len;
-		}
-
-		total = push_all(conn->phys_ctx,
-		                 NULL,
-		                 conn->client.sock,
-		                 conn->ssl,
-		                 (const char *)buf,
-		                 allowed);
-
-		if (total == allowed) {
-
-			buf = (const char *)buf + total;
-			conn->last_throttle_bytes += total;
-			while ((total < (int)len)
-			       && STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)) {
-				allowed = (conn->throttle > ((int)len - total))
-				              ? (int)len - total
-				              : conn->throttle;
-
-				n = push_all(conn->phys_ctx,
-				             NULL,
-				             conn->client.sock,
-				             conn->ssl,
-				             (const char *)buf,
-				             allowed);
-
-				if (n != allowed) {
-					break;
+	if (conn->throttle != NULL) {
+		/* Send slices as soon as the token bucket allows it */
+		total = 0;
+		while (total < (int)len) {
+			allowed = throttle_reserve(conn, (int)len - total);
+			if (allowed <= 0) {
+				break; /* server is stopping */
+			}
+			n = push_all(conn->phys_ctx,
+			             NULL,
+			             conn->client.sock,
+			             conn->ssl,
+			             (const char *)buf + total,
+			             allowed);
+			if (n != allowed) {
+				if (n > 0) {
+					total += n;
+				} else if (total == 0) {
+					total = n;
 				}
-				sleep(1);
-				conn->last_throttle_bytes = allowed;
-				conn->last_throttle_time = time(NULL);
-				buf = (const char *)buf + n;
-				total += n;
+				break;
 			}
+			total += n;
 		}
 	} else {
 		total = push_all(conn->phys_ctx,
@@ -6776,6 +8173,67 @@ mg_write(struct mg_connection *conn, const void *buf, size_t len)
 }
 
 
+int
+mg_writev(struct mg_connection *conn, const struct mg_iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i, n, total;
+
+	if (conn == NULL) {
+		return 0;
+	}
+	if ((iov == NULL) || (iovcnt < 0)) {
+		return -1;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].len > (size_t)INT_MAX - len) {
+			return -1;
+		}
+		len += iov[i].len;
+	}
+
+	if (is_output_buffered(conn)) {
+		/* Mark connection as "data sent" */
+		conn->request_state = 10;
+		return write_buffered(conn, iov, iovcnt, len);
+	}
+
+	if ((conn->throttle != NULL)
+#if defined(USE_HTTP2)
+	    || (conn->protocol_type == PROTOCOL_TYPE_HTTP2)
+#endif
+	) {
+		/* Throttling and HTTP/2 framing are done by mg_write */
+		total = 0;
+		for (i = 0; i < iovcnt; i++) {
+			n = mg_write(conn, iov[i].buf, iov[i].len);
+			if (n < 0) {
+				return (total > 0) ? total : n;
+			}
+			total += n;
+			if (n != (int)iov[i].len) {
+				break;
+			}
+		}
+		return total;
+	}
+
+	if (flush_output_buffer(conn) != 0) {
+		return -1;
+	}
+
+	/* Mark connection as "data sent" */
+	conn->request_state = 10;
+
+	total = push_all_vec(
+	    conn->phys_ctx, conn->client.sock, conn->ssl, iov, iovcnt);
+	if (total > 0) {
+		conn->num_bytes_sent += total;
+	}
+	return total;
+}
+
+
 /* Send a chunk, if "Transfer-Encoding: chunked" is used */
 int
 mg_send_chunk(struct mg_connection *conn,
@@ -6783,34 +8241,31 @@ mg_send_chunk(struct mg_connection *conn,
               unsigned int chunk_len)
 {
 	char lenbuf[16];
-	size_t lenbuf_len;
+	struct mg_iovec iov[3];
 	int ret;
-	int t;
 
 	/* First store the length information in a text buffer. */
 	sprintf(lenbuf, "%x\r\n", chunk_len);
-	lenbuf_len = strlen(lenbuf);
 
-	/* Then send length information, chunk and terminating \r\n. */
-	ret = mg_write(conn, lenbuf, lenbuf_len);
-	if (ret != (int)lenbuf_len) {
+	/* Then send length information, chunk and terminating \r\n
+	 * with one write. */
+	iov[0].buf = lenbuf;
+	iov[0].len = strlen(lenbuf);
+	iov[1].buf = chunk;
+	iov[1].len = chunk_len;
+	iov[2].buf = "\r\n";
+	iov[2].len = 2;
+
+	ret = mg_writev(conn, iov, 3);
+	if (ret != (int)(iov[0].len + chunk_len + 2)) {
 		return -1;
 	}
-	t = ret;
 
-	ret = mg_write(conn, chunk, chunk_len);
-	if (ret != (int)chunk_len) {
+	/* A chunk is a unit of data for the client: send it now */
+	if (flush_output_buffer(conn) != 0) {
 		return -1;
 	}
-	t += ret;
-
-	ret = mg_write(conn, "\r\n", 2);
-	if (ret != 2) {
-		return -1;
-	}
-	t += ret;
-
-	return t;
+	return ret;
 }
 
 
@@ -6913,6 +8368,32 @@ alloc_vprintf(char **out_buf,
 }
 
 
+/* Print message directly into the free space of the output buffer.
+ * Return the message length, or -1 if it does not fit. */
+static int
+buffered_vprintf(struct mg_connection *conn, const char *fmt, va_list ap)
+{
+	va_list ap_copy;
+	size_t avail;
+	int len;
+
+	if (conn->out_buf == NULL) {
+		return -1;
+	}
+	avail = (size_t)(conn->out_buf_size - conn->out_buf_len);
+	va_copy(ap_copy, ap);
+	len = vsnprintf_impl(conn->out_buf + conn->out_buf_len, avail, fmt, ap_copy);
+	va_end(ap_copy);
+	if ((len < 0) || ((size_t)len >= avail)) {
+		return -1;
+	}
+	conn->out_buf_len += len;
+	conn->num_bytes_sent += len;
+	conn->request_state = 10;
+	return len;
+}
+
+
 #if defined(GCC_DIAGNOSTIC)
 /* Enable format-nonliteral warning again. */
 #pragma GCC diagnostic pop
@@ -6926,6 +8407,12 @@ mg_vprintf(struct mg_connection *conn, const char *fmt, va_list ap)
 	char *buf = NULL;
 	int len;
 
+	/* Avoid the copy, if the message fits into the output buffer */
+	if ((conn != NULL) && is_output_buffered(conn)
+	    && ((len = buffered_vprintf(conn, fmt, ap)) >= 0)) {
+		return len;
+	}
+
 	if ((len = alloc_vprintf(&buf, mem, sizeof(mem), fmt, ap)) > 0) {
 		len = mg_write(conn, buf, (size_t)len);
 	}
@@ -7331,16 +8818,12 @@ extention_matches_script(
 #endif
 
 #if defined(USE_LUA)
-	if (match_prefix_strlen(conn->dom_ctx->config[LUA_SCRIPT_EXTENSIONS],
-	                        filename)
-	    > 0) {
+	if (match_config_pattern(conn, LUA_SCRIPT_EXTENSIONS, filename) > 0) {
 		return 1;
 	}
 #endif
 #if defined(USE_DUKTAPE)
-	if (match_prefix_strlen(conn->dom_ctx->config[DUKTAPE_SCRIPT_EXTENSIONS],
-	                        filename)
-	    > 0) {
+	if (match_config_pattern(conn, DUKTAPE_SCRIPT_EXTENSIONS, filename) > 0) {
 		return 1;
 	}
 #endif
@@ -7349,9 +8832,8 @@ extention_matches_script(
 	max = PUT_DELETE_PASSWORDS_FILE - CGI_EXTENSIONS;
 	for (cgi_config_idx = 0; cgi_config_idx < max; cgi_config_idx += inc) {
 		if ((conn->dom_ctx->config[CGI_EXTENSIONS + cgi_config_idx] != NULL)
-		    && (match_prefix_strlen(
-		            conn->dom_ctx->config[CGI_EXTENSIONS + cgi_config_idx],
-		            filename)
+		    && (match_config_pattern(
+		            conn, CGI_EXTENSIONS + cgi_config_idx, filename)
 		        > 0)) {
 			return 1;
 		}
@@ -7373,14 +8855,11 @@ extention_matches_template_text(
 )
 {
 #if defined(USE_LUA)
-	if (match_prefix_strlen(conn->dom_ctx->config[LUA_SERVER_PAGE_EXTENSIONS],
-	                        filename)
-	    > 0) {
+	if (match_config_pattern(conn, LUA_SERVER_PAGE_EXTENSIONS, filename) > 0) {
 		return 1;
 	}
 #endif
-	if (match_prefix_strlen(conn->dom_ctx->config[SSI_EXTENSIONS], filename)
-	    > 0) {
+	if (match_config_pattern(conn, SSI_EXTENSIONS, filename) > 0) {
 		return 1;
 	}
 	return 0;
@@ -7438,6 +8917,143 @@ substitute_index_file(struct mg_connection *conn,
 #endif
 
 
+/* Parse a q-value parameter ("q=0.5") of an Accept-Encoding element.
+ * Return: q-value in thousandths, 1000 if there is no q-value. */
+static int
+parse_qvalue(const char *param, size_t len)
+{
+	const char *end = param + len;
+	int q = 0, scale = 1000;
+
+	while ((param < end) && ((*param == ' ') || (*param == '\t'))) {
+		param++;
+	}
+	if ((end - param < 2) || ((*param != 'q') && (*param != 'Q'))
+	    || (param[1] != '=')) {
+		return 1000;
+	}
+	param += 2;
+	if ((param < end) && (*param == '1')) {
+		return 1000;
+	}
+	if ((param < end) && (*param == '0')) {
+		param++;
+		if ((param < end) && (*param == '.')) {
+			param++;
+			while ((param < end) && isdigit((unsigned char)*param)
+			       && (scale > 1)) {
+				scale /= 10;
+				q += (*param - '0') * scale;
+				param++;
+			}
+		}
+	}
+	return q;
+}
+
+
+/* Parse an Accept-Encoding header into the list of accepted content
+ * encodings (MG_ENCODING_*), sorted by q-value. Encodings with the same
+ * q-value are sorted by the server preference (br, zstd, gzip).
+ * The list is terminated by MG_ENCODING_IDENTITY. */
+static void
+parse_accept_encoding(const char *header,
+                      unsigned char list[MG_ENCODING_COUNT])
+{
+	int q[MG_ENCODING_COUNT];
+	int q_any = 0; /* q-value of "*" */
+	struct vec val;
+	const char *param;
+	size_t len;
+	int i, n, best;
+
+	for (i = 0; i < MG_ENCODING_COUNT; i++) {
+		q[i] = -1; /* Not in the list */
+	}
+	while ((header = next_option(header, &val, NULL)) != NULL) {
+		param = (const char *)memchr(val.ptr, ';', val.len);
+		len = (param != NULL) ? (size_t)(param - val.ptr) : val.len;
+		while ((len > 0)
+		       && ((val.ptr[len - 1] == ' ') || (val.ptr[len - 1] == '\t'))) {
+			len--;
+		}
+		n = (param != NULL)
+		        ? parse_qvalue(param + 1,
+		                       val.len - (size_t)(param + 1 - val.ptr))
+		        : 1000;
+		if ((len == 1) && (val.ptr[0] == '*')) {
+			q_any = n;
+			continue;
+		}
+		for (i = 1; i < MG_ENCODING_COUNT; i++) {
+			if ((strlen(content_encodings[i].name) == len)
+			    && !mg_strncasecmp(val.ptr, content_encodings[i].name, len)) {
+				q[i] = n;
+			}
+		}
+	}
+	for (i = 1; i < MG_ENCODING_COUNT; i++) {
+		if (q[i] < 0) {
+			q[i] = q_any;
+		}
+	}
+
+	/* Selection sort: best encoding first, 0 is not acceptable */
+	for (n = 0; n < MG_ENCODING_COUNT - 1; n++) {
+		best = 0;
+		for (i = MG_ENCODING_COUNT - 1; i > 0; i--) {
+			if ((q[i] > 0) && ((best == 0) || (q[i] > q[best]))) {
+				best = i;
+			}
+		}
+		if (best == 0) {
+			break;
+		}
+		list[n] = (unsigned char)best;
+		q[best] = 0;
+	}
+	list[n] = MG_ENCODING_IDENTITY;
+}
+
+
+#if !defined(NO_FILESYSTEMS)
+/* Look for a precompressed variant of a file (file name + ".br", ".zst"
+ * or ".gz"), in the order of the encodings accepted by the client.
+ * The path of the variant is stored in buf.
+ * Return: encoding of the variant found, or 0 (MG_ENCODING_IDENTITY) */
+static int
+find_precompressed_file(struct mg_connection *conn,
+                        const char *path,
+                        char *buf,
+                        size_t buf_len,
+                        struct mg_file_stat *filestat)
+{
+	struct mg_file_stat file_stat;
+	int i, enc, truncated;
+
+	for (i = 0; (enc = conn->accept_encodings[i]) != MG_ENCODING_IDENTITY;
+	     i++) {
+		mg_snprintf(conn,
+		            &truncated,
+		            buf,
+		            buf_len,
+		            "%s%s",
+		            path,
+		            content_encodings[enc].ext);
+		if (!truncated && mg_stat(conn, buf, &file_stat)
+		    && !file_stat.is_directory) {
+			file_stat.encoding = enc;
+			if (filestat != NULL) {
+				*filestat = file_stat;
+			}
+			return enc;
+		}
+	}
+	return MG_ENCODING_IDENTITY;
+}
+#endif
+
+
 static void
 interpret_uri(struct mg_connection *conn, /* in/out: request (must be valid) */
               char *filename,             /* out: filename */
@@ -7450,15 +9066,13 @@ interpret_uri(struct mg_connection *conn, /* in/out: request (must be valid) */
               int *is_template_text          /* out: SSI file or LSP file? */
 )
 {
-	char const *accept_encoding;
-
 #if !defined(NO_FILES)
 	const char *uri = conn->request_info.local_uri;
 	const char *root = conn->dom_ctx->config[DOCUMENT_ROOT];
 	const char *rewrite;
 	struct vec a, b;
 	ptrdiff_t match_len;
-	char gz_path[UTF8_PATH_MAX];
+	char enc_path[UTF8_PATH_MAX];
 	int truncated;
 #if !defined(NO_CGI) || defined(USE_LUA) || defined(USE_DUKTAPE)
 	char *tmp_str;
@@ -7492,13 +9106,13 @@ interpret_uri(struct mg_connection *conn, /* in/out: request (must be valid) */
 	*is_websocket_request = 0;
 #endif /* USE_WEBSOCKET */
 
-	/* Step 4: Check if gzip encoded response is allowed */
-	conn->accept_gzip = 0;
-	if ((accept_encoding = mg_get_header(conn, "Accept-Encoding")) != NULL) {
-		if (strstr(accept_encoding, "gzip") != NULL) {
-			conn->accept_gzip = 1;
-		}
-	}
+	/* Step 4: Check which encodings of the response are allowed */
+	parse_accept_encoding(mg_get_header(conn, "Accept-Encoding"),
+	                      conn->accept_encodings);
+	conn->accept_gzip = (memchr(conn->accept_encodings,
+	                            MG_ENCODING_GZIP,
+	                            sizeof(conn->accept_encodings))
+	                     != NULL);
 
 #if !defined(NO_FILES)
 	/* Step 5: If there is no root directory, don't look for files. */
@@ -7612,29 +9226,19 @@ interpret_uri(struct mg_connection *conn, /* in/out: request (must be valid) */
 		return;
 	}
 
-	/* Step 9: Check for zipped files: */
+	/* Step 9: Check for precompressed files: */
 	/* If we can't find the actual file, look for the file
-	 * with the same name but a .gz extension. If we find it,
-	 * use that and set the gzipped flag in the file struct
-	 * to indicate that the response need to have the content-
-	 * encoding: gzip header.
-	 * We can only do this if the browser declares support. */
-	if (conn->accept_gzip) {
-		mg_snprintf(
-		    conn, &truncated, gz_path, sizeof(gz_path), "%s.gz", filename);
-
-		if (truncated) {
-			goto interpret_cleanup;
-		}
-
-		if (mg_stat(conn, gz_path, filestat)) {
-			if (filestat) {
-				filestat->is_gzipped = 1;
-				*is_found = 1;
-			}
-			/* Currently gz files can not be scripts. */
-			return;
-		}
+	 * with the same name but a .br, .zst or .gz extension, in the
+	 * order of preference of the browser. If we find it, use that
+	 * and set the encoding in the file struct to indicate that the
+	 * response need to have the content-encoding header. */
+	if (find_precompressed_file(
+	        conn, filename, enc_path, sizeof(enc_path), filestat)) {
+		if (filestat) {
+			*is_found = 1;
+		}
+		/* Currently compressed files can not be scripts. */
+		return;
 	}
 
 #if !defined(NO_CGI) || defined(USE_LUA) || defined(USE_DUKTAPE)
@@ -7651,8 +9255,7 @@ interpret_uri(struct mg_connection *conn, /* in/out: request (must be valid) */
 
 	/* Check config, if index scripts may have sub-resources */
 	allow_substitute_script_subresources =
-	    !mg_strcasecmp(conn->dom_ctx->config[ALLOW_INDEX_SCRIPT_SUB_RES],
-	                   "yes");
+	    conn->dom_ctx->cfg.allow_index_script_sub_res;
 
 	sep_pos = tmp_str_len;
 	while (sep_pos > 0) {
@@ -9260,182 +10863,33 @@ mg_url_encode(const char *src, char *dst, size_t dst_len)
 	return (*src == '\0') ? (int)(pos - dst) : -1;
 }
 
-/* Return 0 on success, non-zero if an error occurs. */
-
 static int
-print_dir_entry(struct de *de)
+must_hide_file(struct mg_connection *conn, const char *path)
 {
-	size_t namesize, escsize, i;
-	char *href, *esc, *p;
-	char size[64], mod[64];
-#if defined(REENTRANT_TIME)
-	struct tm _tm;
-	struct tm *tm = &_tm;
-#else
-	struct tm *tm;
-#endif
-
-	/* Estimate worst case size for encoding and escaping */
-	namesize = strlen(de->file_name) + 1;
-	escsize = de->file_name[strcspn(de->file_name, "&<>")] ? namesize * 5 : 0;
-	href = (char *)mg_malloc(namesize * 3 + escsize);
-	if (href == NULL) {
-		return -1;
-	}
-	mg_url_encode(de->file_name, href, namesize * 3);
-	esc = NULL;
-	if (escsize > 0) {
-		/* HTML escaping needed */
-		esc = href + namesize * 3;
-		for (i = 0, p = esc; de->file_name[i]; i++, p += strlen(p)) {
-			mg_strlcpy(p, de->file_name + i, 2);
-			if (*p == '&') {
-				strcpy(p, "&amp;");
-			} else if (*p == '<') {
-				strcpy(p, "&lt;");
-			} else if (*p == '>') {
-				strcpy(p, "&gt;");
-			}
-		}
+	if (conn && conn->dom_ctx) {
+		const char *pw_pattern = "**" PASSWORDS_FILE_NAME "$";
+		return (match_prefix_strlen(pw_pattern, path) > 0)
+		       || (match_config_pattern(conn, HIDE_FILES, path) > 0);
 	}
+	return 0;
+}
 
-	if (de->file.is_directory) {
-		mg_snprintf(de->conn,
-		            NULL, /* Buffer is big enough */
-		            size,
-		            sizeof(size),
-		            "%s",
-		            "[DIRECTORY]");
-	} else {
-		/* We use (signed) cast below because MSVC 6 compiler cannot
-		 * convert unsigned __int64 to double. Sigh. */
-		if (de->file.size < 1024) {
-			mg_snprintf(de->conn,
-			            NULL, /* Buffer is big enough */
-			            size,
-			            sizeof(size),
-			            "%d",
-			            (int)de->file.size);
-		} else if (de->file.size < 0x100000) {
-			mg_snprintf(de->conn,
-			            NULL, /* Buffer is big enough */
-			            size,
-			            sizeof(size),
-			            "%.1fk",
-			            (double)de->file.size / 1024.0);
-		} else if (de->file.size < 0x40000000) {
-			mg_snprintf(de->conn,
-			            NULL, /* Buffer is big enough */
-			            size,
-			            sizeof(size),
-			            "%.1fM",
-			            (double)de->file.size / 1048576);
-		} else {
-			mg_snprintf(de->conn,
-			            NULL, /* Buffer is big enough */
-			            size,
-			            sizeof(size),
-			            "%.1fG",
-			            (double)de->file.size / 1073741824);
-		}
-	}
-
-	/* Note: mg_snprintf will not cause a buffer overflow above.
-	 * So, string truncation checks are not required here. */
-
-#if defined(REENTRANT_TIME)
-	localtime_r(&de->file.last_modified, tm);
-#else
-	tm = localtime(&de->file.last_modified);
-#endif
-	if (tm != NULL) {
-		strftime(mod, sizeof(mod), "%d-%b-%Y %H:%M", tm);
-	} else {
-		mg_strlcpy(mod, "01-Jan-1970 00:00", sizeof(mod));
-		mod[sizeof(mod) - 1] = '\0';
-	}
-	mg_printf(de->conn,
-	          "<tr><td><a href=\"%s%s\">%s%s</a></td>"
-	          "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
-	          href,
-	          de->file.is_directory ? "/" : "",
-	          esc ? esc : de->file_name,
-	          de->file.is_directory ? "/" : "",
-	          mod,
-	          size);
-	mg_free(href);
-	return 0;
-}
-
-
-/* This function is called from send_directory() and used for
- * sorting directory entries by size, or name, or modification time.
- * On windows, __cdecl specification is needed in case if project is built
- * with __stdcall convention. qsort always requires __cdels callback. */
-static int WINCDECL
-compare_dir_entries(const void *p1, const void *p2)
-{
-	if (p1 && p2) {
-		const struct de *a = (const struct de *)p1, *b = (const struct de *)p2;
-		const char *query_string = a->conn->request_info.query_string;
-		int cmp_result = 0;
-
-		if ((query_string == NULL) || (query_string[0] == '\0')) {
-			query_string = "n";
-		}
-
-		if (a->file.is_directory && !b->file.is_directory) {
-			return -1; /* Always put directories on top */
-		} else if (!a->file.is_directory && b->file.is_directory) {
-			return 1; /* Always put directories on top */
-		} else if (*query_string == 'n') {
-			cmp_result = strcmp(a->file_name, b->file_name);
-		} else if (*query_string == 's') {
-			cmp_result = (a->file.size == b->file.size)
-			                 ? 0
-			                 : ((a->file.size > b->file.size) ? 1 : -1);
-		} else if (*query_string == 'd') {
-			cmp_result =
-			    (a->file.last_modified == b->file.last_modified)
-			        ? 0
-			        : ((a->file.last_modified > b->file.last_modified) ? 1
-			                                                           : -1);
-		}
-
-		return (query_string[1] == 'd') ? -cmp_result : cmp_result;
-	}
-	return 0;
-}
-
-
-static int
-must_hide_file(struct mg_connection *conn, const char *path)
-{
-	if (conn && conn->dom_ctx) {
-		const char *pw_pattern = "**" PASSWORDS_FILE_NAME "$";
-		const char *pattern = conn->dom_ctx->config[HIDE_FILES];
-		return (match_prefix_strlen(pw_pattern, path) > 0)
-		       || (match_prefix_strlen(pattern, path) > 0);
-	}
-	return 0;
-}
-
-
-#if !defined(NO_FILESYSTEMS)
-static int
-scan_directory(struct mg_connection *conn,
-               const char *dir,
-               void *data,
-               int (*cb)(struct de *, void *))
-{
-	char path[UTF8_PATH_MAX];
-	struct dirent *dp;
-	DIR *dirp;
-	struct de de;
-	int truncated;
-
-	if ((dirp = mg_opendir(conn, dir)) == NULL) {
-		return 0;
+
+#if !defined(NO_FILESYSTEMS)
+static int
+scan_directory(struct mg_connection *conn,
+               const char *dir,
+               void *data,
+               int (*cb)(struct de *, void *))
+{
+	char path[UTF8_PATH_MAX];
+	struct dirent *dp;
+	DIR *dirp;
+	struct de de;
+	int truncated;
+
+	if ((dirp = mg_opendir(conn, dir)) == NULL) {
+		return 0;
 	} else {
 		de.conn = conn;
 
@@ -9451,7 +10905,7 @@ scan_directory(struct mg_connection *conn,
 
 			/* If we don't memset stat structure to zero, mtime will have
 			 * garbage and strftime() will segfault later on in
-			 * print_dir_entry(). memset is required only if mg_stat()
+			 * the directory listing. memset is required only if mg_stat()
 			 * fails. For more details, see
 			 * http://code.google.com/p/civetweb/issues/detail?id=79 */
 			memset(&de.file, 0, sizeof(de.file));
@@ -9509,7 +10963,7 @@ remove_directory(struct mg_connection *conn, const char *dir)
 
 			/* If we don't memset stat structure to zero, mtime will have
 			 * garbage and strftime() will segfault later on in
-			 * print_dir_entry(). memset is required only if mg_stat()
+			 * the directory listing. memset is required only if mg_stat()
 			 * fails. For more details, see
 			 * http://code.google.com/p/civetweb/issues/detail?id=79 */
 			memset(&de.file, 0, sizeof(de.file));
@@ -9550,61 +11004,268 @@ remove_directory(struct mg_connection *conn, const char *dir)
 #endif
 
 
-struct dir_scan_data {
-	struct de *entries;
-	size_t num_entries;
-	size_t arr_size;
+#if !defined(NO_FILESYSTEMS)
+#include "dir_index.inl"
+
+
+/* Output of a directory listing. The listing is collected in blocks of
+ * MG_BUF_LEN bytes, sent as chunks if chunked transfer encoding is used. */
+struct dir_listing_out {
+	struct mg_connection *conn;
+	int chunked;
+	size_t len;
+	int modified_valid;
+	time_t modified_minute; /* Time formatted in "modified" */
+	char modified[32];
+	char buf[MG_BUF_LEN];
 };
 
 
-#if !defined(NO_FILESYSTEMS)
-static int
-dir_scan_callback(struct de *de, void *data)
-{
-	struct dir_scan_data *dsd = (struct dir_scan_data *)data;
-	struct de *entries = dsd->entries;
-
-	if ((entries == NULL) || (dsd->num_entries >= dsd->arr_size)) {
-		/* Here "entries" is a temporary pointer and can be replaced,
-		 * "dsd->entries" is the original pointer */
-		entries =
-		    (struct de *)mg_realloc(entries,
-		                            dsd->arr_size * 2 * sizeof(entries[0]));
-		if (entries == NULL) {
-			/* stop scan */
-			return 1;
+static void
+dir_listing_flush(struct dir_listing_out *out)
+{
+	if (out->len > 0) {
+		if (out->chunked) {
+			(void)mg_send_chunk(out->conn,
+			                    out->buf,
+			                    (unsigned int)out->len);
+		} else {
+			(void)mg_write(out->conn, out->buf, out->len);
 		}
-		dsd->entries = entries;
-		dsd->arr_size *= 2;
+		out->len = 0;
 	}
-	entries[dsd->num_entries].file_name = mg_strdup(de->file_name);
-	if (entries[dsd->num_entries].file_name == NULL) {
-		/* stop scan */
-		return 1;
+}
+
+
+static void
+dir_listing_write(struct dir_listing_out *out, const char *data, size_t len)
+{
+	while (len > 0) {
+		size_t n = sizeof(out->buf) - out->len;
+		if (n == 0) {
+			dir_listing_flush(out);
+			continue;
+		}
+		if (n > len) {
+			n = len;
+		}
+		memcpy(out->buf + out->len, data, n);
+		out->len += n;
+		data += n;
+		len -= n;
 	}
-	entries[dsd->num_entries].file = de->file;
-	entries[dsd->num_entries].conn = de->conn;
-	dsd->num_entries++;
+}
 
-	return 0;
+
+static void
+dir_listing_puts(struct dir_listing_out *out, const char *str)
+{
+	dir_listing_write(out, str, strlen(str));
 }
 
 
+/* Write a string URL encoded ('u'), HTML escaped ('h') or escaped for a
+ * JSON string ('j') */
+static void
+dir_listing_write_escaped(struct dir_listing_out *out,
+                          const char *str,
+                          int format)
+{
+	static const char *hex = "0123456789abcdef";
+	char esc[8];
+
+	for (; *str != '\0'; str++) {
+		unsigned char c = (unsigned char)*str;
+		const char *s = NULL;
+
+		if (format == 'u') {
+			if (!isalnum(c) && !strchr("._-$,;~()", c)) {
+				esc[0] = '%';
+				esc[1] = hex[c >> 4];
+				esc[2] = hex[c & 15];
+				esc[3] = '\0';
+				s = esc;
+			}
+		} else if (format == 'h') {
+			if (c == '&') {
+				s = "&amp;";
+			} else if (c == '<') {
+				s = "&lt;";
+			} else if (c == '>') {
+				s = "&gt;";
+			}
+		} else if ((c == '"') || (c == '\\')) {
+			esc[0] = '\\';
+			esc[1] = (char)c;
+			esc[2] = '\0';
+			s = esc;
+		} else if (c < 0x20) {
+			memcpy(esc, "\\u00", 4);
+			esc[4] = hex[c >> 4];
+			esc[5] = hex[c & 15];
+			esc[6] = '\0';
+			s = esc;
+		}
+
+		if (s != NULL) {
+			dir_listing_puts(out, s);
+		} else if (out->len < sizeof(out->buf)) {
+			out->buf[out->len++] = (char)c;
+		} else {
+			dir_listing_write(out, str, 1);
+		}
+	}
+}
+
+
+/* Write one row of the HTML listing */
+static void
+dir_listing_html_entry(struct dir_listing_out *out,
+                       const struct mg_dir_entry *e)
+{
+	struct mg_connection *conn = out->conn;
+	char size[64];
+#if defined(REENTRANT_TIME)
+	struct tm _tm;
+	struct tm *tm = &_tm;
+#else
+	struct tm *tm;
+#endif
+
+	if (e->is_directory) {
+		mg_strlcpy(size, "[DIRECTORY]", sizeof(size));
+	} else {
+		/* We use (signed) cast below because MSVC 6 compiler cannot
+		 * convert unsigned __int64 to double. Sigh. */
+		if (e->size < 1024) {
+			mg_snprintf(conn,
+			            NULL, /* Buffer is big enough */
+			            size,
+			            sizeof(size),
+			            "%d",
+			            (int)e->size);
+		} else if (e->size < 0x100000) {
+			mg_snprintf(conn,
+			            NULL, /* Buffer is big enough */
+			            size,
+			            sizeof(size),
+			            "%.1fk",
+			            (double)(int64_t)e->size / 1024.0);
+		} else if (e->size < 0x40000000) {
+			mg_snprintf(conn,
+			            NULL, /* Buffer is big enough */
+			            size,
+			            sizeof(size),
+			            "%.1fM",
+			            (double)(int64_t)e->size / 1048576);
+		} else {
+			mg_snprintf(conn,
+			            NULL, /* Buffer is big enough */
+			            size,
+			            sizeof(size),
+			            "%.1fG",
+			            (double)(int64_t)e->size / 1073741824);
+		}
+	}
+
+	/* The listing shows minutes: entries modified in the same minute
+	 * (e.g., all files of an unpacked archive) share the formatted time. */
+	if (!out->modified_valid
+	    || (e->last_modified / 60 != out->modified_minute)) {
+#if defined(REENTRANT_TIME)
+		localtime_r(&e->last_modified, tm);
+#else
+		tm = localtime(&e->last_modified);
+#endif
+		if (tm != NULL) {
+			strftime(out->modified,
+			         sizeof(out->modified),
+			         "%d-%b-%Y %H:%M",
+			         tm);
+		} else {
+			mg_strlcpy(out->modified,
+			           "01-Jan-1970 00:00",
+			           sizeof(out->modified));
+		}
+		out->modified_minute = e->last_modified / 60;
+		out->modified_valid = 1;
+	}
+
+	dir_listing_puts(out, "<tr><td><a href=\"");
+	dir_listing_write_escaped(out, e->name.ptr, 'u');
+	dir_listing_puts(out, e->is_directory ? "/\">" : "\">");
+	dir_listing_write_escaped(out, e->name.ptr, 'h');
+	dir_listing_puts(out, e->is_directory ? "/" : "");
+	dir_listing_puts(out, "</a></td><td>&nbsp;");
+	dir_listing_puts(out, out->modified);
+	dir_listing_puts(out, "</td><td>&nbsp;&nbsp;");
+	dir_listing_puts(out, size);
+	dir_listing_puts(out, "</td></tr>\n");
+}
+
+
+/* Write one element of the "entries" array of the JSON listing */
+static void
+dir_listing_json_entry(struct dir_listing_out *out,
+                       const struct mg_dir_entry *e,
+                       int first)
+{
+	char buf[128];
+
+	dir_listing_puts(out, first ? "{\"name\":\"" : ",{\"name\":\"");
+	dir_listing_write_escaped(out, e->name.ptr, 'j');
+	mg_snprintf(out->conn,
+	            NULL, /* Buffer is big enough */
+	            buf,
+	            sizeof(buf),
+	            "\",\"type\":\"%s\",\"size\":%" UINT64_FMT
+	            ",\"modified\":%" INT64_FMT "}",
+	            e->is_directory ? "directory" : "file",
+	            e->is_directory ? (uint64_t)0 : e->size,
+	            (int64_t)e->last_modified);
+	dir_listing_puts(out, buf);
+}
+
+
+/* Send a listing of the directory dir.
+ * The query string selects the order and a part of the listing:
+ * "n", "s" or "d" (name, size, modification time) followed by "a" or "d"
+ * (ascending, descending), "offset" and "limit" (number of entries, 0 for
+ * all entries), and "format=json" for a JSON document instead of HTML. */
 static void
 handle_directory_request(struct mg_connection *conn, const char *dir)
 {
-	size_t i;
-	int sort_direction;
-	struct dir_scan_data data = {NULL, 0, 128};
-	char date[64], *esc, *p;
-	const char *title;
-	time_t curtime = time(NULL);
+	const char *query = conn ? conn->request_info.query_string : NULL;
+	struct dir_listing_out *out;
+	struct mg_dir_index *idx;
+	int sort_key = 'n', descending = 0, json = 0;
+	size_t i, offset = 0, limit = 0, end;
+	char val[32], buf[256];
 
 	if (!conn) {
 		return;
 	}
 
-	if (!scan_directory(conn, dir, &data, dir_scan_callback)) {
+	if ((query != NULL) && (query[0] != '\0')) {
+		size_t query_len = strlen(query);
+
+		if (strchr("nsd", query[0])) {
+			sort_key = query[0];
+			descending = (query[1] == 'd');
+		}
+		if (mg_get_var(query, query_len, "offset", val, sizeof(val)) > 0) {
+			offset = (size_t)strtoul(val, NULL, 10);
+		}
+		if (mg_get_var(query, query_len, "limit", val, sizeof(val)) > 0) {
+			limit = (size_t)strtoul(val, NULL, 10);
+		}
+		if (mg_get_var(query, query_len, "format", val, sizeof(val)) > 0) {
+			json = !strcmp(val, "json");
+		}
+	}
+
+	idx = dir_index_get(conn, dir);
+	if (idx == NULL) {
 		mg_send_http_error(conn,
 		                   500,
 		                   "Error: Cannot open directory\nopendir(%s): %s",
@@ -9612,37 +11273,33 @@ handle_directory_request(struct mg_connection *conn, const char *dir)
 		                   strerror(ERRNO));
 		return;
 	}
-
-	gmt_time_string(date, sizeof(date), &curtime);
-
-	esc = NULL;
-	title = conn->request_info.local_uri;
-	if (title[strcspn(title, "&<>")]) {
-		/* HTML escaping needed */
-		esc = (char *)mg_malloc(strlen(title) * 5 + 1);
-		if (esc) {
-			for (i = 0, p = esc; title[i]; i++, p += strlen(p)) {
-				mg_strlcpy(p, title + i, 2);
-				if (*p == '&') {
-					strcpy(p, "&amp;");
-				} else if (*p == '<') {
-					strcpy(p, "&lt;");
-				} else if (*p == '>') {
-					strcpy(p, "&gt;");
-				}
-			}
-		} else {
-			title = "";
-		}
+	out = (struct dir_listing_out *)mg_calloc_ctx(1,
+	                                              sizeof(*out),
+	                                              conn->phys_ctx);
+	if (out == NULL) {
+		dir_index_release(conn, idx);
+		mg_send_http_error(conn,
+		                   500,
+		                   "Error: Cannot create directory listing\n%s",
+		                   "Out of memory");
+		return;
 	}
+	out->conn = conn;
 
-	sort_direction = ((conn->request_info.query_string != NULL)
-	                  && (conn->request_info.query_string[0] != '\0')
-	                  && (conn->request_info.query_string[1] == 'd'))
-	                     ? 'a'
-	                     : 'd';
+	if (offset > idx->num_entries) {
+		offset = idx->num_entries;
+	}
+	end = ((limit > 0) && (limit < idx->num_entries - offset))
+	          ? (offset + limit)
+	          : idx->num_entries;
 
-	conn->must_close = 1;
+	/* The listing is sent while it is created: use chunked transfer
+	 * encoding, if possible. */
+	out->chunked = (conn->protocol_type == PROTOCOL_TYPE_HTTP1)
+	               && !strcmp(conn->request_info.http_version, "1.1");
+	if (!out->chunked) {
+		conn->must_close = 1;
+	}
 
 	/* Create 200 OK response */
 	mg_response_header_start(conn, 200);
@@ -9650,56 +11307,232 @@ handle_directory_request(struct mg_connection *conn, const char *dir)
 	send_additional_header(conn);
 	mg_response_header_add(conn,
 	                       "Content-Type",
-	                       "text/html; charset=utf-8",
+	                       json ? "application/json; charset=utf-8"
+	                            : "text/html; charset=utf-8",
 	                       -1);
+	if (out->chunked) {
+		mg_response_header_add(conn, "Transfer-Encoding", "chunked", -1);
+	}
 
 	/* Send all headers */
 	mg_response_header_send(conn);
+	conn->status_code = 200;
+
+	if (!strcmp(conn->request_info.request_method, "HEAD")) {
+		dir_index_release(conn, idx);
+		mg_free(out);
+		return;
+	}
 
 	/* Body */
-	mg_printf(conn,
-	          "<html><head><title>Index of %s</title>"
-	          "<style>th {text-align: left;}</style></head>"
-	          "<body><h1>Index of %s</h1><pre><table cellpadding=\"0\">"
-	          "<tr><th><a href=\"?n%c\">Name</a></th>"
-	          "<th><a href=\"?d%c\">Modified</a></th>"
-	          "<th><a href=\"?s%c\">Size</a></th></tr>"
-	          "<tr><td colspan=\"3\"><hr></td></tr>",
-	          esc ? esc : title,
-	          esc ? esc : title,
-	          sort_direction,
-	          sort_direction,
-	          sort_direction);
-	mg_free(esc);
-
-	/* Print first entry - link to a parent directory */
-	mg_printf(conn,
-	          "<tr><td><a href=\"%s\">%s</a></td>"
-	          "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
-	          "..",
-	          "Parent directory",
-	          "-",
-	          "-");
-
-	/* Sort and print directory entries */
-	if (data.entries != NULL) {
-		qsort(data.entries,
-		      data.num_entries,
-		      sizeof(data.entries[0]),
-		      compare_dir_entries);
-		for (i = 0; i < data.num_entries; i++) {
-			print_dir_entry(&data.entries[i]);
-			mg_free(data.entries[i].file_name);
-		}
-		mg_free(data.entries);
-	}
-
-	mg_printf(conn, "%s", "</table></pre></body></html>");
-	conn->status_code = 200;
+	if (json) {
+		dir_listing_puts(out, "{\"path\":\"");
+		dir_listing_write_escaped(out, conn->request_info.local_uri, 'j');
+		mg_snprintf(conn,
+		            NULL, /* Buffer is big enough */
+		            buf,
+		            sizeof(buf),
+		            "\",\"total\":%" UINT64_FMT ",\"offset\":%" UINT64_FMT
+		            ",\"entries\":[",
+		            (uint64_t)idx->num_entries,
+		            (uint64_t)offset);
+		dir_listing_puts(out, buf);
+		for (i = offset; i < end; i++) {
+			const struct mg_dir_entry *e =
+			    dir_index_entry(idx, i, sort_key, descending);
+			dir_listing_json_entry(out, e, i == offset);
+		}
+		dir_listing_puts(out, "]}\n");
+	} else {
+		/* Sort links select the opposite direction of the current order,
+		 * and keep the page size */
+		int sort_direction = descending ? 'a' : 'd';
+		char limit_arg[32] = "";
+
+		if (limit > 0) {
+			mg_snprintf(conn,
+			            NULL, /* Buffer is big enough */
+			            limit_arg,
+			            sizeof(limit_arg),
+			            "&limit=%" UINT64_FMT,
+			            (uint64_t)limit);
+		}
+
+		dir_listing_puts(out, "<html><head><title>Index of ");
+		dir_listing_write_escaped(out, conn->request_info.local_uri, 'h');
+		dir_listing_puts(out,
+		                 "</title><style>th {text-align: left;}</style>"
+		                 "</head><body><h1>Index of ");
+		dir_listing_write_escaped(out, conn->request_info.local_uri, 'h');
+		mg_snprintf(conn,
+		            NULL, /* Buffer is big enough */
+		            buf,
+		            sizeof(buf),
+		            "</h1><pre><table cellpadding=\"0\">"
+		            "<tr><th><a href=\"?n%c%s\">Name</a></th>"
+		            "<th><a href=\"?d%c%s\">Modified</a></th>"
+		            "<th><a href=\"?s%c%s\">Size</a></th></tr>"
+		            "<tr><td colspan=\"3\"><hr></td></tr>",
+		            sort_direction,
+		            limit_arg,
+		            sort_direction,
+		            limit_arg,
+		            sort_direction,
+		            limit_arg);
+		dir_listing_puts(out, buf);
+
+		/* First entry of the first page - link to a parent directory */
+		if (offset == 0) {
+			dir_listing_puts(out,
+			                 "<tr><td><a href=\"..\">Parent directory</a>"
+			                 "</td><td>&nbsp;-</td><td>&nbsp;&nbsp;-</td>"
+			                 "</tr>\n");
+		}
+
+		for (i = offset; i < end; i++) {
+			const struct mg_dir_entry *e =
+			    dir_index_entry(idx, i, sort_key, descending);
+			dir_listing_html_entry(out, e);
+		}
+
+		/* Links to the previous and the next page */
+		if ((limit > 0) && ((offset > 0) || (end < idx->num_entries))) {
+			size_t prev = (offset > limit) ? (offset - limit) : 0;
+
+			dir_listing_puts(out, "<tr><td colspan=\"3\">");
+			if (offset > 0) {
+				mg_snprintf(conn,
+				            NULL, /* Buffer is big enough */
+				            buf,
+				            sizeof(buf),
+				            "<a href=\"?%c%c&offset=%" UINT64_FMT
+				            "%s\">Previous page</a> ",
+				            sort_key,
+				            descending ? 'd' : 'a',
+				            (uint64_t)prev,
+				            limit_arg);
+				dir_listing_puts(out, buf);
+			}
+			if (end < idx->num_entries) {
+				mg_snprintf(conn,
+				            NULL, /* Buffer is big enough */
+				            buf,
+				            sizeof(buf),
+				            "<a href=\"?%c%c&offset=%" UINT64_FMT
+				            "%s\">Next page</a>",
+				            sort_key,
+				            descending ? 'd' : 'a',
+				            (uint64_t)end,
+				            limit_arg);
+				dir_listing_puts(out, buf);
+			}
+			dir_listing_puts(out, "</td></tr>\n");
+		}
+
+		dir_listing_puts(out, "</table></pre></body></html>");
+	}
+
+	dir_listing_flush(out);
+	if (out->chunked) {
+		/* Terminating chunk */
+		(void)mg_send_chunk(conn, "", 0);
+	}
+
+	dir_index_release(conn, idx);
+	mg_free(out);
 }
 #endif /* NO_FILESYSTEMS */
 
 
+#if defined(__linux__) || defined(USE_FILE_CACHE) || defined(USE_MMAP)
+/* File descriptor of an opened file */
+static int
+mg_fileno(const struct mg_file_access *fileacc)
+{
+#if defined(USE_FILE_CACHE)
+	if (fileacc->cached != NULL) {
+		return fileacc->cached->fd;
+	}
+#endif
+	return fileno(fileacc->fp);
+}
+#endif
+
+
+#if defined(USE_MMAP)
+#if !defined(MG_MMAP_MIN_SIZE)
+#define MG_MMAP_MIN_SIZE (64 * 1024) /* Smaller files are read */
+#endif
+#if !defined(MG_MMAP_WINDOW_SIZE)
+#define MG_MMAP_WINDOW_SIZE (1024 * 1024)
+#endif
+
+
+/* Send len bytes from offset of the opened file, mapping one window of the
+ * file after the other into memory. Every window is passed to mg_write
+ * (SSL_write or send) as one block, without copying it to a buffer.
+ * Return 1 if all data has been sent or sending failed, 0 if the remaining
+ * data (offset and len are updated) has to be read from the file, since
+ * it cannot be mapped (e.g., special files). */
+static int
+send_file_data_mmap(struct mg_connection *conn,
+                    struct mg_file *filep,
+                    int64_t *offset,
+                    int64_t *len)
+{
+	int fd = mg_fileno(&filep->access);
+	int64_t page_size = (int64_t)sysconf(_SC_PAGESIZE);
+	struct stat st;
+
+	if ((fd < 0) || (page_size <= 0)) {
+		return 0;
+	}
+
+	while ((*len > 0) && STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)) {
+		int64_t map_offset = *offset - (*offset % page_size);
+		size_t skip = (size_t)(*offset - map_offset);
+		size_t n = MG_MMAP_WINDOW_SIZE - skip;
+		char *p;
+
+		/* Pages behind the end of a file cannot be accessed (SIGBUS):
+		 * never map more than the current size of the file. This does not
+		 * help if the file is truncated while the window is mapped. */
+		if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode)) {
+			return 0;
+		}
+		if ((int64_t)st.st_size <= *offset) {
+			/* End of file */
+			return 1;
+		}
+		if ((int64_t)n > (int64_t)st.st_size - *offset) {
+			n = (size_t)((int64_t)st.st_size - *offset);
+		}
+		if ((int64_t)n > *len) {
+			n = (size_t)*len;
+		}
+
+		p = (char *)
+		    mmap(NULL, skip + n, PROT_READ, MAP_SHARED, fd, (off_t)map_offset);
+		if (p == MAP_FAILED) {
+			return 0;
+		}
+#if defined(MADV_SEQUENTIAL)
+		(void)madvise(p, skip + n, MADV_SEQUENTIAL);
+#endif
+		if (mg_write(conn, p + skip, n) != (int)n) {
+			(void)munmap(p, skip + n);
+			return 1;
+		}
+		(void)munmap(p, skip + n);
+
+		*offset += (int64_t)n;
+		*len -= (int64_t)n;
+	}
+	return 1;
+}
+#endif
+
+
 /* Send len bytes from the opened file to the client. */
 static void
 send_file_data(struct mg_connection *conn,
@@ -9710,6 +11543,9 @@ send_file_data(struct mg_connection *conn,
 	char buf[MG_BUF_LEN];
 	int to_read, num_read, num_written;
 	int64_t size;
+#if defined(USE_IO_URING)
+	struct mg_uring *ring;
+#endif
 
 	if (!filep || !conn) {
 		return;
@@ -9720,25 +11556,60 @@ send_file_data(struct mg_connection *conn,
 	                                      : (int64_t)(filep->stat.size);
 	offset = (offset < 0) ? 0 : ((offset > size) ? size : offset);
 
-	if (len > 0 && filep->access.fp != NULL) {
+	if (len > 0 && is_file_opened(&filep->access)) {
 		/* file stored on disk */
 #if defined(__linux__)
 		/* sendfile is only available for Linux */
-		if ((conn->ssl == 0) && (conn->throttle == 0)
-		    && (!mg_strcasecmp(conn->dom_ctx->config[ALLOW_SENDFILE_CALL],
-		                       "yes"))) {
+#if defined(USE_KTLS)
+		/* HTTP/2 (only used with TLS) requires DATA frames */
+		if (((conn->ssl == 0)
+		     || (conn->ssl_ktls_send
+		         && (conn->protocol_type == PROTOCOL_TYPE_HTTP1)))
+		    && conn->dom_ctx->cfg.allow_sendfile_call) {
+#else
+		if ((conn->ssl == 0) && conn->dom_ctx->cfg.allow_sendfile_call) {
+#endif
 			off_t sf_offs = (off_t)offset;
 			ssize_t sf_sent;
-			int sf_file = fileno(filep->access.fp);
+			int sf_file = mg_fileno(&filep->access);
 			int loop_cnt = 0;
 
+			/* Buffered headers must be sent before the file content */
+			if (flush_output_buffer(conn) != 0) {
+				return;
+			}
+
 			do {
 				/* 2147479552 (0x7FFFF000) is a limit found by experiment on
 				 * 64 bit Linux (2^31 minus one memory page of 4k?). */
 				size_t sf_tosend =
 				    (size_t)((len < 0x7FFFF000) ? len : 0x7FFFF000);
+				if (conn->throttle != NULL) {
+					/* Send slices allowed by the token bucket */
+					sf_tosend = (size_t)throttle_reserve(conn, (int)sf_tosend);
+					if (sf_tosend == 0) {
+						return; /* server is stopping */
+					}
+				}
+#if defined(USE_KTLS)
+				if (conn->ssl != 0) {
+					/* The kernel encrypts the file data */
+					sf_sent = (ssize_t)
+					    SSL_sendfile(conn->ssl, sf_file, sf_offs, sf_tosend, 0);
+					if (sf_sent > 0) {
+						sf_offs += (off_t)sf_sent;
+					} else {
+						ERR_clear_error();
+					}
+				} else
+#endif
 				sf_sent =
 				    sendfile(conn->client.sock, sf_file, &sf_offs, sf_tosend);
+				if (conn->throttle != NULL) {
+					throttle_refund(conn,
+					                (int)sf_tosend
+					                    - ((sf_sent > 0) ? (int)sf_sent : 0));
+				}
 				if (sf_sent > 0) {
 					len -= sf_sent;
 					offset += sf_sent;
@@ -9766,7 +11637,95 @@ send_file_data(struct mg_connection *conn,
 			offset = (int64_t)sf_offs;
 		}
 #endif
-		if ((offset > 0) && (fseeko(filep->access.fp, offset, SEEK_SET) != 0)) {
+#if defined(USE_IO_URING)
+		/* Read and send every block with one system call */
+		if ((conn->ssl == 0) && (conn->throttle == NULL)
+		    && ((ring = get_thread_uring()) != NULL)
+		    && (flush_output_buffer(conn) == 0)) {
+			int fd = mg_fileno(&filep->access);
+
+			num_read = -1;
+			while ((len > 0) && STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)) {
+				to_read = sizeof(buf);
+				if ((int64_t)to_read > len) {
+					to_read = (int)len;
+				}
+				num_written = mg_uring_read_send(ring,
+				                                 fd,
+				                                 offset,
+				                                 conn->client.sock,
+				                                 buf,
+				                                 to_read,
+				                                 SOCKET_TIMEOUT_QUANTUM,
+				                                 &num_read);
+				if (num_read <= 0) {
+					/* End of file, or not a regular file (e.g., the
+					 * output of a CGI process): use the classic way */
+					break;
+				}
+				if (num_written < 0) {
+					return;
+				}
+				if (num_written < num_read) {
+					/* The socket was not ready in time: push_all waits
+					 * up to request_timeout_ms */
+					int n = push_all(conn->phys_ctx,
+					                 NULL,
+					                 conn->client.sock,
+					                 NULL,
+					                 buf + num_written,
+					                 num_read - num_written);
+					if (n > 0) {
+						num_written += n;
+					}
+				}
+				conn->num_bytes_sent += num_written;
+				if (num_written != num_read) {
+					return;
+				}
+				offset += num_read;
+				len -= num_read;
+			}
+			if ((len <= 0) || (num_read == 0)) {
+				return; /* OK */
+			}
+		}
+#endif
+#if defined(USE_MMAP)
+		/* Large files are sent without copying them to a buffer. The file
+		 * position is not used, so this works for cached files as well. */
+		if ((len >= MG_MMAP_MIN_SIZE)
+		    && send_file_data_mmap(conn, filep, &offset, &len)) {
+			return;
+		}
+#endif
+#if defined(USE_FILE_CACHE)
+		if (filep->access.cached != NULL) {
+			/* The file descriptor is shared with other requests, so its
+			 * file position must not be used. */
+			int fd = mg_fileno(&filep->access);
+			while (len > 0) {
+				to_read = sizeof(buf);
+				if ((int64_t)to_read > len) {
+					to_read = (int)len;
+				}
+				num_read = (int)pread(fd, buf, (size_t)to_read, (off_t)offset);
+				if (num_read <= 0) {
+					break;
+				}
+				if ((num_written = mg_write(conn, buf, (size_t)num_read))
+				    != num_read) {
+					break;
+				}
+				offset += num_written;
+				len -= num_written;
+			}
+			return;
+		}
+#endif
+		/* Several ranges of a file are sent in any order */
+		if (((offset > 0) || (ftello(filep->access.fp) > 0))
+		    && (fseeko(filep->access.fp, offset, SEEK_SET) != 0)) {
 			mg_cry_internal(conn,
 			                "%s: fseeko() failed: %s",
 			                __func__,
@@ -9827,6 +11786,254 @@ construct_etag(char *buf, size_t buf_len, const struct mg_file_stat *filestat)
 }
 
 
+#if !defined(NO_FILESYSTEMS)
+#if !defined(MG_MAX_BYTE_RANGES)
+#define MG_MAX_BYTE_RANGES (16)
+#endif
+
+
+struct mg_byte_range {
+	int64_t first;
+	int64_t last;
+	size_t header_len; /* Part header in a multipart/byteranges response */
+};
+
+
+/* Parse a decimal number of a byte range. Return the number of digits,
+ * 0 if there is no number or it does not fit into int64_t. */
+static int
+parse_byte_range_number(const char *str, int64_t *value)
+{
+	int n = 0;
+
+	*value = 0;
+	while (isdigit((unsigned char)str[n])) {
+		if (*value > (INT64_MAX - 9) / 10) {
+			return 0;
+		}
+		*value = *value * 10 + (str[n] - '0');
+		n++;
+	}
+	return n;
+}
+
+
+/* Parse all ranges of a "Range: bytes=..." header for a file of the given
+ * size, e.g., "bytes=0-99,200-299,-100" (the last 100 bytes).
+ * Return the number of satisfiable ranges stored in ranges, 0 if the header
+ * is invalid or has more than max_ranges ranges (the header is ignored and
+ * the complete file is sent), or -1 if no range is satisfiable. */
+static int
+parse_byte_ranges(const char *header,
+                  int64_t size,
+                  struct mg_byte_range *ranges,
+                  int max_ranges)
+{
+	int num_ranges = 0, num_specs = 0, n;
+	int64_t first, last;
+
+	if (mg_strncasecmp(header, "bytes=", 6)) {
+		return 0;
+	}
+	header += 6;
+
+	for (;;) {
+		while ((*header == ' ') || (*header == '\t')) {
+			header++;
+		}
+		if (*header == '-') {
+			/* Suffix range: the last bytes of the file */
+			if ((n = parse_byte_range_number(header + 1, &last)) == 0) {
+				return 0;
+			}
+			header += n + 1;
+			first = (last < size) ? (size - last) : 0;
+			last = size - 1;
+			if (first > last) {
+				/* "-0" or empty file */
+				first = -1;
+			}
+		} else {
+			if ((n = parse_byte_range_number(header, &first)) == 0) {
+				return 0;
+			}
+			header += n;
+			if (*header++ != '-') {
+				return 0;
+			}
+			if ((n = parse_byte_range_number(header, &last)) == 0) {
+				last = size - 1;
+			} else if (last < first) {
+				return 0;
+			} else if (last >= size) {
+				last = size - 1;
+			}
+			header += n;
+			if (first >= size) {
+				/* Not satisfiable */
+				first = -1;
+			}
+		}
+		num_specs++;
+
+		if (first >= 0) {
+			if (num_ranges >= max_ranges) {
+				return 0;
+			}
+			ranges[num_ranges].first = first;
+			ranges[num_ranges].last = last;
+			ranges[num_ranges].header_len = 0;
+			num_ranges++;
+		}
+
+		while ((*header == ' ') || (*header == '\t')) {
+			header++;
+		}
+		if (*header == '\0') {
+			break;
+		}
+		if (*header++ != ',') {
+			return 0;
+		}
+	}
+
+	return (num_ranges > 0) ? num_ranges : -1;
+}
+
+
+/* Check the "If-Range" header: ranges are only sent, if the file has not
+ * been modified since the client got the first part (i.e., the validator
+ * matches). Otherwise the complete file is sent. */
+static int
+is_range_request_valid(const struct mg_connection *conn,
+                       const struct mg_file_stat *filestat)
+{
+	const char *if_range = mg_get_header(conn, "If-Range");
+	char etag[64];
+
+	if (if_range == NULL) {
+		return 1;
+	}
+	if (if_range[0] == '"') {
+		/* Entity tag (strong comparison) */
+		construct_etag(etag, sizeof(etag), filestat);
+		return !strcmp(etag, if_range);
+	}
+	if (!strncmp(if_range, "W/", 2)) {
+		/* Weak entity tags are never valid for ranges */
+		return 0;
+	}
+#if !defined(NO_CACHING)
+	/* HTTP date, must be the exact modification time */
+	return parse_date_string(if_range) == filestat->last_modified;
+#else
+	return 0;
+#endif
+}
+
+
+/* Create the headers of all parts of a multipart/byteranges response and
+ * the closing delimiter in one memory block. The size of the complete body
+ * is stored in content_len. Return NULL if out of memory. */
+static char *
+create_byte_range_headers(struct mg_connection *conn,
+                          struct mg_byte_range *ranges,
+                          int num_ranges,
+                          const struct vec *mime_vec,
+                          int64_t file_size,
+                          const char *boundary,
+                          int64_t *content_len)
+{
+	size_t boundary_len = strlen(boundary);
+	size_t buf_len = (size_t)num_ranges * (mime_vec->len + boundary_len + 128)
+	                 + boundary_len + 16;
+	size_t pos = 0;
+	char *buf = (char *)mg_malloc_ctx(buf_len, conn->phys_ctx);
+	int i;
+
+	if (buf == NULL) {
+		return NULL;
+	}
+	*content_len = 0;
+	for (i = 0; i < num_ranges; i++) {
+		mg_snprintf(conn,
+		            NULL, /* Buffer is big enough */
+		            buf + pos,
+		            buf_len - pos,
+		            "\r\n--%s\r\nContent-Type: %.*s\r\n"
+		            "Content-Range: bytes %" INT64_FMT "-%" INT64_FMT
+		            "/%" INT64_FMT "\r\n\r\n",
+		            boundary,
+		            (int)mime_vec->len,
+		            mime_vec->ptr,
+		            ranges[i].first,
+		            ranges[i].last,
+		            file_size);
+		ranges[i].header_len = strlen(buf + pos);
+		pos += ranges[i].header_len;
+		*content_len += (int64_t)ranges[i].header_len
+		                + (ranges[i].last - ranges[i].first + 1);
+	}
+	mg_snprintf(conn,
+	            NULL, /* Buffer is big enough */
+	            buf + pos,
+	            buf_len - pos,
+	            "\r\n--%s--\r\n",
+	            boundary);
+	*content_len += (int64_t)strlen(buf + pos);
+	return buf;
+}
+
+
+/* Send the body of a multipart/byteranges response: the header of every
+ * part, followed by the data of the range (using sendfile, if possible),
+ * and the closing delimiter. */
+static void
+send_byte_ranges(struct mg_connection *conn,
+                 struct mg_file *filep,
+                 const struct mg_byte_range *ranges,
+                 int num_ranges,
+                 const char *part_headers)
+{
+	int i;
+
+	for (i = 0; i < num_ranges; i++) {
+		if (mg_write(conn, part_headers, ranges[i].header_len)
+		    != (int)ranges[i].header_len) {
+			return;
+		}
+		send_file_data(conn,
+		               filep,
+		               ranges[i].first,
+		               ranges[i].last - ranges[i].first + 1);
+		part_headers += ranges[i].header_len;
+	}
+	(void)mg_write(conn, part_headers, strlen(part_headers));
+}
+
+
+/* Send a "416 Range Not Satisfiable" response */
+static void
+send_range_not_satisfiable(struct mg_connection *conn, int64_t file_size)
+{
+	char range[64];
+
+	mg_snprintf(conn,
+	            NULL, /* Buffer is big enough */
+	            range,
+	            sizeof(range),
+	            "bytes */%" INT64_FMT,
+	            file_size);
+
+	mg_response_header_start(conn, 416);
+	send_additional_header(conn);
+	mg_response_header_add(conn, "Content-Range", range, -1);
+	mg_response_header_add(conn, "Content-Length", "0", -1);
+	mg_response_header_send(conn);
+}
+#endif /* NO_FILESYSTEMS */
+
+
 static void
 fclose_on_exec(struct mg_file_access *filep, struct mg_connection *conn)
 {
@@ -9845,10 +12052,30 @@ fclose_on_exec(struct mg_file_access *filep, struct mg_connection *conn)
 }
 
 
+#if defined(USE_ZLIB)
+/* Output function for the compressors in mod_*.inl, receiving the
+ * compressed data in blocks. Return: 0 on success, -1 on error */
+typedef int (*mg_compress_output)(void *arg,
+                                  const unsigned char *data,
+                                  size_t len);
+#endif
+
+#if defined(USE_BROTLI)
+#include "mod_brotli.inl"
+#endif
+
+#if defined(USE_ZSTD)
+#include "mod_zstd.inl"
+#endif
+
 #if defined(USE_ZLIB)
 #include "mod_zlib.inl"
 #endif
 
+#if defined(USE_RESPONSE_CACHE)
+#include "response_cache.inl"
+#endif
+
 
 #if !defined(NO_FILESYSTEMS)
 static void
@@ -9861,21 +12088,31 @@ handle_static_file_request(struct mg_connection *conn,
 	char lm[64], etag[64];
 	char range[128]; /* large enough, so there will be no overflow */
 	const char *range_hdr;
-	int64_t cl, r1, r2;
+	int64_t cl, r1;
+	struct mg_byte_range ranges[MG_MAX_BYTE_RANGES];
+	int num_ranges = 0;
+	char boundary[64];
+	char *part_headers = NULL; /* multipart/byteranges response */
 	struct vec mime_vec;
-	int n, truncated;
-	char gz_path[UTF8_PATH_MAX];
+	int truncated;
+	char enc_path[UTF8_PATH_MAX];
 	const char *encoding = 0;
 	const char *origin_hdr;
 	const char *cors_orig_cfg;
 	const char *cors1, *cors2;
 	int is_head_request;
+	int is_cached = 0;
+#if defined(USE_RESPONSE_CACHE)
+	int use_response_cache;
+#endif
 
 #if defined(USE_ZLIB)
 	/* Compression is allowed, unless there is a reason not to use
 	 * compression. If the file is already compressed, too small or a
 	 * "range" request was made, on the fly compression is not possible. */
 	int allow_on_the_fly_compression = 1;
+	int on_the_fly_encoding;
+	struct mg_compression_cache_entry *z_cached = NULL;
 #endif
 
 	if ((conn == NULL) || (conn->dom_ctx == NULL) || (filep == NULL)) {
@@ -9902,20 +12139,32 @@ handle_static_file_request(struct mg_connection *conn,
 	range[0] = '\0';
 
 #if defined(USE_ZLIB)
-	/* if this file is in fact a pre-gzipped file, rewrite its filename
-	 * it's important to rewrite the filename after resolving
-	 * the mime type from it, to preserve the actual file's type */
-	if (!conn->accept_gzip) {
+	/* Best encoding accepted by the client, that can be used for on the fly
+	 * compression */
+	on_the_fly_encoding = select_on_the_fly_encoding(conn);
+	if (on_the_fly_encoding == MG_ENCODING_IDENTITY) {
 		allow_on_the_fly_compression = 0;
 	}
 #endif
 
-	/* Check if there is a range header */
+	/* Check if there is a range header. It is ignored, if the file has
+	 * been modified since the client got the first part. */
 	range_hdr = mg_get_header(conn, "Range");
+	if ((range_hdr != NULL) && !is_range_request_valid(conn, &filep->stat)) {
+		range_hdr = NULL;
+	}
 
-	/* For gzipped files, add *.gz */
-	if (filep->stat.is_gzipped) {
-		mg_snprintf(conn, &truncated, gz_path, sizeof(gz_path), "%s.gz", path);
+	/* if this file is in fact a precompressed file, rewrite its filename
+	 * it's important to rewrite the filename after resolving
+	 * the mime type from it, to preserve the actual file's type */
+	if (filep->stat.encoding != MG_ENCODING_IDENTITY) {
+		mg_snprintf(conn,
+		            &truncated,
+		            enc_path,
+		            sizeof(enc_path),
+		            "%s%s",
+		            path,
+		            content_encodings[filep->stat.encoding].ext);
 
 		if (truncated) {
 			mg_send_http_error(conn,
@@ -9925,26 +12174,25 @@ handle_static_file_request(struct mg_connection *conn,
 			return;
 		}
 
-		path = gz_path;
-		encoding = "gzip";
+		path = enc_path;
+		encoding = content_encodings[filep->stat.encoding].name;
 
 #if defined(USE_ZLIB)
 		/* File is already compressed. No "on the fly" compression. */
 		allow_on_the_fly_compression = 0;
 #endif
-	} else if ((conn->accept_gzip) && (range_hdr == NULL)
+	} else if ((conn->accept_encodings[0] != MG_ENCODING_IDENTITY)
+	           && (range_hdr == NULL)
 	           && (filep->stat.size >= MG_FILE_COMPRESSION_SIZE_LIMIT)) {
+		/* Use the best precompressed file (*.br, *.zst, *.gz) */
 		struct mg_file_stat file_stat;
 
-		mg_snprintf(conn, &truncated, gz_path, sizeof(gz_path), "%s.gz", path);
-
-		if (!truncated && mg_stat(conn, gz_path, &file_stat)
-		    && !file_stat.is_directory) {
-			file_stat.is_gzipped = 1;
+		if (find_precompressed_file(
+		        conn, path, enc_path, sizeof(enc_path), &file_stat)) {
 			filep->stat = file_stat;
 			cl = (int64_t)filep->stat.size;
-			path = gz_path;
-			encoding = "gzip";
+			path = enc_path;
+			encoding = content_encodings[file_stat.encoding].name;
 
 #if defined(USE_ZLIB)
 			/* File is already compressed. No "on the fly" compression. */
@@ -9953,46 +12201,63 @@ handle_static_file_request(struct mg_connection *conn,
 		}
 	}
 
-	if (!mg_fopen(conn, path, MG_FOPEN_MODE_READ, filep)) {
-		mg_send_http_error(conn,
-		                   500,
-		                   "Error: Cannot open file\nfopen(%s): %s",
-		                   path,
-		                   strerror(ERRNO));
-		return;
-	}
-
-	fclose_on_exec(&filep->access, conn);
-
-	/* If "Range" request was made: parse header, send only selected part
+	/* If "Range" request was made: parse header, send only selected parts
 	 * of the file. */
-	r1 = r2 = 0;
-	if ((range_hdr != NULL)
-	    && ((n = parse_range_header(range_hdr, &r1, &r2)) > 0) && (r1 >= 0)
-	    && (r2 >= 0)) {
-		/* actually, range requests don't play well with a pre-gzipped
+	r1 = 0;
+	if (range_hdr != NULL) {
+		num_ranges =
+		    parse_byte_ranges(range_hdr, cl, ranges, MG_MAX_BYTE_RANGES);
+	}
+	if (num_ranges != 0) {
+		/* actually, range requests don't play well with a precompressed
 		 * file (since the range is specified in the uncompressed space) */
-		if (filep->stat.is_gzipped) {
+		if (filep->stat.encoding != MG_ENCODING_IDENTITY) {
 			mg_send_http_error(
 			    conn,
 			    416, /* 416 = Range Not Satisfiable */
 			    "%s",
-			    "Error: Range requests in gzipped files are not supported");
-			(void)mg_fclose(
-			    &filep->access); /* ignore error on read only file */
+			    "Error: Range requests in compressed files are not supported");
+			return;
+		}
+		if (num_ranges < 0) {
+			send_range_not_satisfiable(conn, cl);
 			return;
 		}
 		conn->status_code = 206;
-		cl = (n == 2) ? (((r2 > cl) ? cl : r2) - r1 + 1) : (cl - r1);
-		mg_snprintf(conn,
-		            NULL, /* range buffer is big enough */
-		            range,
-		            sizeof(range),
-		            "bytes "
-		            "%" INT64_FMT "-%" INT64_FMT "/%" INT64_FMT,
-		            r1,
-		            r1 + cl - 1,
-		            filep->stat.size);
+		if (num_ranges == 1) {
+			r1 = ranges[0].first;
+			cl = ranges[0].last - r1 + 1;
+			mg_snprintf(conn,
+			            NULL, /* range buffer is big enough */
+			            range,
+			            sizeof(range),
+			            "bytes "
+			            "%" INT64_FMT "-%" INT64_FMT "/%" INT64_FMT,
+			            r1,
+			            ranges[0].last,
+			            filep->stat.size);
+		} else {
+			/* Several ranges are sent as parts of a multipart/byteranges
+			 * body. The boundary must not occur in the file. */
+			uint64_t rnd = get_random();
+			mg_snprintf(conn,
+			            NULL, /* Buffer is big enough */
+			            boundary,
+			            sizeof(boundary),
+			            "civetweb-%08lx%08lx",
+			            (unsigned long)(rnd >> 32),
+			            (unsigned long)(rnd & 0xFFFFFFFFu));
+			part_headers = create_byte_range_headers(
+			    conn, ranges, num_ranges, &mime_vec, cl, boundary, &cl);
+			if (part_headers == NULL) {
+				mg_send_http_error(conn,
+				                   500,
+				                   "Error: Cannot send ranges of %s\n%s",
+				                   path,
+				                   "Out of memory");
+				return;
+			}
+		}
 
 #if defined(USE_ZLIB)
 		/* Do not compress ranges. */
@@ -10024,6 +12289,63 @@ handle_static_file_request(struct mg_connection *conn,
 		cors1 = cors2 = "";
 	}
 
+#if defined(USE_RESPONSE_CACHE)
+	/* Complete responses for small files sent as they are may be cached.
+	 * Responses for mg_send_mime_file2 calls are not cached, since their
+	 * mime type and headers are set by the caller. */
+	use_response_cache =
+	    (mime_type == NULL)
+	    && ((additional_headers == NULL) || (*additional_headers == 0))
+	    && (num_ranges == 0)
+#if defined(USE_ZLIB)
+	    && !allow_on_the_fly_compression
+#endif
+	    && response_cache_usable(conn, &filep->stat);
+	if (use_response_cache
+	    && response_cache_send(
+	        conn, path, &filep->stat, (cors1[0] != 0), is_head_request)) {
+		return;
+	}
+#endif
+
+#if defined(USE_FILE_CACHE)
+	/* Files sent as they are may use an open file from the cache.
+	 * A new response cache entry is created from a file opened by
+	 * mg_fopen. */
+	is_cached =
+#if defined(USE_ZLIB)
+	    !allow_on_the_fly_compression &&
+#endif
+#if defined(USE_RESPONSE_CACHE)
+	    !use_response_cache &&
+#endif
+	    file_cache_open(conn, path, filep);
+#endif
+	if (!is_cached) {
+		if (!mg_fopen(conn, path, MG_FOPEN_MODE_READ, filep)) {
+			mg_send_http_error(conn,
+			                   500,
+			                   "Error: Cannot open file\nfopen(%s): %s",
+			                   path,
+			                   strerror(ERRNO));
+			mg_free(part_headers);
+			return;
+		}
+		fclose_on_exec(&filep->access, conn);
+	}
+
+#if defined(USE_ZLIB)
+	if (allow_on_the_fly_compression
+	    && (conn->phys_ctx->compression_cache != NULL)) {
+		/* Use the compressed file from the cache, or compress it now */
+		z_cached =
+		    compression_cache_get(conn, path, filep, on_the_fly_encoding);
+		if (z_cached != NULL) {
+			cl = (int64_t)z_cached->data_len;
+		}
+	}
+#endif
+
 	/* Prepare Etag, and Last-Modified headers. */
 	gmt_time_string(lm, sizeof(lm), &filep->stat.last_modified);
 	construct_etag(etag, sizeof(etag), &filep->stat);
@@ -10032,10 +12354,21 @@ handle_static_file_request(struct mg_connection *conn,
 	mg_response_header_start(conn, conn->status_code);
 	send_static_cache_header(conn);
 	send_additional_header(conn);
-	mg_response_header_add(conn,
-	                       "Content-Type",
-	                       mime_vec.ptr,
-	                       (int)mime_vec.len);
+	if (part_headers != NULL) {
+		char content_type[128];
+		mg_snprintf(conn,
+		            NULL, /* Buffer is big enough */
+		            content_type,
+		            sizeof(content_type),
+		            "multipart/byteranges; boundary=%s",
+		            boundary);
+		mg_response_header_add(conn, "Content-Type", content_type, -1);
+	} else {
+		mg_response_header_add(conn,
+		                       "Content-Type",
+		                       mime_vec.ptr,
+		                       (int)mime_vec.len);
+	}
 	if (cors1[0] != 0) {
 		mg_response_header_add(conn, cors1, cors2, -1);
 	}
@@ -10045,11 +12378,17 @@ handle_static_file_request(struct mg_connection *conn,
 #if defined(USE_ZLIB)
 	/* On the fly compression allowed */
 	if (allow_on_the_fly_compression) {
-		/* For on the fly compression, we don't know the content size in
-		 * advance, so we have to use chunked encoding */
-		encoding = "gzip";
-		if (conn->protocol_type == PROTOCOL_TYPE_HTTP1) {
-			/* HTTP/2 is always using "chunks" (frames) */
+		encoding = content_encodings[on_the_fly_encoding].name;
+		if (z_cached != NULL) {
+			/* The size of the cached compressed file is known */
+			char len[32];
+			mg_snprintf(conn, NULL, len, sizeof(len), "%" INT64_FMT, cl);
+			mg_response_header_add(conn, "Content-Length", len, -1);
+
+		} else if (conn->protocol_type == PROTOCOL_TYPE_HTTP1) {
+			/* For on the fly compression, we don't know the content size in
+			 * advance, so we have to use chunked encoding.
+			 * HTTP/2 is always using "chunks" (frames) */
 			mg_response_header_add(conn, "Transfer-Encoding", "chunked", -1);
 		}
 
@@ -10072,6 +12411,7 @@ handle_static_file_request(struct mg_connection *conn,
 
 	if (encoding) {
 		mg_response_header_add(conn, "Content-Encoding", encoding, -1);
+		mg_response_header_add(conn, "Vary", "Accept-Encoding", -1);
 	}
 	if (range[0] != 0) {
 		mg_response_header_add(conn, "Content-Range", range, -1);
@@ -10083,21 +12423,43 @@ handle_static_file_request(struct mg_connection *conn,
 		mg_response_header_add_lines(conn, additional_headers);
 	}
 
+#if defined(USE_RESPONSE_CACHE)
+	/* Store the response in the cache, and send it from there */
+	if (use_response_cache
+	    && response_cache_add(
+	        conn, path, filep, (cors1[0] != 0), is_head_request)) {
+		(void)mg_fclose(&filep->access);
+		return;
+	}
+#endif
+
 	/* Send all headers */
 	mg_response_header_send(conn);
 
 	if (!is_head_request) {
 #if defined(USE_ZLIB)
-		if (allow_on_the_fly_compression) {
+		if (z_cached != NULL) {
+			/* Send compressed file from the cache */
+			(void)mg_write(conn, z_cached->data, z_cached->data_len);
+		} else if (allow_on_the_fly_compression) {
 			/* Compress and send */
-			send_compressed_data(conn, filep);
+			send_compressed_data(conn, filep, on_the_fly_encoding);
 		} else
 #endif
-		{
+		if (part_headers != NULL) {
+			/* Send all ranges as parts of a multipart body */
+			send_byte_ranges(conn, filep, ranges, num_ranges, part_headers);
+		} else {
 			/* Send file directly */
 			send_file_data(conn, filep, r1, cl);
 		}
 	}
+#if defined(USE_ZLIB)
+	if (z_cached != NULL) {
+		compression_cache_release(conn->phys_ctx->compression_cache, z_cached);
+	}
+#endif
+	mg_free(part_headers);
 	(void)mg_fclose(&filep->access); /* ignore error on read only file */
 }
 
@@ -10198,8 +12560,7 @@ mg_send_mime_file2(struct mg_connection *conn,
 		} else
 #endif /* NO_CACHING */
 		    if (file.stat.is_directory) {
-			if (!mg_strcasecmp(conn->dom_ctx->config[ENABLE_DIRECTORY_LISTING],
-			                   "yes")) {
+			if (conn->dom_ctx->cfg.enable_directory_listing) {
 				handle_directory_request(conn, path);
 			} else {
 				mg_send_http_error(conn,
@@ -10771,18 +13132,11 @@ read_message(FILE *fp,
 
 	memset(&last_action_time, 0, sizeof(last_action_time));
 
-	if (conn->dom_ctx->config[REQUEST_TIMEOUT]) {
-		/* value of request_timeout is in seconds, config in milliseconds */
-		request_timeout = atof(conn->dom_ctx->config[REQUEST_TIMEOUT]) / 1000.0;
-	} else {
-		request_timeout =
-		    atof(config_options[REQUEST_TIMEOUT].default_value) / 1000.0;
-	}
-	if (conn->handled_requests > 0) {
-		if (conn->dom_ctx->config[KEEP_ALIVE_TIMEOUT]) {
-			request_timeout =
-			    atof(conn->dom_ctx->config[KEEP_ALIVE_TIMEOUT]) / 1000.0;
-		}
+	/* value of request_timeout is in seconds, config in milliseconds */
+	request_timeout = conn->dom_ctx->cfg.request_timeout_ms / 1000.0;
+	if ((conn->handled_requests > 0)
+	    && conn->dom_ctx->cfg.has_keep_alive_timeout) {
+		request_timeout = conn->dom_ctx->cfg.keep_alive_timeout_ms / 1000.0;
 	}
 
 	request_len = get_http_header_len(buf, *nread);
@@ -10853,6 +13207,7 @@ forward_body_data(struct mg_connection *conn, FILE *fp, SOCKET sock, SSL *ssl)
 	} else {
 		if (expect != NULL) {
 			(void)mg_printf(conn, "%s", "HTTP/1.1 100 Continue\r\n\r\n");
+			(void)mg_flush(conn);
 			conn->status_code = 100;
 		} else {
 			conn->status_code = 200;
@@ -11250,16 +13605,9 @@ handle_cgi_request(struct mg_connection *conn,
 	struct process_control_data *proc = NULL;
 
 #if defined(USE_TIMERS)
-	double cgi_timeout;
-	if (conn->dom_ctx->config[CGI_TIMEOUT + cgi_config_idx]) {
-		/* Get timeout in seconds */
-		cgi_timeout =
-		    atof(conn->dom_ctx->config[CGI_TIMEOUT + cgi_config_idx]) * 0.001;
-	} else {
-		cgi_timeout =
-		    atof(config_options[REQUEST_TIMEOUT].default_value) * 0.001;
-	}
-
+	double cgi_timeout =
+	    conn->dom_ctx->cfg.cgi_timeout[cgi_config_idx
+	                                   / (CGI2_EXTENSIONS - CGI_EXTENSIONS)];
 #endif
 
 	buf = NULL;
@@ -11886,8 +14234,7 @@ do_ssi_include(struct mg_connection *conn,
 		                strerror(ERRNO));
 	} else {
 		fclose_on_exec(&file.access, conn);
-		if (match_prefix_strlen(conn->dom_ctx->config[SSI_EXTENSIONS], path)
-		    > 0) {
+		if (match_config_pattern(conn, SSI_EXTENSIONS, path) > 0) {
 			send_ssi_file(conn, path, &file, include_level + 1);
 		} else {
 			send_file_data(conn, &file, 0, INT64_MAX);
@@ -12237,8 +14584,7 @@ handle_propfind(struct mg_connection *conn,
 	/* If it is a directory, print directory entries too if Depth is not 0
 	 */
 	if (filep->is_directory
-	    && !mg_strcasecmp(conn->dom_ctx->config[ENABLE_DIRECTORY_LISTING],
-	                      "yes")
+	    && conn->dom_ctx->cfg.enable_directory_listing
 	    && ((depth == NULL) || (strcmp(depth, "0") != 0))) {
 		scan_directory(conn, path, conn, &print_dav_dir_entry);
 	}
@@ -12350,6 +14696,443 @@ send_websocket_handshake(struct mg_connection *conn, const char *websock_key)
 #endif
 
 
+/* Timeout for reading from a websocket, in seconds */
+static double
+websocket_read_timeout(const struct mg_connection *conn)
+{
+	double timeout = conn->dom_ctx->cfg.websocket_timeout_ms / 1000.0;
+
+	if (timeout <= 0.0) {
+		timeout = conn->dom_ctx->cfg.request_timeout_ms / 1000.0;
+	}
+	if (timeout <= 0.0) {
+		timeout = atof(config_options[REQUEST_TIMEOUT].default_value) / 1000.0;
+	}
+	return timeout;
+}
+
+
+/* Parse the header of the websocket frame at the beginning of buf, holding
+ * body_len bytes. Returns the length of the header including the masking
+ * key, or 0 if the header is not complete yet. The payload length is
+ * stored in *data_len. */
+static size_t
+parse_websocket_frame_header(const unsigned char *buf,
+                             size_t body_len,
+                             uint64_t *data_len)
+{
+	size_t len, mask_len;
+
+	if (body_len < 2) {
+		return 0;
+	}
+	len = buf[1] & 127;
+	mask_len = (buf[1] & 128) ? 4 : 0;
+	if (len < 126) {
+		/* inline 7-bit length field */
+		if (body_len < (2 + mask_len)) {
+			return 0;
+		}
+		*data_len = len;
+		return 2 + mask_len;
+	}
+	if (len == 126) {
+		/* 16-bit length field */
+		if (body_len < (4 + mask_len)) {
+			return 0;
+		}
+		*data_len = ((((size_t)buf[2]) << 8) + buf[3]);
+		return 4 + mask_len;
+	}
+	if (body_len >= (10 + mask_len)) {
+		/* 64-bit length field */
+		uint32_t l1, l2;
+		memcpy(&l1, &buf[2], 4); /* Use memcpy for alignment */
+		memcpy(&l2, &buf[6], 4);
+		*data_len = (((uint64_t)ntohl(l1)) << 32) + ntohl(l2);
+		return 10 + mask_len;
+	}
+	return 0;
+}
+
+
+/* Pass a complete frame to the data handler, or in one slice to the stream
+ * handler. Return the result of the handler. */
+static int
+ws_call_data_handler(struct mg_connection *conn,
+                     mg_websocket_data_handler ws_data_handler,
+                     unsigned char mop,
+                     char *data,
+                     size_t data_len,
+                     void *callback_data)
+{
+	if (conn->ws_stream_handler != NULL) {
+		return conn->ws_stream_handler(
+		    conn, mop, data, data_len, 0, 1, callback_data);
+	}
+	return ws_data_handler(conn, mop, data, data_len, callback_data);
+}
+
+
+/* Close the connection, since a received message is longer than
+ * websocket_max_message_size */
+static void
+ws_close_message_too_big(struct mg_connection *conn, uint64_t message_len)
+{
+	/* Status code 1009: message too big (RFC 6455, 7.4.1) */
+	static const char status[2] = {(char)0x03, (char)0xF1};
+
+	mg_cry_internal(conn,
+	                "Websocket message of %" UINT64_FMT
+	                " bytes exceeds websocket_max_message_size; "
+	                "closing connection",
+	                message_len);
+	(void)mg_websocket_write(conn,
+	                         MG_WEBSOCKET_OPCODE_CONNECTION_CLOSE,
+	                         status,
+	                         sizeof(status));
+}
+
+
+/* Check if a received data frame belongs to a compressed message. Only
+ * the first frame of a message has the RSV1 bit set (RFC 7692, 6.1). */
+static int
+ws_is_deflated(const struct mg_connection *conn, unsigned char mop)
+{
+	if ((mop & 0x0f) == MG_WEBSOCKET_OPCODE_CONTINUATION) {
+		return conn->ws_message_deflated;
+	}
+	return (mop & 0x40) != 0;
+}
+
+
+/* Handle a received websocket frame after unmasking the payload: reply to
+ * PING and filter PONG messages (if enable_websocket_ping_pong is set), and
+ * pass all other messages to the data handler. The payload of a compressed
+ * message requires 4 spare bytes after data_len.
+ * Returns 1 to continue reading, 0 if the connection must be closed. */
+static int
+process_websocket_frame(struct mg_connection *conn,
+                        unsigned char mop,
+                        unsigned char *data,
+                        size_t data_len,
+                        mg_websocket_data_handler ws_data_handler,
+                        void *callback_data,
+                        int *ping_count)
+{
+	int enable_ping_pong = conn->dom_ctx->cfg.enable_websocket_ping_pong;
+	int exit_by_callback = 0;
+	int ret;
+
+	if (enable_ping_pong && ((mop & 0xF) == MG_WEBSOCKET_OPCODE_PONG)) {
+		/* filter PONG messages */
+		DEBUG_TRACE("PONG from %s:%u",
+		            conn->request_info.remote_addr,
+		            conn->request_info.remote_port);
+		/* No unanwered PINGs left */
+		*ping_count = 0;
+	} else if (enable_ping_pong
+	           && ((mop & 0xF) == MG_WEBSOCKET_OPCODE_PING)) {
+		/* reply PING messages */
+		DEBUG_TRACE("Reply PING from %s:%u",
+		            conn->request_info.remote_addr,
+		            conn->request_info.remote_port);
+		ret = mg_websocket_write(conn,
+		                         MG_WEBSOCKET_OPCODE_PONG,
+		                         (char *)data,
+		                         (size_t)data_len);
+		if (ret <= 0) {
+			/* Error: send failed */
+			DEBUG_TRACE("Reply PONG failed (%i)", ret);
+			return 0;
+		}
+
+
+	} else {
+		/* Exit the loop if callback signals to exit (server side),
+		 * or "connection close" opcode received (client side). */
+		if ((ws_data_handler != NULL) || (conn->ws_stream_handler != NULL)) {
+#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+			if (ws_is_deflated(conn, mop)) {
+				/* Inflate the data received if bit RSV1 is set (in the
+				 * first frame of the message). */
+				if (!conn->websocket_deflate_initialized) {
+					if (websocket_deflate_initialize(conn, 1) != Z_OK)
+						exit_by_callback = 1;
+				}
+				if (!exit_by_callback) {
+					/* The inflated message (all its frames) must not
+					 * exceed websocket_max_message_size either: never
+					 * allocate more than one byte above the limit. */
+					uint64_t max_size = conn->phys_ctx->ws_max_message_size;
+					size_t inflate_buf_max =
+					    ((max_size > 0) && (max_size < 0x7FFF0000ul))
+					        ? (size_t)(max_size - conn->ws_inflated_len) + 1
+					        : 0;
+					size_t inflate_buf_size_old = 0;
+					size_t inflate_buf_size =
+					    data_len
+					    * 4; // Initial guess of the inflated message
+					         // size. We double the memory when needed.
+					Bytef *inflated = NULL;
+					Bytef *new_mem = NULL;
+					conn->websocket_inflate_state.avail_in = (uInt)data_len;
+					conn->websocket_inflate_state.next_in = data;
+					if (mop & 0x80) {
+						// Add trailing 0x00 0x00 0xff 0xff bytes to the
+						// last frame of the message
+						data[data_len] = '\x00';
+						data[data_len + 1] = '\x00';
+						data[data_len + 2] = '\xff';
+						data[data_len + 3] = '\xff';
+						conn->websocket_inflate_state.avail_in += 4;
+					}
+					do {
+						if ((inflate_buf_max > 0)
+						    && (inflate_buf_size_old >= inflate_buf_max)) {
+							/* The buffer is full, the message too big */
+							ws_close_message_too_big(
+							    conn,
+							    conn->ws_inflated_len
+							        + (uint64_t)inflate_buf_size_old);
+							exit_by_callback = 1;
+							break;
+						}
+						if (inflate_buf_size_old == 0) {
+							if ((inflate_buf_max > 0)
+							    && (inflate_buf_size > inflate_buf_max)) {
+								inflate_buf_size = inflate_buf_max;
+							}
+							new_mem =
+							    (Bytef *)mg_calloc(inflate_buf_size,
+							                       sizeof(Bytef));
+						} else {
+							inflate_buf_size *= 2;
+							if ((inflate_buf_max > 0)
+							    && (inflate_buf_size > inflate_buf_max)) {
+								inflate_buf_size = inflate_buf_max;
+							}
+							new_mem =
+							    (Bytef *)mg_realloc(inflated,
+							                        inflate_buf_size);
+						}
+						if (new_mem == NULL) {
+							mg_cry_internal(
+							    conn,
+							    "Out of memory: Cannot allocate "
+							    "inflate buffer of %lu bytes",
+							    (unsigned long)inflate_buf_size);
+							exit_by_callback = 1;
+							break;
+						}
+						inflated = new_mem;
+						conn->websocket_inflate_state.avail_out =
+						    (uInt)(inflate_buf_size
+						           - inflate_buf_size_old);
+						conn->websocket_inflate_state.next_out =
+						    inflated + inflate_buf_size_old;
+						ret = zng_inflate(&conn->websocket_inflate_state,
+						              Z_SYNC_FLUSH);
+						if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR
+						    || ret == Z_MEM_ERROR) {
+							mg_cry_internal(
+							    conn,
+							    "ZLIB inflate error: %i %s",
+							    ret,
+							    (conn->websocket_inflate_state.msg
+							         ? conn->websocket_inflate_state.msg
+							         : "<no error message>"));
+							exit_by_callback = 1;
+							break;
+						}
+						inflate_buf_size_old = inflate_buf_size;
+
+					} while (conn->websocket_inflate_state.avail_out
+					         == 0);
+					inflate_buf_size -=
+					    conn->websocket_inflate_state.avail_out;
+					conn->ws_inflated_len += inflate_buf_size;
+					if (!exit_by_callback
+					    && !ws_call_data_handler(conn,
+					                             ws_data_handler,
+					                             mop,
+					                             (char *)inflated,
+					                             inflate_buf_size,
+					                             callback_data)) {
+						exit_by_callback = 1;
+					}
+					mg_free(inflated);
+				}
+			} else
+#endif
+			    if (!ws_call_data_handler(conn,
+			                              ws_data_handler,
+			                              mop,
+			                              (char *)data,
+			                              (size_t)data_len,
+			                              callback_data)) {
+				exit_by_callback = 1;
+			}
+		}
+	}
+
+	if (exit_by_callback) {
+		DEBUG_TRACE("Callback requests to close connection from %s:%u",
+		            conn->request_info.remote_addr,
+		            conn->request_info.remote_port);
+		return 0;
+	}
+	if ((mop & 0xf) == MG_WEBSOCKET_OPCODE_CONNECTION_CLOSE) {
+		/* Opcode == 8, connection close */
+		DEBUG_TRACE("Message requests to close connection from %s:%u",
+		            conn->request_info.remote_addr,
+		            conn->request_info.remote_port);
+		return 0;
+	}
+	return 1;
+}
+
+
+#include "websocket_mask.inl"
+
+
+/* Length of the message a received frame belongs to, including all
+ * previous frames of a fragmented message. */
+static uint64_t
+ws_message_length(const struct mg_connection *conn,
+                  unsigned char mop,
+                  uint64_t data_len)
+{
+	if (((mop & 0x0f) == MG_WEBSOCKET_OPCODE_CONTINUATION)
+	    && (conn->ws_message_len <= ~(uint64_t)0 - data_len)) {
+		return conn->ws_message_len + data_len;
+	}
+	return data_len;
+}
+
+
+/* A frame is received: count it for the current message */
+static void
+ws_message_add_frame(struct mg_connection *conn,
+                     unsigned char mop,
+                     uint64_t data_len)
+{
+	if (!(mop & 0x08)) {
+		/* Data frames only, control frames may be sent in between */
+		conn->ws_message_len = ws_message_length(conn, mop, data_len);
+		if ((mop & 0x0f) != MG_WEBSOCKET_OPCODE_CONTINUATION) {
+			conn->ws_inflated_len = 0;
+			conn->ws_message_deflated = (mop & 0x40) != 0;
+		}
+	}
+}
+
+
+/* Check the payload length of a received frame, before any memory is
+ * allocated for it. The payload of all frames of a fragmented message
+ * counts for websocket_max_message_size. Frames that are collected in one
+ * buffer (buffered != 0) are limited to 2 GB in any case.
+ * Return 1 if the frame may be received, 0 if the connection must be
+ * closed. */
+static int
+ws_check_frame_size(struct mg_connection *conn,
+                    unsigned char mop,
+                    uint64_t data_len,
+                    int buffered)
+{
+	uint64_t max_size = conn->phys_ctx->ws_max_message_size;
+	uint64_t message_len = ws_message_length(conn, mop, data_len);
+
+	if ((max_size > 0) && (message_len > max_size)) {
+		ws_close_message_too_big(conn, message_len);
+		return 0;
+	}
+	if (buffered && (data_len > (uint64_t)0x7FFF0000ul)) {
+		/* no can do */
+		mg_cry_internal(conn,
+		                "%s",
+		                "websocket out of memory; closing connection");
+		return 0;
+	}
+	return 1;
+}
+
+
+/* Check if a frame is passed to the stream handler in slices, as it is
+ * received. Control frames and compressed frames are collected in one
+ * buffer. */
+static int
+ws_is_streamed(const struct mg_connection *conn, unsigned char mop)
+{
+	return (conn->ws_stream_handler != NULL) && !(mop & 0x08)
+	       && !ws_is_deflated(conn, mop);
+}
+
+
+/* Start to receive a frame in slices. The frame header at the beginning of
+ * the receive queue is removed. */
+static void
+ws_stream_begin(struct mg_connection *conn,
+                size_t header_len,
+                uint64_t data_len)
+{
+	unsigned char *buf = (unsigned char *)conn->buf + conn->request_len;
+	size_t body_len = (size_t)(conn->data_len - conn->request_len);
+	struct mg_ws_stream *st = &conn->ws_stream;
+
+	st->active = 1;
+	st->mop = buf[0];
+	st->masked = (buf[1] & 128) != 0;
+	if (st->masked) {
+		memcpy(st->mask, buf + header_len - 4, sizeof(st->mask));
+	}
+	st->size = data_len;
+	st->offset = 0;
+	ws_message_add_frame(conn, st->mop, data_len);
+
+	memmove(buf, buf + header_len, body_len - header_len);
+	conn->data_len -= (int)header_len;
+}
+
+
+/* Pass the payload of the current frame available in the receive queue to
+ * the stream handler, and remove it from the queue.
+ * Return 1 to continue reading, 0 if the connection must be closed. */
+static int
+ws_stream_deliver(struct mg_connection *conn, void *callback_data)
+{
+	unsigned char *buf = (unsigned char *)conn->buf + conn->request_len;
+	size_t body_len = (size_t)(conn->data_len - conn->request_len);
+	struct mg_ws_stream *st = &conn->ws_stream;
+	unsigned char key[4];
+	size_t len = body_len, i;
+	int final, ret;
+
+	if ((uint64_t)len > st->size - st->offset) {
+		len = (size_t)(st->size - st->offset);
+	}
+	if (st->masked) {
+		/* The key continues at the offset of this slice */
+		for (i = 0; i < sizeof(key); i++) {
+			key[i] = st->mask[(st->offset + i) & 3];
+		}
+		ws_mask_apply((char *)buf, (const char *)buf, len, key);
+	}
+
+	final = (st->offset + len == st->size);
+	ret = conn->ws_stream_handler(
+	    conn, st->mop, (char *)buf, len, st->offset, final, callback_data);
+	st->offset += len;
+	if (final) {
+		st->active = 0;
+	}
+
+	memmove(buf, buf + len, body_len - len);
+	conn->data_len -= (int)len;
+	return ret;
+}
+
+
 static void
 read_websocket(struct mg_connection *conn,
                mg_websocket_data_handler ws_data_handler,
@@ -12367,7 +15150,7 @@ read_websocket(struct mg_connection *conn,
 	 * len is the length of the current message
 	 * data_len is the length of the current message's data payload
 	 * header_len is the length of the current message's header */
-	size_t i, len, mask_len = 0, header_len, body_len;
+	size_t len, mask_len = 0, header_len, body_len;
 	uint64_t data_len = 0;
 
 	/* "The masking key is a 32-bit value chosen at random by the client."
@@ -12383,26 +15166,10 @@ read_websocket(struct mg_connection *conn,
 
 
 	/* Variables used for connection monitoring */
-	double timeout = -1.0;
-	int enable_ping_pong = 0;
+	double timeout = websocket_read_timeout(conn);
+	int enable_ping_pong = conn->dom_ctx->cfg.enable_websocket_ping_pong;
 	int ping_count = 0;
 
-	if (conn->dom_ctx->config[ENABLE_WEBSOCKET_PING_PONG]) {
-		enable_ping_pong =
-		    !mg_strcasecmp(conn->dom_ctx->config[ENABLE_WEBSOCKET_PING_PONG],
-		                   "yes");
-	}
-
-	if (conn->dom_ctx->config[WEBSOCKET_TIMEOUT]) {
-		timeout = atoi(conn->dom_ctx->config[WEBSOCKET_TIMEOUT]) / 1000.0;
-	}
-	if ((timeout <= 0.0) && (conn->dom_ctx->config[REQUEST_TIMEOUT])) {
-		timeout = atoi(conn->dom_ctx->config[REQUEST_TIMEOUT]) / 1000.0;
-	}
-	if (timeout <= 0.0) {
-		timeout = atof(config_options[REQUEST_TIMEOUT].default_value) / 1000.0;
-	}
-
 	/* Enter data processing loop */
 	DEBUG_TRACE("Websocket connection %s:%u start data processing loop",
 	            conn->request_info.remote_addr,
@@ -12414,44 +15181,43 @@ read_websocket(struct mg_connection *conn,
 	 * callback, and waiting repeatedly until an error occurs. */
 	while (STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)
 	       && (!conn->must_close)) {
-		header_len = 0;
 		DEBUG_ASSERT(conn->data_len >= conn->request_len);
-		if ((body_len = (size_t)(conn->data_len - conn->request_len)) >= 2) {
-			len = buf[1] & 127;
-			mask_len = (buf[1] & 128) ? 4 : 0;
-			if ((len < 126) && (body_len >= mask_len)) {
-				/* inline 7-bit length field */
-				data_len = len;
-				header_len = 2 + mask_len;
-			} else if ((len == 126) && (body_len >= (4 + mask_len))) {
-				/* 16-bit length field */
-				header_len = 4 + mask_len;
-				data_len = ((((size_t)buf[2]) << 8) + buf[3]);
-			} else if (body_len >= (10 + mask_len)) {
-				/* 64-bit length field */
-				uint32_t l1, l2;
-				memcpy(&l1, &buf[2], 4); /* Use memcpy for alignment */
-				memcpy(&l2, &buf[6], 4);
-				header_len = 10 + mask_len;
-				data_len = (((uint64_t)ntohl(l1)) << 32) + ntohl(l2);
-
-				if (data_len > (uint64_t)0x7FFF0000ul) {
-					/* no can do */
-					mg_cry_internal(
-					    conn,
-					    "%s",
-					    "websocket out of memory; closing connection");
+		body_len = (size_t)(conn->data_len - conn->request_len);
+		if (conn->ws_stream.active) {
+			/* Payload of a frame passed in slices */
+			if ((body_len > 0) || (conn->ws_stream.size == 0)) {
+				if (!ws_stream_deliver(conn, callback_data)) {
 					break;
 				}
+				continue;
+			}
+			header_len = 0; /* Receive more data */
+		} else {
+			header_len =
+			    parse_websocket_frame_header(buf, body_len, &data_len);
+			if ((header_len > 0)
+			    && !ws_check_frame_size(conn,
+			                            buf[0],
+			                            data_len,
+			                            !ws_is_streamed(conn, buf[0]))) {
+				break;
+			}
+			if ((header_len > 0) && ws_is_streamed(conn, buf[0])) {
+				ws_stream_begin(conn, header_len, data_len);
+				continue;
 			}
 		}
 
-		if ((header_len > 0) && (body_len >= header_len)) {
+		if (header_len > 0) {
 			/* Allocate space to hold websocket payload */
 			unsigned char *data = mem;
 
-			if ((size_t)data_len > (size_t)sizeof(mem)) {
-				data = (unsigned char *)mg_malloc_ctx((size_t)data_len,
+			ws_message_add_frame(conn, buf[0], data_len);
+			mask_len = (buf[1] & 128) ? 4 : 0;
+
+			/* 4 spare bytes for inflate, see process_websocket_frame */
+			if ((size_t)data_len + 4 > (size_t)sizeof(mem)) {
+				data = (unsigned char *)mg_malloc_ctx((size_t)data_len + 4,
 				                                      conn->phys_ctx);
 				if (data == NULL) {
 					/* Allocation failed, exit the loop and then close the
@@ -12533,129 +15299,19 @@ read_websocket(struct mg_connection *conn,
 
 			/* Apply mask if necessary */
 			if (mask_len > 0) {
-				for (i = 0; i < (size_t)data_len; i++) {
-					data[i] ^= mask[i & 3];
-				}
+				ws_mask_apply((char *)data,
+				              (const char *)data,
+				              (size_t)data_len,
+				              mask);
 			}
 
-			exit_by_callback = 0;
-			if (enable_ping_pong && ((mop & 0xF) == MG_WEBSOCKET_OPCODE_PONG)) {
-				/* filter PONG messages */
-				DEBUG_TRACE("PONG from %s:%u",
-				            conn->request_info.remote_addr,
-				            conn->request_info.remote_port);
-				/* No unanwered PINGs left */
-				ping_count = 0;
-			} else if (enable_ping_pong
-			           && ((mop & 0xF) == MG_WEBSOCKET_OPCODE_PING)) {
-				/* reply PING messages */
-				DEBUG_TRACE("Reply PING from %s:%u",
-				            conn->request_info.remote_addr,
-				            conn->request_info.remote_port);
-				ret = mg_websocket_write(conn,
-				                         MG_WEBSOCKET_OPCODE_PONG,
-				                         (char *)data,
-				                         (size_t)data_len);
-				if (ret <= 0) {
-					/* Error: send failed */
-					DEBUG_TRACE("Reply PONG failed (%i)", ret);
-					break;
-				}
-
-
-			} else {
-				/* Exit the loop if callback signals to exit (server side),
-				 * or "connection close" opcode received (client side). */
-				if (ws_data_handler != NULL) {
-#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
-					if (mop & 0x40) {
-						/* Inflate the data received if bit RSV1 is set. */
-						if (!conn->websocket_deflate_initialized) {
-							if (websocket_deflate_initialize(conn, 1) != Z_OK)
-								exit_by_callback = 1;
-						}
-						if (!exit_by_callback) {
-							size_t inflate_buf_size_old = 0;
-							size_t inflate_buf_size =
-							    data_len
-							    * 4; // Initial guess of the inflated message
-							         // size. We double the memory when needed.
-							Bytef *inflated = NULL;
-							Bytef *new_mem = NULL;
-							conn->websocket_inflate_state.avail_in =
-							    (uInt)(data_len + 4);
-							conn->websocket_inflate_state.next_in = data;
-							// Add trailing 0x00 0x00 0xff 0xff bytes
-							data[data_len] = '\x00';
-							data[data_len + 1] = '\x00';
-							data[data_len + 2] = '\xff';
-							data[data_len + 3] = '\xff';
-							do {
-								if (inflate_buf_size_old == 0) {
-									new_mem =
-									    (Bytef *)mg_calloc(inflate_buf_size,
-									                       sizeof(Bytef));
-								} else {
-									inflate_buf_size *= 2;
-									new_mem =
-									    (Bytef *)mg_realloc(inflated,
-									                        inflate_buf_size);
-								}
-								if (new_mem == NULL) {
-									mg_cry_internal(
-									    conn,
-									    "Out of memory: Cannot allocate "
-									    "inflate buffer of %lu bytes",
-									    (unsigned long)inflate_buf_size);
-									exit_by_callback = 1;
-									break;
-								}
-								inflated = new_mem;
-								conn->websocket_inflate_state.avail_out =
-								    (uInt)(inflate_buf_size
-								           - inflate_buf_size_old);
-								conn->websocket_inflate_state.next_out =
-								    inflated + inflate_buf_size_old;
-								ret = zng_inflate(&conn->websocket_inflate_state,
-								              Z_SYNC_FLUSH);
-								if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR
-								    || ret == Z_MEM_ERROR) {
-									mg_cry_internal(
-									    conn,
-									    "ZLIB inflate error: %i %s",
-									    ret,
-									    (conn->websocket_inflate_state.msg
-									         ? conn->websocket_inflate_state.msg
-									         : "<no error message>"));
-									exit_by_callback = 1;
-									break;
-								}
-								inflate_buf_size_old = inflate_buf_size;
-
-							} while (conn->websocket_inflate_state.avail_out
-							         == 0);
-							inflate_buf_size -=
-							    conn->websocket_inflate_state.avail_out;
-							if (!ws_data_handler(conn,
-							                     mop,
-							                     (char *)inflated,
-							                     inflate_buf_size,
-							                     callback_data)) {
-								exit_by_callback = 1;
-							}
-							mg_free(inflated);
-						}
-					} else
-#endif
-					    if (!ws_data_handler(conn,
-					                         mop,
-					                         (char *)data,
-					                         (size_t)data_len,
-					                         callback_data)) {
-						exit_by_callback = 1;
-					}
-				}
-			}
+			exit_by_callback = !process_websocket_frame(conn,
+			                                            mop,
+			                                            data,
+			                                            (size_t)data_len,
+			                                            ws_data_handler,
+			                                            callback_data,
+			                                            &ping_count);
 
 			/* It a buffer has been allocated, free it again */
 			if (data != mem) {
@@ -12663,16 +15319,6 @@ read_websocket(struct mg_connection *conn,
 			}
 
 			if (exit_by_callback) {
-				DEBUG_TRACE("Callback requests to close connection from %s:%u",
-				            conn->request_info.remote_addr,
-				            conn->request_info.remote_port);
-				break;
-			}
-			if ((mop & 0xf) == MG_WEBSOCKET_OPCODE_CONNECTION_CLOSE) {
-				/* Opcode == 8, connection close */
-				DEBUG_TRACE("Message requests to close connection from %s:%u",
-				            conn->request_info.remote_addr,
-				            conn->request_info.remote_port);
 				break;
 			}
 
@@ -12741,6 +15387,51 @@ read_websocket(struct mg_connection *conn,
 }
 
 
+#include "websocket_send_queue.inl"
+
+
+/* Create the header of a websocket frame, with the FIN flag and the opcode
+ * in first_byte. Return the length of the header (up to 14 bytes). */
+static size_t
+websocket_frame_header(unsigned char header[14],
+                       unsigned char first_byte,
+                       size_t data_len,
+                       uint32_t masking_key)
+{
+	size_t header_len;
+
+	/* Frame format: http://tools.ietf.org/html/rfc6455#section-5.2 */
+	header[0] = first_byte;
+	if (data_len < 126) {
+		/* inline 7-bit length field */
+		header[1] = (unsigned char)data_len;
+		header_len = 2;
+	} else if (data_len <= 0xFFFF) {
+		/* 16-bit length field */
+		uint16_t len = htons((uint16_t)data_len);
+		header[1] = 126;
+		memcpy(header + 2, &len, 2);
+		header_len = 4;
+	} else {
+		/* 64-bit length field */
+		uint32_t len1 = htonl((uint32_t)((uint64_t)data_len >> 32));
+		uint32_t len2 = htonl((uint32_t)(data_len & 0xFFFFFFFFu));
+		header[1] = 127;
+		memcpy(header + 2, &len1, 4);
+		memcpy(header + 6, &len2, 4);
+		header_len = 10;
+	}
+
+	if (masking_key) {
+		/* add mask */
+		header[1] |= 0x80;
+		memcpy(header + header_len, &masking_key, 4);
+		header_len += 4;
+	}
+	return header_len;
+}
+
+
 static int
 mg_websocket_write_exec(struct mg_connection *conn,
                         int opcode,
@@ -12750,6 +15441,7 @@ mg_websocket_write_exec(struct mg_connection *conn,
 {
 	unsigned char header[14];
 	size_t headerLen;
+	struct mg_iovec iov[2];
 	int retval;
 
 #if defined(GCC_DIAGNOSTIC)
@@ -12810,50 +15502,41 @@ mg_websocket_write_exec(struct mg_connection *conn,
 #pragma GCC diagnostic pop
 #endif
 
-	/* Frame format: http://tools.ietf.org/html/rfc6455#section-5.2 */
-	if (dataLen < 126) {
-		/* inline 7-bit length field */
-		header[1] = (unsigned char)dataLen;
-		headerLen = 2;
-	} else if (dataLen <= 0xFFFF) {
-		/* 16-bit length field */
-		uint16_t len = htons((uint16_t)dataLen);
-		header[1] = 126;
-		memcpy(header + 2, &len, 2);
-		headerLen = 4;
-	} else {
-		/* 64-bit length field */
-		uint32_t len1 = htonl((uint32_t)((uint64_t)dataLen >> 32));
-		uint32_t len2 = htonl((uint32_t)(dataLen & 0xFFFFFFFFu));
-		header[1] = 127;
-		memcpy(header + 2, &len1, 4);
-		memcpy(header + 6, &len2, 4);
-		headerLen = 10;
-	}
+	headerLen = websocket_frame_header(header, header[0], dataLen, masking_key);
 
-	if (masking_key) {
-		/* add mask */
-		header[1] |= 0x80;
-		memcpy(header + headerLen, &masking_key, 4);
-		headerLen += 4;
+	/* Send header and payload with one write */
+	iov[0].buf = header;
+	iov[0].len = headerLen;
+	iov[1].buf = data;
+	iov[1].len = dataLen;
+#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+	if (use_deflate) {
+		iov[1].buf = deflated;
 	}
+#endif
 
-	retval = mg_write(conn, header, headerLen);
-	if (retval != (int)headerLen) {
-		/* Did not send complete header */
-		retval = -1;
+	if (ws_send_queue_enabled(conn)) {
+		/* Queue the frame, do not wait for slow clients */
+		retval = ws_send_queue_write(
+		    conn, header, headerLen, (const char *)iov[1].buf, dataLen);
 	} else {
-		if (dataLen > 0) {
-#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
-			if (use_deflate) {
-				retval = mg_write(conn, deflated, dataLen);
-				mg_free(deflated);
-			} else
-#endif
-				retval = mg_write(conn, data, dataLen);
+		retval = mg_writev(conn, iov, 2);
+		if ((retval < 0) || ((size_t)retval <= headerLen)) {
+			/* Did not send complete header, or no data */
+			retval =
+			    ((retval == (int)headerLen) && (dataLen == 0)) ? retval : -1;
+		} else {
+			/* Number of payload bytes sent */
+			retval -= (int)headerLen;
 		}
-		/* if dataLen == 0, the header length (2) is returned */
 	}
+	/* if dataLen == 0, the header length (2) is returned */
+
+#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+	if (use_deflate) {
+		mg_free(deflated);
+	}
+#endif
 
 	/* TODO: Remove this unlock as well, when lock is removed. */
 	mg_unlock_connection(conn);
@@ -12874,26 +15557,8 @@ mg_websocket_write(struct mg_connection *conn,
 static void
 mask_data(const char *in, size_t in_len, uint32_t masking_key, char *out)
 {
-	size_t i = 0;
-
-	i = 0;
-	if ((in_len > 3) && ((ptrdiff_t)in % 4) == 0) {
-		/* Convert in 32 bit words, if data is 4 byte aligned */
-		while (i < (in_len - 3)) {
-			*(uint32_t *)(void *)(out + i) =
-			    *(uint32_t *)(void *)(in + i) ^ masking_key;
-			i += 4;
-		}
-	}
-	if (i != in_len) {
-		/* convert 1-3 remaining bytes if ((dataLen % 4) != 0)*/
-		while (i < in_len) {
-			*(uint8_t *)(void *)(out + i) =
-			    *(uint8_t *)(void *)(in + i)
-			    ^ *(((uint8_t *)&masking_key) + (i % 4));
-			i++;
-		}
-	}
+	/* The key bytes in the order they are sent */
+	ws_mask_apply(out, in, in_len, (const unsigned char *)&masking_key);
 }
 
 
@@ -12932,6 +15597,21 @@ mg_websocket_client_write(struct mg_connection *conn,
 }
 
 
+#include "websocket_broadcast.inl"
+
+
+#if defined(USE_WEBSOCKET_REACTOR)
+static struct mg_connection *ws_reactor_detach(struct mg_connection *conn);
+static void ws_reactor_discard(struct mg_connection *wconn,
+                               struct mg_connection *conn);
+static void ws_reactor_attach(struct mg_connection *wconn,
+                              struct mg_connection *conn,
+                              mg_websocket_data_handler ws_data_handler,
+                              mg_websocket_close_handler ws_close_handler,
+                              void *cbData);
+#endif
+
+
 static void
 handle_websocket_request(struct mg_connection *conn,
                          const char *path,
@@ -12946,6 +15626,9 @@ handle_websocket_request(struct mg_connection *conn,
 	const char *websock_key = mg_get_header(conn, "Sec-WebSocket-Key");
 	const char *version = mg_get_header(conn, "Sec-WebSocket-Version");
 	ptrdiff_t lua_websock = 0;
+#if defined(USE_WEBSOCKET_REACTOR)
+	struct mg_connection *wconn = conn; /* Connection of the worker thread */
+#endif
 
 #if !defined(USE_LUA)
 	(void)path;
@@ -13070,6 +15753,14 @@ handle_websocket_request(struct mg_connection *conn,
 		websocket_deflate_negotiate(conn);
 #endif
 
+#if defined(USE_WEBSOCKET_REACTOR)
+		/* Step 2.2: Move the connection to the websocket reactor, before
+		 * any handler can store the connection pointer. From here on,
+		 * conn is the connection owned by the reactor (or still wconn,
+		 * if the websocket is served by this worker thread). */
+		conn = ws_reactor_detach(conn);
+#endif
+
 		if ((ws_connect_handler != NULL)
 		    && (ws_connect_handler(conn, cbData) != 0)) {
 			/* C callback has returned non-zero, do not proceed with
@@ -13077,6 +15768,9 @@ handle_websocket_request(struct mg_connection *conn,
 			 */
 			/* Note that C callbacks are no longer called when Lua is
 			 * responsible, so C can no longer filter callbacks for Lua. */
+#if defined(USE_WEBSOCKET_REACTOR)
+			ws_reactor_discard(wconn, conn);
+#endif
 			return;
 		}
 	}
@@ -13086,8 +15780,8 @@ handle_websocket_request(struct mg_connection *conn,
 	else {
 		/* Step 3.1: Check if Lua is responsible. */
 		if (conn->dom_ctx->config[LUA_WEBSOCKET_EXTENSIONS]) {
-			lua_websock = match_prefix_strlen(
-			    conn->dom_ctx->config[LUA_WEBSOCKET_EXTENSIONS], path);
+			lua_websock =
+			    match_config_pattern(conn, LUA_WEBSOCKET_EXTENSIONS, path);
 		}
 
 		if (lua_websock) {
@@ -13114,9 +15808,15 @@ handle_websocket_request(struct mg_connection *conn,
 	/* Step 5: The websocket connection has been accepted */
 	if (!send_websocket_handshake(conn, websock_key)) {
 		mg_send_http_error(conn, 500, "%s", "Websocket handshake failed");
+#if defined(USE_WEBSOCKET_REACTOR)
+		ws_reactor_discard(wconn, conn);
+#endif
 		return;
 	}
 
+	/* Websocket frames are not buffered, they are sent when written */
+	end_output_buffering(conn);
+
 	/* Step 6: Call the ready handler */
 	if (is_callback_resource) {
 		if (ws_ready_handler != NULL) {
@@ -13133,6 +15833,14 @@ handle_websocket_request(struct mg_connection *conn,
 
 	/* Step 7: Enter the read loop */
 	if (is_callback_resource) {
+#if defined(USE_WEBSOCKET_REACTOR)
+		if (conn != wconn) {
+			/* The reactor reads the data and calls the close handler */
+			ws_reactor_attach(
+			    wconn, conn, ws_data_handler, ws_close_handler, cbData);
+			return;
+		}
+#endif
 		read_websocket(conn, ws_data_handler, cbData);
 #if defined(USE_LUA)
 	} else if (lua_websock) {
@@ -13148,7 +15856,8 @@ handle_websocket_request(struct mg_connection *conn,
 	}
 #endif
 
-	/* Step 9: Call the close handler */
+	/* Step 9: Leave all channels and call the close handler */
+	ws_channel_leave_all(conn);
 	if (ws_close_handler) {
 		ws_close_handler(conn, cbData);
 	}
@@ -13206,8 +15915,19 @@ should_switch_to_protocol(const struct mg_connection *conn)
 }
 
 
+/* An IPv4 or IPv6 subnet, used by access_control_list and throttle */
+struct mg_net {
+	int family;        /* AF_INET or AF_INET6 */
+	unsigned int bits; /* Length of the network prefix */
+	uint8_t addr[16];  /* Network address, in network byte order */
+};
+
+
+/* Parse a subnet "x.x.x.x[/x]" or "[IPv6-addr][/x]". With no_strict,
+ * IPv6 addresses without square brackets are accepted as well.
+ * Return 1 on success, 0 if the subnet is malformed. */
 static int
-parse_match_net(const struct vec *vec, const union usa *sa, int no_strict)
+parse_net(const struct vec *vec, struct mg_net *net, int no_strict)
 {
 	int n;
 	unsigned int a, b, c, d, slash;
@@ -13222,14 +15942,13 @@ parse_match_net(const struct vec *vec, const union usa *sa, int no_strict)
 	if ((n > 0) && ((size_t)n == vec->len)) {
 		if ((a < 256) && (b < 256) && (c < 256) && (d < 256) && (slash < 33)) {
 			/* IPv4 format */
-			if (sa->sa.sa_family == AF_INET) {
-				uint32_t ip = (uint32_t)ntohl(sa->sin.sin_addr.s_addr);
-				uint32_t net = ((uint32_t)a << 24) | ((uint32_t)b << 16)
-				               | ((uint32_t)c << 8) | (uint32_t)d;
-				uint32_t mask = slash ? (0xFFFFFFFFu << (32 - slash)) : 0;
-				return (ip & mask) == net;
-			}
-			return 0;
+			net->family = AF_INET;
+			net->bits = slash;
+			net->addr[0] = (uint8_t)a;
+			net->addr[1] = (uint8_t)b;
+			net->addr[2] = (uint8_t)c;
+			net->addr[3] = (uint8_t)d;
+			return 1;
 		}
 	}
 #if defined(USE_IPV6)
@@ -13273,28 +15992,12 @@ parse_match_net(const struct vec *vec, const union usa *sa, int no_strict)
 			}
 			if ((*p == '\0') && (c >= 2)) {
 				struct sockaddr_in6 sin6;
-				unsigned int i;
 
-				/* for strict validation, an actual IPv6 argument is needed */
-				if (sa->sa.sa_family != AF_INET6) {
-					return 0;
-				}
 				if (mg_inet_pton(AF_INET6, ad, &sin6, sizeof(sin6), 0)) {
 					/* IPv6 format */
-					for (i = 0; i < 16; i++) {
-						uint8_t ip = sa->sin6.sin6_addr.s6_addr[i];
-						uint8_t net = sin6.sin6_addr.s6_addr[i];
-						uint8_t mask = 0;
-
-						if (8 * i + 8 < slash) {
-							mask = 0xFFu;
-						} else if (8 * i < slash) {
-							mask = (uint8_t)(0xFFu << (8 * i + 8 - slash));
-						}
-						if ((ip & mask) != net) {
-							return 0;
-						}
-					}
+					net->family = AF_INET6;
+					net->bits = slash;
+					memcpy(net->addr, sin6.sin6_addr.s6_addr, 16);
 					return 1;
 				}
 			}
@@ -13305,48 +16008,64 @@ parse_match_net(const struct vec *vec, const union usa *sa, int no_strict)
 #endif
 
 	/* malformed */
-	return -1;
+	return 0;
 }
 
 
+/* Return 1 if the address is in the subnet, 0 if not */
 static int
-set_throttle(const char *spec, const union usa *rsa, const char *uri)
-{
-	int throttle = 0;
-	struct vec vec, val;
-	char mult;
-	double v;
-
-	while ((spec = next_option(spec, &vec, &val)) != NULL) {
-		mult = ',';
-		if ((val.ptr == NULL) || (sscanf(val.ptr, "%lf%c", &v, &mult) < 1)
-		    || (v < 0)
-		    || ((lowercase(&mult) != 'k') && (lowercase(&mult) != 'm')
-		        && (mult != ','))) {
-			continue;
-		}
-		v *= (lowercase(&mult) == 'k')
-		         ? 1024
-		         : ((lowercase(&mult) == 'm') ? 1048576 : 1);
-		if (vec.len == 1 && vec.ptr[0] == '*') {
-			throttle = (int)v;
-		} else {
-			int matched = parse_match_net(&vec, rsa, 0);
-			if (matched >= 0) {
-				/* a valid IP subnet */
-				if (matched) {
-					throttle = (int)v;
-				}
-			} else if (match_prefix(vec.ptr, vec.len, uri) > 0) {
-				throttle = (int)v;
+match_net(const struct mg_net *net, const union usa *sa)
+{
+	if ((net->family == AF_INET) && (sa->sa.sa_family == AF_INET)) {
+		uint32_t ip = (uint32_t)ntohl(sa->sin.sin_addr.s_addr);
+		uint32_t addr =
+		    ((uint32_t)net->addr[0] << 24) | ((uint32_t)net->addr[1] << 16)
+		    | ((uint32_t)net->addr[2] << 8) | (uint32_t)net->addr[3];
+		uint32_t mask = net->bits ? (0xFFFFFFFFu << (32 - net->bits)) : 0;
+		return (ip & mask) == addr;
+	}
+#if defined(USE_IPV6)
+	if ((net->family == AF_INET6) && (sa->sa.sa_family == AF_INET6)) {
+		unsigned int i;
+
+		for (i = 0; i < 16; i++) {
+			uint8_t ip = sa->sin6.sin6_addr.s6_addr[i];
+			uint8_t mask = 0;
+
+			if (8 * i + 8 < net->bits) {
+				mask = 0xFFu;
+			} else if (8 * i < net->bits) {
+				mask = (uint8_t)(0xFFu << (8 * i + 8 - net->bits));
+			}
+			if ((ip & mask) != net->addr[i]) {
+				return 0;
 			}
 		}
+		return 1;
 	}
+#endif
+	return 0;
+}
+
+
+/* Return -1 if the subnet is malformed, 1 if the address is in the subnet,
+ * 0 if not */
+static int
+parse_match_net(const struct vec *vec, const union usa *sa, int no_strict)
+{
+	struct mg_net net;
 
-	return throttle;
+	if (!parse_net(vec, &net, no_strict)) {
+		return -1;
+	}
+	return match_net(&net, sa);
 }
 
 
+/* Bandwidth limits (throttle option) */
+#include "throttle.inl"
+
+
 /* The mg_upload function is superseeded by mg_handle_form_request. */
 #include "handle_form.inl"
 
@@ -13465,56 +16184,320 @@ switch_domain_context(struct mg_connection *conn)
 }
 
 
-static int mg_construct_local_link(const struct mg_connection *conn,
-                                   char *buf,
-                                   size_t buflen,
-                                   const char *define_proto,
-                                   int define_port,
-                                   const char *define_uri);
+static int mg_construct_local_link(const struct mg_connection *conn,
+                                   char *buf,
+                                   size_t buflen,
+                                   const char *define_proto,
+                                   int define_port,
+                                   const char *define_uri);
+
+
+static void
+redirect_to_https_port(struct mg_connection *conn, int port)
+{
+	char target_url[MG_BUF_LEN];
+	int truncated = 0;
+	const char *expect_proto =
+	    (conn->protocol_type == PROTOCOL_TYPE_WEBSOCKET) ? "wss" : "https";
+
+	/* Use "308 Permanent Redirect" */
+	int redirect_code = 308;
+
+	/* In any case, close the current connection */
+	conn->must_close = 1;
+
+	/* Send host, port, uri and (if it exists) ?query_string */
+	if (mg_construct_local_link(
+	        conn, target_url, sizeof(target_url), expect_proto, port, NULL)
+	    < 0) {
+		truncated = 1;
+	} else if (conn->request_info.query_string != NULL) {
+		size_t slen1 = strlen(target_url);
+		size_t slen2 = strlen(conn->request_info.query_string);
+		if ((slen1 + slen2 + 2) < sizeof(target_url)) {
+			target_url[slen1] = '?';
+			memcpy(target_url + slen1 + 1,
+			       conn->request_info.query_string,
+			       slen2);
+			target_url[slen1 + slen2 + 1] = 0;
+		} else {
+			truncated = 1;
+		}
+	}
+
+	/* Check overflow in location buffer (will not occur if MG_BUF_LEN
+	 * is used as buffer size) */
+	if (truncated) {
+		mg_send_http_error(conn, 500, "%s", "Redirect URL too long");
+		return;
+	}
+
+	/* Use redirect helper function */
+	mg_send_http_redirect(conn, target_url, redirect_code);
+}
+
+
+/* Add an entry to the radix tree below node. key is the lower case URI of
+ * the entry. New nodes are taken from tab->free_node. */
+static void
+handler_tree_insert(struct mg_handler_table *tab,
+                    struct mg_handler_node *node,
+                    const char *key,
+                    size_t key_len,
+                    struct mg_handler_entry *entry)
+{
+	struct mg_handler_node *child, *mid, **link;
+	struct mg_handler_entry **last;
+	size_t n;
+
+	for (;;) {
+		if (key_len == 0) {
+			/* Keep entries with the same key in list order */
+			for (last = &(node->entries); *last != NULL;
+			     last = &((*last)->next)) {
+			}
+			*last = entry;
+			return;
+		}
+
+		for (link = &(node->children);
+		     (*link != NULL) && ((*link)->key[0] != key[0]);
+		     link = &((*link)->sibling)) {
+		}
+		child = *link;
+		if (child == NULL) {
+			child = tab->free_node++;
+			child->key = key;
+			child->key_len = key_len;
+			child->entries = entry;
+			*link = child;
+			return;
+		}
+
+		for (n = 1; (n < child->key_len) && (n < key_len)
+		            && (child->key[n] == key[n]);
+		     n++) {
+		}
+		if (n < child->key_len) {
+			/* Split the edge */
+			mid = tab->free_node++;
+			mid->key = child->key;
+			mid->key_len = n;
+			mid->children = child;
+			mid->sibling = child->sibling;
+			child->key += n;
+			child->key_len -= n;
+			child->sibling = NULL;
+			*link = mid;
+			child = mid;
+		}
+		node = child;
+		key += n;
+		key_len -= n;
+	}
+}
+
+
+/* Compile a handler list into a lookup table. The table is allocated as
+ * one memory block, so it can be freed using mg_free. */
+static struct mg_handler_table *
+build_handler_table(struct mg_context *phys_ctx,
+                    const struct mg_handler_info *handlers)
+{
+	const struct mg_handler_info *rh;
+	struct mg_handler_table *tab;
+	struct mg_handler_entry *entries, **globs;
+	struct mg_handler_node *nodes;
+	struct mg_pattern_token *tokens;
+	char *keys;
+	size_t num = 0, key_size = 0, i, order;
+	int t;
+	(void)phys_ctx; /* Only used for memory statistics */
+
+	for (rh = handlers; rh != NULL; rh = rh->next) {
+		num++;
+		key_size += rh->uri_len + 1;
+	}
+
+	/* Every insert creates at most two nodes, plus one root per type */
+	tab = (struct mg_handler_table *)
+	    mg_calloc_ctx(1,
+	                  sizeof(struct mg_handler_table)
+	                      + num * sizeof(struct mg_handler_entry)
+	                      + num * sizeof(struct mg_handler_entry *)
+	                      + (2 * num + 3) * sizeof(struct mg_handler_node)
+	                      + key_size * sizeof(struct mg_pattern_token)
+	                      + key_size,
+	                  phys_ctx);
+	if (tab == NULL) {
+		return NULL;
+	}
+	entries = (struct mg_handler_entry *)(void *)(tab + 1);
+	globs = (struct mg_handler_entry **)(void *)(entries + num);
+	nodes = (struct mg_handler_node *)(void *)(globs + num);
+	tokens = (struct mg_pattern_token *)(void *)(nodes + 2 * num + 3);
+	keys = (char *)(void *)(tokens + key_size);
+
+	for (t = 0; t < 3; t++) {
+		tab->root[t] = nodes++;
+	}
+	tab->free_node = nodes;
+
+	for (rh = handlers, order = 0; rh != NULL; rh = rh->next, order++) {
+		struct mg_handler_entry *e = entries + order;
+
+		e->rh = (struct mg_handler_info *)rh;
+		e->order = order;
+		e->is_glob = (strcspn(rh->uri, "*?$|") < rh->uri_len);
+		if (e->is_glob) {
+			compile_pattern(rh->uri, rh->uri_len, tokens);
+			e->pattern = tokens;
+			tokens += rh->uri_len + 1;
+		}
+		for (i = 0; i < rh->uri_len; i++) {
+			keys[i] = (char)lowercase(rh->uri + i);
+		}
+		handler_tree_insert(
+		    tab, tab->root[rh->handler_type], keys, rh->uri_len, e);
+		keys += rh->uri_len + 1;
+	}
+
+	/* Glob patterns per handler type, in list order */
+	for (t = 0; t < 3; t++) {
+		tab->globs[t] = globs;
+		for (order = 0; order < num; order++) {
+			if (entries[order].is_glob
+			    && (entries[order].rh->handler_type == t)) {
+				*globs++ = entries + order;
+			}
+		}
+		tab->num_globs[t] = (size_t)(globs - tab->globs[t]);
+	}
+
+	return tab;
+}
+
+
+/* Find the handler for a URI. The result is the same as checking all
+ * handlers of the type for an exact match first, then for a match of
+ * "uri/something", and finally using match_prefix, taking the first
+ * handler in list order in each step. */
+static struct mg_handler_info *
+lookup_handler(const struct mg_handler_table *tab,
+               int handler_type,
+               const char *uri,
+               size_t urilen)
+{
+	const struct mg_handler_node *node = tab->root[handler_type];
+	const struct mg_handler_node *child;
+	const struct mg_handler_entry *e, *sub = NULL, *prefix = NULL;
+	size_t pos = 0, i;
+
+	for (;;) {
+		for (e = node->entries; e != NULL; e = e->next) {
+			if (pos == urilen) {
+				if (memcmp(e->rh->uri, uri, urilen) == 0) {
+					/* exact match */
+					return e->rh;
+				}
+			} else if ((uri[pos] == '/')
+			           && ((sub == NULL) || (e->order < sub->order))
+			           && (memcmp(e->rh->uri, uri, pos) == 0)) {
+				/* match of uri/something */
+				sub = e;
+			}
+			if (!e->is_glob && (pos > 0)
+			    && ((prefix == NULL) || (e->order < prefix->order))) {
+				/* (case insensitive) prefix match without pattern */
+				prefix = e;
+			}
+		}
+		if (pos == urilen) {
+			break;
+		}
+
+		for (child = node->children;
+		     (child != NULL) && (child->key[0] != lowercase(uri + pos));
+		     child = child->sibling) {
+		}
+		if (child == NULL) {
+			break;
+		}
+		for (i = 1; i < child->key_len; i++) {
+			if ((pos + i >= urilen)
+			    || (child->key[i] != lowercase(uri + pos + i))) {
+				break;
+			}
+		}
+		if (i < child->key_len) {
+			break;
+		}
+		pos += i;
+		node = child;
+	}
+
+	if (sub != NULL) {
+		return sub->rh;
+	}
+
+	/* Glob patterns registered before the best prefix match */
+	for (i = 0; i < tab->num_globs[handler_type]; i++) {
+		e = tab->globs[handler_type][i];
+		if ((prefix != NULL) && (prefix->order < e->order)) {
+			break;
+		}
+		if (match_pattern(e->pattern, uri) > 0) {
+			return e->rh;
+		}
+	}
+	return (prefix != NULL) ? prefix->rh : NULL;
+}
+
+
+/* Get the current handler table of a domain. Must be paired with
+ * release_handler_table. */
+static struct mg_handler_table *
+acquire_handler_table(struct mg_domain_context *dom_ctx, ptrdiff_t *slot)
+{
+	ptrdiff_t gen;
+
+	for (;;) {
+		gen = dom_ctx->handler_gen;
+		*slot = gen & 1;
+		mg_atomic_inc(&(dom_ctx->handler_readers[*slot]));
+		if (dom_ctx->handler_gen == gen) {
+			return dom_ctx->handler_table[*slot];
+		}
+		/* A new table has been published meanwhile */
+		mg_atomic_dec(&(dom_ctx->handler_readers[*slot]));
+	}
+}
 
 
 static void
-redirect_to_https_port(struct mg_connection *conn, int port)
+release_handler_table(struct mg_domain_context *dom_ctx, ptrdiff_t slot)
 {
-	char target_url[MG_BUF_LEN];
-	int truncated = 0;
-	const char *expect_proto =
-	    (conn->protocol_type == PROTOCOL_TYPE_WEBSOCKET) ? "wss" : "https";
+	mg_atomic_dec(&(dom_ctx->handler_readers[slot]));
+}
 
-	/* Use "308 Permanent Redirect" */
-	int redirect_code = 308;
 
-	/* In any case, close the current connection */
-	conn->must_close = 1;
+/* Replace the handler table of a domain. Must be called with the context
+ * lock held. Returns after the previous table has been freed, so handlers
+ * no longer in the new table are not referenced by any reader. */
+static void
+publish_handler_table(struct mg_domain_context *dom_ctx,
+                      struct mg_handler_table *tab)
+{
+	ptrdiff_t cur = dom_ctx->handler_gen & 1;
 
-	/* Send host, port, uri and (if it exists) ?query_string */
-	if (mg_construct_local_link(
-	        conn, target_url, sizeof(target_url), expect_proto, port, NULL)
-	    < 0) {
-		truncated = 1;
-	} else if (conn->request_info.query_string != NULL) {
-		size_t slen1 = strlen(target_url);
-		size_t slen2 = strlen(conn->request_info.query_string);
-		if ((slen1 + slen2 + 2) < sizeof(target_url)) {
-			target_url[slen1] = '?';
-			memcpy(target_url + slen1 + 1,
-			       conn->request_info.query_string,
-			       slen2);
-			target_url[slen1 + slen2 + 1] = 0;
-		} else {
-			truncated = 1;
-		}
-	}
+	dom_ctx->handler_table[cur ^ 1] = tab;
+	mg_atomic_inc(&(dom_ctx->handler_gen));
 
-	/* Check overflow in location buffer (will not occur if MG_BUF_LEN
-	 * is used as buffer size) */
-	if (truncated) {
-		mg_send_http_error(conn, 500, "%s", "Redirect URL too long");
-		return;
+	while (dom_ctx->handler_readers[cur] != 0) {
+		mg_sleep(0);
 	}
-
-	/* Use redirect helper function */
-	mg_send_http_redirect(conn, target_url, redirect_code);
+	mg_free(dom_ctx->handler_table[cur]);
+	dom_ctx->handler_table[cur] = NULL;
 }
 
 
@@ -13529,18 +16512,20 @@ mg_set_handler_type(struct mg_context *phys_ctx,
                     mg_websocket_connect_handler connect_handler,
                     mg_websocket_ready_handler ready_handler,
                     mg_websocket_data_handler data_handler,
+                    mg_websocket_stream_handler stream_handler,
                     mg_websocket_close_handler close_handler,
                     mg_authorization_handler auth_handler,
                     void *cbdata)
 {
-	struct mg_handler_info *tmp_rh, **lastref;
+	struct mg_handler_info *old_rh, *new_rh = NULL, **lastref;
+	struct mg_handler_table *tab;
 	size_t urilen = strlen(uri);
 
 	if (handler_type == WEBSOCKET_HANDLER) {
 		DEBUG_ASSERT(handler == NULL);
 		DEBUG_ASSERT(is_delete_request || connect_handler != NULL
 		             || ready_handler != NULL || data_handler != NULL
-		             || close_handler != NULL);
+		             || stream_handler != NULL || close_handler != NULL);
 
 		DEBUG_ASSERT(auth_handler == NULL);
 		if (handler != NULL) {
@@ -13548,7 +16533,7 @@ mg_set_handler_type(struct mg_context *phys_ctx,
 		}
 		if (!is_delete_request && (connect_handler == NULL)
 		    && (ready_handler == NULL) && (data_handler == NULL)
-		    && (close_handler == NULL)) {
+		    && (stream_handler == NULL) && (close_handler == NULL)) {
 			return;
 		}
 		if (auth_handler != NULL) {
@@ -13557,12 +16542,14 @@ mg_set_handler_type(struct mg_context *phys_ctx,
 
 	} else if (handler_type == REQUEST_HANDLER) {
 		DEBUG_ASSERT(connect_handler == NULL && ready_handler == NULL
-		             && data_handler == NULL && close_handler == NULL);
+		             && data_handler == NULL && stream_handler == NULL
+		             && close_handler == NULL);
 		DEBUG_ASSERT(is_delete_request || (handler != NULL));
 		DEBUG_ASSERT(auth_handler == NULL);
 
 		if ((connect_handler != NULL) || (ready_handler != NULL)
-		    || (data_handler != NULL) || (close_handler != NULL)) {
+		    || (data_handler != NULL) || (stream_handler != NULL)
+		    || (close_handler != NULL)) {
 			return;
 		}
 		if (!is_delete_request && (handler == NULL)) {
@@ -13575,13 +16562,15 @@ mg_set_handler_type(struct mg_context *phys_ctx,
 	} else if (handler_type == AUTH_HANDLER) {
 		DEBUG_ASSERT(handler == NULL);
 		DEBUG_ASSERT(connect_handler == NULL && ready_handler == NULL
-		             && data_handler == NULL && close_handler == NULL);
+		             && data_handler == NULL && stream_handler == NULL
+		             && close_handler == NULL);
 		DEBUG_ASSERT(is_delete_request || (auth_handler != NULL));
 		if (handler != NULL) {
 			return;
 		}
 		if ((connect_handler != NULL) || (ready_handler != NULL)
-		    || (data_handler != NULL) || (close_handler != NULL)) {
+		    || (data_handler != NULL) || (stream_handler != NULL)
+		    || (close_handler != NULL)) {
 			return;
 		}
 		if (!is_delete_request && (auth_handler == NULL)) {
@@ -13597,110 +16586,95 @@ mg_set_handler_type(struct mg_context *phys_ctx,
 		return;
 	}
 
+	if (!is_delete_request) {
+		new_rh = (struct mg_handler_info *)
+		    mg_calloc_ctx(1, sizeof(struct mg_handler_info), phys_ctx);
+		if (new_rh == NULL) {
+			mg_cry_ctx_internal(phys_ctx,
+			                    "%s",
+			                    "Cannot create new request handler struct, OOM");
+			return;
+		}
+		new_rh->uri = mg_strdup_ctx(uri, phys_ctx);
+		if (!new_rh->uri) {
+			mg_free(new_rh);
+			mg_cry_ctx_internal(phys_ctx,
+			                    "%s",
+			                    "Cannot create new request handler struct, OOM");
+			return;
+		}
+		new_rh->uri_len = urilen;
+		if (handler_type == REQUEST_HANDLER) {
+			new_rh->handler = handler;
+		} else if (handler_type == WEBSOCKET_HANDLER) {
+			new_rh->subprotocols = subprotocols;
+			new_rh->connect_handler = connect_handler;
+			new_rh->ready_handler = ready_handler;
+			new_rh->data_handler = data_handler;
+			new_rh->stream_handler = stream_handler;
+			new_rh->close_handler = close_handler;
+		} else { /* AUTH_HANDLER */
+			new_rh->auth_handler = auth_handler;
+		}
+		new_rh->cbdata = cbdata;
+		new_rh->handler_type = handler_type;
+		new_rh->next = NULL;
+	}
+
 	mg_lock_context(phys_ctx);
 
 	/* first try to find an existing handler */
-	do {
-		lastref = &(dom_ctx->handlers);
-		for (tmp_rh = dom_ctx->handlers; tmp_rh != NULL;
-		     tmp_rh = tmp_rh->next) {
-			if (tmp_rh->handler_type == handler_type
-			    && (urilen == tmp_rh->uri_len) && !strcmp(tmp_rh->uri, uri)) {
-				if (!is_delete_request) {
-					/* update existing handler */
-					if (handler_type == REQUEST_HANDLER) {
-						/* Wait for end of use before updating */
-						if (tmp_rh->refcount) {
-							mg_unlock_context(phys_ctx);
-							mg_sleep(1);
-							mg_lock_context(phys_ctx);
-							/* tmp_rh might have been freed, search again. */
-							break;
-						}
-						/* Ok, the handler is no more use -> Update it */
-						tmp_rh->handler = handler;
-					} else if (handler_type == WEBSOCKET_HANDLER) {
-						tmp_rh->subprotocols = subprotocols;
-						tmp_rh->connect_handler = connect_handler;
-						tmp_rh->ready_handler = ready_handler;
-						tmp_rh->data_handler = data_handler;
-						tmp_rh->close_handler = close_handler;
-					} else { /* AUTH_HANDLER */
-						tmp_rh->auth_handler = auth_handler;
-					}
-					tmp_rh->cbdata = cbdata;
-				} else {
-					/* remove existing handler */
-					if (handler_type == REQUEST_HANDLER) {
-						/* Wait for end of use before removing */
-						if (tmp_rh->refcount) {
-							tmp_rh->removing = 1;
-							mg_unlock_context(phys_ctx);
-							mg_sleep(1);
-							mg_lock_context(phys_ctx);
-							/* tmp_rh might have been freed, search again. */
-							break;
-						}
-						/* Ok, the handler is no more used */
-					}
-					*lastref = tmp_rh->next;
-					mg_free(tmp_rh->uri);
-					mg_free(tmp_rh);
-				}
-				mg_unlock_context(phys_ctx);
-				return;
-			}
-			lastref = &(tmp_rh->next);
+	for (lastref = &(dom_ctx->handlers); (old_rh = *lastref) != NULL;
+	     lastref = &(old_rh->next)) {
+		if ((old_rh->handler_type == handler_type)
+		    && (urilen == old_rh->uri_len) && !strcmp(old_rh->uri, uri)) {
+			break;
 		}
-	} while (tmp_rh != NULL);
+	}
 
-	if (is_delete_request) {
+	if (is_delete_request && (old_rh == NULL)) {
 		/* no handler to set, this was a remove request to a non-existing
 		 * handler */
 		mg_unlock_context(phys_ctx);
 		return;
 	}
 
-	tmp_rh =
-	    (struct mg_handler_info *)mg_calloc_ctx(1,
-	                                            sizeof(struct mg_handler_info),
-	                                            phys_ctx);
-	if (tmp_rh == NULL) {
-		mg_unlock_context(phys_ctx);
-		mg_cry_ctx_internal(phys_ctx,
-		                    "%s",
-		                    "Cannot create new request handler struct, OOM");
-		return;
+	/* An existing handler is replaced at the same position of the list,
+	 * a new handler is appended. */
+	if (new_rh != NULL) {
+		new_rh->next = (old_rh != NULL) ? old_rh->next : NULL;
+		*lastref = new_rh;
+	} else {
+		*lastref = old_rh->next;
 	}
-	tmp_rh->uri = mg_strdup_ctx(uri, phys_ctx);
-	if (!tmp_rh->uri) {
+
+	tab = build_handler_table(phys_ctx, dom_ctx->handlers);
+	if (tab == NULL) {
+		/* Keep the handler list in sync with the current table */
+		*lastref = old_rh;
 		mg_unlock_context(phys_ctx);
-		mg_free(tmp_rh);
+		if (new_rh != NULL) {
+			mg_free(new_rh->uri);
+			mg_free(new_rh);
+		}
 		mg_cry_ctx_internal(phys_ctx,
 		                    "%s",
-		                    "Cannot create new request handler struct, OOM");
+		                    "Cannot create request handler table, OOM");
 		return;
 	}
-	tmp_rh->uri_len = urilen;
-	if (handler_type == REQUEST_HANDLER) {
-		tmp_rh->refcount = 0;
-		tmp_rh->removing = 0;
-		tmp_rh->handler = handler;
-	} else if (handler_type == WEBSOCKET_HANDLER) {
-		tmp_rh->subprotocols = subprotocols;
-		tmp_rh->connect_handler = connect_handler;
-		tmp_rh->ready_handler = ready_handler;
-		tmp_rh->data_handler = data_handler;
-		tmp_rh->close_handler = close_handler;
-	} else { /* AUTH_HANDLER */
-		tmp_rh->auth_handler = auth_handler;
-	}
-	tmp_rh->cbdata = cbdata;
-	tmp_rh->handler_type = handler_type;
-	tmp_rh->next = NULL;
-
-	*lastref = tmp_rh;
+	publish_handler_table(dom_ctx, tab);
+
 	mg_unlock_context(phys_ctx);
+
+	if (old_rh != NULL) {
+		/* New requests cannot find the old handler anymore, but requests
+		 * currently using it must end before it can be freed. */
+		while (old_rh->refcount != 0) {
+			mg_sleep(1);
+		}
+		mg_free(old_rh->uri);
+		mg_free(old_rh);
+	}
 }
 
 
@@ -13722,6 +16696,7 @@ mg_set_request_handler(struct mg_context *ctx,
 	                    NULL,
 	                    NULL,
 	                    NULL,
+	                    NULL,
 	                    cbdata);
 }
 
@@ -13770,6 +16745,36 @@ mg_set_websocket_handler_with_subprotocols(
 	                    connect_handler,
 	                    ready_handler,
 	                    data_handler,
+	                    NULL,
+	                    close_handler,
+	                    NULL,
+	                    cbdata);
+}
+
+
+void
+mg_set_websocket_stream_handler(struct mg_context *ctx,
+                                const char *uri,
+                                mg_websocket_connect_handler connect_handler,
+                                mg_websocket_ready_handler ready_handler,
+                                mg_websocket_stream_handler stream_handler,
+                                mg_websocket_close_handler close_handler,
+                                void *cbdata)
+{
+	int is_delete_request = (connect_handler == NULL) && (ready_handler == NULL)
+	                        && (stream_handler == NULL)
+	                        && (close_handler == NULL);
+	mg_set_handler_type(ctx,
+	                    &(ctx->dd),
+	                    uri,
+	                    WEBSOCKET_HANDLER,
+	                    is_delete_request,
+	                    NULL,
+	                    NULL,
+	                    connect_handler,
+	                    ready_handler,
+	                    NULL,
+	                    stream_handler,
 	                    close_handler,
 	                    NULL,
 	                    cbdata);
@@ -13793,6 +16798,7 @@ mg_set_auth_handler(struct mg_context *ctx,
 	                    NULL,
 	                    NULL,
 	                    NULL,
+	                    NULL,
 	                    handler,
 	                    cbdata);
 }
@@ -13806,6 +16812,7 @@ get_request_handler(struct mg_connection *conn,
                     mg_websocket_connect_handler *connect_handler,
                     mg_websocket_ready_handler *ready_handler,
                     mg_websocket_data_handler *data_handler,
+                    mg_websocket_stream_handler *stream_handler,
                     mg_websocket_close_handler *close_handler,
                     mg_authorization_handler *auth_handler,
                     void **cbdata,
@@ -13814,66 +16821,39 @@ get_request_handler(struct mg_connection *conn,
 	const struct mg_request_info *request_info = mg_get_request_info(conn);
 	if (request_info) {
 		const char *uri = request_info->local_uri;
-		size_t urilen = strlen(uri);
-		struct mg_handler_info *tmp_rh;
-		int step, matched;
+		struct mg_handler_table *tab;
+		struct mg_handler_info *tmp_rh = NULL;
+		ptrdiff_t slot;
 
 		if (!conn || !conn->phys_ctx || !conn->dom_ctx) {
 			return 0;
 		}
 
-		mg_lock_context(conn->phys_ctx);
-
-		for (step = 0; step < 3; step++) {
-			for (tmp_rh = conn->dom_ctx->handlers; tmp_rh != NULL;
-			     tmp_rh = tmp_rh->next) {
-				if (tmp_rh->handler_type != handler_type) {
-					continue;
-				}
-				if (step == 0) {
-					/* first try for an exact match */
-					matched = (tmp_rh->uri_len == urilen)
-					          && (strcmp(tmp_rh->uri, uri) == 0);
-				} else if (step == 1) {
-					/* next try for a partial match, we will accept
-					uri/something */
-					matched =
-					    (tmp_rh->uri_len < urilen)
-					    && (uri[tmp_rh->uri_len] == '/')
-					    && (memcmp(tmp_rh->uri, uri, tmp_rh->uri_len) == 0);
-				} else {
-					/* finally try for pattern match */
-					matched =
-					    match_prefix(tmp_rh->uri, tmp_rh->uri_len, uri) > 0;
-				}
-				if (matched) {
-					if (handler_type == WEBSOCKET_HANDLER) {
-						*subprotocols = tmp_rh->subprotocols;
-						*connect_handler = tmp_rh->connect_handler;
-						*ready_handler = tmp_rh->ready_handler;
-						*data_handler = tmp_rh->data_handler;
-						*close_handler = tmp_rh->close_handler;
-					} else if (handler_type == REQUEST_HANDLER) {
-						if (tmp_rh->removing) {
-							/* Treat as none found */
-							step = 2;
-							break;
-						}
-						*handler = tmp_rh->handler;
-						/* Acquire handler and give it back */
-						tmp_rh->refcount++;
-						*handler_info = tmp_rh;
-					} else { /* AUTH_HANDLER */
-						*auth_handler = tmp_rh->auth_handler;
-					}
-					*cbdata = tmp_rh->cbdata;
-					mg_unlock_context(conn->phys_ctx);
-					return 1;
-				}
+		tab = acquire_handler_table(conn->dom_ctx, &slot);
+		if (tab != NULL) {
+			tmp_rh = lookup_handler(tab, handler_type, uri, strlen(uri));
+		}
+		if (tmp_rh != NULL) {
+			if (handler_type == WEBSOCKET_HANDLER) {
+				*subprotocols = tmp_rh->subprotocols;
+				*connect_handler = tmp_rh->connect_handler;
+				*ready_handler = tmp_rh->ready_handler;
+				*data_handler = tmp_rh->data_handler;
+				*stream_handler = tmp_rh->stream_handler;
+				*close_handler = tmp_rh->close_handler;
+			} else if (handler_type == REQUEST_HANDLER) {
+				*handler = tmp_rh->handler;
+				/* Acquire handler and give it back */
+				mg_atomic_inc(&(tmp_rh->refcount));
+				*handler_info = tmp_rh;
+			} else { /* AUTH_HANDLER */
+				*auth_handler = tmp_rh->auth_handler;
 			}
+			*cbdata = tmp_rh->cbdata;
 		}
+		release_handler_table(conn->dom_ctx, slot);
 
-		mg_unlock_context(conn->phys_ctx);
+		return (tmp_rh != NULL);
 	}
 	return 0; /* none found */
 }
@@ -13923,17 +16903,14 @@ experimental_websocket_client_close_wrapper(const struct mg_connection *conn,
 #endif
 
 
-/* Decrement recount of handler. conn must not be NULL, handler_info may be NULL
- */
+/* Decrement refcount of handler. handler_info may be NULL */
 static void
 release_handler_ref(struct mg_connection *conn,
                     struct mg_handler_info *handler_info)
 {
+	(void)conn;
 	if (handler_info != NULL) {
-		/* Use context lock for ref counter */
-		mg_lock_context(conn->phys_ctx);
-		handler_info->refcount--;
-		mg_unlock_context(conn->phys_ctx);
+		mg_atomic_dec(&(handler_info->refcount));
 	}
 }
 
@@ -13959,6 +16936,7 @@ handle_request(struct mg_connection *conn)
 	mg_websocket_connect_handler ws_connect_handler = NULL;
 	mg_websocket_ready_handler ws_ready_handler = NULL;
 	mg_websocket_data_handler ws_data_handler = NULL;
+	mg_websocket_stream_handler ws_stream_handler = NULL;
 	mg_websocket_close_handler ws_close_handler = NULL;
 	void *callback_data = NULL;
 	mg_authorization_handler auth_handler = NULL;
@@ -13972,6 +16950,13 @@ handle_request(struct mg_connection *conn)
 
 	/* 0. Reset internal state (required for HTTP/2 proxy) */
 	conn->request_state = 0;
+#if defined(USE_WEBSOCKET)
+	conn->ws_stream_handler = NULL;
+	conn->ws_stream.active = 0;
+	conn->ws_message_len = 0;
+	conn->ws_inflated_len = 0;
+	conn->ws_message_deflated = 0;
+#endif
 
 	/* 1. get the request url */
 	/* 1.1. split into url and query string */
@@ -14031,9 +17016,7 @@ handle_request(struct mg_connection *conn)
 	DEBUG_TRACE("URL: %s", ri->local_uri);
 
 	/* 2. if this ip has limited speed, set it for this connection */
-	conn->throttle = set_throttle(conn->dom_ctx->config[THROTTLE],
-	                              &conn->client.rsa,
-	                              ri->local_uri);
+	throttle_select(conn, ri->local_uri);
 
 	/* 3. call a "handle everything" callback, if registered */
 	if (conn->phys_ctx->callbacks.begin_request != NULL) {
@@ -14151,6 +17134,7 @@ handle_request(struct mg_connection *conn)
 	                        &ws_connect_handler,
 	                        &ws_ready_handler,
 	                        &ws_data_handler,
+	                        &ws_stream_handler,
 	                        &ws_close_handler,
 	                        NULL,
 	                        &callback_data,
@@ -14189,6 +17173,7 @@ handle_request(struct mg_connection *conn)
 	                        NULL,
 	                        NULL,
 	                        NULL,
+	                        NULL,
 	                        &auth_handler,
 	                        &auth_callback_data,
 	                        NULL)) {
@@ -14306,6 +17291,7 @@ handle_request(struct mg_connection *conn)
 			}
 		} else {
 #if defined(USE_WEBSOCKET)
+			conn->ws_stream_handler = ws_stream_handler;
 			handle_websocket_request(conn,
 			                         path,
 			                         is_callback_resource,
@@ -14459,8 +17445,7 @@ handle_request(struct mg_connection *conn)
 		/* Substitute files have already been handled above. */
 		/* Here we can either generate and send a directory listing,
 		 * or send an "access denied" error. */
-		if (!mg_strcasecmp(conn->dom_ctx->config[ENABLE_DIRECTORY_LISTING],
-		                   "yes")) {
+		if (conn->dom_ctx->cfg.enable_directory_listing) {
 			handle_directory_request(conn, path);
 		} else {
 			mg_send_http_error(conn,
@@ -14509,9 +17494,7 @@ handle_file_based_request(struct mg_connection *conn,
 	}
 
 #if defined(USE_LUA)
-	if (match_prefix_strlen(conn->dom_ctx->config[LUA_SERVER_PAGE_EXTENSIONS],
-	                        path)
-	    > 0) {
+	if (match_config_pattern(conn, LUA_SERVER_PAGE_EXTENSIONS, path) > 0) {
 		if (is_in_script_path(conn, path)) {
 			/* Lua server page: an SSI like page containing mostly plain
 			 * html code plus some tags with server generated contents. */
@@ -14523,8 +17506,7 @@ handle_file_based_request(struct mg_connection *conn,
 		return;
 	}
 
-	if (match_prefix_strlen(conn->dom_ctx->config[LUA_SCRIPT_EXTENSIONS], path)
-	    > 0) {
+	if (match_config_pattern(conn, LUA_SCRIPT_EXTENSIONS, path) > 0) {
 		if (is_in_script_path(conn, path)) {
 			/* Lua in-server module script: a CGI like script used to
 			 * generate the entire reply. */
@@ -14538,9 +17520,7 @@ handle_file_based_request(struct mg_connection *conn,
 #endif
 
 #if defined(USE_DUKTAPE)
-	if (match_prefix_strlen(conn->dom_ctx->config[DUKTAPE_SCRIPT_EXTENSIONS],
-	                        path)
-	    > 0) {
+	if (match_config_pattern(conn, DUKTAPE_SCRIPT_EXTENSIONS, path) > 0) {
 		if (is_in_script_path(conn, path)) {
 			/* Call duktape to generate the page */
 			mg_exec_duktape_script(conn, path);
@@ -14557,9 +17537,8 @@ handle_file_based_request(struct mg_connection *conn,
 	max = PUT_DELETE_PASSWORDS_FILE - CGI_EXTENSIONS;
 	for (cgi_config_idx = 0; cgi_config_idx < max; cgi_config_idx += inc) {
 		if (conn->dom_ctx->config[CGI_EXTENSIONS + cgi_config_idx] != NULL) {
-			if (match_prefix_strlen(
-			        conn->dom_ctx->config[CGI_EXTENSIONS + cgi_config_idx],
-			        path)
+			if (match_config_pattern(
+			        conn, CGI_EXTENSIONS + cgi_config_idx, path)
 			    > 0) {
 				if (is_in_script_path(conn, path)) {
 					/* CGI scripts may support all HTTP methods */
@@ -14574,7 +17553,7 @@ handle_file_based_request(struct mg_connection *conn,
 	}
 #endif /* !NO_CGI */
 
-	if (match_prefix_strlen(conn->dom_ctx->config[SSI_EXTENSIONS], path) > 0) {
+	if (match_config_pattern(conn, SSI_EXTENSIONS, path) > 0) {
 		if (is_in_script_path(conn, path)) {
 			handle_ssi_file_request(conn, path, file);
 		} else {
@@ -14625,6 +17604,22 @@ close_all_listening_sockets(struct mg_context *ctx)
 	ctx->listening_sockets = NULL;
 	mg_free(ctx->listening_socket_fds);
 	ctx->listening_socket_fds = NULL;
+
+#if defined(USE_REUSEPORT_ACCEPTORS)
+	if (ctx->acceptors != NULL) {
+		unsigned int a;
+		for (a = 0; a + 1 < ctx->cfg_acceptor_threads; a++) {
+			struct mg_acceptor *acc = &ctx->acceptors[a];
+			for (i = 0; i < acc->num_socks; i++) {
+				closesocket(acc->socks[i].sock);
+			}
+			mg_free(acc->socks);
+			mg_free(acc->pfd);
+		}
+		mg_free(ctx->acceptors);
+		ctx->acceptors = NULL;
+	}
+#endif
 }
 
 
@@ -14860,6 +17855,111 @@ is_ssl_port_used(const char *ports)
 }
 
 
+#if defined(USE_REUSEPORT_ACCEPTORS)
+/* Open a SO_REUSEPORT twin of the listening socket "so" for every
+ * additional acceptor thread. Errors are logged, but not fatal, since the
+ * kernel will only distribute connections among the existing twins. */
+static void
+add_reuseport_twins(struct mg_context *phys_ctx,
+                    const struct socket *so,
+                    int ip_version,
+                    int backlog,
+                    int entry)
+{
+	unsigned int a;
+	int on = 1;
+#if defined(USE_IPV6)
+	int v6only = (ip_version == 6);
+#endif
+	socklen_t len = sizeof(so->lsa.sin);
+	struct socket twin;
+	struct socket *ptr;
+	struct mg_pollfd *pfd;
+	struct mg_acceptor *acc;
+
+#if defined(USE_IPV6)
+	if (so->lsa.sa.sa_family == AF_INET6) {
+		len = sizeof(so->lsa.sin6);
+	}
+#else
+	(void)ip_version;
+#endif
+
+	for (a = 0; (a + 1) < phys_ctx->cfg_acceptor_threads; a++) {
+		acc = &phys_ctx->acceptors[a];
+		twin = *so;
+		twin.sock = socket(so->lsa.sa.sa_family, SOCK_STREAM, /* TCP */ 6);
+		if (twin.sock == INVALID_SOCKET) {
+			mg_cry_ctx_internal(phys_ctx,
+			                    "cannot create socket (entry %i, acceptor %u)",
+			                    entry,
+			                    acc->index);
+			continue;
+		}
+
+		if ((setsockopt(twin.sock,
+		                SOL_SOCKET,
+		                SO_REUSEADDR,
+		                (SOCK_OPT_TYPE)&on,
+		                sizeof(on))
+		     != 0)
+		    || (setsockopt(twin.sock,
+		                   SOL_SOCKET,
+		                   SO_REUSEPORT,
+		                   (SOCK_OPT_TYPE)&on,
+		                   sizeof(on))
+		        != 0)
+#if defined(USE_IPV6)
+		    || ((so->lsa.sa.sa_family == AF_INET6)
+		        && (setsockopt(twin.sock,
+		                       IPPROTO_IPV6,
+		                       IPV6_V6ONLY,
+		                       (void *)&v6only,
+		                       sizeof(v6only))
+		            != 0))
+#endif
+		    || (bind(twin.sock, &twin.lsa.sa, len) != 0)
+		    || (listen(twin.sock, backlog) != 0)) {
+			mg_cry_ctx_internal(phys_ctx,
+			                    "cannot listen (entry %i, acceptor %u): %d (%s)",
+			                    entry,
+			                    acc->index,
+			                    (int)ERRNO,
+			                    strerror(errno));
+			closesocket(twin.sock);
+			continue;
+		}
+
+		if ((ptr = (struct socket *)
+		         mg_realloc_ctx(acc->socks,
+		                        (acc->num_socks + 1) * sizeof(acc->socks[0]),
+		                        phys_ctx))
+		    == NULL) {
+			mg_cry_ctx_internal(phys_ctx, "%s", "Out of memory");
+			closesocket(twin.sock);
+			continue;
+		}
+		acc->socks = ptr;
+
+		if ((pfd = (struct mg_pollfd *)
+		         mg_realloc_ctx(acc->pfd,
+		                        (acc->num_socks + 1) * sizeof(acc->pfd[0]),
+		                        phys_ctx))
+		    == NULL) {
+			mg_cry_ctx_internal(phys_ctx, "%s", "Out of memory");
+			closesocket(twin.sock);
+			continue;
+		}
+		acc->pfd = pfd;
+
+		set_close_on_exec(twin.sock, NULL, phys_ctx);
+		acc->socks[acc->num_socks] = twin;
+		acc->num_socks++;
+	}
+}
+#endif
+
+
 static int
 set_ports_option(struct mg_context *phys_ctx)
 {
@@ -14891,6 +17991,24 @@ set_ports_option(struct mg_context *phys_ctx)
 	len = sizeof(usa);
 	list = phys_ctx->dd.config[LISTENING_PORTS];
 
+#if defined(USE_REUSEPORT_ACCEPTORS)
+	if ((phys_ctx->cfg_acceptor_threads > 1) && (phys_ctx->acceptors == NULL)) {
+		unsigned int a;
+		phys_ctx->acceptors = (struct mg_acceptor *)
+		    mg_calloc_ctx(phys_ctx->cfg_acceptor_threads - 1,
+		                  sizeof(phys_ctx->acceptors[0]),
+		                  phys_ctx);
+		if (phys_ctx->acceptors == NULL) {
+			mg_cry_ctx_internal(phys_ctx, "%s", "Out of memory");
+			return 0;
+		}
+		for (a = 0; (a + 1) < phys_ctx->cfg_acceptor_threads; a++) {
+			phys_ctx->acceptors[a].ctx = phys_ctx;
+			phys_ctx->acceptors[a].index = a + 1;
+		}
+	}
+#endif
+
 	while ((list = next_option(list, &vec, NULL)) != NULL) {
 
 		portsTotal++;
@@ -14970,6 +18088,24 @@ set_ports_option(struct mg_context *phys_ctx)
 		}
 #endif
 
+#if defined(USE_REUSEPORT_ACCEPTORS)
+		/* All acceptor threads listen to the same port */
+		if ((phys_ctx->acceptors != NULL) && (ip_version != 99)
+		    && (setsockopt(so.sock,
+		                   SOL_SOCKET,
+		                   SO_REUSEPORT,
+		                   (SOCK_OPT_TYPE)&on,
+		                   sizeof(on))
+		        != 0)) {
+
+			/* Don't abort, but there will be no twins for this port. */
+			mg_cry_ctx_internal(
+			    phys_ctx,
+			    "cannot set socket option SO_REUSEPORT (entry %i)",
+			    portsTotal);
+		}
+#endif
+
 #if defined(USE_X_DOM_SOCKET)
 		if (ip_version == 99) {
 			/* Unix domain socket */
@@ -15139,9 +18275,11 @@ set_ports_option(struct mg_context *phys_ctx)
 			continue;
 		}
 
+		/* One spare entry at the end is used by the master thread to
+		 * poll the keep-alive reactor. */
 		if ((pfd = (struct mg_pollfd *)
 		         mg_realloc_ctx(phys_ctx->listening_socket_fds,
-		                        (phys_ctx->num_listening_sockets + 1)
+		                        (phys_ctx->num_listening_sockets + 2)
 		                            * sizeof(phys_ctx->listening_socket_fds[0]),
 		                        phys_ctx))
 		    == NULL) {
@@ -15159,6 +18297,13 @@ set_ports_option(struct mg_context *phys_ctx)
 		phys_ctx->listening_socket_fds = pfd;
 		phys_ctx->num_listening_sockets++;
 		portsOk++;
+
+#if defined(USE_REUSEPORT_ACCEPTORS)
+		if ((phys_ctx->acceptors != NULL) && (ip_version != 99)) {
+			add_reuseport_twins(
+			    phys_ctx, &so, ip_version, (int)opt_listen_backlog, portsTotal);
+		}
+#endif
 	}
 
 	if (portsOk != portsTotal) {
@@ -15193,7 +18338,6 @@ log_access(const struct mg_connection *conn)
 	const struct mg_request_info *ri;
 	struct mg_file fi;
 	char date[64], src_addr[IP_ADDR_STR_LEN];
-	struct tm *tm;
 
 	const char *referer;
 	const char *user_agent;
@@ -15271,13 +18415,7 @@ log_access(const struct mg_connection *conn)
 
 	/* If we did not get a log message from Lua, create it here. */
 	if (!log_buf[0]) {
-		tm = localtime(&conn->conn_birth_time);
-		if (tm != NULL) {
-			strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", tm);
-		} else {
-			mg_strlcpy(date, "01/Jan/1970:00:00:00 +0000", sizeof(date));
-			date[sizeof(date) - 1] = '\0';
-		}
+		log_time_string(date, sizeof(date), conn->conn_birth_time);
 
 		ri = &conn->request_info;
 
@@ -15342,43 +18480,17 @@ log_access(const struct mg_connection *conn)
 #endif /* Externally provided function */
 
 
-/* Verify given socket address against the ACL.
- * Return -1 if ACL is malformed, 0 if address is disallowed, 1 if allowed.
+/* Access control list and limits per client address */
+#include "client_limits.inl"
+
+
+/* Verify given socket address against the ACL compiled by set_acl_option.
+ * Return 0 if address is disallowed, 1 if allowed.
  */
 static int
-check_acl(struct mg_context *phys_ctx, const union usa *sa)
+check_acl(const struct mg_context *phys_ctx, const union usa *sa)
 {
-	int allowed, flag, matched;
-	struct vec vec;
-
-	if (phys_ctx) {
-		const char *list = phys_ctx->dd.config[ACCESS_CONTROL_LIST];
-
-		/* If any ACL is set, deny by default */
-		allowed = (list == NULL) ? '+' : '-';
-
-		while ((list = next_option(list, &vec, NULL)) != NULL) {
-			flag = vec.ptr[0];
-			matched = -1;
-			if ((vec.len > 0) && ((flag == '+') || (flag == '-'))) {
-				vec.ptr++;
-				vec.len--;
-				matched = parse_match_net(&vec, sa, 1);
-			}
-			if (matched < 0) {
-				mg_cry_ctx_internal(phys_ctx,
-				                    "%s: subnet must be [+|-]IP-addr[/x]",
-				                    __func__);
-				return -1;
-			}
-			if (matched) {
-				allowed = flag;
-			}
-		}
-
-		return allowed == '+';
-	}
-	return -1;
+	return (phys_ctx->acl == NULL) || acl_check(phys_ctx->acl, sa);
 }
 
 
@@ -15585,9 +18697,10 @@ sslize(struct mg_connection *conn,
 		return 0;
 	}
 
-	short_trust =
-	    (conn->dom_ctx->config[SSL_SHORT_TRUST] != NULL)
-	    && (mg_strcasecmp(conn->dom_ctx->config[SSL_SHORT_TRUST], "yes") == 0);
+#if defined(USE_KTLS)
+	conn->ssl_ktls_send = 0;
+#endif
+	short_trust = conn->dom_ctx->cfg.ssl_short_trust;
 
 	if (short_trust) {
 		int trust_ret = refresh_trust(conn);
@@ -15622,10 +18735,10 @@ sslize(struct mg_connection *conn,
 	}
 
 	/* Reuse the request timeout for the SSL_Accept/SSL_connect timeout  */
-	if (conn->dom_ctx->config[REQUEST_TIMEOUT]) {
+	if (conn->dom_ctx->cfg.has_request_timeout) {
 		/* NOTE: The loop below acts as a back-off, so we can end
 		 * up sleeping for more (or less) than the REQUEST_TIMEOUT. */
-		int to = atoi(conn->dom_ctx->config[REQUEST_TIMEOUT]);
+		int to = conn->dom_ctx->cfg.request_timeout_ms;
 		if (to >= 0) {
 			timeout = (unsigned)to;
 		}
@@ -15696,6 +18809,17 @@ sslize(struct mg_connection *conn,
 		return 0;
 	}
 
+#if defined(USE_KTLS)
+	/* The kernel takes over encryption, if the negotiated cipher is
+	 * supported by the kernel TLS module. */
+#if !defined(NO_SSL_DL)
+	if (!tls_feature_missing[TLS_KTLS])
+#endif
+	{
+		conn->ssl_ktls_send = BIO_get_ktls_send(SSL_get_wbio(conn->ssl));
+	}
+#endif
+
 	return 1;
 }
 
@@ -16412,6 +19536,18 @@ init_ssl_ctx_impl(struct mg_context *phys_ctx,
 	SSL_CTX_set_options(dom_ctx->ssl_ctx, SSL_OP_NO_RENEGOTIATION);
 #endif
 
+#if defined(USE_KTLS)
+	/* Use kernel TLS for sendfile. OpenSSL falls back to user space
+	 * encryption, if the kernel or the cipher does not support it. */
+	if (config_is_yes(phys_ctx->dd.config[ALLOW_SENDFILE_CALL])
+#if !defined(NO_SSL_DL)
+	    && !tls_feature_missing[TLS_KTLS]
+#endif
+	) {
+		SSL_CTX_set_options(dom_ctx->ssl_ctx, SSL_OP_ENABLE_KTLS);
+	}
+#endif
+
 #if !defined(NO_SSL_DL)
 	SSL_CTX_set_ecdh_auto(dom_ctx->ssl_ctx, 1);
 #endif /* NO_SSL_DL */
@@ -16779,14 +19915,18 @@ set_gpass_option(struct mg_context *phys_ctx, struct mg_domain_context *dom_ctx)
 static int
 set_acl_option(struct mg_context *phys_ctx)
 {
-	union usa sa;
-	memset(&sa, 0, sizeof(sa));
-#if defined(USE_IPV6)
-	sa.sin6.sin6_family = AF_INET6;
-#else
-	sa.sin.sin_family = AF_INET;
-#endif
-	return check_acl(phys_ctx, &sa) != -1;
+	const char *list = phys_ctx->dd.config[ACCESS_CONTROL_LIST];
+	const char *error = NULL;
+
+	if (list == NULL) {
+		return 1;
+	}
+	phys_ctx->acl = acl_create(list, &error);
+	if (phys_ctx->acl == NULL) {
+		mg_cry_ctx_internal(phys_ctx, "%s: %s", __func__, error);
+		return 0;
+	}
+	return 1;
 }
 
 
@@ -16806,8 +19946,9 @@ reset_per_request_attributes(struct mg_connection *conn)
 	conn->must_close = 0;
 	conn->request_len = 0;
 	conn->request_state = 0;
-	conn->throttle = 0;
+	conn->throttle = NULL;
 	conn->accept_gzip = 0;
+	conn->accept_encodings[0] = MG_ENCODING_IDENTITY;
 
 	conn->response_info.content_length = conn->request_info.content_length = -1;
 	conn->response_info.http_version = conn->request_info.http_version = NULL;
@@ -16868,7 +20009,7 @@ close_socket_gracefully(struct mg_connection *conn)
 #endif
 	struct linger linger;
 	int error_code = 0;
-	int linger_timeout = -2;
+	int linger_timeout;
 	socklen_t opt_len = sizeof(error_code);
 
 	if (!conn) {
@@ -16896,9 +20037,8 @@ close_socket_gracefully(struct mg_connection *conn)
 	} while (n > 0);
 #endif
 
-	if (conn->dom_ctx->config[LINGER_TIMEOUT]) {
-		linger_timeout = atoi(conn->dom_ctx->config[LINGER_TIMEOUT]);
-	}
+	/* -2 if not configured */
+	linger_timeout = conn->dom_ctx->cfg.linger_timeout_ms;
 
 	/* Set linger option according to configuration */
 	if (linger_timeout >= 0) {
@@ -16987,6 +20127,20 @@ close_socket_gracefully(struct mg_connection *conn)
 static void
 close_connection(struct mg_connection *conn)
 {
+#if defined(USE_WEBSOCKET_REACTOR)
+	if (conn->ws_detached) {
+		/* The socket and the user connection data belong to the copy
+		 * owned by the reactor, it calls the callbacks when it closes the
+		 * connection */
+		conn->ws_detached = 0;
+		conn->must_close = 1;
+#if defined(USE_SERVER_STATS)
+		conn->conn_state = 8; /* closed */
+#endif
+		return;
+	}
+#endif
+
 #if defined(USE_SERVER_STATS)
 	conn->conn_state = 6; /* to close */
 #endif
@@ -17000,6 +20154,16 @@ close_connection(struct mg_connection *conn)
 
 	mg_lock_connection(conn);
 
+#if defined(USE_WEBSOCKET)
+	/* Frames not sent yet are lost */
+	ws_send_queue_free(conn);
+#endif
+
+	/* Send data still waiting in the output buffer */
+	(void)set_output_buffering(conn, 0);
+	mg_free(conn->out_buf);
+	conn->out_buf = NULL;
+
 	/* Set close flag, so keep-alive loops will stop */
 	conn->must_close = 1;
 
@@ -17036,6 +20200,7 @@ close_connection(struct mg_connection *conn)
 	}
 #endif
 	if (conn->client.sock != INVALID_SOCKET) {
+		client_limits_close(conn);
 #if defined(__ZEPHYR__)
 		closesocket(conn->client.sock);
 #else
@@ -17043,6 +20208,9 @@ close_connection(struct mg_connection *conn)
 #endif
 		conn->client.sock = INVALID_SOCKET;
 	}
+#if defined(__linux__)
+	conn->tcp_corked = 0;
+#endif
 
 	/* call the connection_closed callback if assigned */
 	if (conn->phys_ctx->callbacks.connection_closed != NULL) {
@@ -17171,6 +20339,7 @@ mg_connect_client_impl(const struct mg_client_options *client_options,
 	conn->buf_size = (int)max_req_size;
 	conn->phys_ctx->context_type = CONTEXT_HTTP_CLIENT;
 	conn->dom_ctx = &(conn->phys_ctx->dd);
+	init_domain_config(conn->dom_ctx);
 
 	if (!connect_socket(conn->phys_ctx,
 	                    client_options->host,
@@ -17540,8 +20709,7 @@ get_rel_url_at_current_server(const char *uri, const struct mg_connection *conn)
 	const char *portbegin;
 	char *portend;
 
-	auth_domain_check_enabled =
-	    !mg_strcasecmp(conn->dom_ctx->config[ENABLE_AUTH_DOMAIN_CHECK], "yes");
+	auth_domain_check_enabled = conn->dom_ctx->cfg.enable_auth_domain_check;
 
 	/* DNS is case insensitive, so use case insensitive string compare here
 	 */
@@ -17891,9 +21059,8 @@ mg_get_response(struct mg_connection *conn,
                 int timeout)
 {
 	int err, ret;
-	char txt[32]; /* will not overflow */
-	char *save_timeout;
-	char *new_timeout;
+	int save_timeout_ms;
+	unsigned char save_has_timeout;
 
 	if (ebuf_len > 0) {
 		ebuf[0] = '\0';
@@ -17913,18 +21080,21 @@ mg_get_response(struct mg_connection *conn,
 	conn->data_len = 0;
 
 	/* Implementation of API function for HTTP clients */
-	save_timeout = conn->dom_ctx->config[REQUEST_TIMEOUT];
+	save_timeout_ms = conn->dom_ctx->cfg.request_timeout_ms;
+	save_has_timeout = conn->dom_ctx->cfg.has_request_timeout;
 
 	if (timeout >= 0) {
-		mg_snprintf(conn, NULL, txt, sizeof(txt), "%i", timeout);
-		new_timeout = txt;
+		conn->dom_ctx->cfg.request_timeout_ms = timeout;
+		conn->dom_ctx->cfg.has_request_timeout = 1;
 	} else {
-		new_timeout = NULL;
+		conn->dom_ctx->cfg.request_timeout_ms =
+		    atoi(config_options[REQUEST_TIMEOUT].default_value);
+		conn->dom_ctx->cfg.has_request_timeout = 0;
 	}
 
-	conn->dom_ctx->config[REQUEST_TIMEOUT] = new_timeout;
 	ret = get_response(conn, ebuf, ebuf_len, &err);
-	conn->dom_ctx->config[REQUEST_TIMEOUT] = save_timeout;
+	conn->dom_ctx->cfg.request_timeout_ms = save_timeout_ms;
+	conn->dom_ctx->cfg.has_request_timeout = save_has_timeout;
 
 #if defined(MG_LEGACY_INTERFACE)
 	/* TODO: 1) uri is deprecated;
@@ -18395,8 +21565,7 @@ static void
 init_connection(struct mg_connection *conn)
 {
 	/* Is keep alive allowed by the server */
-	int keep_alive_enabled =
-	    !mg_strcasecmp(conn->dom_ctx->config[ENABLE_KEEP_ALIVE], "yes");
+	int keep_alive_enabled = conn->dom_ctx->cfg.enable_keep_alive;
 
 	if (!keep_alive_enabled) {
 		conn->must_close = 1;
@@ -18429,6 +21598,11 @@ init_connection(struct mg_connection *conn)
  * Must be called with a valid connection (conn  and
  * conn->phys_ctx must be valid).
  */
+#if defined(USE_KEEP_ALIVE_PARKING)
+static int park_connection(struct mg_connection *conn);
+#endif
+
+
 static void
 process_new_connection(struct mg_connection *conn)
 {
@@ -18437,10 +21611,15 @@ process_new_connection(struct mg_connection *conn)
 	char ebuf[100];
 	const char *hostend;
 	int reqerr, uri_type;
+	int parked = 0;
 
 #if defined(USE_SERVER_STATS)
+	int handled_before = conn->handled_requests;
 	ptrdiff_t mcon = mg_atomic_inc(&(conn->phys_ctx->active_connections));
-	mg_atomic_add(&(conn->phys_ctx->total_connections), 1);
+	if (handled_before == 0) {
+		/* Connections resumed from the keep-alive reactor are not new */
+		mg_atomic_add(&(conn->phys_ctx->total_connections), 1);
+	}
 	mg_atomic_max(&(conn->phys_ctx->max_active_connections), mcon);
 #endif
 
@@ -18476,6 +21655,16 @@ process_new_connection(struct mg_connection *conn)
 			            "Bad HTTP version: [%s]",
 			            ri->http_version);
 			mg_send_http_error(conn, 505, "%s", ebuf);
+
+		} else if (!client_limits_request(conn)) {
+			/* max_request_rate_per_ip exceeded */
+			mg_snprintf(conn,
+			            NULL, /* No truncation check for ebuf */
+			            ebuf,
+			            sizeof(ebuf),
+			            "%s",
+			            "Too many requests");
+			mg_send_http_error(conn, 429, "%s", ebuf);
 		}
 
 		if (ebuf[0] == '\0') {
@@ -18609,21 +21798,70 @@ process_new_connection(struct mg_connection *conn)
 			break;
 		}
 		conn->handled_requests++;
-	} while (keep_alive);
 
-	DEBUG_TRACE("Done processing connection from %s (%f sec)",
-	            conn->request_info.remote_addr,
-	            difftime(time(NULL), conn->conn_birth_time));
+#if defined(USE_KEEP_ALIVE_PARKING)
+		/* Do not block this worker thread while waiting for the next
+		 * request, if the connection can be parked in the reactor of
+		 * the master thread. */
+		if (keep_alive && park_connection(conn)) {
+			parked = 1;
+			break;
+		}
+#endif
+	} while (keep_alive);
 
-	close_connection(conn);
+	if (parked) {
+		DEBUG_TRACE("Parked idle connection from %s",
+		            conn->request_info.remote_addr);
+	} else {
+#if defined(USE_WEBSOCKET_REACTOR)
+		if (conn->ws_detached) {
+			/* The websocket reactor owns the connection now */
+			DEBUG_TRACE("Moved websocket from %s to the reactor",
+			            conn->request_info.remote_addr);
+		} else
+#endif
+		{
+			DEBUG_TRACE("Done processing connection from %s (%f sec)",
+			            conn->request_info.remote_addr,
+			            difftime(time(NULL), conn->conn_birth_time));
+		}
+		close_connection(conn);
+	}
 
 #if defined(USE_SERVER_STATS)
-	mg_atomic_add(&(conn->phys_ctx->total_requests), conn->handled_requests);
+	mg_atomic_add(&(conn->phys_ctx->total_requests),
+	              conn->handled_requests - handled_before);
 	mg_atomic_dec(&(conn->phys_ctx->active_connections));
 #endif
 }
 
 
+#if defined(USE_KEEP_ALIVE_PARKING)
+static void close_parked_socket(struct mg_context *ctx,
+                                struct mg_parked_conn *pc);
+#endif
+
+
+/* Close a socket that cannot be handled anymore, since the server is
+ * stopping. A parked keep-alive connection is closed like all other
+ * parked connections, including the connection_close(d) callbacks. */
+static void
+discard_socket(struct mg_context *ctx, const struct socket *sp)
+{
+#if defined(USE_KEEP_ALIVE_PARKING)
+	if (sp->parked != NULL) {
+		close_parked_socket(ctx, sp->parked);
+		return;
+	}
+#else
+	(void)ctx;
+#endif
+	set_blocking_mode(sp->sock);
+	closesocket(sp->sock);
+}
+
+
 #if defined(ALTERNATIVE_QUEUE)
 
 static void
@@ -18651,8 +21889,7 @@ produce_socket(struct mg_context *ctx, const struct socket *sp)
 		mg_sleep(1);
 	}
 	/* must consume */
-	set_blocking_mode(sp->sock);
-	closesocket(sp->sock);
+	discard_socket(ctx, sp);
 }
 
 
@@ -18672,8 +21909,7 @@ consume_socket(struct mg_context *ctx, struct socket *sp, int thread_index)
 		(void)pthread_mutex_unlock(&ctx->thread_mutex);
 		if (sp->in_use == 1) {
 			/* must consume */
-			set_blocking_mode(sp->sock);
-			closesocket(sp->sock);
+			discard_socket(ctx, sp);
 		}
 		return 0;
 	}
@@ -18687,12 +21923,195 @@ consume_socket(struct mg_context *ctx, struct socket *sp, int thread_index)
 	return 0;
 }
 
+#elif defined(LOCKFREE_QUEUE)
+
+/* Bounded multi-producer multi-consumer queue (after D. Vyukov).
+ * Every cell carries a sequence number: The cell is free for the producer
+ * of position pos, if its sequence number is pos, and it holds the socket
+ * for the consumer of position pos, if its sequence number is pos + 1.
+ * Positions are claimed by a compare-and-swap, cells are handed over by
+ * advancing their sequence number. sq_size is a power of two. */
+static int
+sq_try_push(struct mg_context *ctx, const struct socket *sp)
+{
+	ptrdiff_t mask = (ptrdiff_t)ctx->sq_size - 1;
+	ptrdiff_t pos = ctx->sq_enqueue_pos;
+	ptrdiff_t prev, diff;
+	struct mg_queue_cell *cell;
+
+	for (;;) {
+		cell = &ctx->sq_cells[pos & mask];
+		diff = mg_atomic_add(&cell->seq, 0) - pos;
+		if (diff == 0) {
+			prev =
+			    mg_atomic_compare_and_swap(&ctx->sq_enqueue_pos, pos, pos + 1);
+			if (prev == pos) {
+				break;
+			}
+			pos = prev;
+		} else if (diff < 0) {
+			/* Cell not consumed yet: queue is full */
+			return 0;
+		} else {
+			/* Another producer took this position */
+			pos = ctx->sq_enqueue_pos;
+		}
+	}
+
+	cell->sock = *sp;
+	mg_atomic_add(&cell->seq, 1);
+	return 1;
+}
+
+
+static int
+sq_try_pop(struct mg_context *ctx, struct socket *sp)
+{
+	ptrdiff_t mask = (ptrdiff_t)ctx->sq_size - 1;
+	ptrdiff_t pos = ctx->sq_dequeue_pos;
+	ptrdiff_t prev, diff;
+	struct mg_queue_cell *cell;
+
+	for (;;) {
+		cell = &ctx->sq_cells[pos & mask];
+		diff = mg_atomic_add(&cell->seq, 0) - (pos + 1);
+		if (diff == 0) {
+			prev =
+			    mg_atomic_compare_and_swap(&ctx->sq_dequeue_pos, pos, pos + 1);
+			if (prev == pos) {
+				break;
+			}
+			pos = prev;
+		} else if (diff < 0) {
+			/* Cell not produced yet: queue is empty */
+			return 0;
+		} else {
+			/* Another consumer took this position */
+			pos = ctx->sq_dequeue_pos;
+		}
+	}
+
+	*sp = cell->sock;
+	/* Free the cell for the producer of position pos + sq_size */
+	mg_atomic_add(&cell->seq, mask);
+	return 1;
+}
+
+
+/* Worker threads take accepted socket from the queue */
+static int
+consume_socket(struct mg_context *ctx, struct socket *sp, int thread_index)
+{
+#if defined(USE_SERVER_STATS)
+	uint64_t wait_start;
+#endif
+	(void)thread_index;
+
+	DEBUG_TRACE("%s", "going idle");
+
+	while (!sq_try_pop(ctx, sp)) {
+		if (!STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+			return 0;
+		}
+
+		/* The queue is empty: sleep until the producer signals sq_full.
+		 * Announce the sleeper before checking the queue once more, so
+		 * a producer either sees the sleeper or we see its socket. */
+		(void)pthread_mutex_lock(&ctx->thread_mutex);
+		mg_atomic_inc(&ctx->sq_sleeping_consumers);
+		if ((ctx->sq_enqueue_pos == ctx->sq_dequeue_pos)
+		    && STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+#if defined(USE_SERVER_STATS)
+			mg_atomic_inc(&ctx->sq_consumer_waits);
+			wait_start = mg_get_current_time_ns();
+#endif
+			pthread_cond_wait(&ctx->sq_full, &ctx->thread_mutex);
+#if defined(USE_SERVER_STATS)
+			mg_atomic_add64(&ctx->sq_consumer_wait_time,
+			                (int64_t)(mg_get_current_time_ns() - wait_start));
+#endif
+		}
+		mg_atomic_dec(&ctx->sq_sleeping_consumers);
+		(void)pthread_mutex_unlock(&ctx->thread_mutex);
+	}
+
+	DEBUG_TRACE("grabbed socket %d, going busy", sp->sock);
+
+	if (ctx->sq_sleeping_producers > 0) {
+		(void)pthread_mutex_lock(&ctx->thread_mutex);
+		(void)pthread_cond_signal(&ctx->sq_empty);
+		(void)pthread_mutex_unlock(&ctx->thread_mutex);
+	}
+
+	if (!STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		/* must consume */
+		discard_socket(ctx, sp);
+		return 0;
+	}
+	return 1;
+}
+
+
+/* Master thread adds accepted socket to a queue */
+static void
+produce_socket(struct mg_context *ctx, const struct socket *sp)
+{
+#if defined(USE_SERVER_STATS)
+	uint64_t wait_start;
+#endif
+
+	while (!sq_try_push(ctx, sp)) {
+		if (!STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+			/* must consume */
+			discard_socket(ctx, sp);
+			return;
+		}
+
+		/* The queue is full: wait until a consumer signals sq_empty */
+		(void)pthread_mutex_lock(&ctx->thread_mutex);
+		mg_atomic_inc(&ctx->sq_sleeping_producers);
+		if (((ctx->sq_enqueue_pos - ctx->sq_dequeue_pos) >= ctx->sq_size)
+		    && STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+			ctx->sq_blocked = 1; /* Status information: All threads busy */
+#if defined(USE_SERVER_STATS)
+			mg_atomic_max(&ctx->sq_max_fill, ctx->sq_size);
+			mg_atomic_inc(&ctx->sq_producer_waits);
+			wait_start = mg_get_current_time_ns();
+#endif
+			(void)pthread_cond_wait(&ctx->sq_empty, &ctx->thread_mutex);
+#if defined(USE_SERVER_STATS)
+			mg_atomic_add64(&ctx->sq_producer_wait_time,
+			                (int64_t)(mg_get_current_time_ns() - wait_start));
+#endif
+			ctx->sq_blocked = 0; /* Not blocked now */
+		}
+		mg_atomic_dec(&ctx->sq_sleeping_producers);
+		(void)pthread_mutex_unlock(&ctx->thread_mutex);
+	}
+
+	DEBUG_TRACE("queued socket %d", sp->sock);
+#if defined(USE_SERVER_STATS)
+	mg_atomic_max(&ctx->sq_max_fill,
+	              ctx->sq_enqueue_pos - ctx->sq_dequeue_pos);
+#endif
+
+	/* Only wake up a worker thread, if there is one sleeping */
+	if (ctx->sq_sleeping_consumers > 0) {
+		(void)pthread_mutex_lock(&ctx->thread_mutex);
+		(void)pthread_cond_signal(&ctx->sq_full);
+		(void)pthread_mutex_unlock(&ctx->thread_mutex);
+	}
+}
+
 #else /* ALTERNATIVE_QUEUE */
 
 /* Worker threads take accepted socket from the queue */
 static int
 consume_socket(struct mg_context *ctx, struct socket *sp, int thread_index)
 {
+#if defined(USE_SERVER_STATS)
+	uint64_t wait_start;
+#endif
 	(void)thread_index;
 
 	(void)pthread_mutex_lock(&ctx->thread_mutex);
@@ -18701,7 +22120,15 @@ consume_socket(struct mg_context *ctx, struct socket *sp, int thread_index)
 	/* If the queue is empty, wait. We're idle at this point. */
 	while ((ctx->sq_head == ctx->sq_tail)
 	       && (STOP_FLAG_IS_ZERO(&ctx->stop_flag))) {
+#if defined(USE_SERVER_STATS)
+		mg_atomic_inc(&ctx->sq_consumer_waits);
+		wait_start = mg_get_current_time_ns();
+#endif
 		pthread_cond_wait(&ctx->sq_full, &ctx->thread_mutex);
+#if defined(USE_SERVER_STATS)
+		mg_atomic_add64(&ctx->sq_consumer_wait_time,
+		                (int64_t)(mg_get_current_time_ns() - wait_start));
+#endif
 	}
 
 	/* If we're stopping, sq_head may be equal to sq_tail. */
@@ -18717,6 +22144,13 @@ consume_socket(struct mg_context *ctx, struct socket *sp, int thread_index)
 			ctx->sq_tail -= ctx->sq_size;
 			ctx->sq_head -= ctx->sq_size;
 		}
+		if (!STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+			/* must consume */
+			(void)pthread_cond_signal(&ctx->sq_empty);
+			(void)pthread_mutex_unlock(&ctx->thread_mutex);
+			discard_socket(ctx, sp);
+			return 0;
+		}
 	}
 
 	(void)pthread_cond_signal(&ctx->sq_empty);
@@ -18726,48 +22160,293 @@ consume_socket(struct mg_context *ctx, struct socket *sp, int thread_index)
 }
 
 
-/* Master thread adds accepted socket to a queue */
+/* Master thread adds accepted socket to a queue */
+static void
+produce_socket(struct mg_context *ctx, const struct socket *sp)
+{
+	int queue_filled;
+	int queued = 0;
+#if defined(USE_SERVER_STATS)
+	uint64_t wait_start;
+#endif
+
+	(void)pthread_mutex_lock(&ctx->thread_mutex);
+
+	queue_filled = ctx->sq_head - ctx->sq_tail;
+
+	/* If the queue is full, wait */
+	while (STOP_FLAG_IS_ZERO(&ctx->stop_flag)
+	       && (queue_filled >= ctx->sq_size)) {
+		ctx->sq_blocked = 1; /* Status information: All threads busy */
+#if defined(USE_SERVER_STATS)
+		if (queue_filled > ctx->sq_max_fill) {
+			ctx->sq_max_fill = queue_filled;
+		}
+		mg_atomic_inc(&ctx->sq_producer_waits);
+		wait_start = mg_get_current_time_ns();
+#endif
+		(void)pthread_cond_wait(&ctx->sq_empty, &ctx->thread_mutex);
+#if defined(USE_SERVER_STATS)
+		mg_atomic_add64(&ctx->sq_producer_wait_time,
+		                (int64_t)(mg_get_current_time_ns() - wait_start));
+#endif
+		ctx->sq_blocked = 0; /* Not blocked now */
+		queue_filled = ctx->sq_head - ctx->sq_tail;
+	}
+
+	if (queue_filled < ctx->sq_size) {
+		/* Copy socket to the queue and increment head */
+		ctx->squeue[ctx->sq_head % ctx->sq_size] = *sp;
+		ctx->sq_head++;
+		queued = 1;
+		DEBUG_TRACE("queued socket %d", sp ? sp->sock : -1);
+	}
+
+	queue_filled = ctx->sq_head - ctx->sq_tail;
+#if defined(USE_SERVER_STATS)
+	if (queue_filled > ctx->sq_max_fill) {
+		ctx->sq_max_fill = queue_filled;
+	}
+#endif
+
+	(void)pthread_cond_signal(&ctx->sq_full);
+	(void)pthread_mutex_unlock(&ctx->thread_mutex);
+
+	if (!queued) {
+		/* must consume */
+		discard_socket(ctx, sp);
+	}
+}
+#endif /* ALTERNATIVE_QUEUE */
+
+
+#if defined(USE_KEEP_ALIVE_PARKING)
+/* Hand an idle keep-alive connection over to the reactor of the master
+ * thread, instead of blocking the worker thread until the next request
+ * arrives or keep_alive_timeout_ms elapses. Only plain HTTP connections
+ * without any buffered data are parked.
+ * Returns 1 if the connection has been parked. In this case, the socket
+ * and the user connection data are no longer owned by conn. */
+static int
+park_connection(struct mg_connection *conn)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+	struct mg_parked_conn *pc;
+	struct epoll_event ev;
+	int ret;
+
+	if ((ctx->park_epfd < 0) || (conn->ssl != NULL) || (conn->data_len != 0)
+	    || (conn->client.sock == INVALID_SOCKET)) {
+		return 0;
+	}
+
+	pc = (struct mg_parked_conn *)mg_calloc_ctx(1, sizeof(*pc), ctx);
+	if (pc == NULL) {
+		return 0;
+	}
+	pc->client = conn->client;
+	pc->client.parked = NULL;
+	pc->conn_data = mg_get_user_connection_data(conn);
+	pc->conn_birth_time = conn->conn_birth_time;
+	pc->handled_requests = conn->handled_requests;
+	clock_gettime(CLOCK_MONOTONIC, &pc->park_time);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = pc;
+
+	/* The list is ordered by park time, so the master thread only needs
+	 * to check the head for timeouts. The element must be linked before
+	 * the socket is added to the reactor, since the master thread may
+	 * resume it immediately. */
+	(void)pthread_mutex_lock(&ctx->park_mutex);
+	pc->prev = ctx->parked_tail;
+	if (ctx->parked_tail) {
+		ctx->parked_tail->next = pc;
+	} else {
+		ctx->parked_head = pc;
+	}
+	ctx->parked_tail = pc;
+
+	ret = epoll_ctl(ctx->park_epfd, EPOLL_CTL_ADD, pc->client.sock, &ev);
+	if (ret != 0) {
+		ctx->parked_tail = pc->prev;
+		if (pc->prev) {
+			pc->prev->next = NULL;
+		} else {
+			ctx->parked_head = NULL;
+		}
+	} else {
+		/* Count it before the master thread can dispatch it */
+		mg_atomic_inc(&ctx->parked_connections);
+	}
+	(void)pthread_mutex_unlock(&ctx->park_mutex);
+
+	if (ret != 0) {
+		/* Keep the connection in this worker thread */
+		mg_free(pc);
+		return 0;
+	}
+
+	conn->client.sock = INVALID_SOCKET;
+	mg_set_user_connection_data(conn, NULL);
+	return 1;
+}
+
+
+/* Restore the state of a connection returned from the keep-alive reactor.
+ * Returns 1 if there is new data to read, 0 if the connection timed out
+ * and needs to be closed. */
+static int
+unpark_connection(struct mg_connection *conn)
+{
+	struct mg_parked_conn *pc = conn->client.parked;
+	int expired = pc->expired;
+
+	conn->client.parked = NULL;
+	conn->conn_birth_time = pc->conn_birth_time;
+	conn->handled_requests = pc->handled_requests;
+	conn->data_len = 0;
+	conn->must_close = 0;
+	conn->connection_type = CONNECTION_TYPE_REQUEST;
+	conn->protocol_type = PROTOCOL_TYPE_HTTP1;
+	mg_set_user_connection_data(conn, pc->conn_data);
+	mg_free(pc);
+
+#if defined(USE_SERVER_STATS)
+	conn->conn_state = 2; /* init */
+#endif
+
+	return !expired;
+}
+
+
+/* Master thread: remove a connection from the reactor and queue it for
+ * the next free worker thread. */
+static void
+dispatch_parked_connection(struct mg_context *ctx,
+                           struct mg_parked_conn *pc,
+                           int expired)
+{
+	struct socket so;
+
+	(void)pthread_mutex_lock(&ctx->park_mutex);
+	if (pc->prev) {
+		pc->prev->next = pc->next;
+	} else {
+		ctx->parked_head = pc->next;
+	}
+	if (pc->next) {
+		pc->next->prev = pc->prev;
+	} else {
+		ctx->parked_tail = pc->prev;
+	}
+	(void)epoll_ctl(ctx->park_epfd, EPOLL_CTL_DEL, pc->client.sock, NULL);
+	mg_atomic_dec(&ctx->parked_connections);
+	(void)pthread_mutex_unlock(&ctx->park_mutex);
+
+	pc->prev = pc->next = NULL;
+	pc->expired = expired;
+	so = pc->client;
+	so.parked = pc;
+	produce_socket(ctx, &so);
+}
+
+
+/* Master thread: dispatch all parked connections with new data (or
+ * closed by the client). */
+static void
+resume_parked_connections(struct mg_context *ctx)
+{
+	struct epoll_event ev[64];
+	int i, n;
+
+	do {
+		n = epoll_wait(ctx->park_epfd, ev, (int)ARRAY_SIZE(ev), 0);
+		for (i = 0; i < n; i++) {
+			dispatch_parked_connection(ctx,
+			                           (struct mg_parked_conn *)ev[i].data.ptr,
+			                           0);
+		}
+	} while (n == (int)ARRAY_SIZE(ev));
+}
+
+
+/* Master thread: dispatch all parked connections exceeding
+ * keep_alive_timeout_ms, so a worker thread will close them. */
+static void
+expire_parked_connections(struct mg_context *ctx)
+{
+	struct timespec now;
+	struct mg_parked_conn *pc;
+
+	if (ctx->park_timeout_ms < 0) {
+		/* No timeout */
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (;;) {
+		/* Only the master thread removes elements, so the head remains
+		 * valid after unlocking. */
+		(void)pthread_mutex_lock(&ctx->park_mutex);
+		pc = ctx->parked_head;
+		(void)pthread_mutex_unlock(&ctx->park_mutex);
+
+		if ((pc == NULL)
+		    || ((mg_difftimespec(&now, &pc->park_time) * 1000.0)
+		        < (double)ctx->park_timeout_ms)) {
+			break;
+		}
+		dispatch_parked_connection(ctx, pc, 1);
+	}
+}
+
+
+/* Close a parked connection during server shutdown, without handing it
+ * to a worker thread. */
 static void
-produce_socket(struct mg_context *ctx, const struct socket *sp)
+close_parked_socket(struct mg_context *ctx, struct mg_parked_conn *pc)
 {
-	int queue_filled;
-
-	(void)pthread_mutex_lock(&ctx->thread_mutex);
+	struct mg_connection fc;
 
-	queue_filled = ctx->sq_head - ctx->sq_tail;
+	fake_connection(&fc, ctx);
+	fc.client = pc->client;
+	fc.conn_birth_time = pc->conn_birth_time;
+	fc.handled_requests = pc->handled_requests;
+	mg_set_user_connection_data(&fc, pc->conn_data);
 
-	/* If the queue is full, wait */
-	while (STOP_FLAG_IS_ZERO(&ctx->stop_flag)
-	       && (queue_filled >= ctx->sq_size)) {
-		ctx->sq_blocked = 1; /* Status information: All threads busy */
-#if defined(USE_SERVER_STATS)
-		if (queue_filled > ctx->sq_max_fill) {
-			ctx->sq_max_fill = queue_filled;
-		}
-#endif
-		(void)pthread_cond_wait(&ctx->sq_empty, &ctx->thread_mutex);
-		ctx->sq_blocked = 0; /* Not blocked now */
-		queue_filled = ctx->sq_head - ctx->sq_tail;
+	if (ctx->callbacks.connection_close != NULL) {
+		ctx->callbacks.connection_close(&fc);
 	}
-
-	if (queue_filled < ctx->sq_size) {
-		/* Copy socket to the queue and increment head */
-		ctx->squeue[ctx->sq_head % ctx->sq_size] = *sp;
-		ctx->sq_head++;
-		DEBUG_TRACE("queued socket %d", sp ? sp->sock : -1);
+	closesocket(pc->client.sock);
+	if (ctx->callbacks.connection_closed != NULL) {
+		ctx->callbacks.connection_closed(&fc);
 	}
+	mg_free(pc);
+}
 
-	queue_filled = ctx->sq_head - ctx->sq_tail;
-#if defined(USE_SERVER_STATS)
-	if (queue_filled > ctx->sq_max_fill) {
-		ctx->sq_max_fill = queue_filled;
-	}
-#endif
 
-	(void)pthread_cond_signal(&ctx->sq_full);
-	(void)pthread_mutex_unlock(&ctx->thread_mutex);
+/* Master thread: close all parked connections during server shutdown.
+ * Must be called after all worker threads have been joined. */
+static void
+close_parked_connections(struct mg_context *ctx)
+{
+	struct mg_parked_conn *pc;
+
+	while ((pc = ctx->parked_head) != NULL) {
+		ctx->parked_head = pc->next;
+		close_parked_socket(ctx, pc);
+	}
+	ctx->parked_tail = NULL;
+	ctx->parked_connections = 0;
 }
-#endif /* ALTERNATIVE_QUEUE */
+#endif /* USE_KEEP_ALIVE_PARKING */
+
+
+#if defined(USE_WEBSOCKET_REACTOR)
+#include "websocket_reactor.inl"
+#endif
 
 
 static void
@@ -18784,6 +22463,9 @@ worker_thread_run(struct mg_connection *conn)
 #if defined(_WIN32)
 	tls.pthread_cond_helper_mutex = CreateEvent(NULL, FALSE, FALSE, NULL);
 #endif
+#if defined(USE_IO_URING)
+	tls.uring = NULL;
+#endif
 
 	/* Initialize thread local storage before calling any callback */
 	pthread_setspecific(sTlsKey, &tls);
@@ -18821,6 +22503,11 @@ worker_thread_run(struct mg_connection *conn)
 	}
 	conn->buf_size = (int)ctx->max_request_size;
 
+#if defined(USE_IO_URING)
+	/* NULL if io_uring is not available: use the classic system calls */
+	tls.uring = mg_uring_create();
+#endif
+
 	conn->dom_ctx = &(ctx->dd); /* Use default domain and default host */
 
 	conn->tls_user_ptr = tls.user_ptr; /* store ptr for quick access */
@@ -18949,12 +22636,24 @@ worker_thread_run(struct mg_connection *conn)
 #endif
 
 		} else {
-			/* process HTTP connection */
-			init_connection(conn);
-			conn->connection_type = CONNECTION_TYPE_REQUEST;
-			/* Start with HTTP, WS will be an "upgrade" request later */
-			conn->protocol_type = PROTOCOL_TYPE_HTTP1;
-			process_new_connection(conn);
+#if defined(USE_KEEP_ALIVE_PARKING)
+			if (conn->client.parked != NULL) {
+				/* idle keep-alive connection returned from the reactor */
+				if (unpark_connection(conn)) {
+					process_new_connection(conn);
+				} else {
+					close_connection(conn);
+				}
+			} else
+#endif
+			{
+				/* process HTTP connection */
+				init_connection(conn);
+				conn->connection_type = CONNECTION_TYPE_REQUEST;
+				/* Start with HTTP, WS will be an "upgrade" request later */
+				conn->protocol_type = PROTOCOL_TYPE_HTTP1;
+				process_new_connection(conn);
+			}
 		}
 
 		DEBUG_TRACE("%s", "Connection closed");
@@ -18973,6 +22672,9 @@ worker_thread_run(struct mg_connection *conn)
 	pthread_setspecific(sTlsKey, NULL);
 #if defined(_WIN32)
 	CloseHandle(tls.pthread_cond_helper_mutex);
+#endif
+#if defined(USE_IO_URING)
+	mg_uring_destroy(tls.uring);
 #endif
 	pthread_mutex_destroy(&conn->mutex);
 
@@ -19029,13 +22731,23 @@ accept_new_connection(const struct socket *listener, struct mg_context *ctx)
 	struct socket so;
 	char src_addr[IP_ADDR_STR_LEN];
 	socklen_t len = sizeof(so.rsa);
+	int reject;
 #if !defined(__ZEPHYR__)
 	int on = 1;
 #endif
 	memset(&so, 0, sizeof(so));
 
+#if defined(__linux__) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+	/* Set both flags in the accept call, saving two syscalls */
+	if ((so.sock = accept4(listener->sock,
+	                       &so.rsa.sa,
+	                       &len,
+	                       SOCK_NONBLOCK | SOCK_CLOEXEC))
+	    == INVALID_SOCKET) {
+#else
 	if ((so.sock = accept(listener->sock, &so.rsa.sa, &len))
 	    == INVALID_SOCKET) {
+#endif
 	} else if (check_acl(ctx, &so.rsa) != 1) {
 		sockaddr_to_string(src_addr, sizeof(src_addr), &so.rsa);
 		mg_cry_ctx_internal(ctx,
@@ -19046,7 +22758,9 @@ accept_new_connection(const struct socket *listener, struct mg_context *ctx)
 	} else {
 		/* Put so socket structure into the queue */
 		DEBUG_TRACE("Accepted socket %d", (int)so.sock);
+#if !(defined(__linux__) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC))
 		set_close_on_exec(so.sock, NULL, ctx);
+#endif
 		so.is_ssl = listener->is_ssl;
 		so.ssl_redir = listener->ssl_redir;
 		if (getsockname(so.sock, &so.lsa.sa, &len) != 0) {
@@ -19088,8 +22802,7 @@ accept_new_connection(const struct socket *listener, struct mg_context *ctx)
 		 * when HTTP 1.1 persistent connections are used and the responses
 		 * are relatively small (eg. less than 1400 bytes).
 		 */
-		if ((ctx->dd.config[CONFIG_TCP_NODELAY] != NULL)
-		    && (!strcmp(ctx->dd.config[CONFIG_TCP_NODELAY], "1"))) {
+		if (ctx->dd.cfg.tcp_nodelay) {
 			if (set_tcp_nodelay(&so, 1) != 0) {
 				mg_cry_ctx_internal(
 				    ctx,
@@ -19099,10 +22812,20 @@ accept_new_connection(const struct socket *listener, struct mg_context *ctx)
 			}
 		}
 
+#if !(defined(__linux__) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC))
 		/* The "non blocking" property should already be
 		 * inherited from the parent socket. Set it for
 		 * non-compliant socket implementations. */
 		set_non_blocking_mode(so.sock);
+#endif
+
+		/* Reject clients exceeding their limits without using a worker */
+		reject = client_limits_accept(ctx, &so);
+		if (reject != 0) {
+			DEBUG_TRACE("Rejected socket %d: %i", (int)so.sock, reject);
+			client_limits_reject(&so, reject);
+			return;
+		}
 
 		so.in_use = 0;
 		produce_socket(ctx, &so);
@@ -19110,6 +22833,66 @@ accept_new_connection(const struct socket *listener, struct mg_context *ctx)
 }
 
 
+#if defined(USE_REUSEPORT_ACCEPTORS)
+/* Accept loop of an additional acceptor thread. It polls only its own
+ * SO_REUSEPORT listening sockets, the kernel decides which thread accepts
+ * a new connection. All acceptors feed the same worker queue. */
+static void *
+acceptor_thread(void *thread_func_param)
+{
+	struct mg_acceptor *acc = (struct mg_acceptor *)thread_func_param;
+	struct mg_context *ctx = acc->ctx;
+	struct mg_workerTLS tls;
+	struct sigaction sa;
+	unsigned int i;
+
+	/* Ignore SIGPIPE */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	mg_set_thread_name("accept");
+
+	tls.is_master = 1;
+	tls.thread_idx = (unsigned)mg_atomic_inc(&thread_idx_max);
+	pthread_setspecific(sTlsKey, &tls);
+
+	if (ctx->callbacks.init_thread) {
+		/* Acceptor threads are additional master threads (type 0) */
+		tls.user_ptr = ctx->callbacks.init_thread(ctx, 0);
+	} else {
+		tls.user_ptr = NULL;
+	}
+
+	while (STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		for (i = 0; i < acc->num_socks; i++) {
+			acc->pfd[i].fd = acc->socks[i].sock;
+			acc->pfd[i].events = POLLIN;
+		}
+
+		if (mg_poll(acc->pfd,
+		            acc->num_socks,
+		            SOCKET_TIMEOUT_QUANTUM,
+		            &(ctx->stop_flag))
+		    > 0) {
+			for (i = 0; i < acc->num_socks; i++) {
+				if (STOP_FLAG_IS_ZERO(&ctx->stop_flag)
+				    && (acc->pfd[i].revents & POLLIN)) {
+					accept_new_connection(&acc->socks[i], ctx);
+				}
+			}
+		}
+	}
+
+	if (ctx->callbacks.exit_thread) {
+		ctx->callbacks.exit_thread(ctx, 0, tls.user_ptr);
+	}
+	pthread_setspecific(sTlsKey, NULL);
+	return NULL;
+}
+#endif
+
+
 static void
 master_thread_run(struct mg_context *ctx)
 {
@@ -19189,19 +22972,70 @@ master_thread_run(struct mg_context *ctx)
 	/* Server starts *now* */
 	ctx->start_time = time(NULL);
 
+#if defined(USE_REUSEPORT_ACCEPTORS)
+	/* Start additional acceptor threads */
+	if (ctx->acceptors != NULL) {
+		for (i = 0; (i + 1) < ctx->cfg_acceptor_threads; i++) {
+			struct mg_acceptor *acc = &ctx->acceptors[i];
+			if ((acc->num_socks > 0)
+			    && (mg_start_thread_with_id(acceptor_thread,
+			                                acc,
+			                                &acc->threadid)
+			        != 0)) {
+				unsigned int j;
+				mg_cry_ctx_internal(ctx,
+				                    "Cannot start acceptor thread %u: error %ld",
+				                    acc->index,
+				                    (long)ERRNO);
+				/* Nobody would accept connections assigned to these
+				 * sockets by the kernel */
+				for (j = 0; j < acc->num_socks; j++) {
+					closesocket(acc->socks[j].sock);
+				}
+				acc->num_socks = 0;
+			}
+		}
+	}
+#endif
+
+#if defined(USE_WEBSOCKET_REACTOR)
+	ws_reactor_start(ctx);
+#endif
+#if defined(USE_WEBSOCKET)
+	ws_sender_start(ctx);
+#endif
+
 	/* Server accept loop */
 	pfd = ctx->listening_socket_fds;
 	while (STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		unsigned int num_pfd = ctx->num_listening_sockets;
+		int poll_timeout = SOCKET_TIMEOUT_QUANTUM;
+
 		for (i = 0; i < ctx->num_listening_sockets; i++) {
 			pfd[i].fd = ctx->listening_sockets[i].sock;
 			pfd[i].events = POLLIN;
 		}
 
-		if (mg_poll(pfd,
-		            ctx->num_listening_sockets,
-		            SOCKET_TIMEOUT_QUANTUM,
-		            &(ctx->stop_flag))
-		    > 0) {
+#if defined(USE_KEEP_ALIVE_PARKING)
+		/* The epoll descriptor becomes readable, if any parked
+		 * connection is readable. There is always one spare entry at
+		 * the end of the pfd array (see set_ports_option). */
+		if (ctx->park_epfd >= 0) {
+			pfd[num_pfd].fd = ctx->park_epfd;
+			pfd[num_pfd].events = POLLIN;
+			num_pfd++;
+
+			/* Wake up regularly to check for keep-alive timeouts */
+			if ((ctx->parked_connections > 0) && (ctx->park_timeout_ms >= 0)
+			    && ((ctx->park_timeout_ms / 4) < poll_timeout)) {
+				poll_timeout = ((ctx->park_timeout_ms / 4) < 10)
+				                   ? 10
+				                   : (ctx->park_timeout_ms / 4);
+			}
+		}
+#endif
+
+		if (mg_poll(pfd, num_pfd, poll_timeout, &(ctx->stop_flag)) > 0) {
 			for (i = 0; i < ctx->num_listening_sockets; i++) {
 				/* NOTE(lsm): on QNX, poll() returns POLLRDNORM after the
 				 * successful poll, and POLLIN is defined as
@@ -19213,12 +23047,36 @@ master_thread_run(struct mg_context *ctx)
 					accept_new_connection(&ctx->listening_sockets[i], ctx);
 				}
 			}
+#if defined(USE_KEEP_ALIVE_PARKING)
+			if ((ctx->park_epfd >= 0) && STOP_FLAG_IS_ZERO(&ctx->stop_flag)
+			    && (pfd[ctx->num_listening_sockets].revents & POLLIN)) {
+				resume_parked_connections(ctx);
+			}
+#endif
+		}
+
+#if defined(USE_KEEP_ALIVE_PARKING)
+		if ((ctx->park_epfd >= 0) && STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+			expire_parked_connections(ctx);
 		}
+#endif
 	}
 
 	/* Here stop_flag is 1 - Initiate shutdown. */
 	DEBUG_TRACE("%s", "stopping workers");
 
+#if defined(USE_REUSEPORT_ACCEPTORS)
+	/* Acceptor threads must not use the sockets closed below, nor
+	 * produce sockets for workers that already stopped. */
+	if (ctx->acceptors != NULL) {
+		for (i = 0; (i + 1) < ctx->cfg_acceptor_threads; i++) {
+			if (ctx->acceptors[i].num_socks > 0) {
+				mg_join_thread(ctx->acceptors[i].threadid);
+			}
+		}
+	}
+#endif
+
 	/* Stop signal received: somebody called mg_stop. Quit. */
 	close_all_listening_sockets(ctx);
 
@@ -19241,6 +23099,36 @@ master_thread_run(struct mg_context *ctx)
 		}
 	}
 
+#if defined(LOCKFREE_QUEUE)
+	/* Sockets queued for worker threads that have already left */
+	{
+		struct socket so;
+		while (sq_try_pop(ctx, &so)) {
+			discard_socket(ctx, &so);
+		}
+	}
+#elif !defined(ALTERNATIVE_QUEUE)
+	/* Sockets queued for worker threads that have already left */
+	while (ctx->sq_head > ctx->sq_tail) {
+		discard_socket(ctx, &ctx->squeue[ctx->sq_tail % ctx->sq_size]);
+		ctx->sq_tail++;
+	}
+#endif
+
+#if defined(USE_KEEP_ALIVE_PARKING)
+	/* No worker thread is left that could park another connection */
+	close_parked_connections(ctx);
+#endif
+
+#if defined(USE_WEBSOCKET_REACTOR)
+	/* No worker thread is left that could add another websocket */
+	ws_reactor_stop(ctx);
+#endif
+#if defined(USE_WEBSOCKET)
+	/* All websocket connections are closed now */
+	ws_sender_stop(ctx);
+#endif
+
 #if defined(USE_LUA)
 	/* Free Lua state of lua background task */
 	if (ctx->lua_background_state) {
@@ -19345,8 +23233,48 @@ free_context(struct mg_context *ctx)
 #else
 	(void)pthread_cond_destroy(&ctx->sq_empty);
 	(void)pthread_cond_destroy(&ctx->sq_full);
+#if defined(LOCKFREE_QUEUE)
+	mg_free(ctx->sq_cells);
+#else
 	mg_free(ctx->squeue);
 #endif
+#endif
+
+#if defined(USE_KEEP_ALIVE_PARKING)
+	if (ctx->park_epfd >= 0) {
+		close(ctx->park_epfd);
+	}
+	(void)pthread_mutex_destroy(&ctx->park_mutex);
+#endif
+
+#if defined(USE_WEBSOCKET_REACTOR)
+	ws_reactor_destroy(ctx->ws_reactor);
+#endif
+#if defined(USE_WEBSOCKET)
+	ws_channel_free_all(ctx);
+	(void)pthread_cond_destroy(&ctx->ws_channel_cond);
+	(void)pthread_mutex_destroy(&ctx->ws_channel_mutex);
+	ws_sender_destroy(ctx->ws_sender);
+#endif
+
+	mg_free(ctx->acl);
+	client_table_destroy(ctx->client_table);
+
+#if defined(USE_FILE_CACHE)
+	file_cache_destroy(ctx->file_cache);
+#endif
+
+#if defined(USE_RESPONSE_CACHE)
+	response_cache_destroy(ctx->response_cache);
+#endif
+
+#if !defined(NO_FILESYSTEMS)
+	dir_index_cache_destroy(ctx->dir_index_cache);
+#endif
+
+#if defined(USE_ZLIB)
+	compression_cache_destroy(ctx->compression_cache);
+#endif
 
 	/* Destroy other context global data structures mutex */
 	(void)pthread_mutex_destroy(&ctx->nonce_mutex);
@@ -19365,7 +23293,11 @@ free_context(struct mg_context *ctx)
 		}
 	}
 
+	free_domain_config(&(ctx->dd));
+
 	/* Deallocate request handlers */
+	mg_free(ctx->dd.handler_table[0]);
+	mg_free(ctx->dd.handler_table[1]);
 	while (ctx->dd.handlers) {
 		tmp_rh = ctx->dd.handlers;
 		ctx->dd.handlers = tmp_rh->next;
@@ -19589,6 +23521,10 @@ static
 	ctx->dd.auth_nonce_mask =
 	    (uint64_t)get_random() ^ (uint64_t)(ptrdiff_t)(options);
 
+#if defined(USE_KEEP_ALIVE_PARKING)
+	ctx->park_epfd = -1; /* not (yet) created */
+#endif
+
 	/* Save started thread index to reuse in other external API calls
 	 * For the sake of thread synchronization all non-civetweb threads
 	 * can be considered as single external thread */
@@ -19609,6 +23545,14 @@ static
 	ok &= (0 == pthread_mutex_init(&ctx->nonce_mutex, &pthread_mutex_attr));
 #if defined(USE_LUA)
 	ok &= (0 == pthread_mutex_init(&ctx->lua_bg_mutex, &pthread_mutex_attr));
+#endif
+#if defined(USE_KEEP_ALIVE_PARKING)
+	ok &= (0 == pthread_mutex_init(&ctx->park_mutex, &pthread_mutex_attr));
+#endif
+#if defined(USE_WEBSOCKET)
+	ok &= (0
+	       == pthread_mutex_init(&ctx->ws_channel_mutex, &pthread_mutex_attr));
+	ok &= (0 == pthread_cond_init(&ctx->ws_channel_cond, NULL));
 #endif
 	if (!ok) {
 		const char *err_msg =
@@ -19694,6 +23638,7 @@ static
 			ctx->dd.config[i] = mg_strdup_ctx(default_value, ctx);
 		}
 	}
+	init_domain_config(&(ctx->dd));
 
 	/* Request size option */
 	itmp = atoi(ctx->dd.config[MAX_REQUEST_SIZE]);
@@ -19734,9 +23679,28 @@ static
 		pthread_setspecific(sTlsKey, NULL);
 		return NULL;
 	}
+#if defined(LOCKFREE_QUEUE)
+	/* The lock-free ring requires a power of two */
+	{
+		int qsize = 1;
+		while ((qsize < itmp) && (qsize < (INT_MAX / 2))) {
+			qsize *= 2;
+		}
+		itmp = qsize;
+	}
+	ctx->sq_cells = (struct mg_queue_cell *)mg_calloc((unsigned int)itmp,
+	                                                  sizeof(struct mg_queue_cell));
+	if (ctx->sq_cells != NULL) {
+		for (i = 0; i < (unsigned int)itmp; i++) {
+			ctx->sq_cells[i].seq = (ptrdiff_t)i;
+		}
+	}
+	if (ctx->sq_cells == NULL) {
+#else
 	ctx->squeue =
 	    (struct socket *)mg_calloc((unsigned int)itmp, sizeof(struct socket));
 	if (ctx->squeue == NULL) {
+#endif
 		mg_cry_ctx_internal(ctx,
 		                    "Out of memory: Cannot allocate %s",
 		                    config_options[CONNECTION_QUEUE_SIZE].name);
@@ -19777,6 +23741,147 @@ static
 		return NULL;
 	}
 
+#if defined(USE_KEEP_ALIVE_PARKING)
+	/* Reactor for idle keep-alive connections */
+	if (!mg_strcasecmp(ctx->dd.config[ENABLE_KEEP_ALIVE_PARKING], "yes")
+	    && !mg_strcasecmp(ctx->dd.config[ENABLE_KEEP_ALIVE], "yes")) {
+		ctx->park_timeout_ms = atoi(ctx->dd.config[KEEP_ALIVE_TIMEOUT]);
+		ctx->park_epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (ctx->park_epfd < 0) {
+			/* Not fatal: keep-alive connections just remain in their
+			 * worker threads. */
+			mg_cry_ctx_internal(ctx,
+			                    "Cannot create keep-alive reactor: %s",
+			                    strerror(ERRNO));
+		}
+	}
+#endif
+
+#if defined(USE_WEBSOCKET)
+	itmp = atoi(ctx->dd.config[WEBSOCKET_BROADCAST_TIMEOUT]);
+	ctx->ws_broadcast_timeout_ms = (itmp > 0) ? (unsigned int)itmp : 0;
+
+	ctx->ws_max_message_size = (uint64_t)strtoull(
+	    ctx->dd.config[WEBSOCKET_MAX_MESSAGE_SIZE], NULL, 10);
+
+	/* Send queues for websocket connections */
+	itmp = atoi(ctx->dd.config[WEBSOCKET_SEND_QUEUE_SIZE]);
+	if (itmp > 0) {
+		ctx->ws_sender = ws_sender_create(
+		    ctx, (size_t)itmp, ctx->dd.config[WEBSOCKET_SEND_QUEUE_POLICY]);
+		if (ctx->ws_sender == NULL) {
+			/* Not fatal: websocket writes just block. */
+			mg_cry_ctx_internal(ctx,
+			                    "%s",
+			                    "Cannot create websocket send queues");
+		}
+	}
+#endif
+
+#if defined(USE_WEBSOCKET_REACTOR)
+	/* Event loop for websockets */
+	itmp = atoi(ctx->dd.config[WEBSOCKET_DISPATCH_THREADS]);
+	if (itmp > MAX_WORKER_THREADS) {
+		mg_cry_ctx_internal(ctx,
+		                    "%s",
+		                    "Too many websocket dispatch threads requested");
+		itmp = MAX_WORKER_THREADS;
+	}
+	if (itmp > 0) {
+		ctx->ws_reactor = ws_reactor_create(ctx, (unsigned int)itmp);
+		if (ctx->ws_reactor == NULL) {
+			/* Not fatal: websockets are just served by worker threads. */
+			mg_cry_ctx_internal(ctx,
+			                    "Cannot create websocket reactor: %s",
+			                    strerror(ERRNO));
+		}
+	}
+#endif
+
+	/* Connections and requests per client address */
+	itmp = atoi(ctx->dd.config[MAX_CONNECTIONS_PER_IP]);
+	if ((itmp > 0) || (atoi(ctx->dd.config[MAX_REQUEST_RATE_PER_IP]) > 0)) {
+		ctx->client_table = client_table_create(
+		    itmp, atoi(ctx->dd.config[MAX_REQUEST_RATE_PER_IP]));
+		if (ctx->client_table == NULL) {
+			/* Not fatal: clients are just not limited. */
+			mg_cry_ctx_internal(ctx,
+			                    "Out of memory: Cannot allocate %s",
+			                    config_options[MAX_CONNECTIONS_PER_IP].name);
+		}
+	}
+
+#if defined(USE_FILE_CACHE)
+	/* Cache for file status information and open files. Entries with a
+	 * TTL of 0 would expire right away, so this disables the cache. */
+	itmp = atoi(ctx->dd.config[STATIC_FILE_CACHE_ENTRIES]);
+	if (itmp > 0) {
+		int ttl_ms = atoi(ctx->dd.config[STATIC_FILE_CACHE_TTL]);
+		if (ttl_ms > 0) {
+			ctx->file_cache = file_cache_create(ctx, (unsigned)itmp, ttl_ms);
+			if (ctx->file_cache == NULL) {
+				/* Not fatal: files are just not cached. */
+				mg_cry_ctx_internal(
+				    ctx,
+				    "Out of memory: Cannot allocate %s",
+				    config_options[STATIC_FILE_CACHE_ENTRIES].name);
+			}
+		}
+	}
+#endif
+
+#if defined(USE_RESPONSE_CACHE)
+	/* Cache for responses of small files */
+	itmp = atoi(ctx->dd.config[RESPONSE_CACHE_SIZE]);
+	if (itmp > 0) {
+		int max_file_size = atoi(ctx->dd.config[RESPONSE_CACHE_MAX_FILE_SIZE]);
+		ctx->response_cache =
+		    response_cache_create((size_t)itmp,
+		                          (max_file_size > 0) ? (size_t)max_file_size
+		                                              : 0);
+		if (ctx->response_cache == NULL) {
+			/* Not fatal: responses are just not cached. */
+			mg_cry_ctx_internal(ctx,
+			                    "Out of memory: Cannot allocate %s",
+			                    config_options[RESPONSE_CACHE_SIZE].name);
+		}
+	}
+#endif
+
+#if !defined(NO_FILESYSTEMS)
+	/* Cache for sorted directory indexes */
+	itmp = atoi(ctx->dd.config[DIRECTORY_LISTING_CACHE_SIZE]);
+	if (itmp > 0) {
+		ctx->dir_index_cache = dir_index_cache_create((size_t)itmp);
+		if (ctx->dir_index_cache == NULL) {
+			/* Not fatal: directories are just scanned for every listing. */
+			mg_cry_ctx_internal(
+			    ctx,
+			    "Out of memory: Cannot allocate %s",
+			    config_options[DIRECTORY_LISTING_CACHE_SIZE].name);
+		}
+	}
+#endif
+
+#if defined(USE_ZLIB)
+	/* Compression level for on the fly compression */
+	itmp = atoi(ctx->dd.config[COMPRESSION_LEVEL]);
+	ctx->compression_level =
+	    ((itmp >= 1) && (itmp <= 9)) ? itmp : Z_BEST_COMPRESSION;
+
+	/* Cache for compressed files */
+	itmp = atoi(ctx->dd.config[COMPRESSION_CACHE_SIZE]);
+	if (itmp > 0) {
+		ctx->compression_cache = compression_cache_create((size_t)itmp);
+		if (ctx->compression_cache == NULL) {
+			/* Not fatal: compressed files are just not cached. */
+			mg_cry_ctx_internal(ctx,
+			                    "Out of memory: Cannot allocate %s",
+			                    config_options[COMPRESSION_CACHE_SIZE].name);
+		}
+	}
+#endif
+
 	/* Document root */
 #if defined(NO_FILES)
 	if (ctx->dd.config[DOCUMENT_ROOT] != NULL) {
@@ -19945,6 +24050,29 @@ static
 	}
 #endif
 
+#if defined(USE_REUSEPORT_ACCEPTORS)
+	/* Acceptor thread count option, including the master thread */
+	itmp = atoi(ctx->dd.config[ACCEPTOR_THREADS]);
+	if ((itmp < 1) || (itmp > MAX_WORKER_THREADS)) {
+		mg_cry_ctx_internal(ctx,
+		                    "%s value \"%s\" is invalid",
+		                    config_options[ACCEPTOR_THREADS].name,
+		                    ctx->dd.config[ACCEPTOR_THREADS]);
+		if ((error != NULL) && (error->text_buffer_size > 0)) {
+			mg_snprintf(NULL,
+			            NULL, /* No truncation check for error buffers */
+			            error->text,
+			            error->text_buffer_size,
+			            "Invalid configuration option value: %s",
+			            config_options[ACCEPTOR_THREADS].name);
+		}
+		free_context(ctx);
+		pthread_setspecific(sTlsKey, NULL);
+		return NULL;
+	}
+	ctx->cfg_acceptor_threads = (unsigned int)itmp;
+#endif
+
 	if (!set_ports_option(ctx)) {
 		const char *err_msg = "Failed to setup server ports";
 		/* Fatal error - abort start. */
@@ -20340,6 +24468,7 @@ mg_start_domain2(struct mg_context *ctx,
 			new_dom->config[i] = mg_strdup_ctx(default_value, ctx);
 		}
 	}
+	init_domain_config(new_dom);
 
 	new_dom->handlers = NULL;
 	new_dom->next = NULL;
@@ -20362,6 +24491,7 @@ mg_start_domain2(struct mg_context *ctx,
 			            "%s",
 			            "Initializing SSL context failed");
 		}
+		free_domain_config(new_dom);
 		mg_free(new_dom);
 		return -3;
 	}
@@ -20388,6 +24518,7 @@ mg_start_domain2(struct mg_context *ctx,
 				            new_dom->config[AUTHENTICATION_DOMAIN],
 				            config_options[AUTHENTICATION_DOMAIN].name);
 			}
+			free_domain_config(new_dom);
 			mg_free(new_dom);
 			mg_unlock_context(ctx);
 			return -5;
@@ -20838,7 +24969,7 @@ int
 mg_get_context_info(const struct mg_context *ctx, char *buffer, int buflen)
 {
 #if defined(USE_SERVER_STATS)
-	char *end, *append_eoobj = NULL, block[256];
+	char *end, *append_eoobj = NULL, block[512];
 	size_t context_info_length = 0;
 
 #if defined(_WIN32)
@@ -20918,6 +25049,9 @@ mg_get_context_info(const struct mg_context *ctx, char *buffer, int buflen)
 		            ",%s\"connections\" : {%s"
 		            "\"active\" : %i,%s"
 		            "\"maxActive\" : %i,%s"
+#if defined(USE_KEEP_ALIVE_PARKING)
+		            "\"parked\" : %i,%s"
+#endif
 		            "\"total\" : %i%s"
 		            "}",
 		            eol,
@@ -20926,6 +25060,10 @@ mg_get_context_info(const struct mg_context *ctx, char *buffer, int buflen)
 		            eol,
 		            max_active_connections,
 		            eol,
+#if defined(USE_KEEP_ALIVE_PARKING)
+		            (int)ctx->parked_connections,
+		            eol,
+#endif
 		            total_connections,
 		            eol);
 		context_info_length += mg_str_append(&buffer, end, block);
@@ -20940,17 +25078,33 @@ mg_get_context_info(const struct mg_context *ctx, char *buffer, int buflen)
 		            "\"length\" : %i,%s"
 		            "\"filled\" : %i,%s"
 		            "\"maxFilled\" : %i,%s"
-		            "\"full\" : %s%s"
+		            "\"full\" : %s,%s"
+		            "\"consumerWaits\" : %lu,%s"
+		            "\"consumerWaitTime\" : %.3f,%s"
+		            "\"producerWaits\" : %lu,%s"
+		            "\"producerWaitTime\" : %.3f%s"
 		            "}",
 		            eol,
 		            eol,
 		            ctx->sq_size,
 		            eol,
+#if defined(LOCKFREE_QUEUE)
+		            (int)(ctx->sq_enqueue_pos - ctx->sq_dequeue_pos),
+#else
 		            ctx->sq_head - ctx->sq_tail,
+#endif
 		            eol,
-		            ctx->sq_max_fill,
+		            (int)ctx->sq_max_fill,
 		            eol,
 		            (ctx->sq_blocked ? "true" : "false"),
+		            eol,
+		            (unsigned long)ctx->sq_consumer_waits,
+		            eol,
+		            (double)ctx->sq_consumer_wait_time / 1.0E9,
+		            eol,
+		            (unsigned long)ctx->sq_producer_waits,
+		            eol,
+		            (double)ctx->sq_producer_wait_time / 1.0E9,
 		            eol);
 		context_info_length += mg_str_append(&buffer, end, block);
 #endif
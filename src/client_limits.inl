@@ -0,0 +1,389 @@
+/* Access control and limits per client IP address, checked for every
+ * accepted socket before a worker thread is used.
+ * The access_control_list option is compiled into a binary prefix tree
+ * once at startup. Looking up an address walks at most 32 (IPv4) or
+ * 128 (IPv6) nodes, instead of parsing the entire list again.
+ * The number of open connections and the request rate of every client
+ * address are counted in a hash table of MG_CLIENT_TABLE_SIZE entries.
+ * The rate is estimated from the requests in the current and the previous
+ * second (sliding window). Entries without open connections, that have not
+ * been used for two seconds, are reused for other addresses. If no entry
+ * is available, the client is not limited.
+ */
+
+#if !defined(MG_CLIENT_TABLE_SIZE)
+#define MG_CLIENT_TABLE_SIZE (4096) /* must be a power of two */
+#endif
+
+/* Number of entries searched for a client address */
+#define MG_CLIENT_TABLE_PROBES (8)
+
+
+struct mg_acl_node {
+	int child[2]; /* Nodes for the next bit 0 and 1, 0 if none */
+	int rule;     /* Last rule for this prefix, -1 if none */
+};
+
+
+struct mg_acl {
+	char *flags; /* '+' or '-' for every rule */
+	int num_nodes;
+	struct mg_acl_node *nodes; /* 0: IPv4 root, 1: IPv6 root */
+};
+
+
+struct mg_client_entry {
+	int family;       /* 0 if the entry has not been used yet */
+	uint8_t addr[16]; /* IPv4 addresses use the first 4 bytes */
+	int connections;  /* Open connections */
+	unsigned int requests;      /* Requests in the current second */
+	unsigned int prev_requests; /* Requests in the previous second */
+	uint64_t second;            /* Current second of this entry */
+};
+
+
+struct mg_client_table {
+	pthread_mutex_t lock;
+	int max_connections;  /* Per address, 0 = unlimited */
+	int max_request_rate; /* Requests per second per address, 0 = unlim. */
+	struct mg_client_entry entries[MG_CLIENT_TABLE_SIZE];
+};
+
+
+/* Get the address bytes of a client. Return the number of bits, or 0 for
+ * other address families. */
+static int
+client_address(const union usa *sa, uint8_t addr[16])
+{
+	memset(addr, 0, 16);
+	if (sa->sa.sa_family == AF_INET) {
+		memcpy(addr, &sa->sin.sin_addr, 4);
+		return 32;
+	}
+#if defined(USE_IPV6)
+	if (sa->sa.sa_family == AF_INET6) {
+		memcpy(addr, &sa->sin6.sin6_addr, 16);
+		return 128;
+	}
+#endif
+	return 0;
+}
+
+
+/* Check if a subnet contains addresses, i.e., all bits after the prefix
+ * are 0. Other subnets do not match any address. */
+static int
+acl_net_is_valid(const struct mg_net *net)
+{
+	unsigned int i;
+
+	for (i = net->bits; i < ((net->family == AF_INET) ? 32u : 128u); i++) {
+		if (net->addr[i / 8] & (0x80u >> (i % 8))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/* Compile the access control list. Return NULL and set *error if the list
+ * is malformed (or out of memory). */
+static struct mg_acl *
+acl_create(const char *list, const char **error)
+{
+	struct mg_acl *acl;
+	struct mg_acl_node *node;
+	struct mg_net net;
+	struct vec vec;
+	const char *p;
+	int num_rules = 0, max_nodes = 2;
+	int i, n, rule;
+	unsigned int bit;
+
+	/* Validate the list and count the nodes needed */
+	for (p = list; (p = next_option(p, &vec, NULL)) != NULL;) {
+		if ((vec.len < 1) || ((vec.ptr[0] != '+') && (vec.ptr[0] != '-'))) {
+			*error = "subnet must be [+|-]IP-addr[/x]";
+			return NULL;
+		}
+		vec.ptr++;
+		vec.len--;
+		if (!parse_net(&vec, &net, 1)) {
+			*error = "subnet must be [+|-]IP-addr[/x]";
+			return NULL;
+		}
+		num_rules++;
+		max_nodes += (int)net.bits;
+	}
+
+	acl = (struct mg_acl *)mg_calloc(1,
+	                                 sizeof(*acl)
+	                                     + max_nodes * sizeof(struct mg_acl_node)
+	                                     + num_rules + 1);
+	if (acl == NULL) {
+		*error = "out of memory";
+		return NULL;
+	}
+	acl->nodes = (struct mg_acl_node *)(acl + 1);
+	acl->flags = (char *)(acl->nodes + max_nodes);
+	acl->nodes[0].rule = acl->nodes[1].rule = -1;
+	acl->num_nodes = 2;
+
+	rule = 0;
+	for (p = list; (p = next_option(p, &vec, NULL)) != NULL; rule++) {
+		acl->flags[rule] = vec.ptr[0];
+		vec.ptr++;
+		vec.len--;
+		(void)parse_net(&vec, &net, 1);
+		if (!acl_net_is_valid(&net)) {
+			continue;
+		}
+
+		/* Add the path for the prefix to the tree */
+		n = (net.family == AF_INET) ? 0 : 1;
+		for (bit = 0; bit < net.bits; bit++) {
+			i = (net.addr[bit / 8] >> (7 - (bit % 8))) & 1;
+			if (acl->nodes[n].child[i] == 0) {
+				node = &acl->nodes[acl->num_nodes];
+				node->rule = -1;
+				acl->nodes[n].child[i] = acl->num_nodes++;
+			}
+			n = acl->nodes[n].child[i];
+		}
+		/* The last matching rule wins */
+		acl->nodes[n].rule = rule;
+	}
+	return acl;
+}
+
+
+/* Return 1 if the address is allowed, 0 if not */
+static int
+acl_check(const struct mg_acl *acl, const union usa *sa)
+{
+	uint8_t addr[16];
+	int bits = client_address(sa, addr);
+	int best = -1, n, i;
+
+	if (bits > 0) {
+		n = (bits == 32) ? 0 : 1;
+		for (i = 0;; i++) {
+			if (acl->nodes[n].rule > best) {
+				best = acl->nodes[n].rule;
+			}
+			if (i == bits) {
+				break;
+			}
+			n = acl->nodes[n].child[(addr[i / 8] >> (7 - (i % 8))) & 1];
+			if (n == 0) {
+				break;
+			}
+		}
+	}
+
+	/* If any ACL is set, deny by default */
+	return (best >= 0) && (acl->flags[best] == '+');
+}
+
+
+static struct mg_client_table *
+client_table_create(int max_connections, int max_request_rate)
+{
+	struct mg_client_table *t =
+	    (struct mg_client_table *)mg_calloc(1, sizeof(*t));
+
+	if (t == NULL) {
+		return NULL;
+	}
+	if (0 != pthread_mutex_init(&t->lock, NULL)) {
+		mg_free(t);
+		return NULL;
+	}
+	t->max_connections = (max_connections > 0) ? max_connections : 0;
+	t->max_request_rate = (max_request_rate > 0) ? max_request_rate : 0;
+	return t;
+}
+
+
+static void
+client_table_destroy(struct mg_client_table *t)
+{
+	if (t != NULL) {
+		(void)pthread_mutex_destroy(&t->lock);
+		mg_free(t);
+	}
+}
+
+
+/* Find the entry of a client address, or create it (if create is set).
+ * Return NULL if there is no entry. Call with t->lock held. */
+static struct mg_client_entry *
+client_table_find(struct mg_client_table *t,
+                  const union usa *sa,
+                  uint64_t second,
+                  int create)
+{
+	struct mg_client_entry *e, *unused = NULL;
+	uint8_t addr[16];
+	uint32_t h;
+	int i, family = sa->sa.sa_family;
+
+	(void)client_address(sa, addr);
+	h = mg_fnv1a(MG_FNV1A_INIT, addr, sizeof(addr));
+
+	for (i = 0; i < MG_CLIENT_TABLE_PROBES; i++) {
+		e = &t->entries[(h + (uint32_t)i) & (MG_CLIENT_TABLE_SIZE - 1)];
+		if ((e->family == family) && !memcmp(e->addr, addr, sizeof(addr))) {
+			/* Move the request counters to the current second */
+			if (e->second != second) {
+				e->prev_requests = (e->second + 1 == second) ? e->requests : 0;
+				e->requests = 0;
+				e->second = second;
+			}
+			return e;
+		}
+		if ((unused == NULL)
+		    && ((e->family == 0)
+		        || ((e->connections == 0) && (e->second + 1 < second)))) {
+			unused = e;
+		}
+	}
+
+	if (!create || (unused == NULL)) {
+		return NULL;
+	}
+	unused->family = family;
+	memcpy(unused->addr, addr, sizeof(addr));
+	unused->connections = 0;
+	unused->requests = 0;
+	unused->prev_requests = 0;
+	unused->second = second;
+	return unused;
+}
+
+
+/* Check if a client reached max_request_rate_per_ip */
+static int
+client_rate_exceeded(const struct mg_client_table *t,
+                     const struct mg_client_entry *e,
+                     uint64_t now_ns)
+{
+	double elapsed = (double)(now_ns % 1000000000) / 1.0e9;
+	double rate = (double)e->prev_requests * (1.0 - elapsed) + e->requests;
+
+	return (t->max_request_rate > 0) && (rate >= t->max_request_rate);
+}
+
+
+/* Count a new connection. Return 0 if it is accepted, or the HTTP status
+ * code (429 or 503) to reject it. */
+static int
+client_limits_accept(struct mg_context *ctx, struct socket *so)
+{
+	struct mg_client_table *t = ctx->client_table;
+	struct mg_client_entry *e;
+	uint64_t now = mg_get_current_time_ns();
+	int status = 0;
+
+	if (t == NULL) {
+		return 0;
+	}
+	pthread_mutex_lock(&t->lock);
+	e = client_table_find(t, &so->rsa, now / 1000000000, 1);
+	if (e != NULL) {
+		if (client_rate_exceeded(t, e, now)) {
+			status = 429;
+		} else if ((t->max_connections > 0)
+		           && (e->connections >= t->max_connections)) {
+			status = 503;
+		} else {
+			e->connections++;
+			so->client_counted = 1;
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+	return status;
+}
+
+
+/* Count a request. Return 1 if it may be handled, 0 if the client sends
+ * too many requests. */
+static int
+client_limits_request(struct mg_connection *conn)
+{
+	struct mg_client_table *t = conn->phys_ctx->client_table;
+	struct mg_client_entry *e;
+	uint64_t now;
+	int ok = 1;
+
+	if ((t == NULL) || (t->max_request_rate == 0)) {
+		return 1;
+	}
+	now = mg_get_current_time_ns();
+	pthread_mutex_lock(&t->lock);
+	e = client_table_find(t, &conn->client.rsa, now / 1000000000, 1);
+	if (e != NULL) {
+		if (client_rate_exceeded(t, e, now)) {
+			ok = 0;
+		} else {
+			e->requests++;
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+	return ok;
+}
+
+
+/* A counted connection is closed */
+static void
+client_limits_close(struct mg_connection *conn)
+{
+	struct mg_client_table *t = conn->phys_ctx->client_table;
+	struct mg_client_entry *e;
+
+	if ((t == NULL) || !conn->client.client_counted) {
+		return;
+	}
+	conn->client.client_counted = 0;
+	pthread_mutex_lock(&t->lock);
+	e = client_table_find(t,
+	                      &conn->client.rsa,
+	                      mg_get_current_time_ns() / 1000000000,
+	                      0);
+	if ((e != NULL) && (e->connections > 0)) {
+		e->connections--;
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+
+/* Reject an accepted socket without using a worker thread */
+static void
+client_limits_reject(const struct socket *so, int status)
+{
+#if defined(_WIN32)
+	typedef int len_t;
+#else
+	typedef size_t len_t;
+#endif
+	char buf[256];
+	const char *response =
+	    (status == 429) ? "HTTP/1.1 429 Too Many Requests\r\n"
+	                      "Content-Length: 0\r\n"
+	                      "Retry-After: 1\r\n"
+	                      "Connection: close\r\n\r\n"
+	                    : "HTTP/1.1 503 Service Unavailable\r\n"
+	                      "Content-Length: 0\r\n"
+	                      "Retry-After: 1\r\n"
+	                      "Connection: close\r\n\r\n";
+
+	if (!so->is_ssl) {
+		/* The socket is non-blocking: read what the client has sent
+		 * already, so closing the socket does not reset the connection
+		 * before the response arrives. */
+		(void)recv(so->sock, buf, sizeof(buf), 0);
+		(void)send(so->sock, response, (len_t)strlen(response), MSG_NOSIGNAL);
+		(void)shutdown(so->sock, SHUTDOWN_WR);
+	}
+	closesocket(so->sock);
+}
@@ -0,0 +1,404 @@
+/* Sorted index of a directory, used for directory listings.
+ * Listing a directory needs one mg_stat call per entry, and sorting a large
+ * directory takes time. An index holds the names and status information of
+ * all entries (names in one memory block), sorted by name, size and
+ * modification time. In every order, directories are listed before files.
+ * An index is never modified once it has been created, so any number of
+ * requests may use it at the same time.
+ * Indexes are cached, if "directory_listing_cache_size" is set. A cached
+ * index is valid as long as the modification time of the directory does
+ * not change. Creating, removing or renaming an entry modifies the
+ * directory, writing to a file does not: sizes and modification times of
+ * files in the listing are updated with the next change of the directory.
+ */
+#if defined(NO_FILESYSTEMS)
+#error "This file must not be included, if NO_FILESYSTEMS is set"
+#endif
+
+#if !defined(MG_DIR_INDEX_CACHE_BUCKETS)
+#define MG_DIR_INDEX_CACHE_BUCKETS (64) /* must be a power of two */
+#endif
+
+
+struct mg_dir_entry {
+	union {
+		size_t ofs;      /* Offset in the name block, while scanning */
+		const char *ptr; /* Name, once the index is complete */
+	} name;
+	uint64_t size;
+	time_t last_modified;
+	int is_directory;
+};
+
+
+struct mg_dir_index {
+	struct mg_lru_node node; /* Must be the first member */
+	const struct mg_domain_context *dom_ctx; /* hide_files_patterns used */
+	time_t dir_modified;           /* Modification time of the directory */
+	size_t num_entries;
+	size_t num_dirs;               /* Directories are the first entries */
+	struct mg_dir_entry *entries;  /* Sorted by name */
+	const struct mg_dir_entry **by_size;
+	const struct mg_dir_entry **by_date;
+	char *names;
+	char path[1]; /* Allocated with the required length */
+};
+
+
+struct mg_dir_index_cache {
+	pthread_mutex_t lock;
+	struct mg_lru_cache table; /* max_size is directory_listing_cache_size */
+};
+
+
+/* Data collected by scan_directory */
+struct dir_index_scan {
+	struct mg_dir_entry *entries;
+	size_t num_entries;
+	size_t arr_size;
+	char *names;
+	size_t names_len;
+	size_t names_size;
+};
+
+
+static int
+dir_index_scan_callback(struct de *de, void *data)
+{
+	struct dir_index_scan *scan = (struct dir_index_scan *)data;
+	size_t name_len = strlen(de->file_name) + 1;
+	struct mg_dir_entry *e;
+
+	if (scan->num_entries >= scan->arr_size) {
+		size_t arr_size = (scan->arr_size > 0) ? (scan->arr_size * 2) : 128;
+		struct mg_dir_entry *entries = (struct mg_dir_entry *)mg_realloc(
+		    scan->entries, arr_size * sizeof(entries[0]));
+		if (entries == NULL) {
+			/* stop scan */
+			return 1;
+		}
+		scan->entries = entries;
+		scan->arr_size = arr_size;
+	}
+	if (scan->names_len + name_len > scan->names_size) {
+		size_t names_size = (scan->names_size * 2 > name_len + MG_BUF_LEN)
+		                        ? (scan->names_size * 2)
+		                        : (scan->names_len + name_len + MG_BUF_LEN);
+		char *names = (char *)mg_realloc(scan->names, names_size);
+		if (names == NULL) {
+			/* stop scan */
+			return 1;
+		}
+		scan->names = names;
+		scan->names_size = names_size;
+	}
+
+	e = &scan->entries[scan->num_entries++];
+	e->name.ofs = scan->names_len;
+	e->size = de->file.size;
+	e->last_modified = de->file.last_modified;
+	e->is_directory = de->file.is_directory;
+	memcpy(scan->names + scan->names_len, de->file_name, name_len);
+	scan->names_len += name_len;
+
+	return 0;
+}
+
+
+/* Sort functions: directories first, then by name, size or modification
+ * time. The name is used as second key, so every order is well defined,
+ * and a listing can be split into pages. */
+static int WINCDECL
+dir_entry_compare_name(const void *p1, const void *p2)
+{
+	const struct mg_dir_entry *a = (const struct mg_dir_entry *)p1;
+	const struct mg_dir_entry *b = (const struct mg_dir_entry *)p2;
+
+	if (a->is_directory != b->is_directory) {
+		return a->is_directory ? -1 : 1;
+	}
+	return strcmp(a->name.ptr, b->name.ptr);
+}
+
+
+static int WINCDECL
+dir_entry_compare_size(const void *p1, const void *p2)
+{
+	const struct mg_dir_entry *a = *(const struct mg_dir_entry *const *)p1;
+	const struct mg_dir_entry *b = *(const struct mg_dir_entry *const *)p2;
+
+	if ((a->is_directory == b->is_directory) && (a->size != b->size)) {
+		return (a->size > b->size) ? 1 : -1;
+	}
+	return dir_entry_compare_name(a, b);
+}
+
+
+static int WINCDECL
+dir_entry_compare_date(const void *p1, const void *p2)
+{
+	const struct mg_dir_entry *a = *(const struct mg_dir_entry *const *)p1;
+	const struct mg_dir_entry *b = *(const struct mg_dir_entry *const *)p2;
+
+	if ((a->is_directory == b->is_directory)
+	    && (a->last_modified != b->last_modified)) {
+		return (a->last_modified > b->last_modified) ? 1 : -1;
+	}
+	return dir_entry_compare_name(a, b);
+}
+
+
+static void
+dir_index_free(struct mg_dir_index *idx)
+{
+	mg_free(idx->entries);
+	mg_free(idx->by_size);
+	mg_free(idx->by_date);
+	mg_free(idx->names);
+	mg_free(idx);
+}
+
+
+static void
+dir_index_free_node(struct mg_lru_node *node)
+{
+	dir_index_free((struct mg_dir_index *)node);
+}
+
+
+/* Scan a directory and create a sorted index.
+ * Return NULL if the directory cannot be read, or out of memory. */
+static struct mg_dir_index *
+dir_index_create(struct mg_connection *conn,
+                 const char *dir,
+                 time_t dir_modified)
+{
+	struct dir_index_scan scan;
+	struct mg_dir_index *idx;
+	size_t i, path_len = strlen(dir);
+
+	memset(&scan, 0, sizeof(scan));
+	if (!scan_directory(conn, dir, &scan, dir_index_scan_callback)) {
+		return NULL;
+	}
+
+	idx = (struct mg_dir_index *)mg_calloc_ctx(1,
+	                                           sizeof(*idx) + path_len,
+	                                           conn->phys_ctx);
+	if (idx == NULL) {
+		mg_free(scan.entries);
+		mg_free(scan.names);
+		return NULL;
+	}
+	memcpy(idx->path, dir, path_len + 1);
+	idx->dom_ctx = conn->dom_ctx;
+	idx->dir_modified = dir_modified;
+	idx->entries = scan.entries;
+	idx->names = scan.names;
+	idx->num_entries = scan.num_entries;
+
+	if (idx->num_entries > 0) {
+		/* The name block will not be moved anymore */
+		for (i = 0; i < idx->num_entries; i++) {
+			idx->entries[i].name.ptr = idx->names + idx->entries[i].name.ofs;
+			if (idx->entries[i].is_directory) {
+				idx->num_dirs++;
+			}
+		}
+		qsort(idx->entries,
+		      idx->num_entries,
+		      sizeof(idx->entries[0]),
+		      dir_entry_compare_name);
+
+		idx->by_size = (const struct mg_dir_entry **)mg_malloc_ctx(
+		    idx->num_entries * sizeof(idx->by_size[0]), conn->phys_ctx);
+		idx->by_date = (const struct mg_dir_entry **)mg_malloc_ctx(
+		    idx->num_entries * sizeof(idx->by_date[0]), conn->phys_ctx);
+		if ((idx->by_size == NULL) || (idx->by_date == NULL)) {
+			dir_index_free(idx);
+			return NULL;
+		}
+		for (i = 0; i < idx->num_entries; i++) {
+			idx->by_size[i] = idx->by_date[i] = &idx->entries[i];
+		}
+		qsort(idx->by_size,
+		      idx->num_entries,
+		      sizeof(idx->by_size[0]),
+		      dir_entry_compare_size);
+		qsort(idx->by_date,
+		      idx->num_entries,
+		      sizeof(idx->by_date[0]),
+		      dir_entry_compare_date);
+	}
+
+	idx->node.mem_size = sizeof(*idx) + path_len + scan.names_size
+	                     + scan.arr_size * sizeof(struct mg_dir_entry)
+	                     + 2 * idx->num_entries * sizeof(struct mg_dir_entry *);
+	idx->node.refs = 1;
+	return idx;
+}
+
+
+/* Get the entry at position pos (0 <= pos < num_entries) of a listing
+ * sorted by sort_key ('n', 's' or 'd') */
+static const struct mg_dir_entry *
+dir_index_entry(const struct mg_dir_index *idx,
+                size_t pos,
+                int sort_key,
+                int descending)
+{
+	if (descending) {
+		/* Directories are still listed first */
+		pos = (pos < idx->num_dirs) ? (idx->num_dirs - 1 - pos)
+		                            : (idx->num_entries - 1 - pos
+		                               + idx->num_dirs);
+	}
+	if (sort_key == 's') {
+		return idx->by_size[pos];
+	}
+	if (sort_key == 'd') {
+		return idx->by_date[pos];
+	}
+	return &idx->entries[pos];
+}
+
+
+static struct mg_dir_index_cache *
+dir_index_cache_create(size_t max_size)
+{
+	struct mg_dir_index_cache *cache = (struct mg_dir_index_cache *)mg_calloc(
+	    1, sizeof(struct mg_dir_index_cache));
+
+	if (cache == NULL) {
+		return NULL;
+	}
+	if (0 != lru_cache_init(&cache->table,
+	                        MG_DIR_INDEX_CACHE_BUCKETS,
+	                        max_size,
+	                        dir_index_free_node,
+	                        NULL)) {
+		mg_free(cache);
+		return NULL;
+	}
+	if (0 != pthread_mutex_init(&cache->lock, NULL)) {
+		lru_cache_free(&cache->table);
+		mg_free(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+
+static void
+dir_index_cache_destroy(struct mg_dir_index_cache *cache)
+{
+	if (cache == NULL) {
+		return;
+	}
+	/* All requests are finished, no index is in use anymore */
+	lru_cache_free(&cache->table);
+	(void)pthread_mutex_destroy(&cache->lock);
+	mg_free(cache);
+}
+
+
+/* Find the index of a directory. Call with cache->lock held. */
+static struct mg_dir_index *
+dir_index_cache_lookup(struct mg_dir_index_cache *cache,
+                       const struct mg_domain_context *dom_ctx,
+                       const char *path,
+                       uint32_t hash)
+{
+	struct mg_lru_node *node = lru_cache_bucket(&cache->table, hash);
+	struct mg_dir_index *idx;
+
+	for (; node != NULL; node = node->next) {
+		idx = (struct mg_dir_index *)node;
+		if ((node->hash == hash) && (idx->dom_ctx == dom_ctx)
+		    && !strcmp(idx->path, path)) {
+			return idx;
+		}
+	}
+	return NULL;
+}
+
+
+/* Release an index returned by dir_index_get */
+static void
+dir_index_release(struct mg_connection *conn, struct mg_dir_index *idx)
+{
+	struct mg_dir_index_cache *cache = conn->phys_ctx->dir_index_cache;
+
+	if (cache == NULL) {
+		dir_index_free(idx);
+		return;
+	}
+	pthread_mutex_lock(&cache->lock);
+	lru_cache_release(&cache->table, &idx->node);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+/* Get the index of a directory, from the cache or by scanning the
+ * directory. The index must be released using dir_index_release.
+ * Return NULL if the directory cannot be read. */
+static struct mg_dir_index *
+dir_index_get(struct mg_connection *conn, const char *dir)
+{
+	struct mg_dir_index_cache *cache = conn->phys_ctx->dir_index_cache;
+	struct mg_dir_index *idx, *old;
+	struct mg_file_stat dir_stat;
+	uint32_t hash;
+
+	if (cache == NULL) {
+		return dir_index_create(conn, dir, 0);
+	}
+	if (!mg_stat(conn, dir, &dir_stat)) {
+		return NULL;
+	}
+
+	hash = lru_cache_hash(dir);
+	pthread_mutex_lock(&cache->lock);
+	idx = dir_index_cache_lookup(cache, conn->dom_ctx, dir, hash);
+	if (idx != NULL) {
+		if (idx->dir_modified != dir_stat.last_modified) {
+			/* The directory has been modified */
+			lru_cache_unlink(&cache->table, &idx->node);
+			idx = NULL;
+		} else {
+			lru_cache_touch(&cache->table, &idx->node);
+			idx->node.refs++;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	if (idx != NULL) {
+		return idx;
+	}
+
+	/* Scan without holding the lock. If another thread scans the same
+	 * directory at the same time, the last index is kept. */
+	idx = dir_index_create(conn, dir, dir_stat.last_modified);
+	if (idx == NULL) {
+		return NULL;
+	}
+	idx->node.hash = hash;
+
+	/* The modification time has a resolution of one second. If the
+	 * directory has been modified within the last second, another change
+	 * in the same second would not be noticed: do not cache it yet. */
+	if (dir_stat.last_modified + 1 >= time(NULL)) {
+		return idx;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	old = dir_index_cache_lookup(cache, conn->dom_ctx, dir, hash);
+	if (old != NULL) {
+		lru_cache_unlink(&cache->table, &old->node);
+	}
+	if (idx->node.mem_size <= cache->table.max_size) {
+		lru_cache_link(&cache->table, &idx->node);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return idx;
+}
@@ -0,0 +1,428 @@
+/* Cache for file status information and open file descriptors.
+ *
+ * Serving a static file requires several stat calls (the file itself,
+ * index files, *.gz siblings) and an open call before the first byte is
+ * sent. This cache stores the result of mg_stat, including negative
+ * results, for every path, and keeps the files sent by
+ * handle_static_file_request open, so their descriptors can be used by
+ * send_file_data directly. Entries are valid for static_file_cache_ttl_ms.
+ * Files modified by the server itself (PUT, DELETE, ...) are invalidated
+ * immediately.
+ *
+ * The cache is divided into shards with their own lock, selected by the
+ * hash of the path. Every shard is a hash table with a LRU list, limited
+ * to its share of static_file_cache_entries.
+ */
+#if !defined(USE_FILE_CACHE)
+#error "This file must only be included, if USE_FILE_CACHE is set"
+#endif
+
+#if !defined(MG_FILE_CACHE_SHARDS)
+#define MG_FILE_CACHE_SHARDS (16) /* must be a power of two */
+#endif
+
+
+struct mg_file_cache_entry {
+	struct mg_lru_node node;  /* Must be the first member, refs counts the
+	                           * requests using fd, mem_size is 1 */
+	uint64_t expires;         /* Monotonic time in ns */
+	int found;                /* Return value of mg_stat */
+	struct mg_file_stat stat; /* Status information, if found */
+	int fd;                   /* Open file descriptor, -1 if not opened */
+	char path[1];             /* Allocated with the required length */
+};
+
+
+struct mg_file_cache_shard {
+	pthread_mutex_t lock;
+	struct mg_lru_cache table; /* max_size is the number of entries */
+};
+
+
+struct mg_file_cache {
+	uint64_t ttl_ns;
+	struct mg_file_cache_shard shards[MG_FILE_CACHE_SHARDS];
+};
+
+
+static uint64_t
+file_cache_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t)ts.tv_sec) * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+
+static struct mg_file_cache_shard *
+file_cache_shard(struct mg_file_cache *cache, uint32_t hash)
+{
+	/* The lower bits select the bucket, use the upper bits here */
+	return &cache->shards[(hash >> 24) & (MG_FILE_CACHE_SHARDS - 1)];
+}
+
+
+static void
+file_cache_free_entry(struct mg_lru_node *node)
+{
+	struct mg_file_cache_entry *e = (struct mg_file_cache_entry *)node;
+
+	if (e->fd >= 0) {
+		close(e->fd);
+	}
+	mg_free(e);
+}
+
+
+/* Call with shard->lock held. */
+static struct mg_file_cache_entry *
+file_cache_lookup(struct mg_file_cache_shard *shard,
+                  const char *path,
+                  uint32_t hash)
+{
+	struct mg_lru_node *node = lru_cache_bucket(&shard->table, hash);
+
+	while ((node != NULL)
+	       && ((node->hash != hash)
+	           || strcmp(((struct mg_file_cache_entry *)node)->path, path))) {
+		node = node->next;
+	}
+	return (struct mg_file_cache_entry *)node;
+}
+
+
+/* Find a valid entry and mark it as most recently used.
+ * Call with shard->lock held. */
+static struct mg_file_cache_entry *
+file_cache_find(struct mg_file_cache_shard *shard,
+                const char *path,
+                uint32_t hash,
+                uint64_t now)
+{
+	struct mg_file_cache_entry *e = file_cache_lookup(shard, path, hash);
+
+	if (e == NULL) {
+		return NULL;
+	}
+	if (now >= e->expires) {
+		lru_cache_unlink(&shard->table, &e->node);
+		return NULL;
+	}
+	lru_cache_touch(&shard->table, &e->node);
+	return e;
+}
+
+
+static void
+file_cache_destroy(struct mg_file_cache *cache)
+{
+	unsigned i;
+
+	if (cache == NULL) {
+		return;
+	}
+	for (i = 0; i < MG_FILE_CACHE_SHARDS; i++) {
+		struct mg_file_cache_shard *shard = &cache->shards[i];
+		if (shard->table.buckets != NULL) {
+			/* All requests are completed, nothing is in use anymore */
+			lru_cache_free(&shard->table);
+			(void)pthread_mutex_destroy(&shard->lock);
+		}
+	}
+	mg_free(cache);
+}
+
+
+/* Create a cache for max_entries paths, valid for ttl_ms (> 0).
+ * Return NULL if out of memory. */
+static struct mg_file_cache *
+file_cache_create(struct mg_context *ctx, unsigned max_entries, int ttl_ms)
+{
+	struct mg_file_cache *cache;
+	unsigned i, capacity, buckets;
+
+	(void)ctx; /* only used for memory statistics */
+
+	cache = (struct mg_file_cache *)mg_calloc_ctx(1, sizeof(*cache), ctx);
+	if (cache == NULL) {
+		return NULL;
+	}
+	cache->ttl_ns = (uint64_t)ttl_ms * 1000000;
+
+	capacity = (max_entries + MG_FILE_CACHE_SHARDS - 1) / MG_FILE_CACHE_SHARDS;
+	buckets = 1;
+	while (buckets < capacity) {
+		buckets *= 2;
+	}
+
+	for (i = 0; i < MG_FILE_CACHE_SHARDS; i++) {
+		struct mg_file_cache_shard *shard = &cache->shards[i];
+		if (0 != lru_cache_init(&shard->table,
+		                        buckets,
+		                        capacity,
+		                        file_cache_free_entry,
+		                        ctx)) {
+			file_cache_destroy(cache);
+			return NULL;
+		}
+		if (0 != pthread_mutex_init(&shard->lock, &pthread_mutex_attr)) {
+			lru_cache_free(&shard->table);
+			file_cache_destroy(cache);
+			return NULL;
+		}
+	}
+	return cache;
+}
+
+
+static struct mg_file_cache *
+file_cache_of(const struct mg_connection *conn)
+{
+	if ((conn == NULL) || (conn->phys_ctx == NULL)) {
+		return NULL;
+	}
+	return conn->phys_ctx->file_cache;
+}
+
+
+/* Get file information, return 1 if file exists, 0 if not.
+ * Uses the cache, if it is enabled. */
+static int
+mg_stat(const struct mg_connection *conn,
+        const char *path,
+        struct mg_file_stat *filep)
+{
+	struct mg_file_cache *cache = file_cache_of(conn);
+	struct mg_file_cache_shard *shard;
+	struct mg_file_cache_entry *e;
+	uint32_t hash;
+	uint64_t now;
+	size_t len;
+	int found;
+
+	if ((cache == NULL) || (filep == NULL) || (path == NULL)) {
+		return mg_stat_fs(conn, path, filep);
+	}
+
+	hash = lru_cache_hash(path);
+	shard = file_cache_shard(cache, hash);
+	now = file_cache_now();
+
+	pthread_mutex_lock(&shard->lock);
+	e = file_cache_find(shard, path, hash, now);
+	if (e != NULL) {
+		*filep = e->stat;
+		found = e->found;
+		pthread_mutex_unlock(&shard->lock);
+		return found;
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	found = mg_stat_fs(conn, path, filep);
+
+	len = strlen(path);
+	e = (struct mg_file_cache_entry *)mg_malloc_ctx(sizeof(*e) + len,
+	                                                conn->phys_ctx);
+	if (e == NULL) {
+		return found;
+	}
+	memset(&e->node, 0, sizeof(e->node));
+	memcpy(e->path, path, len + 1);
+	e->node.hash = hash;
+	e->node.mem_size = 1;
+	e->expires = now + cache->ttl_ns;
+	e->found = found;
+	e->stat = *filep;
+	e->fd = -1;
+
+	pthread_mutex_lock(&shard->lock);
+	if (file_cache_find(shard, path, hash, now) == NULL) {
+		lru_cache_link(&shard->table, &e->node);
+		e = NULL;
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if (e != NULL) {
+		/* Another thread was faster */
+		mg_free(e);
+	}
+	return found;
+}
+
+
+/* Find the entry of a regular file with the status information in
+ * filestat. Call with shard->lock held. */
+static struct mg_file_cache_entry *
+file_cache_find_file(struct mg_file_cache_shard *shard,
+                     const char *path,
+                     uint32_t hash,
+                     const struct mg_file_stat *filestat)
+{
+	struct mg_file_cache_entry *e =
+	    file_cache_find(shard, path, hash, file_cache_now());
+
+	if ((e == NULL) || !e->found || e->stat.is_directory
+	    || (e->stat.size != filestat->size)
+	    || (e->stat.last_modified != filestat->last_modified)) {
+		return NULL;
+	}
+	return e;
+}
+
+
+/* Open a regular file using a cached file descriptor. The file is only
+ * opened, if the status information in filep->stat (from mg_stat) is still
+ * up to date.
+ * Return 1 if filep->access refers to a cached file now, 0 if the caller
+ * must use mg_fopen. The file must be closed using mg_fclose. */
+static int
+file_cache_open(const struct mg_connection *conn,
+                const char *path,
+                struct mg_file *filep)
+{
+	struct mg_file_cache *cache = file_cache_of(conn);
+	struct mg_file_cache_shard *shard;
+	struct mg_file_cache_entry *e;
+	struct stat st;
+	uint32_t hash;
+	int fd = -1;
+
+	if (cache == NULL) {
+		return 0;
+	}
+
+	hash = lru_cache_hash(path);
+	shard = file_cache_shard(cache, hash);
+
+	pthread_mutex_lock(&shard->lock);
+	e = file_cache_find_file(shard, path, hash, &filep->stat);
+	if ((e == NULL) || (e->fd < 0)) {
+		pthread_mutex_unlock(&shard->lock);
+		if (e == NULL) {
+			return 0;
+		}
+
+		/* Open the file without holding the lock. The file might have
+		 * been replaced since its status has been cached, so check it. */
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			return 0;
+		}
+		if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode)
+		    || ((uint64_t)st.st_size != filep->stat.size)
+		    || (st.st_mtime != filep->stat.last_modified)) {
+			close(fd);
+			return 0;
+		}
+
+		/* The entry might have been removed in the meantime */
+		pthread_mutex_lock(&shard->lock);
+		e = file_cache_find_file(shard, path, hash, &filep->stat);
+		if (e == NULL) {
+			pthread_mutex_unlock(&shard->lock);
+			close(fd);
+			return 0;
+		}
+		if (e->fd < 0) {
+			e->fd = fd;
+			fd = -1;
+		}
+	}
+	e->node.refs++;
+	pthread_mutex_unlock(&shard->lock);
+
+	if (fd >= 0) {
+		/* Another thread opened the file as well */
+		close(fd);
+	}
+
+	filep->access.fp = NULL;
+	filep->access.cache = cache;
+	filep->access.cached = e;
+	return 1;
+}
+
+
+/* Release a file opened by file_cache_open */
+static void
+file_cache_close(struct mg_file_cache *cache, struct mg_file_cache_entry *e)
+{
+	struct mg_file_cache_shard *shard = file_cache_shard(cache, e->node.hash);
+
+	pthread_mutex_lock(&shard->lock);
+	lru_cache_release(&shard->table, &e->node);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+
+/* Remove path from the cache, since it has been modified */
+static void
+file_cache_invalidate(struct mg_file_cache *cache, const char *path)
+{
+	struct mg_file_cache_shard *shard;
+	struct mg_file_cache_entry *e;
+	uint32_t hash;
+
+	if ((cache == NULL) || (path == NULL)) {
+		return;
+	}
+
+	hash = lru_cache_hash(path);
+	shard = file_cache_shard(cache, hash);
+
+	pthread_mutex_lock(&shard->lock);
+	e = file_cache_lookup(shard, path, hash);
+	if (e != NULL) {
+		lru_cache_unlink(&shard->table, &e->node);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+
+/* Called by mg_fopen for a file opened for writing: the cached status
+ * becomes invalid now, and once more when the file is closed. */
+static void
+file_cache_begin_write(const struct mg_connection *conn,
+                       const char *path,
+                       struct mg_file_access *fileacc)
+{
+	size_t len = strlen(path) + 1;
+
+	fileacc->cache = file_cache_of(conn);
+	if (fileacc->cache == NULL) {
+		return;
+	}
+	file_cache_invalidate(fileacc->cache, path);
+	fileacc->written_path = (char *)mg_malloc_ctx(len, conn->phys_ctx);
+	if (fileacc->written_path != NULL) {
+		memcpy(fileacc->written_path, path, len);
+	}
+}
+
+
+/* Called by mg_fclose */
+static void
+file_cache_end_write(struct mg_file_access *fileacc)
+{
+	file_cache_invalidate(fileacc->cache, fileacc->written_path);
+	mg_free(fileacc->written_path);
+	fileacc->written_path = NULL;
+}
+
+
+static int
+file_cache_mkdir(const struct mg_connection *conn, const char *path, int mode)
+{
+	int ret = mkdir(path, (mode_t)mode);
+	file_cache_invalidate(file_cache_of(conn), path);
+	return ret;
+}
+
+
+static int
+file_cache_remove(const struct mg_connection *conn, const char *path)
+{
+	int ret = remove(path);
+	file_cache_invalidate(file_cache_of(conn), path);
+	return ret;
+}
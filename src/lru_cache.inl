@@ -0,0 +1,173 @@
+/* Hash table with a LRU list, shared by the caches for file status
+ * information, compressed files, responses and directory indexes.
+ *
+ * Every cache entry starts with a struct mg_lru_node. The cache counts the
+ * mem_size of all entries in the table; before a new entry is added, the
+ * least recently used entries are removed until it fits into max_size.
+ * Entries still in use by a request (refs > 0) stay allocated after they
+ * have been removed from the table, and are freed by the last call of
+ * lru_cache_release. The caller must hold the lock protecting the cache.
+ */
+
+
+struct mg_lru_node {
+	struct mg_lru_node *next;     /* Next entry in the hash bucket */
+	struct mg_lru_node *lru_prev; /* Less recently used entry */
+	struct mg_lru_node *lru_next; /* More recently used entry */
+	uint32_t hash;
+	size_t mem_size; /* Counted for the size limit */
+	int refs;        /* Number of requests using the entry */
+	int in_table;    /* 0 if removed, but still in use */
+};
+
+
+struct mg_lru_cache {
+	struct mg_lru_node **buckets;
+	unsigned bucket_mask;
+	size_t max_size;
+	size_t size;
+	struct mg_lru_node *lru_oldest;
+	struct mg_lru_node *lru_newest;
+	void (*free_entry)(struct mg_lru_node *node);
+};
+
+
+static uint32_t
+lru_cache_hash(const char *key)
+{
+	return mg_fnv1a(MG_FNV1A_INIT, key, strlen(key));
+}
+
+
+/* Initialize an empty cache with num_buckets (a power of two) buckets.
+ * Return 0 on success, -1 if out of memory. */
+static int
+lru_cache_init(struct mg_lru_cache *cache,
+               unsigned num_buckets,
+               size_t max_size,
+               void (*free_entry)(struct mg_lru_node *node),
+               struct mg_context *ctx)
+{
+	(void)ctx; /* only used for memory statistics */
+
+	memset(cache, 0, sizeof(*cache));
+	cache->buckets = (struct mg_lru_node **)mg_calloc_ctx(
+	    num_buckets, sizeof(cache->buckets[0]), ctx);
+	if (cache->buckets == NULL) {
+		return -1;
+	}
+	cache->bucket_mask = num_buckets - 1;
+	cache->max_size = max_size;
+	cache->free_entry = free_entry;
+	return 0;
+}
+
+
+/* First entry of the bucket for hash. Follow node->next for the others. */
+static struct mg_lru_node *
+lru_cache_bucket(const struct mg_lru_cache *cache, uint32_t hash)
+{
+	return cache->buckets[hash & cache->bucket_mask];
+}
+
+
+/* Remove an entry from the table. It is freed once it is not in use
+ * anymore. */
+static void
+lru_cache_unlink(struct mg_lru_cache *cache, struct mg_lru_node *node)
+{
+	struct mg_lru_node **pp = &cache->buckets[node->hash & cache->bucket_mask];
+
+	while (*pp != node) {
+		pp = &(*pp)->next;
+	}
+	*pp = node->next;
+
+	if (node->lru_prev) {
+		node->lru_prev->lru_next = node->lru_next;
+	} else {
+		cache->lru_oldest = node->lru_next;
+	}
+	if (node->lru_next) {
+		node->lru_next->lru_prev = node->lru_prev;
+	} else {
+		cache->lru_newest = node->lru_prev;
+	}
+	cache->size -= node->mem_size;
+	node->in_table = 0;
+
+	if (node->refs == 0) {
+		cache->free_entry(node);
+	}
+}
+
+
+/* Add an entry as most recently used entry. Old entries are removed,
+ * until the new entry fits into the size limit. */
+static void
+lru_cache_link(struct mg_lru_cache *cache, struct mg_lru_node *node)
+{
+	struct mg_lru_node **bucket =
+	    &cache->buckets[node->hash & cache->bucket_mask];
+
+	while ((cache->lru_oldest != NULL)
+	       && (cache->size + node->mem_size > cache->max_size)) {
+		lru_cache_unlink(cache, cache->lru_oldest);
+	}
+
+	node->next = *bucket;
+	*bucket = node;
+	node->lru_next = NULL;
+	node->lru_prev = cache->lru_newest;
+	if (cache->lru_newest) {
+		cache->lru_newest->lru_next = node;
+	} else {
+		cache->lru_oldest = node;
+	}
+	cache->lru_newest = node;
+	cache->size += node->mem_size;
+	node->in_table = 1;
+}
+
+
+/* Mark an entry in the table as most recently used */
+static void
+lru_cache_touch(struct mg_lru_cache *cache, struct mg_lru_node *node)
+{
+	if (node->lru_next == NULL) {
+		return;
+	}
+	node->lru_next->lru_prev = node->lru_prev;
+	if (node->lru_prev) {
+		node->lru_prev->lru_next = node->lru_next;
+	} else {
+		cache->lru_oldest = node->lru_next;
+	}
+	node->lru_prev = cache->lru_newest;
+	node->lru_next = NULL;
+	cache->lru_newest->lru_next = node;
+	cache->lru_newest = node;
+}
+
+
+/* A request does not use an entry anymore */
+static void
+lru_cache_release(struct mg_lru_cache *cache, struct mg_lru_node *node)
+{
+	node->refs--;
+	if ((node->refs == 0) && !node->in_table) {
+		cache->free_entry(node);
+	}
+}
+
+
+/* Free all entries and the table. No entry may be in use anymore. */
+static void
+lru_cache_free(struct mg_lru_cache *cache)
+{
+	while (cache->lru_oldest != NULL) {
+		lru_cache_unlink(cache, cache->lru_oldest);
+	}
+	mg_free(cache->buckets);
+	cache->buckets = NULL;
+}
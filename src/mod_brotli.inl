@@ -0,0 +1,97 @@
+/* On-the-fly compression using Brotli ("Content-Encoding: br").
+ * The compressed data is passed to an output function (see mod_zlib.inl).
+ */
+#if !defined(USE_BROTLI)
+#error "This file must only be included, if USE_BROTLI is set"
+#endif
+
+
+static void *
+brotli_alloc(void *opaque, size_t size)
+{
+	struct mg_connection *conn = (struct mg_connection *)opaque;
+	void *ret = mg_malloc_ctx(size, conn->phys_ctx);
+	(void)conn; /* mg_malloc_ctx makro might not need it */
+
+	return ret;
+}
+
+
+static void
+brotli_free(void *opaque, void *address)
+{
+	(void)opaque; /* not required */
+
+	mg_free(address);
+}
+
+
+/* Compress a file with Brotli. The compressed data is passed to output in
+ * blocks of up to MG_BUF_LEN bytes.
+ * Return: 0 on success, -1 on error */
+static int
+brotli_compress(struct mg_connection *conn,
+                FILE *in_file,
+                uint64_t file_size,
+                mg_compress_output output,
+                void *arg)
+{
+	BrotliEncoderState *state;
+	BrotliEncoderOperation op = BROTLI_OPERATION_PROCESS;
+	unsigned char in_buf[MG_BUF_LEN];
+	unsigned char out_buf[MG_BUF_LEN];
+	const uint8_t *next_in = in_buf;
+	uint8_t *next_out;
+	size_t avail_in = 0, avail_out;
+	int ret = -1;
+
+	state = BrotliEncoderCreateInstance(brotli_alloc, brotli_free, conn);
+	if (state == NULL) {
+		mg_cry_internal(conn, "%s", "Brotli init failed");
+		return -1;
+	}
+
+	/* The compression level (1-9) is used as Brotli quality (0-11) */
+	BrotliEncoderSetParameter(state,
+	                          BROTLI_PARAM_QUALITY,
+	                          (uint32_t)conn->phys_ctx->compression_level);
+	if (file_size < (1u << 30)) {
+		BrotliEncoderSetParameter(state,
+		                          BROTLI_PARAM_SIZE_HINT,
+		                          (uint32_t)file_size);
+	}
+
+	for (;;) {
+		/* Read more data, until the end of the file */
+		if ((avail_in == 0) && (op == BROTLI_OPERATION_PROCESS)) {
+			avail_in = fread(in_buf, 1, MG_BUF_LEN, in_file);
+			if (ferror(in_file)) {
+				mg_cry_internal(conn, "fread failed: %s", strerror(ERRNO));
+				break;
+			}
+			next_in = in_buf;
+			if (feof(in_file)) {
+				op = BROTLI_OPERATION_FINISH;
+			}
+		}
+
+		avail_out = MG_BUF_LEN;
+		next_out = out_buf;
+		if (!BrotliEncoderCompressStream(
+		        state, op, &avail_in, &next_in, &avail_out, &next_out, NULL)) {
+			mg_cry_internal(conn, "%s", "Brotli compression failed");
+			break;
+		}
+		if ((avail_out < MG_BUF_LEN)
+		    && (output(arg, out_buf, MG_BUF_LEN - avail_out) != 0)) {
+			break;
+		}
+		if (BrotliEncoderIsFinished(state)) {
+			ret = 0;
+			break;
+		}
+	}
+
+	BrotliEncoderDestroyInstance(state);
+	return ret;
+}
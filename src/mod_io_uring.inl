@@ -0,0 +1,310 @@
+/* io_uring based socket and file I/O for worker threads (Linux only).
+ * This file uses the kernel interface directly, liburing is not required.
+ * Every worker thread owns one ring, all operations are synchronous:
+ * the requests for one I/O step are submitted together, and the thread
+ * waits for all of their completions with the same system call.
+ */
+#if !defined(USE_IO_URING)
+#error "This file must only be included, if USE_IO_URING is set"
+#endif
+#if !defined(__linux__)
+#error "USE_IO_URING requires Linux"
+#endif
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Submission queue size. One I/O step uses at most 3 entries. */
+#if !defined(MG_URING_ENTRIES)
+#define MG_URING_ENTRIES (8)
+#endif
+
+struct mg_uring {
+	int fd;
+	void *ring_ptr;
+	size_t ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned to_submit; /* Entries prepared, but not yet submitted */
+};
+
+
+static int
+mg_uring_enter(int fd, unsigned to_submit, unsigned min_complete)
+{
+	return (int)syscall(__NR_io_uring_enter,
+	                    fd,
+	                    to_submit,
+	                    min_complete,
+	                    IORING_ENTER_GETEVENTS,
+	                    NULL,
+	                    0);
+}
+
+
+static void
+mg_uring_destroy(struct mg_uring *ring)
+{
+	if (ring == NULL) {
+		return;
+	}
+	if (ring->sqes != NULL) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->ring_ptr != NULL) {
+		munmap(ring->ring_ptr, ring->ring_size);
+	}
+	close(ring->fd);
+	mg_free(ring);
+}
+
+
+/* Create a ring. Returns NULL, if io_uring is not available (old kernel,
+ * or disabled by the system configuration). The caller must then use
+ * the classic system calls. */
+static struct mg_uring *
+mg_uring_create(void)
+{
+	struct io_uring_params p;
+	struct mg_uring *ring;
+	size_t sq_size, cq_size;
+	char *ptr;
+
+	ring = (struct mg_uring *)mg_calloc(1, sizeof(struct mg_uring));
+	if (ring == NULL) {
+		return NULL;
+	}
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = (int)syscall(__NR_io_uring_setup, MG_URING_ENTRIES, &p);
+	if (ring->fd < 0) {
+		mg_free(ring);
+		return NULL;
+	}
+	set_close_on_exec(ring->fd, NULL, NULL);
+
+	/* FAST_POLL (Linux 5.7) implies support for all operations used here.
+	 * Without it, socket operations would block a kernel worker thread. */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+	    || !(p.features & IORING_FEAT_FAST_POLL)) {
+		mg_uring_destroy(ring);
+		return NULL;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+	ptr = (char *)mmap(NULL,
+	                   ring->ring_size,
+	                   PROT_READ | PROT_WRITE,
+	                   MAP_SHARED | MAP_POPULATE,
+	                   ring->fd,
+	                   IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED) {
+		mg_uring_destroy(ring);
+		return NULL;
+	}
+	ring->ring_ptr = ptr;
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL,
+	                                         ring->sqes_size,
+	                                         PROT_READ | PROT_WRITE,
+	                                         MAP_SHARED | MAP_POPULATE,
+	                                         ring->fd,
+	                                         IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		mg_uring_destroy(ring);
+		return NULL;
+	}
+
+	ring->sq_head = (unsigned *)(ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(ptr + p.sq_off.array);
+	ring->cq_head = (unsigned *)(ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+
+	return ring;
+}
+
+
+/* Get the next free submission queue entry, cleared */
+static struct io_uring_sqe *
+mg_uring_get_sqe(struct mg_uring *ring, uint64_t user_data)
+{
+	unsigned tail = *ring->sq_tail + ring->to_submit;
+	unsigned idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = user_data;
+	ring->sq_array[idx] = idx;
+	ring->to_submit++;
+	return sqe;
+}
+
+
+/* Submit all prepared entries, and wait until all of them are completed.
+ * The completion result of the entry with user_data i is stored in res[i].
+ * Return: 0 on success, -1 if the ring could not be used. */
+static int
+mg_uring_run(struct mg_uring *ring, int *res, unsigned count)
+{
+	unsigned done = 0, head, tail;
+	int n;
+
+	/* Publish the new entries to the kernel */
+	__atomic_store_n(ring->sq_tail,
+	                 *ring->sq_tail + ring->to_submit,
+	                 __ATOMIC_RELEASE);
+
+	while (done < count) {
+		n = mg_uring_enter(ring->fd, ring->to_submit, count - done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			/* Entries that were not accepted are dropped */
+			ring->to_submit = 0;
+			return -1;
+		}
+		ring->to_submit -= ((unsigned)n < ring->to_submit)
+		                       ? (unsigned)n
+		                       : ring->to_submit;
+
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			if (cqe->user_data < count) {
+				res[cqe->user_data] = cqe->res;
+			}
+			head++;
+			done++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+
+static void
+mg_uring_prep_link_timeout(struct mg_uring *ring,
+                           uint64_t user_data,
+                           struct __kernel_timespec *ts,
+                           int timeout_ms)
+{
+	struct io_uring_sqe *sqe = mg_uring_get_sqe(ring, user_data);
+
+	ts->tv_sec = timeout_ms / 1000;
+	ts->tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)ts;
+	sqe->len = 1;
+}
+
+
+/* Send or receive (op = IORING_OP_SEND or IORING_OP_RECV) on a socket,
+ * waiting at most timeout_ms for the socket to become ready.
+ * This replaces a poll and a send/recv call with one system call.
+ * Return: like send/recv, 0 for timeout (send), -ETIMEDOUT for timeout
+ * (recv), or -errno on error. */
+static int
+mg_uring_sock_io(struct mg_uring *ring,
+                 int op,
+                 SOCKET sock,
+                 void *buf,
+                 int len,
+                 int timeout_ms)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe;
+	int res[2] = {-ECANCELED, 0};
+
+	sqe = mg_uring_get_sqe(ring, 0);
+	sqe->opcode = (uint8_t)op;
+	sqe->fd = sock;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = (unsigned)len;
+	sqe->msg_flags = (op == IORING_OP_SEND) ? MSG_NOSIGNAL : 0;
+	sqe->flags = IOSQE_IO_LINK;
+	mg_uring_prep_link_timeout(ring, 1, &ts, timeout_ms);
+
+	if (mg_uring_run(ring, res, 2) != 0) {
+		return -EIO;
+	}
+	if ((res[0] == -ECANCELED) || (res[0] == -EAGAIN)) {
+		/* The timeout expired before the socket was ready */
+		return (op == IORING_OP_SEND) ? 0 : -ETIMEDOUT;
+	}
+	return res[0];
+}
+
+
+/* Read up to len bytes at offset from a file, and send them to a socket,
+ * with one system call. The socket wait is limited to timeout_ms.
+ * The number of bytes read is stored in *nread (0 at the end of the file,
+ * -errno on error).
+ * Return: number of bytes sent, which may be less than *nread if the send
+ * call was not complete or timed out, or -errno on error. */
+static int
+mg_uring_read_send(struct mg_uring *ring,
+                   int fd,
+                   int64_t offset,
+                   SOCKET sock,
+                   char *buf,
+                   int len,
+                   int timeout_ms,
+                   int *nread)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe;
+	int res[3] = {-ECANCELED, -ECANCELED, 0};
+
+	sqe = mg_uring_get_sqe(ring, 0);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->off = (uint64_t)offset;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = (unsigned)len;
+	sqe->flags = IOSQE_IO_LINK;
+
+	/* A short read breaks the link, so the send is only executed if the
+	 * buffer has been filled completely. */
+	sqe = mg_uring_get_sqe(ring, 1);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = sock;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = (unsigned)len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->flags = IOSQE_IO_LINK;
+	mg_uring_prep_link_timeout(ring, 2, &ts, timeout_ms);
+
+	if (mg_uring_run(ring, res, 3) != 0) {
+		*nread = -EIO;
+		return -EIO;
+	}
+
+	*nread = res[0];
+	if ((res[1] == -ECANCELED) || (res[1] == -EAGAIN)) {
+		/* Short read, or timeout */
+		return 0;
+	}
+	return res[1];
+}
@@ -28,8 +28,15 @@ zfree(void *opaque, void *address)
 }
 
 
-static void
-send_compressed_data(struct mg_connection *conn, struct mg_file *filep)
+/* Compress a file with gzip. The compressed data is passed to output in
+ * blocks of up to MG_BUF_LEN bytes.
+ * Return: 0 on success, -1 on error */
+static int
+gzip_compress(struct mg_connection *conn,
+              FILE *in_file,
+              uint64_t file_size,
+              mg_compress_output output,
+              void *arg)
 {
 	int zret;
 	zng_stream zstream;
@@ -37,7 +44,8 @@ send_compressed_data(struct mg_connection *conn, struct mg_file *filep)
 	unsigned bytes_avail;
 	unsigned char in_buf[MG_BUF_LEN];
 	unsigned char out_buf[MG_BUF_LEN];
-	FILE *in_file = filep->access.fp;
+
+	(void)file_size; /* not required for gzip */
 
 	/* Prepare state buffer. User server context memory allocation. */
 	memset(&zstream, 0, sizeof(zstream));
@@ -47,7 +55,7 @@ send_compressed_data(struct mg_connection *conn, struct mg_file *filep)
 
 	/* Initialize for GZIP compression (MAX_WBITS | 16) */
 	zret = zng_deflateInit2(&zstream,
-	                    Z_BEST_COMPRESSION,
+	                    conn->phys_ctx->compression_level,
 	                    Z_DEFLATED,
 	                    MAX_WBITS | 16,
 	                    MEM_LEVEL,
@@ -59,7 +67,7 @@ send_compressed_data(struct mg_connection *conn, struct mg_file *filep)
 		                zret,
 		                (zstream.msg ? zstream.msg : "<no error message>"));
 		zng_deflateEnd(&zstream);
-		return;
+		return -1;
 	}
 
 	/* Read until end of file */
@@ -68,7 +76,7 @@ send_compressed_data(struct mg_connection *conn, struct mg_file *filep)
 		if (ferror(in_file)) {
 			mg_cry_internal(conn, "fread failed: %s", strerror(ERRNO));
 			(void)zng_deflateEnd(&zstream);
-			return;
+			return -1;
 		}
 
 		do_flush = (feof(in_file) ? Z_FINISH : Z_NO_FLUSH);
@@ -89,7 +97,7 @@ send_compressed_data(struct mg_connection *conn, struct mg_file *filep)
 
 			bytes_avail = MG_BUF_LEN - zstream.avail_out;
 			if (bytes_avail) {
-				if (mg_send_chunk(conn, (char *)out_buf, bytes_avail) < 0) {
+				if (output(arg, out_buf, bytes_avail) != 0) {
 					zret = -98;
 					break;
 				}
@@ -117,15 +125,361 @@ send_compressed_data(struct mg_connection *conn, struct mg_file *filep)
 		                "GZIP incomplete (%i): %s",
 		                zret,
 		                (zstream.msg ? zstream.msg : "<no error message>"));
+		zng_deflateEnd(&zstream);
+		return -1;
 	}
 
 	zng_deflateEnd(&zstream);
+	return 0;
+}
+
+
+/* Select the best content encoding accepted by the client, for which a
+ * compressor is available.
+ * Return: MG_ENCODING_*, MG_ENCODING_IDENTITY if there is none */
+static int
+select_on_the_fly_encoding(const struct mg_connection *conn)
+{
+	int i, enc;
+
+	for (i = 0; (enc = conn->accept_encodings[i]) != MG_ENCODING_IDENTITY;
+	     i++) {
+		if ((enc == MG_ENCODING_GZIP)
+#if defined(USE_BROTLI)
+		    || (enc == MG_ENCODING_BR)
+#endif
+#if defined(USE_ZSTD)
+		    || (enc == MG_ENCODING_ZSTD)
+#endif
+		) {
+			return enc;
+		}
+	}
+	return MG_ENCODING_IDENTITY;
+}
+
+
+/* Compress a file with the compressor for a content encoding.
+ * Return: 0 on success, -1 on error */
+static int
+compress_file(struct mg_connection *conn,
+              int encoding,
+              FILE *in_file,
+              uint64_t file_size,
+              mg_compress_output output,
+              void *arg)
+{
+	switch (encoding) {
+#if defined(USE_BROTLI)
+	case MG_ENCODING_BR:
+		return brotli_compress(conn, in_file, file_size, output, arg);
+#endif
+#if defined(USE_ZSTD)
+	case MG_ENCODING_ZSTD:
+		return zstd_compress(conn, in_file, file_size, output, arg);
+#endif
+	default:
+		return gzip_compress(conn, in_file, file_size, output, arg);
+	}
+}
+
+
+/* Output function sending every block as one chunk */
+static int
+compress_output_chunk(void *arg, const unsigned char *data, size_t len)
+{
+	struct mg_connection *conn = (struct mg_connection *)arg;
+
+	return (mg_send_chunk(conn, (const char *)data, (unsigned)len) < 0) ? -1
+	                                                                    : 0;
+}
+
+
+/* Memory block filled by compress_output_buffer */
+struct mg_compress_buffer {
+	struct mg_context *ctx;
+	unsigned char *data;
+	size_t len;
+	size_t size;
+};
+
+
+/* Output function collecting all blocks in memory */
+static int
+compress_output_buffer(void *arg, const unsigned char *data, size_t len)
+{
+	struct mg_compress_buffer *buf = (struct mg_compress_buffer *)arg;
+
+	if (buf->len + len > buf->size) {
+		size_t size = buf->size * 2;
+		unsigned char *grown;
+
+		if (size < buf->len + len) {
+			size = buf->len + len;
+		}
+		grown = (unsigned char *)mg_realloc_ctx(buf->data, size, buf->ctx);
+		if (grown == NULL) {
+			return -1;
+		}
+		buf->data = grown;
+		buf->size = size;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	return 0;
+}
+
+
+static void
+send_compressed_data(struct mg_connection *conn,
+                     struct mg_file *filep,
+                     int encoding)
+{
+	/* Errors are logged by the compressor. There is no way to tell the
+	 * client, except for an incomplete response. */
+	(void)compress_file(conn,
+	                    encoding,
+	                    filep->access.fp,
+	                    filep->stat.size,
+	                    compress_output_chunk,
+	                    (void *)conn);
 
 	/* Send "end of chunked data" marker */
 	mg_write(conn, "0\r\n\r\n", 5);
 }
 
 
+/* Cache for compressed files.
+ * Files compressed on the fly are stored in memory, so the next request
+ * for the same file can be answered without compressing it again.
+ * Entries are identified by the path and the content encoding, and are
+ * only valid as long as the size and modification time of the file did
+ * not change. The total size is limited to compression_cache_size bytes,
+ * the least recently used entries are removed first.
+ */
+#if !defined(MG_COMPRESSION_CACHE_BUCKETS)
+#define MG_COMPRESSION_CACHE_BUCKETS (256) /* must be a power of two */
+#endif
+
+
+struct mg_compression_cache_entry {
+	struct mg_lru_node node; /* Must be the first member */
+	int encoding;            /* MG_ENCODING_* */
+	uint64_t file_size;      /* Size of the uncompressed file */
+	time_t last_modified;    /* Modification time of the uncompressed file */
+	unsigned char *data;     /* Compressed content */
+	size_t data_len;         /* Size of the compressed content */
+	char path[1];            /* Allocated with the required length */
+};
+
+
+struct mg_compression_cache {
+	pthread_mutex_t lock;
+	struct mg_lru_cache table; /* max_size is compression_cache_size */
+};
+
+
+static void
+compression_cache_free_entry(struct mg_lru_node *node)
+{
+	struct mg_compression_cache_entry *e =
+	    (struct mg_compression_cache_entry *)node;
+
+	mg_free(e->data);
+	mg_free(e);
+}
+
+
+static struct mg_compression_cache *
+compression_cache_create(size_t max_size)
+{
+	struct mg_compression_cache *cache = (struct mg_compression_cache *)
+	    mg_calloc(1, sizeof(struct mg_compression_cache));
+
+	if (cache == NULL) {
+		return NULL;
+	}
+	if (0 != lru_cache_init(&cache->table,
+	                        MG_COMPRESSION_CACHE_BUCKETS,
+	                        max_size,
+	                        compression_cache_free_entry,
+	                        NULL)) {
+		mg_free(cache);
+		return NULL;
+	}
+	if (0 != pthread_mutex_init(&cache->lock, NULL)) {
+		lru_cache_free(&cache->table);
+		mg_free(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+
+static void
+compression_cache_destroy(struct mg_compression_cache *cache)
+{
+	if (cache == NULL) {
+		return;
+	}
+	/* All requests are finished, no entry is in use anymore */
+	lru_cache_free(&cache->table);
+	(void)pthread_mutex_destroy(&cache->lock);
+	mg_free(cache);
+}
+
+
+/* Find the entry for a file and an encoding.
+ * Call with cache->lock held. */
+static struct mg_compression_cache_entry *
+compression_cache_lookup(struct mg_compression_cache *cache,
+                         const char *path,
+                         uint32_t hash,
+                         int encoding)
+{
+	struct mg_lru_node *node = lru_cache_bucket(&cache->table, hash);
+	struct mg_compression_cache_entry *e;
+
+	for (; node != NULL; node = node->next) {
+		e = (struct mg_compression_cache_entry *)node;
+		if ((node->hash == hash) && (e->encoding == encoding)
+		    && !strcmp(e->path, path)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+
+/* Find the entry for a file and mark it as used by the caller.
+ * Entries for an older version of the file are removed. */
+static struct mg_compression_cache_entry *
+compression_cache_find(struct mg_compression_cache *cache,
+                       const char *path,
+                       uint32_t hash,
+                       int encoding,
+                       const struct mg_file_stat *filestat)
+{
+	struct mg_compression_cache_entry *e;
+
+	pthread_mutex_lock(&cache->lock);
+	e = compression_cache_lookup(cache, path, hash, encoding);
+	if (e != NULL) {
+		if ((e->file_size != filestat->size)
+		    || (e->last_modified != filestat->last_modified)) {
+			/* The file has been modified */
+			lru_cache_unlink(&cache->table, &e->node);
+			e = NULL;
+		} else {
+			lru_cache_touch(&cache->table, &e->node);
+			e->node.refs++;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return e;
+}
+
+
+/* Release an entry returned by compression_cache_get */
+static void
+compression_cache_release(struct mg_compression_cache *cache,
+                          struct mg_compression_cache_entry *e)
+{
+	pthread_mutex_lock(&cache->lock);
+	lru_cache_release(&cache->table, &e->node);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+/* Get the compressed content of an open file from the cache. If it is not
+ * in the cache yet, the file is compressed and added to the cache.
+ * Return: entry to be released with compression_cache_release, or NULL if
+ * the file cannot be cached (cache disabled, file too large, error). In
+ * this case, the file is still positioned at the beginning. */
+static struct mg_compression_cache_entry *
+compression_cache_get(struct mg_connection *conn,
+                      const char *path,
+                      struct mg_file *filep,
+                      int encoding)
+{
+	struct mg_compression_cache *cache = conn->phys_ctx->compression_cache;
+	struct mg_compression_cache_entry *e, *old;
+	struct mg_compress_buffer buf;
+	uint32_t hash;
+	size_t path_len;
+	unsigned char *shrunk;
+
+	if ((cache == NULL) || (filep->access.fp == NULL)
+	    || (filep->stat.size > cache->table.max_size)) {
+		return NULL;
+	}
+
+	hash = lru_cache_hash(path);
+	e = compression_cache_find(cache, path, hash, encoding, &filep->stat);
+	if (e != NULL) {
+		return e;
+	}
+
+	/* Compress without holding the lock. If another thread compresses
+	 * the same file at the same time, the last result is kept. */
+	buf.ctx = conn->phys_ctx;
+	buf.len = 0;
+	buf.size = (size_t)(filep->stat.size / 2) + MG_BUF_LEN;
+	buf.data = (unsigned char *)mg_malloc_ctx(buf.size, conn->phys_ctx);
+	if ((buf.data == NULL)
+	    || (compress_file(conn,
+	                      encoding,
+	                      filep->access.fp,
+	                      filep->stat.size,
+	                      compress_output_buffer,
+	                      (void *)&buf)
+	        != 0)) {
+		/* Try again without the cache */
+		mg_free(buf.data);
+		rewind(filep->access.fp);
+		return NULL;
+	}
+
+	/* Return unused memory */
+	shrunk = (unsigned char *)mg_realloc_ctx(buf.data,
+	                                         (buf.len > 0) ? buf.len : 1,
+	                                         conn->phys_ctx);
+	if (shrunk != NULL) {
+		buf.data = shrunk;
+	}
+
+	path_len = strlen(path);
+	e = (struct mg_compression_cache_entry *)
+	    mg_calloc_ctx(1, sizeof(*e) + path_len, conn->phys_ctx);
+	if (e == NULL) {
+		mg_free(buf.data);
+		rewind(filep->access.fp);
+		return NULL;
+	}
+	memcpy(e->path, path, path_len + 1);
+	e->node.hash = hash;
+	e->encoding = encoding;
+	e->file_size = filep->stat.size;
+	e->last_modified = filep->stat.last_modified;
+	e->data = buf.data;
+	e->data_len = buf.len;
+	e->node.mem_size = sizeof(*e) + path_len + buf.len;
+	e->node.refs = 1;
+
+	pthread_mutex_lock(&cache->lock);
+	old = compression_cache_lookup(cache, path, hash, encoding);
+	if (old != NULL) {
+		lru_cache_unlink(&cache->table, &old->node);
+	}
+	if (e->node.mem_size <= cache->table.max_size) {
+		lru_cache_link(&cache->table, &e->node);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return e;
+}
+
+
 #if defined(USE_WEBSOCKET) && defined(MG_EXPERIMENTAL_INTERFACES)
 static int
 websocket_deflate_initialize(struct mg_connection *conn, int server)
@@ -0,0 +1,75 @@
+/* On-the-fly compression using Zstandard ("Content-Encoding: zstd").
+ * The compressed data is passed to an output function (see mod_zlib.inl).
+ */
+#if !defined(USE_ZSTD)
+#error "This file must only be included, if USE_ZSTD is set"
+#endif
+
+
+/* Compress a file with Zstandard. The compressed data is passed to output
+ * in blocks of up to MG_BUF_LEN bytes.
+ * Return: 0 on success, -1 on error */
+static int
+zstd_compress(struct mg_connection *conn,
+              FILE *in_file,
+              uint64_t file_size,
+              mg_compress_output output,
+              void *arg)
+{
+	ZSTD_CCtx *cctx;
+	ZSTD_inBuffer input;
+	ZSTD_outBuffer out;
+	unsigned char in_buf[MG_BUF_LEN];
+	unsigned char out_buf[MG_BUF_LEN];
+	size_t remaining;
+	int last;
+
+	cctx = ZSTD_createCCtx();
+	if (cctx == NULL) {
+		mg_cry_internal(conn, "%s", "Zstd init failed");
+		return -1;
+	}
+
+	/* The compression level (1-9) is used as Zstandard level (1-19).
+	 * The size is stored in the frame header. */
+	ZSTD_CCtx_setParameter(cctx,
+	                       ZSTD_c_compressionLevel,
+	                       conn->phys_ctx->compression_level);
+	ZSTD_CCtx_setPledgedSrcSize(cctx, file_size);
+
+	/* Read until end of file */
+	do {
+		input.src = in_buf;
+		input.size = fread(in_buf, 1, MG_BUF_LEN, in_file);
+		input.pos = 0;
+		if (ferror(in_file)) {
+			mg_cry_internal(conn, "fread failed: %s", strerror(ERRNO));
+			ZSTD_freeCCtx(cctx);
+			return -1;
+		}
+		last = feof(in_file);
+
+		/* Compress all input, flush the frame after the last block */
+		do {
+			out.dst = out_buf;
+			out.size = MG_BUF_LEN;
+			out.pos = 0;
+			remaining = ZSTD_compressStream2(
+			    cctx, &out, &input, last ? ZSTD_e_end : ZSTD_e_continue);
+			if (ZSTD_isError(remaining)) {
+				mg_cry_internal(conn,
+				                "Zstd compression failed: %s",
+				                ZSTD_getErrorName(remaining));
+				ZSTD_freeCCtx(cctx);
+				return -1;
+			}
+			if ((out.pos > 0) && (output(arg, out_buf, out.pos) != 0)) {
+				ZSTD_freeCCtx(cctx);
+				return -1;
+			}
+		} while (last ? (remaining != 0) : (input.pos != input.size));
+	} while (!last);
+
+	ZSTD_freeCCtx(cctx);
+	return 0;
+}
@@ -31,6 +31,7 @@ typedef struct bignum BIGNUM;
 typedef struct ossl_init_settings_st OPENSSL_INIT_SETTINGS;
 typedef struct evp_md EVP_MD;
 typedef struct x509 X509;
+typedef struct bio_st BIO;
 
 
 #define SSL_CTRL_OPTIONS (32)
@@ -59,6 +60,9 @@ typedef struct x509 X509;
 #define SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION (0x00010000ul)
 #define SSL_OP_NO_COMPRESSION (0x00020000ul)
 #define SSL_OP_NO_RENEGOTIATION (0x40000000ul)
+#define SSL_OP_ENABLE_KTLS (0x00000008ul)
+
+#define BIO_CTRL_GET_KTLS_SEND (73)
 
 #define SSL_CB_HANDSHAKE_START (0x10)
 #define SSL_CB_HANDSHAKE_DONE (0x20)
@@ -85,6 +89,7 @@ typedef struct x509 X509;
 enum ssl_func_category {
 	TLS_Mandatory, /* required for HTTPS */
 	TLS_ALPN,      /* required for Application Layer Protocol Negotiation */
+	TLS_KTLS,      /* required for kernel TLS (sendfile for HTTPS) */
 	TLS_END_OF_LIST
 };
 
@@ -179,6 +184,9 @@ typedef int (*tSSL_next_protos_advertised_cb)(SSL *ssl,
 	      .ptr)
 
 #define SSL_CTX_set_timeout (*(long (*)(SSL_CTX *, long))ssl_sw[42].ptr)
+#define SSL_sendfile                                                           \
+	(*(ssize_t(*)(SSL *, int, off_t, size_t, int))ssl_sw[43].ptr)
+#define SSL_get_wbio (*(BIO * (*)(const SSL *)) ssl_sw[44].ptr)
 
 #define SSL_CTX_clear_options(ctx, op)                                         \
 	SSL_CTX_ctrl((ctx), SSL_CTRL_CLEAR_OPTIONS, (op), NULL)
@@ -229,6 +237,9 @@ typedef int (*tSSL_next_protos_advertised_cb)(SSL *ssl,
 #define BN_free (*(void (*)(const BIGNUM *a))crypto_sw[13].ptr)
 #define CRYPTO_free (*(void (*)(void *addr))crypto_sw[14].ptr)
 #define ERR_clear_error (*(void (*)(void))crypto_sw[15].ptr)
+#define BIO_ctrl (*(long (*)(BIO *, int, long, void *))crypto_sw[16].ptr)
+
+#define BIO_get_ktls_send(b) (BIO_ctrl(b, BIO_CTRL_GET_KTLS_SEND, 0, NULL) > 0)
 
 #define OPENSSL_free(a) CRYPTO_free(a)
 
@@ -286,6 +297,8 @@ static struct ssl_func ssl_sw[] = {
     {"SSL_CTX_set_alpn_select_cb", TLS_ALPN, NULL},
     {"SSL_CTX_set_next_protos_advertised_cb", TLS_ALPN, NULL},
     {"SSL_CTX_set_timeout", TLS_Mandatory, NULL},
+    {"SSL_sendfile", TLS_KTLS, NULL},
+    {"SSL_get_wbio", TLS_KTLS, NULL},
     {NULL, TLS_END_OF_LIST, NULL}};
 
 
@@ -308,6 +321,7 @@ static struct ssl_func crypto_sw[] = {
     {"BN_free", TLS_Mandatory, NULL},
     {"CRYPTO_free", TLS_Mandatory, NULL},
     {"ERR_clear_error", TLS_Mandatory, NULL},
+    {"BIO_ctrl", TLS_KTLS, NULL},
     {NULL, TLS_END_OF_LIST, NULL}};
 #endif
 
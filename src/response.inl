@@ -36,9 +36,11 @@ free_buffered_response_header_list(struct mg_connection *conn)
 }
 
 
-/* Send first line of HTTP/1.x response */
+/* Print first line of HTTP/1.x response */
 static void
-send_http1_response_status_line(struct mg_connection *conn)
+print_http1_response_status_line(struct mg_connection *conn,
+                                 char *buf,
+                                 size_t buf_len)
 {
 	const char *status_txt;
 	const char *http_version = conn->request_info.http_version;
@@ -55,10 +57,53 @@ send_http1_response_status_line(struct mg_connection *conn)
 	/* mg_get_response_code_text will never return NULL */
 	status_txt = mg_get_response_code_text(conn, conn->status_code);
 
-	mg_printf(conn, "HTTP/%s %i %s\r\n", http_version, status_code, status_txt);
+	mg_snprintf(conn,
+	            NULL, /* No truncation check: status text is short */
+	            buf,
+	            buf_len,
+	            "HTTP/%s %i %s\r\n",
+	            http_version,
+	            status_code,
+	            status_txt);
 }
 
 
+#if defined(NO_RESPONSE_BUFFERING)
+/* Send first line of HTTP/1.x response */
+static void
+send_http1_response_status_line(struct mg_connection *conn)
+{
+	char line[128];
+
+	print_http1_response_status_line(conn, line, sizeof(line));
+	mg_write(conn, line, strlen(line));
+}
+
+
+#else
+/* Append data to a buffer of MG_BUF_LEN bytes used to send the response
+ * header with a single write. The buffer is sent early only if it is full. */
+static void
+append_response_header_data(struct mg_connection *conn,
+                            char *buf,
+                            size_t *buf_len,
+                            const char *data,
+                            size_t len)
+{
+	if (*buf_len + len > MG_BUF_LEN) {
+		mg_write(conn, buf, *buf_len);
+		*buf_len = 0;
+		if (len > MG_BUF_LEN) {
+			mg_write(conn, data, len);
+			return;
+		}
+	}
+	memcpy(buf + *buf_len, data, len);
+	*buf_len += len;
+}
+#endif
+
+
 /* Initialize a new HTTP response
  * Parameters:
  *   conn: Current connection handle.
@@ -262,6 +307,9 @@ mg_response_header_send(struct mg_connection *conn)
 	int i;
 	int has_date = 0;
 	int has_connection = 0;
+	char buf[MG_BUF_LEN];
+	size_t buf_len = 0;
+	char line[128];
 #endif
 
 	if (conn == NULL) {
@@ -289,20 +337,23 @@ mg_response_header_send(struct mg_connection *conn)
 	}
 #endif
 
-	/* Send */
-	send_http1_response_status_line(conn);
+	/* Collect the complete header in buf, to send it with one write */
+	print_http1_response_status_line(conn, line, sizeof(line));
+	append_response_header_data(conn, buf, &buf_len, line, strlen(line));
 	for (i = 0; i < conn->response_info.num_headers; i++) {
-		mg_printf(conn,
-		          "%s: %s\r\n",
-		          conn->response_info.http_headers[i].name,
-		          conn->response_info.http_headers[i].value);
+		const char *name = conn->response_info.http_headers[i].name;
+		const char *value = conn->response_info.http_headers[i].value;
+
+		append_response_header_data(conn, buf, &buf_len, name, strlen(name));
+		append_response_header_data(conn, buf, &buf_len, ": ", 2);
+		append_response_header_data(conn, buf, &buf_len, value, strlen(value));
+		append_response_header_data(conn, buf, &buf_len, "\r\n", 2);
 
 		/* Check for some special headers */
-		if (!mg_strcasecmp("Date", conn->response_info.http_headers[i].name)) {
+		if (!mg_strcasecmp("Date", name)) {
 			has_date = 1;
 		}
-		if (!mg_strcasecmp("Connection",
-		                   conn->response_info.http_headers[i].name)) {
+		if (!mg_strcasecmp("Connection", name)) {
 			has_connection = 1;
 		}
 	}
@@ -311,14 +362,25 @@ mg_response_header_send(struct mg_connection *conn)
 		time_t curtime = time(NULL);
 		char date[64];
 		gmt_time_string(date, sizeof(date), &curtime);
-		mg_printf(conn, "Date: %s\r\n", date);
+		mg_snprintf(conn, NULL, line, sizeof(line), "Date: %s\r\n", date);
+		append_response_header_data(conn, buf, &buf_len, line, strlen(line));
 	}
 	if (!has_connection) {
-		mg_printf(conn, "Connection: %s\r\n", suggest_connection_header(conn));
+		mg_snprintf(conn,
+		            NULL,
+		            line,
+		            sizeof(line),
+		            "Connection: %s\r\n",
+		            suggest_connection_header(conn));
+		append_response_header_data(conn, buf, &buf_len, line, strlen(line));
 	}
-#endif
 
+	append_response_header_data(conn, buf, &buf_len, "\r\n", 2);
+	mg_write(conn, buf, buf_len);
+#else
 	mg_write(conn, "\r\n", 2);
+#endif
+
 	conn->request_state = 3;
 
 	/* ok */
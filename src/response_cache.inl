@@ -0,0 +1,294 @@
+/* Cache for complete responses of small static files.
+ * An entry holds all header lines of a "200 OK" response, the empty line
+ * terminating the header and the content of the file in one memory block.
+ * A cache hit is sent with one writev call: only the status line, the
+ * "Date" and the "Connection" header are created for every request.
+ * Entries are identified by the path, the domain and the presence of a
+ * CORS header, and are only valid as long as the size and modification
+ * time of the file did not change. The total size is limited to
+ * response_cache_size bytes, the least recently used entries are removed
+ * first.
+ */
+#if !defined(USE_RESPONSE_CACHE)
+#error "This file must only be included, if USE_RESPONSE_CACHE is set"
+#endif
+
+#if !defined(MG_RESPONSE_CACHE_BUCKETS)
+#define MG_RESPONSE_CACHE_BUCKETS (256) /* must be a power of two */
+#endif
+
+
+struct mg_response_cache_entry {
+	struct mg_lru_node node; /* Must be the first member */
+	const struct mg_domain_context *dom_ctx; /* Configuration used */
+	int cors;             /* 1 if the response has a CORS header */
+	uint64_t file_size;   /* Size of the file */
+	time_t last_modified; /* Modification time of the file */
+	char *data;           /* Header lines, empty line and file content */
+	size_t header_len;    /* Size of the header lines and the empty line */
+	size_t data_len;      /* Size of the complete block */
+	char path[1];         /* Allocated with the required length */
+};
+
+
+struct mg_response_cache {
+	pthread_mutex_t lock;
+	struct mg_lru_cache table; /* max_size is response_cache_size */
+	size_t max_file_size;      /* Limit for the size of one file */
+};
+
+
+static void
+response_cache_free_entry(struct mg_lru_node *node)
+{
+	mg_free(node);
+}
+
+
+static struct mg_response_cache *
+response_cache_create(size_t max_size, size_t max_file_size)
+{
+	struct mg_response_cache *cache = (struct mg_response_cache *)mg_calloc(
+	    1, sizeof(struct mg_response_cache));
+
+	if (cache == NULL) {
+		return NULL;
+	}
+	if (0 != lru_cache_init(&cache->table,
+	                        MG_RESPONSE_CACHE_BUCKETS,
+	                        max_size,
+	                        response_cache_free_entry,
+	                        NULL)) {
+		mg_free(cache);
+		return NULL;
+	}
+	if (0 != pthread_mutex_init(&cache->lock, NULL)) {
+		lru_cache_free(&cache->table);
+		mg_free(cache);
+		return NULL;
+	}
+	cache->max_file_size = max_file_size;
+	return cache;
+}
+
+
+static void
+response_cache_destroy(struct mg_response_cache *cache)
+{
+	if (cache == NULL) {
+		return;
+	}
+	/* All requests are finished, no entry is in use anymore */
+	lru_cache_free(&cache->table);
+	(void)pthread_mutex_destroy(&cache->lock);
+	mg_free(cache);
+}
+
+
+/* Find the entry for a file. Call with cache->lock held. */
+static struct mg_response_cache_entry *
+response_cache_lookup(struct mg_response_cache *cache,
+                      const struct mg_domain_context *dom_ctx,
+                      const char *path,
+                      uint32_t hash,
+                      int cors)
+{
+	struct mg_lru_node *node = lru_cache_bucket(&cache->table, hash);
+	struct mg_response_cache_entry *e;
+
+	for (; node != NULL; node = node->next) {
+		e = (struct mg_response_cache_entry *)node;
+		if ((node->hash == hash) && (e->dom_ctx == dom_ctx)
+		    && (e->cors == cors) && !strcmp(e->path, path)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+
+/* Release an entry used to send a response */
+static void
+response_cache_release(struct mg_response_cache *cache,
+                       struct mg_response_cache_entry *e)
+{
+	pthread_mutex_lock(&cache->lock);
+	lru_cache_release(&cache->table, &e->node);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+/* Send a response from a cache entry, and release the entry */
+static void
+response_cache_send_entry(struct mg_connection *conn,
+                          struct mg_response_cache_entry *e,
+                          int is_head_request)
+{
+	struct mg_response_cache *cache = conn->phys_ctx->response_cache;
+	struct mg_iovec iov[2];
+	char head[256], date[64];
+	size_t len;
+	time_t now = time(NULL);
+
+	print_http1_response_status_line(conn, head, sizeof(head));
+	len = strlen(head);
+	gmt_time_string(date, sizeof(date), &now);
+	mg_snprintf(conn,
+	            NULL, /* No truncation check: the lines are short */
+	            head + len,
+	            sizeof(head) - len,
+	            "Date: %s\r\nConnection: %s\r\n",
+	            date,
+	            suggest_connection_header(conn));
+
+	iov[0].buf = head;
+	iov[0].len = strlen(head);
+	iov[1].buf = e->data;
+	iov[1].len = is_head_request ? e->header_len : e->data_len;
+	(void)mg_writev(conn, iov, 2);
+
+	response_cache_release(cache, e);
+}
+
+
+/* Check if the response for a file may be stored in the cache */
+static int
+response_cache_usable(const struct mg_connection *conn,
+                      const struct mg_file_stat *filestat)
+{
+	const struct mg_response_cache *cache = conn->phys_ctx->response_cache;
+
+	return (cache != NULL) && (conn->protocol_type == PROTOCOL_TYPE_HTTP1)
+	       && !conn->in_error_handler
+	       && (filestat->size <= cache->max_file_size);
+}
+
+
+/* Send the response for a file from the cache.
+ * Return 1 if the response has been sent, 0 if the file is not in the
+ * cache or has been modified. */
+static int
+response_cache_send(struct mg_connection *conn,
+                    const char *path,
+                    const struct mg_file_stat *filestat,
+                    int cors,
+                    int is_head_request)
+{
+	struct mg_response_cache *cache = conn->phys_ctx->response_cache;
+	struct mg_response_cache_entry *e;
+	uint32_t hash = lru_cache_hash(path);
+
+	pthread_mutex_lock(&cache->lock);
+	e = response_cache_lookup(cache, conn->dom_ctx, path, hash, cors);
+	if (e != NULL) {
+		if ((e->file_size != filestat->size)
+		    || (e->last_modified != filestat->last_modified)) {
+			/* The file has been modified */
+			lru_cache_unlink(&cache->table, &e->node);
+			e = NULL;
+		} else {
+			lru_cache_touch(&cache->table, &e->node);
+			e->node.refs++;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (e == NULL) {
+		return 0;
+	}
+	response_cache_send_entry(conn, e, is_head_request);
+	return 1;
+}
+
+
+/* Create a cache entry from the response headers collected by
+ * mg_response_header_add and the content of the open file, store it in the
+ * cache and send the response.
+ * Return 1 if the response has been sent, 0 if it cannot be cached. In this
+ * case, the file is still positioned at the beginning, and the headers
+ * must be sent by the caller. */
+static int
+response_cache_add(struct mg_connection *conn,
+                   const char *path,
+                   struct mg_file *filep,
+                   int cors,
+                   int is_head_request)
+{
+	struct mg_response_cache *cache = conn->phys_ctx->response_cache;
+	struct mg_response_cache_entry *e, *old;
+	size_t header_len = 2; /* empty line */
+	size_t path_len, file_len, pos;
+	int i;
+
+	if (filep->access.fp == NULL) {
+		return 0;
+	}
+	for (i = 0; i < conn->response_info.num_headers; i++) {
+		const char *name = conn->response_info.http_headers[i].name;
+
+		/* Headers created for every request must not be configured */
+		if (!mg_strcasecmp("Date", name)
+		    || !mg_strcasecmp("Connection", name)) {
+			return 0;
+		}
+		header_len += strlen(name) + 2
+		              + strlen(conn->response_info.http_headers[i].value) + 2;
+	}
+
+	path_len = strlen(path);
+	file_len = (size_t)filep->stat.size;
+	e = (struct mg_response_cache_entry *)mg_calloc_ctx(
+	    1, sizeof(*e) + path_len + header_len + file_len, conn->phys_ctx);
+	if (e == NULL) {
+		return 0;
+	}
+	memcpy(e->path, path, path_len + 1);
+	e->data = e->path + path_len + 1;
+
+	/* The file might have been modified since mg_stat has been called */
+	if ((fread(e->data + header_len, 1, file_len, filep->access.fp)
+	     != file_len)
+	    || (fgetc(filep->access.fp) != EOF)) {
+		mg_free(e);
+		rewind(filep->access.fp);
+		return 0;
+	}
+
+	pos = 0;
+	for (i = 0; i < conn->response_info.num_headers; i++) {
+		const char *name = conn->response_info.http_headers[i].name;
+		const char *value = conn->response_info.http_headers[i].value;
+		size_t name_len = strlen(name), value_len = strlen(value);
+
+		memcpy(e->data + pos, name, name_len);
+		memcpy(e->data + pos + name_len, ": ", 2);
+		memcpy(e->data + pos + name_len + 2, value, value_len);
+		memcpy(e->data + pos + name_len + 2 + value_len, "\r\n", 2);
+		pos += name_len + 2 + value_len + 2;
+	}
+	memcpy(e->data + pos, "\r\n", 2);
+
+	e->node.hash = lru_cache_hash(path);
+	e->dom_ctx = conn->dom_ctx;
+	e->cors = cors;
+	e->file_size = filep->stat.size;
+	e->last_modified = filep->stat.last_modified;
+	e->header_len = header_len;
+	e->data_len = header_len + file_len;
+	e->node.mem_size = sizeof(*e) + path_len + e->data_len;
+	e->node.refs = 1;
+
+	pthread_mutex_lock(&cache->lock);
+	old =
+	    response_cache_lookup(cache, conn->dom_ctx, path, e->node.hash, cors);
+	if (old != NULL) {
+		lru_cache_unlink(&cache->table, &old->node);
+	}
+	if (e->node.mem_size <= cache->table.max_size) {
+		lru_cache_link(&cache->table, &e->node);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	response_cache_send_entry(conn, e, is_head_request);
+	return 1;
+}
@@ -0,0 +1,347 @@
+/* Bandwidth limits ("throttle" option) using token buckets.
+ * The option is compiled into a list of rules once per domain (see
+ * init_domain_config). For every request, the last rule matching the
+ * client address or the URI is selected. The limit of a rule applies to
+ *   - every connection on its own (default),
+ *   - all connections from the same client IP address ("/ip" suffix),
+ *   - all connections using the rule together ("/shared" suffix).
+ * Buckets are refilled continuously and hold at most MG_THROTTLE_BURST_MS
+ * worth of data, so a throttled connection sends small slices of data
+ * at short intervals instead of one block per second.
+ */
+
+#if !defined(MG_THROTTLE_BURST_MS)
+#define MG_THROTTLE_BURST_MS (100)
+#endif
+
+#if !defined(MG_THROTTLE_CLIENTS)
+#define MG_THROTTLE_CLIENTS (256) /* must be a power of two */
+#endif
+
+/* Number of entries searched for a client address */
+#define MG_THROTTLE_PROBES (8)
+
+
+enum { THROTTLE_MATCH_ALL, THROTTLE_MATCH_NET, THROTTLE_MATCH_URI };
+
+enum { THROTTLE_PER_CONNECTION, THROTTLE_PER_IP, THROTTLE_SHARED };
+
+
+struct mg_throttle_client {
+	int family;       /* 0 if the entry has not been used yet */
+	uint8_t addr[16]; /* IPv4 addresses use the first 4 bytes */
+	struct mg_throttle_bucket bucket;
+};
+
+
+struct mg_throttle_rule {
+	int match;
+	int scope;
+	struct mg_net net;                  /* THROTTLE_MATCH_NET */
+	struct mg_pattern_token *uri;       /* THROTTLE_MATCH_URI, compiled */
+	double rate;                        /* Bytes per second, 0 = unlimited */
+	double burst;                       /* Size of a bucket in bytes */
+	struct mg_throttle_bucket shared;   /* THROTTLE_SHARED */
+	struct mg_throttle_client *clients; /* THROTTLE_PER_IP */
+};
+
+
+struct mg_throttle {
+	pthread_mutex_t lock; /* Protects buckets used by several connections */
+	int num_rules;
+	struct mg_throttle_rule *rules;
+};
+
+
+/* Parse a rate "1.5", "10k" or "2m", optionally followed by "/ip" or
+ * "/shared". Return 1 on success, 0 if malformed. */
+static int
+throttle_parse_rate(const struct vec *val, double *rate, int *scope)
+{
+	char buf[64];
+	char *end;
+	double v;
+
+	if ((val->ptr == NULL) || (val->len >= sizeof(buf))) {
+		return 0;
+	}
+	memcpy(buf, val->ptr, val->len);
+	buf[val->len] = '\0';
+
+	v = strtod(buf, &end);
+	if ((end == buf) || !(v >= 0)) {
+		return 0;
+	}
+	if (lowercase(end) == 'k') {
+		v *= 1024;
+		end++;
+	} else if (lowercase(end) == 'm') {
+		v *= 1048576;
+		end++;
+	}
+
+	if (*end != '/') {
+		*scope = THROTTLE_PER_CONNECTION;
+	} else if (!mg_strcasecmp(end, "/ip")) {
+		*scope = THROTTLE_PER_IP;
+	} else if (!mg_strcasecmp(end, "/shared")) {
+		*scope = THROTTLE_SHARED;
+	} else {
+		return 0;
+	}
+	*rate = v;
+	return 1;
+}
+
+
+static void
+throttle_destroy(struct mg_throttle *throttle)
+{
+	int i;
+
+	if (throttle == NULL) {
+		return;
+	}
+	for (i = 0; i < throttle->num_rules; i++) {
+		mg_free(throttle->rules[i].clients);
+	}
+	(void)pthread_mutex_destroy(&throttle->lock);
+	mg_free(throttle);
+}
+
+
+/* Compile the throttle option. Malformed entries are ignored.
+ * Return NULL if the option does not contain any rule. */
+static struct mg_throttle *
+throttle_create(const char *spec)
+{
+	struct mg_throttle *throttle;
+	struct mg_throttle_rule *rule;
+	struct mg_pattern_token *tokens;
+	struct vec vec, val;
+	const char *list;
+	int num_entries = 0;
+
+	for (list = spec; (list = next_option(list, &vec, &val)) != NULL;) {
+		num_entries++;
+	}
+	if (num_entries == 0) {
+		return NULL;
+	}
+
+	/* The compiled URI patterns (pattern length + 1 tokens each) are
+	 * stored behind the rules */
+	throttle = (struct mg_throttle *)mg_calloc(
+	    1,
+	    sizeof(*throttle) + num_entries * sizeof(struct mg_throttle_rule)
+	        + (strlen(spec) + num_entries) * sizeof(struct mg_pattern_token));
+	if (throttle == NULL) {
+		return NULL;
+	}
+	if (0 != pthread_mutex_init(&throttle->lock, NULL)) {
+		mg_free(throttle);
+		return NULL;
+	}
+	throttle->rules = (struct mg_throttle_rule *)(throttle + 1);
+	tokens = (struct mg_pattern_token *)(void *)(throttle->rules + num_entries);
+
+	for (list = spec; (list = next_option(list, &vec, &val)) != NULL;) {
+		rule = &throttle->rules[throttle->num_rules];
+		if (!throttle_parse_rate(&val, &rule->rate, &rule->scope)) {
+			continue;
+		}
+		if ((vec.len == 1) && (vec.ptr[0] == '*')) {
+			rule->match = THROTTLE_MATCH_ALL;
+		} else if (parse_net(&vec, &rule->net, 0)) {
+			rule->match = THROTTLE_MATCH_NET;
+		} else {
+			rule->match = THROTTLE_MATCH_URI;
+			rule->uri = tokens;
+			compile_pattern(vec.ptr, vec.len, tokens);
+			tokens += vec.len + 1;
+		}
+		rule->burst = rule->rate * MG_THROTTLE_BURST_MS / 1000.0;
+		if (rule->burst < 1.0) {
+			rule->burst = 1.0;
+		}
+		if ((rule->scope == THROTTLE_PER_IP) && (rule->rate > 0)) {
+			rule->clients = (struct mg_throttle_client *)mg_calloc(
+			    MG_THROTTLE_CLIENTS, sizeof(struct mg_throttle_client));
+			if (rule->clients == NULL) {
+				throttle_destroy(throttle);
+				return NULL;
+			}
+		}
+		throttle->num_rules++;
+	}
+
+	if (throttle->num_rules == 0) {
+		throttle_destroy(throttle);
+		return NULL;
+	}
+	return throttle;
+}
+
+
+/* Select the rule limiting the current request. The last matching rule
+ * wins. A rule with a rate of 0 removes the limit. */
+static void
+throttle_select(struct mg_connection *conn, const char *uri)
+{
+	struct mg_throttle *throttle = conn->dom_ctx->cfg.throttle;
+	struct mg_throttle_rule *rule, *selected = NULL;
+	int i;
+
+	for (i = 0; (throttle != NULL) && (i < throttle->num_rules); i++) {
+		rule = &throttle->rules[i];
+		if ((rule->match == THROTTLE_MATCH_ALL)
+		    || ((rule->match == THROTTLE_MATCH_NET)
+		        && match_net(&rule->net, &conn->client.rsa))
+		    || ((rule->match == THROTTLE_MATCH_URI)
+		        && (match_pattern(rule->uri, uri) > 0))) {
+			selected = rule;
+		}
+	}
+
+	conn->throttle = ((selected != NULL) && (selected->rate > 0)) ? selected
+	                                                              : NULL;
+	conn->throttle_bucket.tokens = 0;
+	conn->throttle_bucket.last_ns = 0; /* full at the first use */
+}
+
+
+/* Find the bucket of a client address, or reuse the entry not used for
+ * the longest time. Call with throttle->lock held. */
+static struct mg_throttle_bucket *
+throttle_client_bucket(struct mg_throttle_rule *rule, const union usa *rsa)
+{
+	struct mg_throttle_client *c, *oldest = NULL;
+	uint8_t addr[16];
+	uint32_t h;
+	int i, family = rsa->sa.sa_family;
+
+	memset(addr, 0, sizeof(addr));
+	if (family == AF_INET) {
+		memcpy(addr, &rsa->sin.sin_addr, 4);
+	}
+#if defined(USE_IPV6)
+	else if (family == AF_INET6) {
+		memcpy(addr, &rsa->sin6.sin6_addr, 16);
+	}
+#endif
+	h = mg_fnv1a(MG_FNV1A_INIT, addr, sizeof(addr));
+
+	for (i = 0; i < MG_THROTTLE_PROBES; i++) {
+		c = &rule->clients[(h + (uint32_t)i) & (MG_THROTTLE_CLIENTS - 1)];
+		if ((c->family == family) && !memcmp(c->addr, addr, sizeof(addr))) {
+			return &c->bucket;
+		}
+		if (c->family == 0) {
+			oldest = c;
+			break;
+		}
+		if ((oldest == NULL) || (c->bucket.last_ns < oldest->bucket.last_ns)) {
+			oldest = c;
+		}
+	}
+
+	oldest->family = family;
+	memcpy(oldest->addr, addr, sizeof(addr));
+	oldest->bucket.tokens = 0;
+	oldest->bucket.last_ns = 0;
+	return &oldest->bucket;
+}
+
+
+/* Return the bucket of a throttled connection, and lock it if it is
+ * shared with other connections. */
+static struct mg_throttle_bucket *
+throttle_lock_bucket(struct mg_connection *conn)
+{
+	struct mg_throttle_rule *rule = conn->throttle;
+
+	if (rule->scope == THROTTLE_PER_CONNECTION) {
+		return &conn->throttle_bucket;
+	}
+	pthread_mutex_lock(&conn->dom_ctx->cfg.throttle->lock);
+	if (rule->scope == THROTTLE_PER_IP) {
+		return throttle_client_bucket(rule, &conn->client.rsa);
+	}
+	return &rule->shared;
+}
+
+
+static void
+throttle_unlock_bucket(struct mg_connection *conn)
+{
+	if (conn->throttle->scope != THROTTLE_PER_CONNECTION) {
+		pthread_mutex_unlock(&conn->dom_ctx->cfg.throttle->lock);
+	}
+}
+
+
+static void
+throttle_refill(const struct mg_throttle_rule *rule,
+                struct mg_throttle_bucket *bucket)
+{
+	uint64_t now = mg_get_current_time_ns();
+
+	if (bucket->last_ns == 0) {
+		bucket->tokens = rule->burst;
+	} else if (now > bucket->last_ns) {
+		bucket->tokens += (double)(now - bucket->last_ns) * rule->rate / 1.0e9;
+		if (bucket->tokens > rule->burst) {
+			bucket->tokens = rule->burst;
+		}
+	}
+	bucket->last_ns = now;
+}
+
+
+/* Wait until data may be sent on a throttled connection.
+ * Return the number of bytes (1 to want) that may be sent now, or 0 if the
+ * server is stopping. */
+static int
+throttle_reserve(struct mg_connection *conn, int want)
+{
+	const struct mg_throttle_rule *rule = conn->throttle;
+	struct mg_throttle_bucket *bucket;
+	double need = (want < rule->burst) ? (double)want : rule->burst;
+	int granted, wait_ms;
+
+	for (;;) {
+		bucket = throttle_lock_bucket(conn);
+		throttle_refill(rule, bucket);
+		if (bucket->tokens >= need) {
+			granted = (bucket->tokens < want) ? (int)bucket->tokens : want;
+			bucket->tokens -= granted;
+			throttle_unlock_bucket(conn);
+			return granted;
+		}
+		wait_ms = (int)((need - bucket->tokens) * 1000.0 / rule->rate) + 1;
+		throttle_unlock_bucket(conn);
+
+		if (!STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)) {
+			return 0;
+		}
+		/* Check the stop flag at least every 100 ms */
+		mg_sleep((wait_ms < 100) ? wait_ms : 100);
+	}
+}
+
+
+/* Return bytes reserved by throttle_reserve, but not sent */
+static void
+throttle_refund(struct mg_connection *conn, int unused)
+{
+	struct mg_throttle_bucket *bucket;
+
+	if (unused > 0) {
+		bucket = throttle_lock_bucket(conn);
+		bucket->tokens += unused;
+		if (bucket->tokens > conn->throttle->burst) {
+			bucket->tokens = conn->throttle->burst;
+		}
+		throttle_unlock_bucket(conn);
+	}
+}
@@ -0,0 +1,534 @@
+/* Sending the same websocket message to many clients ("broadcast").
+ * The frame header is created only once, and the frame is stored in a
+ * reference counted buffer used for all clients. Messages compressed
+ * according to rfc7692 are compressed only once as well, for all clients
+ * without server context takeover (for other clients, the compressed
+ * frame would break the compression context, they get an uncompressed
+ * frame).
+ * Frames are sent to all clients at the same time using non-blocking
+ * writes, so one slow client does not delay the others. A client that
+ * accepted only a part of the frame within websocket_broadcast_timeout_ms
+ * is a slow consumer: its connection is closed, since the rest of the
+ * frame is lost. A client that could not be locked in time (e.g., since
+ * another thread is writing to it) did not get any data, so it is skipped.
+ * If websocket send queues are enabled, the frame is appended to the queue
+ * of every client instead, and the queue policy decides about slow clients.
+ * Clients may be grouped into named channels, a connection leaves all
+ * channels automatically when it is closed. Channel broadcasts send to a
+ * copy of the member list, a closing member waits until they are done.
+ */
+#if !defined(USE_WEBSOCKET)
+#error "This file must only be included, if USE_WEBSOCKET is set"
+#endif
+
+
+struct mg_ws_channel {
+	struct mg_ws_channel *next;
+	struct mg_connection **members;
+	unsigned int num_members;
+	unsigned int max_members;
+	char name[1]; /* Allocated with the required length */
+};
+
+
+/* State of one connection while a frame is broadcasted */
+struct mg_ws_broadcast_member {
+	struct mg_connection *conn;
+	struct mg_ws_frame *frame; /* NULL if done */
+	size_t sent;               /* Bytes of the frame sent */
+	int locked;                /* 1 if conn->mutex is held */
+};
+
+
+static struct mg_ws_frame *
+ws_frame_create(struct mg_context *ctx,
+                int opcode,
+                const char *data,
+                size_t data_len)
+{
+	unsigned char header[14];
+	size_t header_len = websocket_frame_header(
+	    header, (unsigned char)(0x80u | ((unsigned)opcode & 0xf)), data_len, 0);
+
+	return ws_frame_alloc(ctx, header, header_len, data, data_len);
+}
+
+
+#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+/* Compress a message once, without using a compression context of a
+ * connection */
+static struct mg_ws_frame *
+ws_frame_create_deflated(struct mg_context *ctx,
+                         int opcode,
+                         const char *data,
+                         size_t data_len,
+                         int window_bits)
+{
+	struct mg_ws_frame *f;
+	zng_stream zs;
+	unsigned char header[14];
+	size_t bound, deflated_len, header_len;
+
+	memset(&zs, 0, sizeof(zs));
+	if (zng_deflateInit2(&zs,
+	                     Z_BEST_COMPRESSION,
+	                     Z_DEFLATED,
+	                     -1 * window_bits,
+	                     MEM_LEVEL,
+	                     Z_DEFAULT_STRATEGY)
+	    != Z_OK) {
+		return NULL;
+	}
+	bound = (size_t)zng_deflateBound(&zs, (uLong)data_len) + 16;
+	f = (struct mg_ws_frame *)mg_malloc_ctx(sizeof(*f) + sizeof(header)
+	                                            + bound,
+	                                        ctx);
+	if (f == NULL) {
+		zng_deflateEnd(&zs);
+		return NULL;
+	}
+	zs.next_in = (const uint8_t *)data;
+	zs.avail_in = (uInt)data_len;
+	zs.next_out = (uint8_t *)f->mem + sizeof(header);
+	zs.avail_out = (uInt)bound;
+	zng_deflate(&zs, Z_SYNC_FLUSH);
+	/* Strip trailing 0x00 0x00 0xff 0xff bytes */
+	deflated_len = bound - zs.avail_out - 4;
+	zng_deflateEnd(&zs);
+
+	/* The header is stored directly before the payload */
+	header_len =
+	    websocket_frame_header(header,
+	                           (unsigned char)(0xC0u | ((unsigned)opcode & 0xf)),
+	                           deflated_len,
+	                           0);
+	memcpy(f->mem + sizeof(header) - header_len, header, header_len);
+	f->refs = 1;
+	f->buf = f->mem + sizeof(header) - header_len;
+	f->len = header_len + deflated_len;
+	return f;
+}
+#endif
+
+
+static void
+ws_broadcast_member_done(struct mg_ws_broadcast_member *m)
+{
+	if (m->locked) {
+		mg_unlock_connection(m->conn);
+		m->locked = 0;
+	}
+	ws_frame_release(m->frame);
+	m->frame = NULL;
+}
+
+
+/* Send a message to a list of server websocket connections.
+ * Return the number of connections the frame has been sent to, or -1 on
+ * error. */
+static int
+ws_broadcast_send(struct mg_context *ctx,
+                  struct mg_connection *const *conns,
+                  unsigned int num_conns,
+                  int opcode,
+                  const char *data,
+                  size_t data_len)
+{
+	struct mg_ws_broadcast_member *m;
+	struct mg_pollfd *pfd;
+	struct mg_ws_frame *frame, *deflated = NULL;
+	struct mg_connection *conn;
+	uint64_t now, deadline;
+	unsigned int i, num = 0, num_pfd, pending, delivered = 0;
+	int n, wait_ms, wait_for_lock;
+#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+	int window_bits = 0;
+#endif
+
+	if (num_conns == 0) {
+		return 0;
+	}
+	m = (struct mg_ws_broadcast_member *)mg_calloc_ctx(
+	    num_conns, sizeof(*m) + sizeof(*pfd), ctx);
+	frame = ws_frame_create(ctx, opcode, data, data_len);
+	if ((m == NULL) || (frame == NULL)) {
+		mg_free(m);
+		ws_frame_release(frame);
+		return -1;
+	}
+	pfd = (struct mg_pollfd *)(void *)(m + num_conns);
+
+#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+	/* Compress once for all clients without context takeover, using the
+	 * smallest window size of these clients */
+	for (i = 0; (i < num_conns) && (data_len > 100 * 1024); i++) {
+		conn = conns[i];
+		if ((conn != NULL) && conn->accept_gzip
+		    && conn->websocket_deflate_server_no_context_takeover
+		    && ((window_bits == 0)
+		        || (conn->websocket_deflate_server_max_windows_bits
+		            < window_bits))) {
+			window_bits = conn->websocket_deflate_server_max_windows_bits;
+		}
+	}
+	if (window_bits > 0) {
+		deflated = ws_frame_create_deflated(
+		    ctx, opcode, data, data_len, window_bits);
+	}
+#endif
+
+	for (i = 0; i < num_conns; i++) {
+		conn = conns[i];
+		if ((conn == NULL) || (conn->phys_ctx != ctx)
+		    || (conn->protocol_type != PROTOCOL_TYPE_WEBSOCKET)
+		    || (conn->client.sock == INVALID_SOCKET) || conn->must_close) {
+			continue;
+		}
+		m[num].conn = conn;
+#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+		if ((deflated != NULL) && conn->accept_gzip
+		    && conn->websocket_deflate_server_no_context_takeover) {
+			m[num].frame = ws_frame_ref(deflated);
+		} else
+#endif
+			m[num].frame = ws_frame_ref(frame);
+		num++;
+	}
+
+	deadline = mg_get_current_time_ns()
+	           + (uint64_t)ctx->ws_broadcast_timeout_ms * 1000000;
+	for (;;) {
+		pending = num_pfd = 0;
+		wait_for_lock = 0;
+		for (i = 0; i < num; i++) {
+			if (m[i].frame == NULL) {
+				continue;
+			}
+			conn = m[i].conn;
+			if (!m[i].locked) {
+				/* Do not block: the lock might be held by a thread
+				 * waiting for another connection of this broadcast */
+				if (0 != pthread_mutex_trylock(&conn->mutex)) {
+					pending++;
+					wait_for_lock = 1;
+					continue;
+				}
+				m[i].locked = 1;
+				if (flush_output_buffer(conn) != 0) {
+					ws_broadcast_member_done(&m[i]);
+					continue;
+				}
+			}
+
+			if (ws_send_queue_enabled(conn)) {
+				/* The queue (or its policy) takes care of slow clients */
+				if (ws_send_queue_push(conn, m[i].frame, deadline) > 0) {
+					delivered++;
+				}
+				ws_broadcast_member_done(&m[i]);
+				continue;
+			}
+
+			n = ws_push_nonblocking(conn,
+			                        m[i].frame->buf + m[i].sent,
+			                        m[i].frame->len - m[i].sent);
+			if (n < 0) {
+				/* The reading thread will notice the error as well */
+				ws_broadcast_member_done(&m[i]);
+				continue;
+			}
+			m[i].sent += (size_t)n;
+			conn->num_bytes_sent += n;
+			if (m[i].sent == m[i].frame->len) {
+				ws_broadcast_member_done(&m[i]);
+				delivered++;
+				continue;
+			}
+			/* Keep the lock until the frame is complete */
+			pending++;
+			pfd[num_pfd].fd = conn->client.sock;
+			pfd[num_pfd].events = POLLOUT;
+			num_pfd++;
+		}
+
+		now = mg_get_current_time_ns();
+		if ((pending == 0) || (now >= deadline)
+		    || !STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+			break;
+		}
+		wait_ms = (int)((deadline - now) / 1000000) + 1;
+		if (wait_for_lock) {
+			wait_ms = 1;
+		}
+		if (num_pfd > 0) {
+			(void)mg_poll(pfd, num_pfd, wait_ms, &ctx->stop_flag);
+		} else {
+			mg_sleep(wait_ms);
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		if (m[i].frame != NULL) {
+			/* Only a partial frame breaks the stream: a client that did
+			 * not get any data just misses this message */
+			if (m[i].sent > 0) {
+				ws_slow_consumer(m[i].conn);
+			}
+			ws_broadcast_member_done(&m[i]);
+		}
+	}
+	ws_frame_release(frame);
+	ws_frame_release(deflated);
+	mg_free(m);
+	return (int)delivered;
+}
+
+
+static struct mg_ws_channel *
+ws_channel_find(struct mg_context *ctx, const char *name)
+{
+	struct mg_ws_channel *ch = ctx->ws_channels;
+
+	while ((ch != NULL) && strcmp(ch->name, name)) {
+		ch = ch->next;
+	}
+	return ch;
+}
+
+
+/* Remove a connection from a channel, and the channel if it is empty.
+ * Call with ctx->ws_channel_mutex held. */
+static int
+ws_channel_remove(struct mg_context *ctx,
+                  struct mg_ws_channel *ch,
+                  struct mg_connection *conn)
+{
+	struct mg_ws_channel **pp;
+	unsigned int i;
+
+	for (i = 0; i < ch->num_members; i++) {
+		if (ch->members[i] == conn) {
+			break;
+		}
+	}
+	if (i == ch->num_members) {
+		return 0;
+	}
+	ch->members[i] = ch->members[--ch->num_members];
+	conn->ws_num_channels--;
+
+	if (ch->num_members == 0) {
+		pp = &ctx->ws_channels;
+		while (*pp != ch) {
+			pp = &(*pp)->next;
+		}
+		*pp = ch->next;
+		mg_free(ch->members);
+		mg_free(ch);
+	}
+	return 1;
+}
+
+
+/* A websocket connection is closed: leave all channels, and wait until
+ * no channel broadcast uses the connection anymore. */
+static void
+ws_channel_leave_all(struct mg_connection *conn)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+	struct mg_ws_channel *ch, *next;
+
+	/* Always locked: a broadcast may still use a connection that already
+	 * left its channels */
+	(void)pthread_mutex_lock(&ctx->ws_channel_mutex);
+	for (ch = ctx->ws_channels; (ch != NULL) && (conn->ws_num_channels > 0);
+	     ch = next) {
+		next = ch->next;
+		(void)ws_channel_remove(ctx, ch, conn);
+	}
+	/* Broadcasts do not block on the connection: this wait is limited by
+	 * websocket_broadcast_timeout_ms */
+	while (conn->ws_broadcast_refs > 0) {
+		(void)pthread_cond_wait(&ctx->ws_channel_cond,
+		                        &ctx->ws_channel_mutex);
+	}
+	(void)pthread_mutex_unlock(&ctx->ws_channel_mutex);
+}
+
+
+/* Free all channels when the server stops */
+static void
+ws_channel_free_all(struct mg_context *ctx)
+{
+	struct mg_ws_channel *ch;
+
+	while ((ch = ctx->ws_channels) != NULL) {
+		ctx->ws_channels = ch->next;
+		mg_free(ch->members);
+		mg_free(ch);
+	}
+}
+
+
+int
+mg_websocket_broadcast(struct mg_connection **conns,
+                       unsigned int num_conns,
+                       int opcode,
+                       const char *data,
+                       size_t data_len)
+{
+	unsigned int i;
+
+	if ((conns == NULL) || ((data == NULL) && (data_len > 0))) {
+		return -1;
+	}
+	for (i = 0; i < num_conns; i++) {
+		if ((conns[i] != NULL) && (conns[i]->phys_ctx != NULL)
+		    && (conns[i]->phys_ctx->context_type == CONTEXT_SERVER)) {
+			return ws_broadcast_send(
+			    conns[i]->phys_ctx, conns, num_conns, opcode, data, data_len);
+		}
+	}
+	return 0;
+}
+
+
+int
+mg_websocket_channel_join(struct mg_connection *conn, const char *channel)
+{
+	struct mg_context *ctx;
+	struct mg_ws_channel *ch;
+	struct mg_connection **members;
+	size_t name_len;
+	unsigned int i;
+	int ret = 0;
+
+	if ((conn == NULL) || (channel == NULL) || (conn->phys_ctx == NULL)
+	    || (conn->phys_ctx->context_type != CONTEXT_SERVER)
+	    || (conn->protocol_type != PROTOCOL_TYPE_WEBSOCKET)) {
+		return -1;
+	}
+	ctx = conn->phys_ctx;
+
+	(void)pthread_mutex_lock(&ctx->ws_channel_mutex);
+	ch = ws_channel_find(ctx, channel);
+	if (ch == NULL) {
+		name_len = strlen(channel);
+		ch = (struct mg_ws_channel *)mg_calloc_ctx(1,
+		                                           sizeof(*ch) + name_len,
+		                                           ctx);
+		if (ch == NULL) {
+			(void)pthread_mutex_unlock(&ctx->ws_channel_mutex);
+			return -1;
+		}
+		memcpy(ch->name, channel, name_len + 1);
+		ch->next = ctx->ws_channels;
+		ctx->ws_channels = ch;
+	}
+
+	for (i = 0; i < ch->num_members; i++) {
+		if (ch->members[i] == conn) {
+			break;
+		}
+	}
+	if (i == ch->num_members) {
+		if (ch->num_members == ch->max_members) {
+			members = (struct mg_connection **)mg_realloc_ctx(
+			    ch->members,
+			    (ch->max_members + 16) * sizeof(ch->members[0]),
+			    ctx);
+			if (members == NULL) {
+				ret = -1;
+			} else {
+				ch->members = members;
+				ch->max_members += 16;
+			}
+		}
+		if (ret == 0) {
+			ch->members[ch->num_members++] = conn;
+			conn->ws_num_channels++;
+		} else if (ch->num_members == 0) {
+			/* Do not keep an empty channel */
+			ctx->ws_channels = ch->next;
+			mg_free(ch->members);
+			mg_free(ch);
+		}
+	}
+	(void)pthread_mutex_unlock(&ctx->ws_channel_mutex);
+	return ret;
+}
+
+
+int
+mg_websocket_channel_leave(struct mg_connection *conn, const char *channel)
+{
+	struct mg_context *ctx;
+	struct mg_ws_channel *ch;
+	int ret = -1;
+
+	if ((conn == NULL) || (channel == NULL) || (conn->ws_num_channels == 0)) {
+		return -1;
+	}
+	ctx = conn->phys_ctx;
+
+	(void)pthread_mutex_lock(&ctx->ws_channel_mutex);
+	ch = ws_channel_find(ctx, channel);
+	if ((ch != NULL) && ws_channel_remove(ctx, ch, conn)) {
+		ret = 0;
+	}
+	(void)pthread_mutex_unlock(&ctx->ws_channel_mutex);
+	return ret;
+}
+
+
+int
+mg_websocket_channel_broadcast(struct mg_context *ctx,
+                               const char *channel,
+                               int opcode,
+                               const char *data,
+                               size_t data_len)
+{
+	struct mg_ws_channel *ch;
+	struct mg_connection **members = NULL;
+	unsigned int i, num_members = 0;
+	int ret = 0;
+
+	if ((ctx == NULL) || (ctx->context_type != CONTEXT_SERVER)
+	    || (channel == NULL) || ((data == NULL) && (data_len > 0))) {
+		return -1;
+	}
+
+	/* Send to a copy of the member list, so joining and leaving is not
+	 * blocked while sending. The references keep the members from being
+	 * closed (and their connection structures from being reused). */
+	(void)pthread_mutex_lock(&ctx->ws_channel_mutex);
+	ch = ws_channel_find(ctx, channel);
+	if ((ch != NULL) && (ch->num_members > 0)) {
+		members = (struct mg_connection **)mg_malloc_ctx(
+		    ch->num_members * sizeof(members[0]), ctx);
+		if (members == NULL) {
+			ret = -1;
+		} else {
+			num_members = ch->num_members;
+			for (i = 0; i < num_members; i++) {
+				members[i] = ch->members[i];
+				members[i]->ws_broadcast_refs++;
+			}
+		}
+	}
+	(void)pthread_mutex_unlock(&ctx->ws_channel_mutex);
+
+	if (members == NULL) {
+		return ret;
+	}
+	ret = ws_broadcast_send(ctx, members, num_members, opcode, data, data_len);
+
+	(void)pthread_mutex_lock(&ctx->ws_channel_mutex);
+	for (i = 0; i < num_members; i++) {
+		members[i]->ws_broadcast_refs--;
+	}
+	(void)pthread_cond_broadcast(&ctx->ws_channel_cond);
+	(void)pthread_mutex_unlock(&ctx->ws_channel_mutex);
+	mg_free(members);
+	return ret;
+}
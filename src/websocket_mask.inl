@@ -0,0 +1,177 @@
+/* Masking and unmasking of websocket payloads (RFC 6455, section 5.3).
+ * Every payload byte is XORed with one byte of the 4 byte masking key.
+ * Since the key repeats every 4 bytes, a vector of 16 or 32 bytes can be
+ * XORed with the key replicated to the vector width, as long as the vector
+ * starts at a payload offset divisible by 4.
+ * A short prologue first handles single bytes until the output is 16 byte
+ * aligned, and rotates the key accordingly. Then the largest part of the
+ * payload is handled by vector kernels using unaligned loads, so the input
+ * need not be aligned:
+ *   - AVX2 (x86), if the CPU supports it (checked at runtime),
+ *   - SSE2 (x86, always available on x86_64),
+ *   - NEON (ARM, if enabled for the compiler, always on AArch64).
+ * The remaining bytes are handled 8 bytes at a time, and finally bytes
+ * again. Use NO_WEBSOCKET_SIMD to build without the vector kernels.
+ */
+#if !defined(USE_WEBSOCKET)
+#error "This file must only be included, if USE_WEBSOCKET is set"
+#endif
+
+
+#if defined(USE_WEBSOCKET_AVX2)
+/* 1 if the CPU and the OS support AVX2, 0 if not, -1 if unknown yet */
+static volatile int ws_mask_avx2_supported = -1;
+
+
+static int
+ws_mask_check_avx2(void)
+{
+	int supported = 0;
+#if defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 0);
+	if (info[0] >= 7) {
+		__cpuid(info, 1);
+		/* OSXSAVE and AVX, and the OS saves the YMM registers */
+		if ((info[2] & (1 << 27)) && (info[2] & (1 << 28))
+		    && ((_xgetbv(0) & 6) == 6)) {
+			__cpuidex(info, 7, 0);
+			supported = ((info[1] & (1 << 5)) != 0);
+		}
+	}
+#else
+	__builtin_cpu_init();
+	supported = (__builtin_cpu_supports("avx2") != 0);
+#endif
+	return supported;
+}
+
+
+#if !defined(_MSC_VER)
+__attribute__((target("avx2")))
+#endif
+static size_t
+ws_mask_avx2(char *out, const char *in, size_t len, uint32_t key)
+{
+	__m256i k = _mm256_set1_epi32((int)key);
+	__m256i v0, v1;
+	size_t i = 0;
+
+	for (; i + 64 <= len; i += 64) {
+		v0 = _mm256_loadu_si256((const __m256i *)(const void *)(in + i));
+		v1 = _mm256_loadu_si256((const __m256i *)(const void *)(in + i + 32));
+		_mm256_storeu_si256((__m256i *)(void *)(out + i),
+		                    _mm256_xor_si256(v0, k));
+		_mm256_storeu_si256((__m256i *)(void *)(out + i + 32),
+		                    _mm256_xor_si256(v1, k));
+	}
+	for (; i + 32 <= len; i += 32) {
+		v0 = _mm256_loadu_si256((const __m256i *)(const void *)(in + i));
+		_mm256_storeu_si256((__m256i *)(void *)(out + i),
+		                    _mm256_xor_si256(v0, k));
+	}
+	return i;
+}
+#endif /* USE_WEBSOCKET_AVX2 */
+
+
+#if defined(USE_WEBSOCKET_SSE2)
+static size_t
+ws_mask_sse2(char *out, const char *in, size_t len, uint32_t key)
+{
+	__m128i k = _mm_set1_epi32((int)key);
+	__m128i v0, v1;
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		v0 = _mm_loadu_si128((const __m128i *)(const void *)(in + i));
+		v1 = _mm_loadu_si128((const __m128i *)(const void *)(in + i + 16));
+		_mm_storeu_si128((__m128i *)(void *)(out + i), _mm_xor_si128(v0, k));
+		_mm_storeu_si128((__m128i *)(void *)(out + i + 16),
+		                 _mm_xor_si128(v1, k));
+	}
+	for (; i + 16 <= len; i += 16) {
+		v0 = _mm_loadu_si128((const __m128i *)(const void *)(in + i));
+		_mm_storeu_si128((__m128i *)(void *)(out + i), _mm_xor_si128(v0, k));
+	}
+	return i;
+}
+#endif /* USE_WEBSOCKET_SSE2 */
+
+
+#if defined(USE_WEBSOCKET_NEON)
+static size_t
+ws_mask_neon(char *out, const char *in, size_t len, uint32_t key)
+{
+	uint8x16_t k = vreinterpretq_u8_u32(vdupq_n_u32(key));
+	uint8x16_t v0, v1;
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		v0 = vld1q_u8((const uint8_t *)(in + i));
+		v1 = vld1q_u8((const uint8_t *)(in + i + 16));
+		vst1q_u8((uint8_t *)(out + i), veorq_u8(v0, k));
+		vst1q_u8((uint8_t *)(out + i + 16), veorq_u8(v1, k));
+	}
+	for (; i + 16 <= len; i += 16) {
+		v0 = vld1q_u8((const uint8_t *)(in + i));
+		vst1q_u8((uint8_t *)(out + i), veorq_u8(v0, k));
+	}
+	return i;
+}
+#endif /* USE_WEBSOCKET_NEON */
+
+
+/* XOR len bytes of in with the masking key (the 4 key bytes in the order
+ * they are sent) and store them to out. in and out may be the same buffer,
+ * they need not be aligned. */
+static void
+ws_mask_apply(char *out, const char *in, size_t len, const unsigned char key[4])
+{
+	unsigned char rot[8];
+	uint32_t key32;
+	uint64_t key64, w;
+	size_t i = 0, j;
+
+	/* Prologue: single bytes, until the output is aligned */
+	while ((i < len) && (((size_t)(uintptr_t)(out + i) & 15) != 0)) {
+		out[i] = (char)((unsigned char)in[i] ^ key[i & 3]);
+		i++;
+	}
+
+	/* Key for the remaining data, which starts at key byte i & 3 */
+	for (j = 0; j < sizeof(rot); j++) {
+		rot[j] = key[(i + j) & 3];
+	}
+	memcpy(&key32, rot, sizeof(key32));
+	memcpy(&key64, rot, sizeof(key64));
+
+	/* The kernels handle multiples of 16 bytes, the key does not move */
+#if defined(USE_WEBSOCKET_AVX2)
+	if (ws_mask_avx2_supported < 0) {
+		/* Every thread gets the same result */
+		ws_mask_avx2_supported = ws_mask_check_avx2();
+	}
+	if (ws_mask_avx2_supported) {
+		i += ws_mask_avx2(out + i, in + i, len - i, key32);
+	}
+#endif
+#if defined(USE_WEBSOCKET_SSE2)
+	i += ws_mask_sse2(out + i, in + i, len - i, key32);
+#elif defined(USE_WEBSOCKET_NEON)
+	i += ws_mask_neon(out + i, in + i, len - i, key32);
+#else
+	(void)key32;
+#endif
+
+	/* Epilogue: 8 bytes, then single bytes */
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&w, in + i, sizeof(w));
+		w ^= key64;
+		memcpy(out + i, &w, sizeof(w));
+	}
+	for (; i < len; i++) {
+		out[i] = (char)((unsigned char)in[i] ^ key[i & 3]);
+	}
+}
@@ -0,0 +1,864 @@
+/* Event loop for websocket connections ("websocket_dispatch_threads").
+ * Without it, read_websocket blocks a worker thread for the lifetime of a
+ * websocket. With it, the connection is moved from the worker thread to a
+ * heap allocated connection structure, and its socket is added to an
+ * epoll descriptor. The reactor thread waits for readable sockets and
+ * queues them for a small pool of dispatch threads. A dispatch thread
+ * reads all available data, handles the complete frames and calls the
+ * data handler. An idle websocket only costs its connection structure
+ * and its receive buffer.
+ * Sockets are added with EPOLLONESHOT and armed again after the data has
+ * been handled, so the handlers of one connection are never called by two
+ * threads at the same time. Every MG_WS_REACTOR_CHECK_MS, the reactor
+ * thread also queues idle connections exceeding websocket_timeout_ms (to
+ * send PING messages, if enabled) and connections closed using
+ * mg_close_connection.
+ * Only plain (not TLS) websockets of C handlers use the reactor. TLS and
+ * Lua websockets are still served by their worker thread.
+ */
+#if !defined(USE_WEBSOCKET_REACTOR)
+#error "This file must only be included, if USE_WEBSOCKET_REACTOR is set"
+#endif
+
+#if !defined(MG_WS_REACTOR_CHECK_MS)
+#define MG_WS_REACTOR_CHECK_MS (250)
+#endif
+
+/* Payloads up to this size are copied to the stack of the dispatch
+ * thread, like in read_websocket */
+#define MG_WS_REACTOR_STACK_FRAME (4096)
+
+
+enum {
+	WS_REACTOR_ARMED,   /* Waiting for data in epoll */
+	WS_REACTOR_QUEUED,  /* Waiting for a dispatch thread */
+	WS_REACTOR_RUNNING, /* Handled by a dispatch thread */
+	WS_REACTOR_CLOSED   /* Closed, waiting to be freed */
+};
+
+
+struct mg_ws_reactor_conn {
+	struct mg_connection conn; /* Must be the first element */
+	mg_websocket_data_handler data_handler;
+	mg_websocket_close_handler close_handler;
+	void *cbdata;
+	int state;                 /* WS_REACTOR_*, protected by the lock */
+	int ping_count;            /* Unanswered PING messages */
+	uint64_t timeout_ns;       /* websocket_timeout_ms */
+	uint64_t last_activity_ns; /* Time of the last data received */
+	unsigned char *frame;      /* Frame larger than the receive buffer */
+	size_t frame_size;         /* Payload length of this frame */
+	size_t frame_len;          /* Payload bytes received so far */
+	unsigned char frame_mop;   /* FIN flag and opcode of this frame */
+	unsigned char frame_mask[4];
+	int frame_masked;
+	struct mg_ws_reactor_conn *next_ready; /* Dispatch or free queue */
+	struct mg_ws_reactor_conn *prev;       /* List of all connections */
+	struct mg_ws_reactor_conn *next;
+};
+
+
+struct mg_ws_reactor {
+	struct mg_context *ctx;
+	int epfd;
+	int wakeup_fd;        /* eventfd to stop the reactor thread */
+	pthread_mutex_t lock; /* Protects the lists and all states */
+	pthread_cond_t cond;  /* Signaled when a connection is queued */
+	int running;          /* 1 if the threads have been started */
+	int stopping;
+	unsigned int num_threads; /* Dispatch threads */
+	unsigned int num_started;
+	pthread_t reactor_thread;
+	pthread_t *dispatch_threads;
+	struct mg_ws_reactor_conn *ready_head;
+	struct mg_ws_reactor_conn *ready_tail;
+	struct mg_ws_reactor_conn *conns;  /* All connections */
+	struct mg_ws_reactor_conn *closed; /* Connections to be freed */
+	volatile ptrdiff_t num_conns;
+};
+
+
+static struct mg_ws_reactor *
+ws_reactor_create(struct mg_context *ctx, unsigned int num_threads)
+{
+	struct mg_ws_reactor *r;
+	struct epoll_event ev;
+
+	r = (struct mg_ws_reactor *)mg_calloc_ctx(1, sizeof(*r), ctx);
+	if (r == NULL) {
+		return NULL;
+	}
+	r->dispatch_threads =
+	    (pthread_t *)mg_calloc_ctx(num_threads, sizeof(pthread_t), ctx);
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	r->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; /* The only event without connection */
+	if ((r->dispatch_threads == NULL) || (r->epfd < 0) || (r->wakeup_fd < 0)
+	    || (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakeup_fd, &ev) != 0)
+	    || (0 != pthread_mutex_init(&r->lock, NULL))) {
+		if (r->epfd >= 0) {
+			close(r->epfd);
+		}
+		if (r->wakeup_fd >= 0) {
+			close(r->wakeup_fd);
+		}
+		mg_free(r->dispatch_threads);
+		mg_free(r);
+		return NULL;
+	}
+	if (0 != pthread_cond_init(&r->cond, NULL)) {
+		(void)pthread_mutex_destroy(&r->lock);
+		close(r->epfd);
+		close(r->wakeup_fd);
+		mg_free(r->dispatch_threads);
+		mg_free(r);
+		return NULL;
+	}
+	r->ctx = ctx;
+	r->num_threads = num_threads;
+	return r;
+}
+
+
+static void
+ws_reactor_free_conn(struct mg_ws_reactor_conn *w)
+{
+	struct mg_request_info *ri = &w->conn.request_info;
+
+	if (ri->local_uri != ri->local_uri_raw) {
+		mg_free((void *)ri->local_uri);
+	}
+	mg_free((void *)ri->remote_user);
+	mg_free(w->frame);
+	mg_free(w->conn.buf);
+	(void)pthread_mutex_destroy(&w->conn.mutex);
+	mg_free(w);
+}
+
+
+/* Free the reactor. The threads must have been stopped before. */
+static void
+ws_reactor_destroy(struct mg_ws_reactor *r)
+{
+	struct mg_ws_reactor_conn *w;
+
+	if (r == NULL) {
+		return;
+	}
+	while ((w = r->closed) != NULL) {
+		r->closed = w->next_ready;
+		ws_reactor_free_conn(w);
+	}
+	(void)pthread_cond_destroy(&r->cond);
+	(void)pthread_mutex_destroy(&r->lock);
+	close(r->epfd);
+	close(r->wakeup_fd);
+	mg_free(r->dispatch_threads);
+	mg_free(r);
+}
+
+
+/* Append a connection to the dispatch queue. Call with r->lock held. */
+static void
+ws_reactor_queue(struct mg_ws_reactor *r, struct mg_ws_reactor_conn *w)
+{
+	w->state = WS_REACTOR_QUEUED;
+	w->next_ready = NULL;
+	if (r->ready_tail != NULL) {
+		r->ready_tail->next_ready = w;
+	} else {
+		r->ready_head = w;
+	}
+	r->ready_tail = w;
+}
+
+
+/* Relocate a pointer into the request buffer of a worker thread to the
+ * copy of the buffer */
+static const char *
+ws_reactor_relocate(const struct mg_connection *conn,
+                    char *buf,
+                    const char *p)
+{
+	if ((p >= conn->buf) && (p < conn->buf + conn->buf_size)) {
+		return buf + (p - conn->buf);
+	}
+	return p;
+}
+
+
+/* Move a websocket connection from the worker thread to a connection
+ * structure owned by the reactor, before any websocket handler is called.
+ * Return the new connection, or conn if the websocket must be served by
+ * the worker thread. The worker thread must not use the socket anymore. */
+static struct mg_connection *
+ws_reactor_detach(struct mg_connection *conn)
+{
+	struct mg_ws_reactor *r = conn->phys_ctx->ws_reactor;
+	struct mg_ws_reactor_conn *w;
+	struct mg_request_info *ri;
+	char *buf;
+	int i;
+
+	if ((r == NULL) || !r->running || (conn->ssl != NULL)
+	    || (conn->client.sock == INVALID_SOCKET)) {
+		return conn;
+	}
+
+	w = (struct mg_ws_reactor_conn *)mg_calloc_ctx(1,
+	                                               sizeof(*w),
+	                                               conn->phys_ctx);
+	buf = (char *)mg_malloc_ctx((size_t)conn->buf_size, conn->phys_ctx);
+	if ((w == NULL) || (buf == NULL)) {
+		mg_free(w);
+		mg_free(buf);
+		return conn;
+	}
+
+	/* Data buffered for the previous response must be sent first */
+	(void)flush_output_buffer(conn);
+
+	w->conn = *conn;
+	if (0 != pthread_mutex_init(&w->conn.mutex, &pthread_mutex_attr)) {
+		mg_free(w);
+		mg_free(buf);
+		return conn;
+	}
+	memcpy(buf, conn->buf, (size_t)conn->data_len);
+	w->conn.buf = buf;
+	w->conn.path_info = NULL;
+	w->conn.out_buf = NULL;
+	w->conn.out_buf_alloc = 0;
+	w->conn.out_buf_len = 0;
+	w->conn.response_info.num_headers = 0;
+
+	/* The request information points into the request buffer */
+	ri = &w->conn.request_info;
+	ri->request_method = ws_reactor_relocate(conn, buf, ri->request_method);
+	ri->request_uri = ws_reactor_relocate(conn, buf, ri->request_uri);
+	ri->local_uri_raw = ws_reactor_relocate(conn, buf, ri->local_uri_raw);
+	ri->http_version = ws_reactor_relocate(conn, buf, ri->http_version);
+	ri->query_string = ws_reactor_relocate(conn, buf, ri->query_string);
+	ri->acceptedWebSocketSubprotocol =
+	    ws_reactor_relocate(conn, buf, ri->acceptedWebSocketSubprotocol);
+	for (i = 0; i < ri->num_headers; i++) {
+		ri->http_headers[i].name =
+		    ws_reactor_relocate(conn, buf, ri->http_headers[i].name);
+		ri->http_headers[i].value =
+		    ws_reactor_relocate(conn, buf, ri->http_headers[i].value);
+	}
+	ri->local_uri = ri->local_uri_raw;
+	if (conn->request_info.local_uri != conn->request_info.local_uri_raw) {
+		/* The cleaned URI is freed by the worker thread */
+		ri->local_uri = mg_strdup_ctx(conn->request_info.local_uri,
+		                              conn->phys_ctx);
+		if (ri->local_uri == NULL) {
+			ri->local_uri = ri->local_uri_raw;
+		}
+	}
+#if defined(MG_LEGACY_INTERFACE)
+	ri->uri = ri->local_uri;
+#endif
+	if (conn->request_info.remote_user != NULL) {
+		ri->remote_user =
+		    mg_strdup_ctx(conn->request_info.remote_user, conn->phys_ctx);
+	}
+	ri->client_cert = NULL;
+
+	/* The worker thread keeps its own request data (for logging), but it
+	 * no longer owns the socket and the user connection data. Closing it
+	 * must not call the connection callbacks a second time. */
+	conn->ws_detached = 1;
+	mg_free(conn->out_buf);
+	conn->out_buf = NULL;
+	conn->client.sock = INVALID_SOCKET;
+	conn->client.client_counted = 0;
+	conn->must_close = 1;
+#if defined(__linux__)
+	conn->tcp_corked = 0;
+#endif
+	mg_set_user_connection_data(conn, NULL);
+
+	return &w->conn;
+}
+
+
+/* Update the request of the worker thread with the response sent by the
+ * detached connection, before the worker thread logs it */
+static void
+ws_reactor_update_request(struct mg_connection *wconn,
+                          const struct mg_connection *conn)
+{
+	wconn->status_code = conn->status_code;
+	wconn->num_bytes_sent = conn->num_bytes_sent;
+}
+
+
+/* Close a detached connection, if the websocket handshake failed or has
+ * been rejected. No websocket handler has to be called. */
+static void
+ws_reactor_discard(struct mg_connection *wconn, struct mg_connection *conn)
+{
+	if (conn == wconn) {
+		return;
+	}
+	ws_reactor_update_request(wconn, conn);
+	close_connection(conn);
+	ws_reactor_free_conn((struct mg_ws_reactor_conn *)conn);
+}
+
+
+/* Add a detached connection to the reactor, after the ready handler has
+ * been called. Data received after the handshake is handled at once. */
+static void
+ws_reactor_attach(struct mg_connection *wconn,
+                  struct mg_connection *conn,
+                  mg_websocket_data_handler ws_data_handler,
+                  mg_websocket_close_handler ws_close_handler,
+                  void *cbData)
+{
+	struct mg_ws_reactor *r = conn->phys_ctx->ws_reactor;
+	struct mg_ws_reactor_conn *w = (struct mg_ws_reactor_conn *)conn;
+	struct epoll_event ev;
+	int ret;
+
+	ws_reactor_update_request(wconn, conn);
+
+	w->data_handler = ws_data_handler;
+	w->close_handler = ws_close_handler;
+	w->cbdata = cbData;
+	w->timeout_ns = (uint64_t)(websocket_read_timeout(conn) * 1.0e9);
+	w->last_activity_ns = mg_get_current_time_ns();
+	conn->in_websocket_handling = 1;
+
+	/* Added without EPOLLIN: the socket is armed by the dispatch thread */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLONESHOT;
+	ev.data.ptr = w;
+
+	(void)pthread_mutex_lock(&r->lock);
+	ret = epoll_ctl(r->epfd, EPOLL_CTL_ADD, conn->client.sock, &ev);
+	if (ret == 0) {
+		w->prev = NULL;
+		w->next = r->conns;
+		if (r->conns != NULL) {
+			r->conns->prev = w;
+		}
+		r->conns = w;
+		r->num_conns++;
+		ws_reactor_queue(r, w);
+		(void)pthread_cond_signal(&r->cond);
+	}
+	(void)pthread_mutex_unlock(&r->lock);
+
+	if (ret != 0) {
+		mg_cry_internal(conn,
+		                "Cannot add websocket to reactor: %s",
+		                strerror(ERRNO));
+		conn->in_websocket_handling = 0;
+		ws_channel_leave_all(conn);
+		if (ws_close_handler != NULL) {
+			ws_close_handler(conn, cbData);
+		}
+		close_connection(conn);
+		ws_reactor_free_conn(w);
+	}
+}
+
+
+/* Wait for new data on a connection handled by a dispatch thread */
+static void
+ws_reactor_arm(struct mg_ws_reactor *r, struct mg_ws_reactor_conn *w)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = w;
+
+	/* The state must be set first: the event may occur at once */
+	(void)pthread_mutex_lock(&r->lock);
+	w->state = WS_REACTOR_ARMED;
+	(void)pthread_mutex_unlock(&r->lock);
+
+	if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, w->conn.client.sock, &ev) != 0) {
+		/* Closed by the next check of the reactor thread */
+		mg_cry_internal(&w->conn,
+		                "Cannot arm websocket in reactor: %s",
+		                strerror(ERRNO));
+		w->conn.must_close = 1;
+	}
+}
+
+
+/* Close a connection handled by a dispatch thread (or by the master
+ * thread, while the server stops). */
+static void
+ws_reactor_close(struct mg_ws_reactor *r, struct mg_ws_reactor_conn *w)
+{
+	struct mg_connection *conn = &w->conn;
+
+	(void)epoll_ctl(r->epfd, EPOLL_CTL_DEL, conn->client.sock, NULL);
+	conn->in_websocket_handling = 0;
+
+#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+	if (conn->websocket_deflate_initialized) {
+		zng_deflateEnd(&conn->websocket_deflate_state);
+		zng_inflateEnd(&conn->websocket_inflate_state);
+	}
+#endif
+
+	ws_channel_leave_all(conn);
+	if (w->close_handler != NULL) {
+		w->close_handler(conn, w->cbdata);
+	}
+	close_connection(conn);
+
+	/* The reactor thread frees the structure: an event it is currently
+	 * handling might still refer to it. */
+	(void)pthread_mutex_lock(&r->lock);
+	if (w->prev != NULL) {
+		w->prev->next = w->next;
+	} else {
+		r->conns = w->next;
+	}
+	if (w->next != NULL) {
+		w->next->prev = w->prev;
+	}
+	r->num_conns--;
+	w->state = WS_REACTOR_CLOSED;
+	w->next_ready = r->closed;
+	r->closed = w;
+	(void)pthread_mutex_unlock(&r->lock);
+}
+
+
+/* Receive available data without blocking. Return the number of bytes,
+ * 0 if no data is available, or -1 if the connection has been closed by
+ * the client or failed. */
+static int
+ws_reactor_recv(struct mg_connection *conn, void *buf, size_t len)
+{
+	ssize_t n;
+
+	do {
+		n = recv(conn->client.sock, buf, len, MSG_DONTWAIT);
+	} while ((n < 0) && (ERRNO == EINTR));
+
+	if (n > 0) {
+		return (int)n;
+	}
+	if ((n < 0) && ((ERRNO == EAGAIN) || (ERRNO == EWOULDBLOCK))) {
+		return 0;
+	}
+	return -1;
+}
+
+
+/* Read all data available for a connection and handle all complete
+ * frames. Return 1 to keep the connection, 0 to close it. */
+static int
+ws_reactor_read(struct mg_ws_reactor_conn *w)
+{
+	struct mg_connection *conn = &w->conn;
+
+	/* The original websocket upgrade request is never removed, so the
+	 * queue of received frames begins after it (see read_websocket). */
+	unsigned char *buf = (unsigned char *)conn->buf + conn->request_len;
+	size_t space = (size_t)(conn->buf_size - conn->request_len);
+	unsigned char mem[MG_WS_REACTOR_STACK_FRAME + 4]; /* see inflate */
+	unsigned char *data, mop, mask[4];
+	size_t header_len, body_len, len;
+	uint64_t data_len, now;
+	int n, ok, masked, got_data = 0;
+
+	for (;;) {
+		if (!STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)
+		    || conn->must_close) {
+			return 0;
+		}
+
+		data = NULL;
+		if (w->frame != NULL) {
+			if (w->frame_len < w->frame_size) {
+				/* Receive the payload of a large frame */
+				n = ws_reactor_recv(conn,
+				                    w->frame + w->frame_len,
+				                    w->frame_size - w->frame_len);
+				if (n < 0) {
+					return 0;
+				}
+				if (n == 0) {
+					break;
+				}
+				w->frame_len += (size_t)n;
+				got_data = 1;
+				continue;
+			}
+			data = w->frame;
+			data_len = w->frame_size;
+			mop = w->frame_mop;
+			masked = w->frame_masked;
+			memcpy(mask, w->frame_mask, sizeof(mask));
+			w->frame = NULL;
+
+		} else {
+			body_len = (size_t)(conn->data_len - conn->request_len);
+			header_len = 0;
+			if (conn->ws_stream.active) {
+				/* Payload of a frame passed in slices */
+				if ((body_len > 0) || (conn->ws_stream.size == 0)) {
+					if (!ws_stream_deliver(conn, w->cbdata)) {
+						return 0;
+					}
+					continue;
+				}
+			} else {
+				header_len =
+				    parse_websocket_frame_header(buf, body_len, &data_len);
+			}
+			if (header_len > 0) {
+				mop = buf[0];
+				if (!ws_check_frame_size(conn,
+				                         mop,
+				                         data_len,
+				                         !ws_is_streamed(conn, mop))) {
+					return 0;
+				}
+				if (ws_is_streamed(conn, mop)) {
+					ws_stream_begin(conn, header_len, data_len);
+					continue;
+				}
+				masked = (buf[1] & 128) != 0;
+				if (masked) {
+					memcpy(mask, buf + header_len - 4, sizeof(mask));
+				} else {
+					memset(mask, 0, sizeof(mask));
+				}
+				len = header_len + (size_t)data_len;
+
+				if (len <= body_len) {
+					/* The first frame in the queue is complete */
+					ws_message_add_frame(conn, mop, data_len);
+					data = mem;
+					if (data_len > MG_WS_REACTOR_STACK_FRAME) {
+						data = (unsigned char *)
+						    mg_malloc_ctx((size_t)data_len + 4,
+						                  conn->phys_ctx);
+						if (data == NULL) {
+							mg_cry_internal(conn,
+							                "%s",
+							                "websocket out of memory; "
+							                "closing connection");
+							return 0;
+						}
+					}
+					memcpy(data, buf + header_len, (size_t)data_len);
+					memmove(buf, buf + len, body_len - len);
+					conn->data_len -= (int)len;
+
+				} else if (len > space) {
+					/* The frame does not fit into the buffer: receive
+					 * the payload into a buffer of its own */
+					ws_message_add_frame(conn, mop, data_len);
+					w->frame = (unsigned char *)
+					    mg_malloc_ctx((size_t)data_len + 4, conn->phys_ctx);
+					if (w->frame == NULL) {
+						mg_cry_internal(
+						    conn,
+						    "%s",
+						    "websocket out of memory; closing connection");
+						return 0;
+					}
+					w->frame_size = (size_t)data_len;
+					w->frame_len = body_len - header_len;
+					w->frame_mop = mop;
+					w->frame_masked = masked;
+					memcpy(w->frame_mask, mask, sizeof(mask));
+					memcpy(w->frame, buf + header_len, w->frame_len);
+					conn->data_len = conn->request_len;
+					continue;
+				}
+			}
+
+			if (data == NULL) {
+				/* The frame is not complete: receive more data */
+				if (conn->data_len >= conn->buf_size) {
+					/* No space left for a frame header */
+					return 0;
+				}
+				n = ws_reactor_recv(conn,
+				                    conn->buf + conn->data_len,
+				                    (size_t)(conn->buf_size - conn->data_len));
+				if (n < 0) {
+					return 0;
+				}
+				if (n == 0) {
+					break;
+				}
+				conn->data_len += n;
+				got_data = 1;
+				continue;
+			}
+		}
+
+		/* Apply mask if necessary */
+		if (masked) {
+			ws_mask_apply((char *)data,
+			              (const char *)data,
+			              (size_t)data_len,
+			              mask);
+		}
+
+		ok = process_websocket_frame(conn,
+		                             mop,
+		                             data,
+		                             (size_t)data_len,
+		                             w->data_handler,
+		                             w->cbdata,
+		                             &w->ping_count);
+		if (data != mem) {
+			mg_free(data);
+		}
+		if (!ok) {
+			return 0;
+		}
+	}
+
+	now = mg_get_current_time_ns();
+	if (got_data) {
+		/* Reset open PING count */
+		w->ping_count = 0;
+		w->last_activity_ns = now;
+
+	} else if (now - w->last_activity_ns >= w->timeout_ns) {
+		/* Timeout: same as in read_websocket */
+		if (w->ping_count > MG_MAX_UNANSWERED_PING) {
+			DEBUG_TRACE("Too many (%i) unanswered ping from %s:%u "
+			            "- closing connection",
+			            w->ping_count,
+			            conn->request_info.remote_addr,
+			            conn->request_info.remote_port);
+			return 0;
+		}
+		if (conn->dom_ctx->cfg.enable_websocket_ping_pong) {
+			if (mg_websocket_write(conn, MG_WEBSOCKET_OPCODE_PING, NULL, 0)
+			    <= 0) {
+				DEBUG_TRACE("%s", "Send PING failed");
+				return 0;
+			}
+			w->ping_count++;
+		}
+		w->last_activity_ns = now;
+	}
+	return 1;
+}
+
+
+static void *
+ws_reactor_dispatch_thread(void *thread_func_param)
+{
+	struct mg_ws_reactor *r = (struct mg_ws_reactor *)thread_func_param;
+	struct mg_context *ctx = r->ctx;
+	struct mg_ws_reactor_conn *w;
+	struct mg_workerTLS tls;
+	struct sigaction sa;
+
+	/* Ignore SIGPIPE */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	mg_set_thread_name("wsock");
+
+	memset(&tls, 0, sizeof(tls));
+	tls.is_master = 0;
+	tls.thread_idx = (unsigned)mg_atomic_inc(&thread_idx_max);
+	pthread_setspecific(sTlsKey, &tls);
+
+	if (ctx->callbacks.init_thread) {
+		/* Dispatch threads call websocket handlers like worker threads */
+		tls.user_ptr = ctx->callbacks.init_thread(ctx, 1);
+	} else {
+		tls.user_ptr = NULL;
+	}
+
+	for (;;) {
+		(void)pthread_mutex_lock(&r->lock);
+		while ((r->ready_head == NULL) && !r->stopping) {
+			(void)pthread_cond_wait(&r->cond, &r->lock);
+		}
+		if (r->stopping) {
+			(void)pthread_mutex_unlock(&r->lock);
+			break;
+		}
+		w = r->ready_head;
+		r->ready_head = w->next_ready;
+		if (r->ready_head == NULL) {
+			r->ready_tail = NULL;
+		}
+		w->state = WS_REACTOR_RUNNING;
+		(void)pthread_mutex_unlock(&r->lock);
+
+		w->conn.tls_user_ptr = tls.user_ptr;
+		if (ws_reactor_read(w)) {
+			ws_reactor_arm(r, w);
+		} else {
+			ws_reactor_close(r, w);
+		}
+	}
+
+	if (ctx->callbacks.exit_thread) {
+		ctx->callbacks.exit_thread(ctx, 1, tls.user_ptr);
+	}
+	pthread_setspecific(sTlsKey, NULL);
+	return NULL;
+}
+
+
+static void *
+ws_reactor_thread(void *thread_func_param)
+{
+	struct mg_ws_reactor *r = (struct mg_ws_reactor *)thread_func_param;
+	struct epoll_event ev[64];
+	struct mg_ws_reactor_conn *w, *closed;
+	uint64_t now, next_check = 0, u;
+	ssize_t ret;
+	int i, n, queued, stopping;
+
+	mg_set_thread_name("ws-loop");
+
+	for (;;) {
+		/* Free the connections closed by dispatch threads. Their sockets
+		 * have been removed from epoll before, so no event returned by
+		 * epoll_wait below can refer to them. */
+		(void)pthread_mutex_lock(&r->lock);
+		closed = r->closed;
+		r->closed = NULL;
+		stopping = r->stopping;
+		(void)pthread_mutex_unlock(&r->lock);
+		while ((w = closed) != NULL) {
+			closed = w->next_ready;
+			ws_reactor_free_conn(w);
+		}
+		if (stopping) {
+			break;
+		}
+
+		n = epoll_wait(r->epfd, ev, (int)ARRAY_SIZE(ev), MG_WS_REACTOR_CHECK_MS);
+		now = mg_get_current_time_ns();
+		queued = 0;
+
+		(void)pthread_mutex_lock(&r->lock);
+		for (i = 0; i < n; i++) {
+			w = (struct mg_ws_reactor_conn *)ev[i].data.ptr;
+			if (w == NULL) {
+				/* Woken up by ws_reactor_stop */
+				ret = read(r->wakeup_fd, &u, sizeof(u));
+				(void)ret;
+			} else if (w->state == WS_REACTOR_ARMED) {
+				ws_reactor_queue(r, w);
+				queued++;
+			}
+		}
+		if (now >= next_check) {
+			for (w = r->conns; w != NULL; w = w->next) {
+				if ((w->state == WS_REACTOR_ARMED)
+				    && (w->conn.must_close
+				        || !STOP_FLAG_IS_ZERO(&r->ctx->stop_flag)
+				        || (now - w->last_activity_ns >= w->timeout_ns))) {
+					ws_reactor_queue(r, w);
+					queued++;
+				}
+			}
+			next_check = now + (uint64_t)MG_WS_REACTOR_CHECK_MS * 1000000;
+		}
+		if (queued == 1) {
+			(void)pthread_cond_signal(&r->cond);
+		} else if (queued > 1) {
+			(void)pthread_cond_broadcast(&r->cond);
+		}
+		(void)pthread_mutex_unlock(&r->lock);
+	}
+	return NULL;
+}
+
+
+/* Master thread: start the reactor and dispatch threads */
+static void
+ws_reactor_start(struct mg_context *ctx)
+{
+	struct mg_ws_reactor *r = ctx->ws_reactor;
+	unsigned int i;
+
+	if (r == NULL) {
+		return;
+	}
+	for (i = 0; i < r->num_threads; i++) {
+		if (mg_start_thread_with_id(ws_reactor_dispatch_thread,
+		                            r,
+		                            &r->dispatch_threads[r->num_started])
+		    != 0) {
+			mg_cry_ctx_internal(ctx,
+			                    "Cannot start websocket dispatch thread: %ld",
+			                    (long)ERRNO);
+		} else {
+			r->num_started++;
+		}
+	}
+	if ((r->num_started == 0)
+	    || (mg_start_thread_with_id(ws_reactor_thread, r, &r->reactor_thread)
+	        != 0)) {
+		mg_cry_ctx_internal(ctx,
+		                    "%s",
+		                    "Cannot start websocket reactor, websockets are "
+		                    "served by worker threads");
+		(void)pthread_mutex_lock(&r->lock);
+		r->stopping = 1;
+		(void)pthread_cond_broadcast(&r->cond);
+		(void)pthread_mutex_unlock(&r->lock);
+		for (i = 0; i < r->num_started; i++) {
+			mg_join_thread(r->dispatch_threads[i]);
+		}
+		return;
+	}
+	r->running = 1;
+}
+
+
+/* Master thread: stop all reactor threads and close all websockets.
+ * Must be called after all worker threads have been joined. */
+static void
+ws_reactor_stop(struct mg_context *ctx)
+{
+	struct mg_ws_reactor *r = ctx->ws_reactor;
+	uint64_t u = 1;
+	ssize_t ret;
+	unsigned int i;
+
+	if ((r == NULL) || !r->running) {
+		return;
+	}
+
+	(void)pthread_mutex_lock(&r->lock);
+	r->stopping = 1;
+	(void)pthread_cond_broadcast(&r->cond);
+	(void)pthread_mutex_unlock(&r->lock);
+	ret = write(r->wakeup_fd, &u, sizeof(u));
+	(void)ret;
+
+	mg_join_thread(r->reactor_thread);
+	for (i = 0; i < r->num_started; i++) {
+		mg_join_thread(r->dispatch_threads[i]);
+	}
+	r->running = 0;
+
+	/* No other thread uses the connections anymore */
+	r->ready_head = r->ready_tail = NULL;
+	while (r->conns != NULL) {
+		ws_reactor_close(r, r->conns);
+	}
+}
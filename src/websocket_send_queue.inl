@@ -0,0 +1,636 @@
+/* Non-blocking send queues for websocket connections
+ * ("websocket_send_queue_size").
+ * Without them, mg_websocket_write blocks until the complete frame has been
+ * written, so one slow client stalls the thread sending data to many
+ * clients. With them, every frame is stored in a reference counted buffer
+ * and appended to a queue of the connection. As long as the queue is empty,
+ * the frame is written at once, as far as the socket accepts it without
+ * blocking. The rest is written by a sender thread, which waits until the
+ * sockets of all connections with queued data are writable.
+ * If the data queued for a connection exceeds websocket_send_queue_size
+ * bytes, the websocket_send_queue_policy decides what happens to a new
+ * frame:
+ *   - "block": the writing thread sends queued data itself, until there is
+ *     space in the queue, or the connection is closed after
+ *     websocket_timeout_ms,
+ *   - "drop": the new frame is dropped (and counted),
+ *   - "close": the connection is closed.
+ * A queue is only protected by the mutex of its connection. The list of
+ * queues waiting for the sender thread is protected by the sender lock.
+ * The sender thread only uses pthread_mutex_trylock for connections,
+ * since writing threads add their queue to the list while holding the
+ * connection mutex.
+ */
+#if !defined(USE_WEBSOCKET)
+#error "This file must only be included, if USE_WEBSOCKET is set"
+#endif
+
+#if !defined(MG_WS_SENDER_POLL_MS)
+#define MG_WS_SENDER_POLL_MS (20)
+#endif
+
+
+enum {
+	WS_QUEUE_POLICY_BLOCK,
+	WS_QUEUE_POLICY_DROP,
+	WS_QUEUE_POLICY_CLOSE
+};
+
+
+/* Websocket frame shared by several connections and queues */
+struct mg_ws_frame {
+	volatile ptrdiff_t refs;
+	const char *buf; /* Header and payload */
+	size_t len;
+	char mem[1]; /* Allocated with the required length */
+};
+
+
+struct mg_ws_queue_entry {
+	struct mg_ws_queue_entry *next;
+	struct mg_ws_frame *frame;
+};
+
+
+struct mg_ws_send_queue {
+	struct mg_connection *conn;
+	struct mg_ws_queue_entry *head;
+	struct mg_ws_queue_entry *tail;
+	size_t sent;             /* Bytes of the first frame already sent */
+	size_t bytes;            /* Bytes waiting to be sent */
+	unsigned int frames;     /* Frames waiting to be sent */
+	uint64_t dropped;        /* Frames dropped (policy "drop") */
+	int listed;              /* 1 if in the list of the sender thread */
+	struct mg_ws_send_queue *prev; /* List of the sender thread */
+	struct mg_ws_send_queue *next;
+};
+
+
+struct mg_ws_sender {
+	struct mg_context *ctx;
+	size_t high_water; /* websocket_send_queue_size */
+	int policy;        /* WS_QUEUE_POLICY_* */
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* Signaled when a queue is added to the list */
+	int running;         /* 1 if the sender thread has been started */
+	int stopping;
+	pthread_t thread;
+	struct mg_ws_send_queue *pending; /* Queues with data to send */
+	unsigned int num_pending;
+	struct mg_pollfd *pfd; /* Used by the sender thread only */
+	unsigned int pfd_size;
+};
+
+
+static struct mg_ws_frame *
+ws_frame_alloc(struct mg_context *ctx,
+               const unsigned char *header,
+               size_t header_len,
+               const char *data,
+               size_t data_len)
+{
+	struct mg_ws_frame *f;
+
+	(void)ctx; /* Only used for memory statistics */
+	f = (struct mg_ws_frame *)mg_malloc_ctx(sizeof(*f) + header_len + data_len,
+	                                        ctx);
+	if (f == NULL) {
+		return NULL;
+	}
+	memcpy(f->mem, header, header_len);
+	if (data_len > 0) {
+		memcpy(f->mem + header_len, data, data_len);
+	}
+	f->refs = 1;
+	f->buf = f->mem;
+	f->len = header_len + data_len;
+	return f;
+}
+
+
+static struct mg_ws_frame *
+ws_frame_ref(struct mg_ws_frame *f)
+{
+	mg_atomic_inc(&f->refs);
+	return f;
+}
+
+
+static void
+ws_frame_release(struct mg_ws_frame *f)
+{
+	if ((f != NULL) && (mg_atomic_dec(&f->refs) == 0)) {
+		mg_free(f);
+	}
+}
+
+
+/* Write as much of a buffer as possible without blocking.
+ * Return the number of bytes written (0 if the connection is busy),
+ * or -1 on error. */
+static int
+ws_push_nonblocking(struct mg_connection *conn, const char *buf, size_t len)
+{
+	int n, flags = MSG_NOSIGNAL;
+
+	if (len > INT_MAX) {
+		len = INT_MAX;
+	}
+#if defined(USE_MBEDTLS)
+	if (conn->ssl != NULL) {
+		n = mbed_ssl_write(conn->ssl, (const unsigned char *)buf, (int)len);
+		if ((n == MBEDTLS_ERR_SSL_WANT_READ)
+		    || (n == MBEDTLS_ERR_SSL_WANT_WRITE)
+		    || (n == MBEDTLS_ERR_SSL_ASYNC_IN_PROGRESS)) {
+			return 0;
+		}
+		return (n > 0) ? n : -1;
+	}
+#elif !defined(NO_SSL)
+	if (conn->ssl != NULL) {
+		int err;
+
+		ERR_clear_error();
+		n = SSL_write(conn->ssl, buf, (int)len);
+		if (n <= 0) {
+			err = SSL_get_error(conn->ssl, n);
+			ERR_clear_error();
+			return ((err == SSL_ERROR_WANT_READ)
+			        || (err == SSL_ERROR_WANT_WRITE))
+			           ? 0
+			           : -1;
+		}
+		return n;
+	}
+#endif
+
+#if defined(MSG_DONTWAIT)
+	flags |= MSG_DONTWAIT;
+#endif
+#if defined(_WIN32)
+	n = (int)send(conn->client.sock, buf, (int)len, flags);
+	if ((n < 0) && (ERRNO == WSAEWOULDBLOCK)) {
+		return 0;
+	}
+#else
+	do {
+		n = (int)send(conn->client.sock, buf, len, flags);
+	} while ((n < 0) && (ERRNO == EINTR));
+	if ((n < 0) && ERROR_TRY_AGAIN(ERRNO)) {
+		return 0;
+	}
+#endif
+	return (n >= 0) ? n : -1;
+}
+
+
+/* A client does not accept data fast enough */
+static void
+ws_slow_consumer(struct mg_connection *conn)
+{
+	if (STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)) {
+		mg_cry_internal(conn,
+		                "Websocket client %s:%u is too slow, closing "
+		                "connection",
+		                conn->request_info.remote_addr,
+		                conn->request_info.remote_port);
+	}
+	/* The thread reading from this connection calls the close handler */
+	conn->must_close = 1;
+	(void)shutdown(conn->client.sock, SHUTDOWN_BOTH);
+}
+
+
+static struct mg_ws_sender *
+ws_sender_create(struct mg_context *ctx, size_t high_water, const char *policy)
+{
+	struct mg_ws_sender *s =
+	    (struct mg_ws_sender *)mg_calloc_ctx(1, sizeof(*s), ctx);
+
+	if (s == NULL) {
+		return NULL;
+	}
+	if (0 != pthread_mutex_init(&s->lock, NULL)) {
+		mg_free(s);
+		return NULL;
+	}
+	if (0 != pthread_cond_init(&s->cond, NULL)) {
+		(void)pthread_mutex_destroy(&s->lock);
+		mg_free(s);
+		return NULL;
+	}
+	s->ctx = ctx;
+	s->high_water = high_water;
+	if (!mg_strcasecmp(policy, "drop")) {
+		s->policy = WS_QUEUE_POLICY_DROP;
+	} else if (!mg_strcasecmp(policy, "close")) {
+		s->policy = WS_QUEUE_POLICY_CLOSE;
+	} else {
+		s->policy = WS_QUEUE_POLICY_BLOCK;
+	}
+	return s;
+}
+
+
+/* Free the sender. All connections must have been closed before. */
+static void
+ws_sender_destroy(struct mg_ws_sender *s)
+{
+	if (s != NULL) {
+		(void)pthread_cond_destroy(&s->cond);
+		(void)pthread_mutex_destroy(&s->lock);
+		mg_free(s->pfd);
+		mg_free(s);
+	}
+}
+
+
+/* Check if frames of a connection are queued */
+static int
+ws_send_queue_enabled(const struct mg_connection *conn)
+{
+	const struct mg_ws_sender *s = conn->phys_ctx->ws_sender;
+
+	return (s != NULL) && s->running
+	       && (conn->phys_ctx->context_type == CONTEXT_SERVER);
+}
+
+
+/* Add a queue to the list of the sender thread. Call with the connection
+ * mutex held. */
+static void
+ws_sender_add(struct mg_ws_sender *s, struct mg_ws_send_queue *q)
+{
+	(void)pthread_mutex_lock(&s->lock);
+	if (!q->listed) {
+		q->listed = 1;
+		q->prev = NULL;
+		q->next = s->pending;
+		if (s->pending != NULL) {
+			s->pending->prev = q;
+		}
+		s->pending = q;
+		s->num_pending++;
+		(void)pthread_cond_signal(&s->cond);
+	}
+	(void)pthread_mutex_unlock(&s->lock);
+}
+
+
+/* Remove a queue from the list. Call with s->lock held. */
+static void
+ws_sender_remove(struct mg_ws_sender *s, struct mg_ws_send_queue *q)
+{
+	if (q->prev != NULL) {
+		q->prev->next = q->next;
+	} else {
+		s->pending = q->next;
+	}
+	if (q->next != NULL) {
+		q->next->prev = q->prev;
+	}
+	q->listed = 0;
+	s->num_pending--;
+}
+
+
+/* Write queued frames without blocking. Call with the connection mutex
+ * held. Return 1 if the queue is empty, 0 if data is left, -1 on error. */
+static int
+ws_send_queue_drain(struct mg_ws_send_queue *q)
+{
+	struct mg_connection *conn = q->conn;
+	struct mg_ws_queue_entry *e;
+	int n;
+
+	while ((e = q->head) != NULL) {
+		n = ws_push_nonblocking(conn,
+		                        e->frame->buf + q->sent,
+		                        e->frame->len - q->sent);
+		if (n < 0) {
+			return -1;
+		}
+		q->sent += (size_t)n;
+		conn->num_bytes_sent += n;
+		if (q->sent < e->frame->len) {
+			return 0;
+		}
+		q->head = e->next;
+		if (q->head == NULL) {
+			q->tail = NULL;
+		}
+		q->bytes -= e->frame->len;
+		q->frames--;
+		q->sent = 0;
+		ws_frame_release(e->frame);
+		mg_free(e);
+	}
+	return 1;
+}
+
+
+/* Wait until the queue has space for a frame of len bytes, by sending
+ * queued data in the calling thread. Call with the connection mutex held.
+ * Return 1 if there is space, 0 if not. */
+static int
+ws_send_queue_wait(struct mg_ws_send_queue *q, size_t len, uint64_t deadline)
+{
+	struct mg_connection *conn = q->conn;
+	struct mg_ws_sender *s = conn->phys_ctx->ws_sender;
+	struct mg_pollfd pfd[1];
+	uint64_t now;
+
+	for (;;) {
+		if (ws_send_queue_drain(q) < 0) {
+			return 0;
+		}
+		if ((q->frames == 0) || (q->bytes + len <= s->high_water)) {
+			return 1;
+		}
+		now = mg_get_current_time_ns();
+		if ((now >= deadline)
+		    || !STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)) {
+			return 0;
+		}
+		pfd[0].fd = conn->client.sock;
+		pfd[0].events = POLLOUT;
+		(void)mg_poll(pfd,
+		              1,
+		              (int)((deadline - now) / 1000000) + 1,
+		              &conn->phys_ctx->stop_flag);
+	}
+}
+
+
+/* Append a frame to the queue of a connection, or send it at once if the
+ * queue is empty. Call with the connection mutex held.
+ * Return 1 if the frame has been sent or queued, 0 if it has been dropped,
+ * or -1 if the connection is closed. */
+static int
+ws_send_queue_push(struct mg_connection *conn,
+                   struct mg_ws_frame *frame,
+                   uint64_t deadline)
+{
+	struct mg_ws_sender *s = conn->phys_ctx->ws_sender;
+	struct mg_ws_send_queue *q = conn->ws_queue;
+	struct mg_ws_queue_entry *e;
+
+	if (conn->must_close) {
+		return -1;
+	}
+	if (((q == NULL) || (q->frames == 0))
+	    && (flush_output_buffer(conn) != 0)) {
+		return -1;
+	}
+	if (q == NULL) {
+		/* First frame sent to this connection */
+		q = (struct mg_ws_send_queue *)mg_calloc_ctx(1,
+		                                             sizeof(*q),
+		                                             conn->phys_ctx);
+		if (q == NULL) {
+			return -1;
+		}
+		q->conn = conn;
+		conn->ws_queue = q;
+	}
+
+	if ((q->frames > 0) && (q->bytes + frame->len > s->high_water)) {
+		/* High-water mark reached */
+		if (s->policy == WS_QUEUE_POLICY_DROP) {
+			q->dropped++;
+			return 0;
+		}
+		if ((s->policy == WS_QUEUE_POLICY_CLOSE)
+		    || !ws_send_queue_wait(q, frame->len, deadline)) {
+			ws_slow_consumer(conn);
+			return -1;
+		}
+	}
+
+	e = (struct mg_ws_queue_entry *)mg_malloc_ctx(sizeof(*e),
+	                                              conn->phys_ctx);
+	if (e == NULL) {
+		return -1;
+	}
+	e->next = NULL;
+	e->frame = ws_frame_ref(frame);
+	if (q->tail != NULL) {
+		q->tail->next = e;
+	} else {
+		q->head = e;
+	}
+	q->tail = e;
+	q->bytes += frame->len;
+	q->frames++;
+
+	if (q->frames == 1) {
+		/* Try to send it at once */
+		if (ws_send_queue_drain(q) < 0) {
+			return -1;
+		}
+	}
+	if (q->frames > 0) {
+		ws_sender_add(s, q);
+	}
+	return 1;
+}
+
+
+/* Send a frame created by mg_websocket_write using the queue. Call with the
+ * connection mutex held. Return value: like mg_websocket_write. */
+static int
+ws_send_queue_write(struct mg_connection *conn,
+                    const unsigned char *header,
+                    size_t header_len,
+                    const char *data,
+                    size_t data_len)
+{
+	struct mg_ws_frame *frame;
+	uint64_t deadline =
+	    mg_get_current_time_ns()
+	    + (uint64_t)(websocket_read_timeout(conn) * 1.0e9);
+	int ret;
+
+	frame = ws_frame_alloc(conn->phys_ctx, header, header_len, data, data_len);
+	if (frame == NULL) {
+		mg_cry_internal(conn,
+		                "%s",
+		                "Cannot allocate websocket frame: Out of memory");
+		return -1;
+	}
+	ret = ws_send_queue_push(conn, frame, deadline);
+	ws_frame_release(frame);
+
+	if (ret > 0) {
+		/* Like mg_websocket_write: the header length for empty frames */
+		return (data_len > 0) ? (int)data_len : (int)header_len;
+	}
+	return ret;
+}
+
+
+/* Discard the queue of a connection, when it is closed. Call with the
+ * connection mutex held. */
+static void
+ws_send_queue_free(struct mg_connection *conn)
+{
+	struct mg_ws_send_queue *q = conn->ws_queue;
+	struct mg_ws_sender *s = conn->phys_ctx->ws_sender;
+	struct mg_ws_queue_entry *e;
+
+	if (q == NULL) {
+		return;
+	}
+	if (q->listed) {
+		(void)pthread_mutex_lock(&s->lock);
+		ws_sender_remove(s, q);
+		(void)pthread_mutex_unlock(&s->lock);
+	}
+	while ((e = q->head) != NULL) {
+		q->head = e->next;
+		ws_frame_release(e->frame);
+		mg_free(e);
+	}
+	mg_free(q);
+	conn->ws_queue = NULL;
+}
+
+
+#if defined(_WIN32)
+static unsigned __stdcall ws_sender_thread(void *thread_func_param)
+#else
+static void *
+ws_sender_thread(void *thread_func_param)
+#endif
+{
+	struct mg_ws_sender *s = (struct mg_ws_sender *)thread_func_param;
+	struct mg_ws_send_queue *q, *next;
+	struct mg_pollfd *pfd;
+	unsigned int n;
+	int ret;
+
+	mg_set_thread_name("ws-send");
+
+	(void)pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while ((s->pending == NULL) && !s->stopping) {
+			(void)pthread_cond_wait(&s->cond, &s->lock);
+		}
+		if (s->stopping) {
+			break;
+		}
+
+		/* Wait until one of the sockets is writable */
+		if (s->num_pending > s->pfd_size) {
+			pfd = (struct mg_pollfd *)mg_realloc_ctx(s->pfd,
+			                                         s->num_pending
+			                                             * sizeof(*pfd),
+			                                         s->ctx);
+			if (pfd != NULL) {
+				s->pfd = pfd;
+				s->pfd_size = s->num_pending;
+			}
+		}
+		n = 0;
+		for (q = s->pending; (q != NULL) && (n < s->pfd_size); q = q->next) {
+			s->pfd[n].fd = q->conn->client.sock;
+			s->pfd[n].events = POLLOUT;
+			n++;
+		}
+		(void)pthread_mutex_unlock(&s->lock);
+		if (n > 0) {
+			(void)mg_poll(s->pfd, n, MG_WS_SENDER_POLL_MS, &s->ctx->stop_flag);
+		} else {
+			mg_sleep(MG_WS_SENDER_POLL_MS);
+		}
+		(void)pthread_mutex_lock(&s->lock);
+
+		/* Send as much as possible. Connections used by other threads
+		 * are skipped, and tried again later. */
+		for (q = s->pending; q != NULL; q = next) {
+			next = q->next;
+			if (0 != pthread_mutex_trylock(&q->conn->mutex)) {
+				continue;
+			}
+			ret = ws_send_queue_drain(q);
+			if (ret != 0) {
+				/* Empty, or failed: the reading thread will close the
+				 * connection and free the queue */
+				ws_sender_remove(s, q);
+			}
+			(void)pthread_mutex_unlock(&q->conn->mutex);
+		}
+	}
+	(void)pthread_mutex_unlock(&s->lock);
+#if defined(_WIN32)
+	return 0;
+#else
+	return NULL;
+#endif
+}
+
+
+/* Master thread: start the sender thread */
+static void
+ws_sender_start(struct mg_context *ctx)
+{
+	struct mg_ws_sender *s = ctx->ws_sender;
+
+	if (s == NULL) {
+		return;
+	}
+	if (mg_start_thread_with_id(ws_sender_thread, s, &s->thread) != 0) {
+		mg_cry_ctx_internal(ctx,
+		                    "Cannot start websocket sender thread: %ld, "
+		                    "websocket send queues are disabled",
+		                    (long)ERRNO);
+		return;
+	}
+	s->running = 1;
+}
+
+
+/* Master thread: stop the sender thread. Must be called after all
+ * websocket connections have been closed. */
+static void
+ws_sender_stop(struct mg_context *ctx)
+{
+	struct mg_ws_sender *s = ctx->ws_sender;
+
+	if ((s == NULL) || !s->running) {
+		return;
+	}
+	(void)pthread_mutex_lock(&s->lock);
+	s->stopping = 1;
+	(void)pthread_cond_signal(&s->cond);
+	(void)pthread_mutex_unlock(&s->lock);
+	mg_join_thread(s->thread);
+	s->running = 0;
+}
+
+
+int
+mg_websocket_get_send_queue_info(struct mg_connection *conn,
+                                 struct mg_websocket_send_queue_info *info)
+{
+	const struct mg_ws_send_queue *q;
+
+	if ((conn == NULL) || (info == NULL) || (conn->phys_ctx == NULL)) {
+		return -1;
+	}
+	memset(info, 0, sizeof(*info));
+	if (!ws_send_queue_enabled(conn)) {
+		return -1;
+	}
+	info->high_water = conn->phys_ctx->ws_sender->high_water;
+
+	mg_lock_connection(conn);
+	q = conn->ws_queue;
+	if (q != NULL) {
+		info->queued_bytes = q->bytes - q->sent;
+		info->queued_frames = q->frames;
+		info->dropped_frames = q->dropped;
+	}
+	mg_unlock_connection(conn);
+	return 0;
+}
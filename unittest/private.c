@@ -247,9 +247,11 @@ START_TEST(test_should_keep_alive)
 	ck_assert_int_eq(conn.request_info.num_headers, 0);
 
 	ctx.dd.config[ENABLE_KEEP_ALIVE] = no;
+	init_domain_config(&(ctx.dd));
 	ck_assert_int_eq(should_keep_alive(&conn), 0);
 
 	ctx.dd.config[ENABLE_KEEP_ALIVE] = yes;
+	init_domain_config(&(ctx.dd));
 	ck_assert_int_eq(should_keep_alive(&conn), 1);
 
 	conn.must_close = 1;
@@ -292,6 +294,9 @@ START_TEST(test_match_prefix)
 	/* Adapted from unit_test.c */
 	/* Copyright (c) 2013-2015 the Civetweb developers */
 	/* Copyright (c) 2004-2013 Sergey Lyubka */
+	static const char *evil_pattern = "**a**a**a**a**a**a**a**a**a**a**b$";
+	char long_str[4001];
+
 	ck_assert_int_eq(4, match_prefix("/api", 4, "/api"));
 	ck_assert_int_eq(3, match_prefix("/a/", 3, "/a/b/c"));
 	ck_assert_int_eq(-1, match_prefix("/a/", 3, "/ab/c"));
@@ -320,6 +325,135 @@ START_TEST(test_match_prefix)
 	ck_assert_int_eq(6, match_prefix("**.a$|**.b$", 11, "/a/b.b"));
 	ck_assert_int_eq(6, match_prefix("**.a$|**.b$", 11, "/a/B.A"));
 	ck_assert_int_eq(5, match_prefix("**o$", 4, "HELLO"));
+
+	/* Patterns must not backtrack exponentially */
+	memset(long_str, 'a', sizeof(long_str) - 1);
+	long_str[sizeof(long_str) - 1] = 0;
+	ck_assert_int_eq(-1,
+	                 match_prefix(evil_pattern, strlen(evil_pattern), long_str));
+	ck_assert_int_eq(4000, match_prefix("**a**a**a**a$", 13, long_str));
+	ck_assert_int_eq(3, match_prefix("x|**b|aa?", 9, "aaa"));
+}
+END_TEST
+
+
+/* Handler lookup as it was done before handler tables were compiled */
+static struct mg_handler_info *
+reference_handler_lookup(struct mg_handler_info *handlers,
+                         int handler_type,
+                         const char *uri)
+{
+	size_t urilen = strlen(uri);
+	struct mg_handler_info *rh;
+	int step, matched;
+
+	for (step = 0; step < 3; step++) {
+		for (rh = handlers; rh != NULL; rh = rh->next) {
+			if (rh->handler_type != handler_type) {
+				continue;
+			}
+			if (step == 0) {
+				matched = (rh->uri_len == urilen) && !strcmp(rh->uri, uri);
+			} else if (step == 1) {
+				matched = (rh->uri_len < urilen) && (uri[rh->uri_len] == '/')
+				          && !memcmp(rh->uri, uri, rh->uri_len);
+			} else {
+				matched = match_prefix(rh->uri, rh->uri_len, uri) > 0;
+			}
+			if (matched) {
+				return rh;
+			}
+		}
+	}
+	return NULL;
+}
+
+
+START_TEST(test_handler_table)
+{
+	static const char *uris[] = {"/api/**.json$",
+	                             "/api/v1",
+	                             "/api",
+	                             "/API/v2",
+	                             "/api/v1/users",
+	                             "/static",
+	                             "/a",
+	                             "/ab",
+	                             "**.lua$",
+	                             "/api/v1/users/*/posts",
+	                             "/x|/y",
+	                             "",
+	                             "/api/v1/items"};
+	static const char *requests[] = {"/api/v1",
+	                                 "/api/v1/users",
+	                                 "/api/v1/users/7",
+	                                 "/api/v1/users/7/posts",
+	                                 "/api/v1/x.json",
+	                                 "/api/v2",
+	                                 "/api/v2/x",
+	                                 "/API/V2/X",
+	                                 "/Api",
+	                                 "/apix",
+	                                 "/api/v1/itemsx",
+	                                 "/static/x.lua",
+	                                 "/staticx",
+	                                 "/a/b",
+	                                 "/ab",
+	                                 "/abc",
+	                                 "/A",
+	                                 "/y/z",
+	                                 "/",
+	                                 "",
+	                                 "/none"};
+	struct mg_handler_info handlers[sizeof(uris) / sizeof(uris[0])];
+	struct mg_handler_table *tab;
+	struct mg_handler_info *rh;
+	size_t i, j;
+	int t;
+
+	mark_point();
+
+	memset(handlers, 0, sizeof(handlers));
+	for (i = 0; i < sizeof(uris) / sizeof(uris[0]); i++) {
+		handlers[i].uri = (char *)uris[i];
+		handlers[i].uri_len = strlen(uris[i]);
+		/* "/a", "" and "/api/v1/items" are websocket handlers */
+		handlers[i].handler_type = ((i == 6) || (i == 11) || (i == 12))
+		                               ? WEBSOCKET_HANDLER
+		                               : REQUEST_HANDLER;
+		handlers[i].next = (i + 1 < sizeof(uris) / sizeof(uris[0]))
+		                       ? &handlers[i + 1]
+		                       : NULL;
+	}
+
+	tab = build_handler_table(NULL, NULL);
+	ck_assert_ptr_ne(tab, NULL);
+	ck_assert_ptr_eq(lookup_handler(tab, REQUEST_HANDLER, "/x", 2), NULL);
+	mg_free(tab);
+
+	tab = build_handler_table(NULL, handlers);
+	ck_assert_ptr_ne(tab, NULL);
+
+	rh = lookup_handler(tab, REQUEST_HANDLER, "/api/v1/users/7", 15);
+	ck_assert_ptr_eq(rh, &handlers[1]);
+	rh = lookup_handler(tab, REQUEST_HANDLER, "/api/v1/x.json", 14);
+	ck_assert_ptr_eq(rh, &handlers[1]);
+	rh = lookup_handler(tab, REQUEST_HANDLER, "/apix", 5);
+	ck_assert_ptr_eq(rh, &handlers[2]);
+	rh = lookup_handler(tab, WEBSOCKET_HANDLER, "/a/b", 4);
+	ck_assert_ptr_eq(rh, &handlers[6]);
+	rh = lookup_handler(tab, AUTH_HANDLER, "/api", 4);
+	ck_assert_ptr_eq(rh, NULL);
+
+	for (t = REQUEST_HANDLER; t <= AUTH_HANDLER; t++) {
+		for (j = 0; j < sizeof(requests) / sizeof(requests[0]); j++) {
+			ck_assert_ptr_eq(
+			    lookup_handler(tab, t, requests[j], strlen(requests[j])),
+			    reference_handler_lookup(handlers, t, requests[j]));
+		}
+	}
+
+	mg_free(tab);
 }
 END_TEST
 
@@ -965,6 +1099,228 @@ START_TEST(test_parse_http_headers)
 END_TEST
 
 
+START_TEST(test_parse_accept_encoding)
+{
+	unsigned char list[MG_ENCODING_COUNT];
+
+	mark_point();
+
+	/* No header: no compression */
+	parse_accept_encoding(NULL, list);
+	ck_assert_int_eq(list[0], MG_ENCODING_IDENTITY);
+
+	/* Same q-value: server preference */
+	parse_accept_encoding("gzip, deflate, br, zstd", list);
+	ck_assert_int_eq(list[0], MG_ENCODING_BR);
+	ck_assert_int_eq(list[1], MG_ENCODING_ZSTD);
+	ck_assert_int_eq(list[2], MG_ENCODING_GZIP);
+	ck_assert_int_eq(list[3], MG_ENCODING_IDENTITY);
+
+	/* Sorted by q-value, q=0 is not acceptable */
+	parse_accept_encoding("br;q=0.5, GZIP ; q=0.9,zstd;q=0", list);
+	ck_assert_int_eq(list[0], MG_ENCODING_GZIP);
+	ck_assert_int_eq(list[1], MG_ENCODING_BR);
+	ck_assert_int_eq(list[2], MG_ENCODING_IDENTITY);
+
+	parse_accept_encoding("gzip;q=0.001, br;q=0.01", list);
+	ck_assert_int_eq(list[0], MG_ENCODING_BR);
+	ck_assert_int_eq(list[1], MG_ENCODING_GZIP);
+	ck_assert_int_eq(list[2], MG_ENCODING_IDENTITY);
+
+	/* "*" applies to all encodings not in the list */
+	parse_accept_encoding("*;q=0.1, gzip", list);
+	ck_assert_int_eq(list[0], MG_ENCODING_GZIP);
+	ck_assert_int_eq(list[1], MG_ENCODING_BR);
+	ck_assert_int_eq(list[2], MG_ENCODING_ZSTD);
+	ck_assert_int_eq(list[3], MG_ENCODING_IDENTITY);
+
+	parse_accept_encoding("identity, *;q=0", list);
+	ck_assert_int_eq(list[0], MG_ENCODING_IDENTITY);
+
+	/* Unknown encodings and similar names are ignored */
+	parse_accept_encoding("x-gzip, gzipper, b, compress", list);
+	ck_assert_int_eq(list[0], MG_ENCODING_IDENTITY);
+}
+END_TEST
+
+
+START_TEST(test_parse_byte_ranges)
+{
+	struct mg_byte_range r[4];
+
+	mark_point();
+
+	/* Single ranges, limited to the file size */
+	ck_assert_int_eq(parse_byte_ranges("bytes=0-99", 1000, r, 4), 1);
+	ck_assert_int_eq((int)r[0].first, 0);
+	ck_assert_int_eq((int)r[0].last, 99);
+	ck_assert_int_eq(parse_byte_ranges("bytes=500-", 1000, r, 4), 1);
+	ck_assert_int_eq((int)r[0].first, 500);
+	ck_assert_int_eq((int)r[0].last, 999);
+	ck_assert_int_eq(parse_byte_ranges("bytes=900-2000", 1000, r, 4), 1);
+	ck_assert_int_eq((int)r[0].last, 999);
+
+	/* Suffix ranges */
+	ck_assert_int_eq(parse_byte_ranges("bytes=-100", 1000, r, 4), 1);
+	ck_assert_int_eq((int)r[0].first, 900);
+	ck_assert_int_eq((int)r[0].last, 999);
+	ck_assert_int_eq(parse_byte_ranges("bytes=-2000", 1000, r, 4), 1);
+	ck_assert_int_eq((int)r[0].first, 0);
+
+	/* Several ranges, in the order of the request */
+	ck_assert_int_eq(
+	    parse_byte_ranges("bytes=500-599, 0-9,-1", 1000, r, 4), 3);
+	ck_assert_int_eq((int)r[0].first, 500);
+	ck_assert_int_eq((int)r[0].last, 599);
+	ck_assert_int_eq((int)r[1].first, 0);
+	ck_assert_int_eq((int)r[1].last, 9);
+	ck_assert_int_eq((int)r[2].first, 999);
+	ck_assert_int_eq((int)r[2].last, 999);
+
+	/* Ranges outside the file are skipped */
+	ck_assert_int_eq(parse_byte_ranges("bytes=2000-,10-19", 1000, r, 4), 1);
+	ck_assert_int_eq((int)r[0].first, 10);
+	ck_assert_int_eq(parse_byte_ranges("bytes=1000-1999", 1000, r, 4), -1);
+	ck_assert_int_eq(parse_byte_ranges("bytes=-0", 1000, r, 4), -1);
+	ck_assert_int_eq(parse_byte_ranges("bytes=0-", 0, r, 4), -1);
+
+	/* Invalid headers and too many ranges are ignored */
+	ck_assert_int_eq(parse_byte_ranges("bytes=10-5", 1000, r, 4), 0);
+	ck_assert_int_eq(parse_byte_ranges("bytes=a-b", 1000, r, 4), 0);
+	ck_assert_int_eq(parse_byte_ranges("bytes=1-2;3-4", 1000, r, 4), 0);
+	ck_assert_int_eq(parse_byte_ranges("bytes=1-2,", 1000, r, 4), 0);
+	ck_assert_int_eq(parse_byte_ranges("items=0-9", 1000, r, 4), 0);
+	ck_assert_int_eq(
+	    parse_byte_ranges("bytes=99999999999999999999-", 1000, r, 4), 0);
+	ck_assert_int_eq(
+	    parse_byte_ranges("bytes=0-1,2-3,4-5,6-7,8-9", 1000, r, 4), 0);
+}
+END_TEST
+
+
+START_TEST(test_throttle_rules)
+{
+	struct mg_throttle *t;
+	struct mg_throttle_rule *r;
+	struct mg_throttle_bucket *b;
+	union usa sa;
+
+	mark_point();
+
+	/* Rules are compiled in order, malformed rules are skipped */
+	ck_assert_ptr_eq(throttle_create(""), NULL);
+	ck_assert_ptr_eq(throttle_create("*=x,*=1k/all"), NULL);
+	t = throttle_create("*=1k,10.0.0.0/8=0,/dl/**=1.5m/shared,"
+	                    "*=fast,192.168.1.0/24=100/ip");
+	ck_assert_ptr_ne(t, NULL);
+	ck_assert_int_eq(t->num_rules, 4);
+
+	r = &t->rules[0];
+	ck_assert_int_eq(r->match, THROTTLE_MATCH_ALL);
+	ck_assert_int_eq(r->scope, THROTTLE_PER_CONNECTION);
+	ck_assert_int_eq((int)r->rate, 1024);
+	ck_assert_int_eq((int)r->burst, 1024 * MG_THROTTLE_BURST_MS / 1000);
+
+	r = &t->rules[1];
+	ck_assert_int_eq(r->match, THROTTLE_MATCH_NET);
+	ck_assert_int_eq((int)r->rate, 0);
+
+	r = &t->rules[2];
+	ck_assert_int_eq(r->match, THROTTLE_MATCH_URI);
+	ck_assert_int_eq(r->scope, THROTTLE_SHARED);
+	ck_assert_ptr_ne(r->uri, NULL);
+	ck_assert_int_eq((int)match_pattern(r->uri, "/dl/a/b"), 7);
+	ck_assert_int_le((int)match_pattern(r->uri, "/img/a"), 0);
+	ck_assert_int_eq((int)r->rate, 1572864);
+
+	r = &t->rules[3];
+	ck_assert_int_eq(r->match, THROTTLE_MATCH_NET);
+	ck_assert_int_eq(r->scope, THROTTLE_PER_IP);
+	ck_assert_ptr_ne(r->clients, NULL);
+	ck_assert_int_eq((int)r->burst, 10);
+
+	/* Subnets */
+	memset(&sa, 0, sizeof(sa));
+	sa.sin.sin_family = AF_INET;
+	sa.sin.sin_addr.s_addr = htonl(0x0A010203); /* 10.1.2.3 */
+	ck_assert_int_eq(match_net(&t->rules[1].net, &sa), 1);
+	ck_assert_int_eq(match_net(&t->rules[3].net, &sa), 0);
+	sa.sin.sin_addr.s_addr = htonl(0xC0A801FE); /* 192.168.1.254 */
+	ck_assert_int_eq(match_net(&t->rules[1].net, &sa), 0);
+	ck_assert_int_eq(match_net(&t->rules[3].net, &sa), 1);
+
+	/* Connections from one address share a bucket */
+	b = throttle_client_bucket(r, &sa);
+	ck_assert_ptr_ne(b, NULL);
+	ck_assert_ptr_eq(throttle_client_bucket(r, &sa), b);
+	sa.sin.sin_addr.s_addr = htonl(0xC0A80101); /* 192.168.1.1 */
+	ck_assert_ptr_ne(throttle_client_bucket(r, &sa), b);
+
+	throttle_destroy(t);
+}
+END_TEST
+
+
+static int
+acl_allows(const struct mg_acl *acl, const char *ip)
+{
+	union usa sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin.sin_family = AF_INET;
+	sa.sin.sin_addr.s_addr = inet_addr(ip);
+	return acl_check(acl, &sa);
+}
+
+
+START_TEST(test_acl_tree)
+{
+	struct mg_acl *acl;
+	const char *error = NULL;
+
+	mark_point();
+
+	/* Malformed lists */
+	ck_assert_ptr_eq(acl_create("192.168.0.1", &error), NULL);
+	ck_assert_ptr_ne(error, NULL);
+	error = NULL;
+	ck_assert_ptr_eq(acl_create("+192.168.0.1/33", &error), NULL);
+	ck_assert_ptr_ne(error, NULL);
+	error = NULL;
+	ck_assert_ptr_eq(acl_create("+192.168.0.1,-x", &error), NULL);
+	ck_assert_ptr_ne(error, NULL);
+
+	/* The last matching subnet wins, all others are denied */
+	acl = acl_create("+10.0.0.0/8,-10.1.0.0/16,+10.1.2.3,"
+	                 "+192.168.1.1/24,+0.0.0.0/32",
+	                 &error);
+	ck_assert_ptr_ne(acl, NULL);
+	ck_assert_int_eq(acl_allows(acl, "10.0.0.1"), 1);
+	ck_assert_int_eq(acl_allows(acl, "10.255.255.255"), 1);
+	ck_assert_int_eq(acl_allows(acl, "10.1.0.1"), 0);
+	ck_assert_int_eq(acl_allows(acl, "10.1.2.3"), 1);
+	ck_assert_int_eq(acl_allows(acl, "10.1.2.4"), 0);
+	ck_assert_int_eq(acl_allows(acl, "11.0.0.1"), 0);
+	ck_assert_int_eq(acl_allows(acl, "0.0.0.0"), 1);
+	/* Host bits in the subnet address: never matches */
+	ck_assert_int_eq(acl_allows(acl, "192.168.1.1"), 0);
+	mg_free(acl);
+
+	acl = acl_create("+0.0.0.0/0,-127.0.0.1", &error);
+	ck_assert_ptr_ne(acl, NULL);
+	ck_assert_int_eq(acl_allows(acl, "8.8.8.8"), 1);
+	ck_assert_int_eq(acl_allows(acl, "127.0.0.1"), 0);
+	ck_assert_int_eq(acl_allows(acl, "127.0.0.2"), 1);
+	mg_free(acl);
+
+	acl = acl_create("-127.0.0.1,+0.0.0.0/0", &error);
+	ck_assert_ptr_ne(acl, NULL);
+	ck_assert_int_eq(acl_allows(acl, "127.0.0.1"), 1);
+	mg_free(acl);
+}
+END_TEST
+
+
 START_TEST(test_encode_decode)
 {
 	char buf[128];
@@ -1086,6 +1442,37 @@ START_TEST(test_encode_decode)
 END_TEST
 
 
+#if defined(USE_WEBSOCKET)
+static void
+check_mask_apply(const char in[1024], char out[1024])
+{
+	static const unsigned char key[4] = {0x12, 0x34, 0x56, 0xf8};
+	char ref[300];
+	int in_ofs, out_ofs, len, i;
+
+	for (in_ofs = 0; in_ofs < 32; in_ofs += 3) {
+		for (out_ofs = 0; out_ofs < 32; out_ofs++) {
+			for (len = 0; len < 300; len += 7) {
+				for (i = 0; i < len; i++) {
+					ref[i] =
+					    (char)((unsigned char)in[in_ofs + i] ^ key[i & 3]);
+				}
+				memset(out, 99, 1024);
+				ws_mask_apply(out + out_ofs, in + in_ofs, (size_t)len, key);
+				ck_assert(!memcmp(out + out_ofs, ref, (size_t)len));
+				ck_assert_int_eq((int)(unsigned char)out[out_ofs + len], 99);
+
+				/* In place */
+				memcpy(out + out_ofs, in + in_ofs, (size_t)len);
+				ws_mask_apply(out + out_ofs, out + out_ofs, (size_t)len, key);
+				ck_assert(!memcmp(out + out_ofs, ref, (size_t)len));
+			}
+		}
+	}
+}
+#endif
+
+
 START_TEST(test_mask_data)
 {
 #if defined(USE_WEBSOCKET)
@@ -1127,6 +1514,72 @@ START_TEST(test_mask_data)
 	ck_assert_uint_eq((unsigned char)out[2], 2u ^ 2u);
 	ck_assert_uint_eq((unsigned char)out[3], 3u ^ 1u);
 	ck_assert_uint_eq((unsigned char)out[4], 4u ^ 4u);
+
+	/* Vector kernels, for all alignments of input and output */
+	for (i = 0; i < 1024; i++) {
+		in[i] = (char)((unsigned char)(i * 13 + 5));
+	}
+	check_mask_apply(in, out);
+#if defined(USE_WEBSOCKET_AVX2)
+	/* Without AVX2 */
+	ws_mask_avx2_supported = 0;
+	check_mask_apply(in, out);
+	ws_mask_avx2_supported = -1;
+#endif
+#endif
+}
+END_TEST
+
+
+START_TEST(test_mask_data_throughput)
+{
+#if defined(USE_WEBSOCKET)
+	/* Unmask a large, unaligned frame several times, as read_websocket
+	 * does for telemetry streams. This benchmark takes a few seconds, so
+	 * it only runs if CIVETWEB_BENCHMARK is set in the environment. */
+	static const unsigned char key[4] = {0xa1, 0xb2, 0xc3, 0xd4};
+	const size_t len = 4 * 1024 * 1024;
+	const int rounds = 16;
+	char *buf;
+	uint64_t start, simd_ns, byte_ns;
+	size_t i;
+	int r;
+
+	if (getenv("CIVETWEB_BENCHMARK") == NULL) {
+		return;
+	}
+	buf = (char *)mg_malloc(len + 1);
+	ck_assert(buf != NULL);
+	for (i = 0; i <= len; i++) {
+		buf[i] = (char)((unsigned char)i);
+	}
+
+	start = mg_get_current_time_ns();
+	for (r = 0; r < rounds; r++) {
+		ws_mask_apply(buf + 1, buf + 1, len, key);
+	}
+	simd_ns = mg_get_current_time_ns() - start + 1;
+
+	/* An even number of rounds restores the data */
+	for (i = 0; i < len; i++) {
+		ck_assert_int_eq((int)(unsigned char)buf[i + 1],
+		                 (int)(unsigned char)(i + 1));
+	}
+
+	/* Reference: the former byte loop */
+	start = mg_get_current_time_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < len; i++) {
+			buf[i + 1] ^= (char)key[i & 3];
+		}
+	}
+	byte_ns = mg_get_current_time_ns() - start + 1;
+
+	printf("Mask data: %.0f MB/s (byte loop: %.0f MB/s)\n",
+	       (double)len * rounds / 1.048576 / (double)simd_ns * 1000.0,
+	       (double)len * rounds / 1.048576 / (double)byte_ns * 1000.0);
+
+	mg_free(buf);
 #endif
 }
 END_TEST
@@ -1193,6 +1646,43 @@ START_TEST(test_parse_date_string)
 END_TEST
 
 
+START_TEST(test_time_string_cache)
+{
+	time_t t;
+	char date[64], expected[64];
+	int i;
+
+	/* The first call formats the string, the second one uses the cache */
+	t = (time_t)784111777;
+	for (i = 0; i < 2; i++) {
+		gmt_time_string(date, sizeof(date), &t);
+		ck_assert_str_eq(date, "Sun, 06 Nov 1994 08:49:37 GMT");
+	}
+	gmt_time_string(date, 4, &t);
+	ck_assert_str_eq(date, "Sun");
+
+	/* Times using the same slot */
+	t += MG_TIME_STRING_SLOTS;
+	gmt_time_string(date, sizeof(date), &t);
+	ck_assert_str_eq(date, "Sun, 06 Nov 1994 08:49:53 GMT");
+	t -= MG_TIME_STRING_SLOTS;
+	gmt_time_string(date, sizeof(date), &t);
+	ck_assert_str_eq(date, "Sun, 06 Nov 1994 08:49:37 GMT");
+
+	/* Access log time stamps use the local time */
+	t = time(NULL);
+	strftime(expected,
+	         sizeof(expected),
+	         "%d/%b/%Y:%H:%M:%S %z",
+	         localtime(&t));
+	for (i = 0; i < 2; i++) {
+		log_time_string(date, sizeof(date), t);
+		ck_assert_str_eq(date, expected);
+	}
+}
+END_TEST
+
+
 START_TEST(test_sha1)
 {
 #ifdef SHA1_DIGEST_SIZE
@@ -1264,6 +1754,137 @@ START_TEST(test_sha1)
 END_TEST
 
 
+#if defined(USE_IO_URING)
+START_TEST(test_io_uring)
+{
+	struct mg_uring *ring;
+	int sv[2], fd, i, nread, ret;
+	char data[1000], buf[256];
+	char path[] = "/tmp/civetweb_uring_XXXXXX";
+
+	ring = mg_uring_create();
+	if (ring == NULL) {
+		/* io_uring not available on this system */
+		return;
+	}
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+
+	/* Nothing to receive: timeout */
+	ret = mg_uring_sock_io(ring, IORING_OP_RECV, sv[1], buf, sizeof(buf), 50);
+	ck_assert_int_eq(ret, -ETIMEDOUT);
+
+	/* Send and receive */
+	ret = mg_uring_sock_io(ring, IORING_OP_SEND, sv[0], "hello", 5, 50);
+	ck_assert_int_eq(ret, 5);
+	ret = mg_uring_sock_io(ring, IORING_OP_RECV, sv[1], buf, sizeof(buf), 50);
+	ck_assert_int_eq(ret, 5);
+	ck_assert(!memcmp(buf, "hello", 5));
+
+	/* Read from a file and send */
+	for (i = 0; i < (int)sizeof(data); i++) {
+		data[i] = (char)i;
+	}
+	fd = mkstemp(path);
+	ck_assert_int_ge(fd, 0);
+	ck_assert_int_eq((int)write(fd, data, sizeof(data)), (int)sizeof(data));
+
+	ret = mg_uring_read_send(ring, fd, 100, sv[0], buf, 200, 50, &nread);
+	ck_assert_int_eq(nread, 200);
+	ck_assert_int_eq(ret, 200);
+	ck_assert_int_eq((int)recv(sv[1], buf, sizeof(buf), 0), 200);
+	ck_assert(!memcmp(buf, data + 100, 200));
+
+	/* Short read at the end of the file: nothing is sent */
+	ret = mg_uring_read_send(ring, fd, 900, sv[0], buf, 200, 50, &nread);
+	ck_assert_int_eq(nread, 100);
+	ck_assert_int_eq(ret, 0);
+	ck_assert(!memcmp(buf, data + 900, 100));
+
+	/* End of file */
+	ret = mg_uring_read_send(ring, fd, 1000, sv[0], buf, 200, 50, &nread);
+	ck_assert_int_eq(nread, 0);
+	ck_assert_int_eq(ret, 0);
+
+	close(fd);
+	unlink(path);
+	close(sv[0]);
+	close(sv[1]);
+	mg_uring_destroy(ring);
+}
+END_TEST
+#endif
+
+
+#if defined(LOCKFREE_QUEUE)
+START_TEST(test_lockfree_queue)
+{
+	struct mg_context *ctx;
+	struct socket so;
+	int i, round;
+
+	ctx = (struct mg_context *)mg_calloc(1, sizeof(*ctx));
+	ck_assert(ctx != NULL);
+	ctx->sq_size = 4;
+	ctx->sq_cells =
+	    (struct mg_queue_cell *)mg_calloc(4, sizeof(struct mg_queue_cell));
+	ck_assert(ctx->sq_cells != NULL);
+	for (i = 0; i < 4; i++) {
+		ctx->sq_cells[i].seq = i;
+	}
+	memset(&so, 0, sizeof(so));
+
+	/* Empty queue */
+	ck_assert_int_eq(sq_try_pop(ctx, &so), 0);
+
+	/* Fill the queue, until it is full */
+	for (i = 0; i < 4; i++) {
+		so.sock = (SOCKET)(100 + i);
+		ck_assert_int_eq(sq_try_push(ctx, &so), 1);
+	}
+	so.sock = (SOCKET)104;
+	ck_assert_int_eq(sq_try_push(ctx, &so), 0);
+
+	/* Sockets come out in the order they went in, then it is empty */
+	for (i = 0; i < 4; i++) {
+		ck_assert_int_eq(sq_try_pop(ctx, &so), 1);
+		ck_assert_int_eq((int)so.sock, 100 + i);
+	}
+	ck_assert_int_eq(sq_try_pop(ctx, &so), 0);
+
+	/* Positions run beyond the ring size many times */
+	for (round = 0; round < 10; round++) {
+		for (i = 0; i < 3; i++) {
+			so.sock = (SOCKET)(round * 10 + i);
+			ck_assert_int_eq(sq_try_push(ctx, &so), 1);
+		}
+		for (i = 0; i < 3; i++) {
+			ck_assert_int_eq(sq_try_pop(ctx, &so), 1);
+			ck_assert_int_eq((int)so.sock, round * 10 + i);
+		}
+		ck_assert_int_eq(sq_try_pop(ctx, &so), 0);
+	}
+	ck_assert_int_eq((int)ctx->sq_enqueue_pos, 34);
+	ck_assert_int_eq((int)ctx->sq_dequeue_pos, 34);
+
+	/* Full and empty again, after the wraparound */
+	for (i = 0; i < 4; i++) {
+		so.sock = (SOCKET)(200 + i);
+		ck_assert_int_eq(sq_try_push(ctx, &so), 1);
+	}
+	ck_assert_int_eq(sq_try_push(ctx, &so), 0);
+	for (i = 0; i < 4; i++) {
+		ck_assert_int_eq(sq_try_pop(ctx, &so), 1);
+		ck_assert_int_eq((int)so.sock, 200 + i);
+	}
+	ck_assert_int_eq(sq_try_pop(ctx, &so), 0);
+
+	mg_free(ctx->sq_cells);
+	mg_free(ctx);
+}
+END_TEST
+#endif
+
+
 START_TEST(test_config_options)
 {
 	/* Check size of config_options vs. number of options in enum. */
@@ -1291,6 +1912,34 @@ START_TEST(test_config_options)
 	                 config_options[ENABLE_AUTH_DOMAIN_CHECK].name);
 	ck_assert_str_eq("ssi_pattern", config_options[SSI_EXTENSIONS].name);
 	ck_assert_str_eq("throttle", config_options[THROTTLE].name);
+	ck_assert_str_eq("max_connections_per_ip",
+	                 config_options[MAX_CONNECTIONS_PER_IP].name);
+	ck_assert_str_eq("max_request_rate_per_ip",
+	                 config_options[MAX_REQUEST_RATE_PER_IP].name);
+	ck_assert_str_eq("output_buffer_size",
+	                 config_options[OUTPUT_BUFFER_SIZE].name);
+#if defined(USE_FILE_CACHE)
+	ck_assert_str_eq("static_file_cache_entries",
+	                 config_options[STATIC_FILE_CACHE_ENTRIES].name);
+	ck_assert_str_eq("static_file_cache_ttl_ms",
+	                 config_options[STATIC_FILE_CACHE_TTL].name);
+#endif
+#if defined(USE_RESPONSE_CACHE)
+	ck_assert_str_eq("response_cache_size",
+	                 config_options[RESPONSE_CACHE_SIZE].name);
+	ck_assert_str_eq("response_cache_max_file_size",
+	                 config_options[RESPONSE_CACHE_MAX_FILE_SIZE].name);
+#endif
+#if !defined(NO_FILESYSTEMS)
+	ck_assert_str_eq("directory_listing_cache_size",
+	                 config_options[DIRECTORY_LISTING_CACHE_SIZE].name);
+#endif
+#if defined(USE_ZLIB)
+	ck_assert_str_eq("compression_level",
+	                 config_options[COMPRESSION_LEVEL].name);
+	ck_assert_str_eq("compression_cache_size",
+	                 config_options[COMPRESSION_CACHE_SIZE].name);
+#endif
 	ck_assert_str_eq("access_log_file", config_options[ACCESS_LOG_FILE].name);
 	ck_assert_str_eq("enable_directory_listing",
 	                 config_options[ENABLE_DIRECTORY_LISTING].name);
@@ -1337,6 +1986,18 @@ START_TEST(test_config_options)
 	                 config_options[WEBSOCKET_TIMEOUT].name);
 	ck_assert_str_eq("enable_websocket_ping_pong",
 	                 config_options[ENABLE_WEBSOCKET_PING_PONG].name);
+	ck_assert_str_eq("websocket_broadcast_timeout_ms",
+	                 config_options[WEBSOCKET_BROADCAST_TIMEOUT].name);
+	ck_assert_str_eq("websocket_send_queue_size",
+	                 config_options[WEBSOCKET_SEND_QUEUE_SIZE].name);
+	ck_assert_str_eq("websocket_send_queue_policy",
+	                 config_options[WEBSOCKET_SEND_QUEUE_POLICY].name);
+	ck_assert_str_eq("websocket_max_message_size",
+	                 config_options[WEBSOCKET_MAX_MESSAGE_SIZE].name);
+#endif
+#if defined(USE_WEBSOCKET_REACTOR)
+	ck_assert_str_eq("websocket_dispatch_threads",
+	                 config_options[WEBSOCKET_DISPATCH_THREADS].name);
 #endif
 
 	ck_assert_str_eq("decode_url", config_options[DECODE_URL].name);
@@ -1381,6 +2042,11 @@ START_TEST(test_config_options)
 #if defined(__linux__)
 	ck_assert_str_eq("allow_sendfile_call",
 	                 config_options[ALLOW_SENDFILE_CALL].name);
+	ck_assert_str_eq("tcp_cork", config_options[CONFIG_TCP_CORK].name);
+#endif
+#if defined(USE_REUSEPORT_ACCEPTORS)
+	ck_assert_str_eq("acceptor_threads",
+	                 config_options[ACCEPTOR_THREADS].name);
 #endif
 #if defined(_WIN32)
 	ck_assert_str_eq("case_sensitive",
@@ -1413,6 +2079,7 @@ make_private_suite(void)
 	TCase *const tcase_url_parsing_1 = tcase_create("URL Parsing 1");
 	TCase *const tcase_url_parsing_2 = tcase_create("URL Parsing 2");
 	TCase *const tcase_url_parsing_3 = tcase_create("URL Parsing 3");
+	TCase *const tcase_handler_table = tcase_create("Handler Table");
 	TCase *const tcase_internal_parse_1 = tcase_create("Internal Parsing 1");
 	TCase *const tcase_internal_parse_2 = tcase_create("Internal Parsing 2");
 	TCase *const tcase_internal_parse_3 = tcase_create("Internal Parsing 3");
@@ -1420,10 +2087,17 @@ make_private_suite(void)
 	TCase *const tcase_internal_parse_5 = tcase_create("Internal Parsing 5");
 	TCase *const tcase_internal_parse_6 = tcase_create("Internal Parsing 6");
 	TCase *const tcase_internal_parse_7 = tcase_create("Internal Parsing 7");
+	TCase *const tcase_internal_parse_8 = tcase_create("Internal Parsing 8");
 	TCase *const tcase_encode_decode = tcase_create("Encode Decode");
 	TCase *const tcase_mask_data = tcase_create("Mask Data");
 	TCase *const tcase_parse_date_string = tcase_create("Date Parsing");
 	TCase *const tcase_sha1 = tcase_create("SHA1");
+#if defined(USE_IO_URING)
+	TCase *const tcase_io_uring = tcase_create("io_uring");
+#endif
+#if defined(LOCKFREE_QUEUE)
+	TCase *const tcase_lockfree_queue = tcase_create("Lock-free Queue");
+#endif
 	TCase *const tcase_config_options = tcase_create("Config Options");
 
 	tcase_add_test(tcase_http_message, test_parse_http_message);
@@ -1438,6 +2112,10 @@ make_private_suite(void)
 	tcase_set_timeout(tcase_url_parsing_1, civetweb_min_test_timeout);
 	suite_add_tcase(suite, tcase_url_parsing_1);
 
+	tcase_add_test(tcase_handler_table, test_handler_table);
+	tcase_set_timeout(tcase_handler_table, civetweb_min_test_timeout);
+	suite_add_tcase(suite, tcase_handler_table);
+
 	tcase_add_test(tcase_url_parsing_2, test_remove_dot_segments);
 	tcase_set_timeout(tcase_url_parsing_2, civetweb_min_test_timeout);
 	suite_add_tcase(suite, tcase_url_parsing_2);
@@ -1474,15 +2152,24 @@ make_private_suite(void)
 	tcase_set_timeout(tcase_internal_parse_7, civetweb_min_test_timeout);
 	suite_add_tcase(suite, tcase_internal_parse_7);
 
+	tcase_add_test(tcase_internal_parse_8, test_parse_accept_encoding);
+	tcase_add_test(tcase_internal_parse_8, test_parse_byte_ranges);
+	tcase_add_test(tcase_internal_parse_8, test_throttle_rules);
+	tcase_add_test(tcase_internal_parse_8, test_acl_tree);
+	tcase_set_timeout(tcase_internal_parse_8, civetweb_min_test_timeout);
+	suite_add_tcase(suite, tcase_internal_parse_8);
+
 	tcase_add_test(tcase_encode_decode, test_encode_decode);
 	tcase_set_timeout(tcase_encode_decode, civetweb_min_test_timeout);
 	suite_add_tcase(suite, tcase_encode_decode);
 
 	tcase_add_test(tcase_mask_data, test_mask_data);
+	tcase_add_test(tcase_mask_data, test_mask_data_throughput);
 	tcase_set_timeout(tcase_mask_data, civetweb_min_test_timeout);
 	suite_add_tcase(suite, tcase_mask_data);
 
 	tcase_add_test(tcase_parse_date_string, test_parse_date_string);
+	tcase_add_test(tcase_parse_date_string, test_time_string_cache);
 	tcase_set_timeout(tcase_parse_date_string, civetweb_min_test_timeout);
 	suite_add_tcase(suite, tcase_parse_date_string);
 
@@ -1490,6 +2177,18 @@ make_private_suite(void)
 	tcase_set_timeout(tcase_sha1, civetweb_min_test_timeout);
 	suite_add_tcase(suite, tcase_sha1);
 
+#if defined(USE_IO_URING)
+	tcase_add_test(tcase_io_uring, test_io_uring);
+	tcase_set_timeout(tcase_io_uring, civetweb_min_test_timeout);
+	suite_add_tcase(suite, tcase_io_uring);
+
+#endif
+#if defined(LOCKFREE_QUEUE)
+	tcase_add_test(tcase_lockfree_queue, test_lockfree_queue);
+	tcase_set_timeout(tcase_lockfree_queue, civetweb_min_test_timeout);
+	suite_add_tcase(suite, tcase_lockfree_queue);
+
+#endif
 	tcase_add_test(tcase_config_options, test_config_options);
 	tcase_set_timeout(tcase_config_options, civetweb_min_test_timeout);
 	suite_add_tcase(suite, tcase_config_options);
@@ -1515,6 +2214,7 @@ MAIN_PRIVATE(void)
 	test_mg_vsnprintf(0);
 	test_remove_dot_segments(0);
 	test_parse_date_string(0);
+	test_time_string_cache(0);
 	test_parse_port_string(0);
 	test_parse_http_message(0);
 	test_parse_http_headers(0);
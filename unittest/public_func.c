@@ -137,6 +137,8 @@ START_TEST(test_mg_version)
 	ck_assert_int_gt(ret, 0);
 	len = (int)strlen(buf);
 	ck_assert_int_eq(len, ret);
+	ck_assert(strstr(buf, "\"consumerWaits\"") != NULL);
+	ck_assert(strstr(buf, "\"producerWaitTime\"") != NULL);
 	free(buf);
 	mg_stop(ctx);
 #else
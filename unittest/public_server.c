@@ -37,6 +37,10 @@
 #include "public_server.h"
 #include <civetweb.h>
 
+#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+#include "zlib.h"
+#endif
+
 #if defined(_WIN32)
 #include <windows.h>
 #define test_sleep(x) (Sleep((x)*1000))
@@ -383,6 +387,56 @@ test_mg_stop(struct mg_context *ctx, unsigned line)
 }
 
 
+/* Send a request to the test server at port 8080 and check the status
+ * code (any status, if expected_status is 0). The content is read into
+ * buf (at most bufsize - 1 bytes, 0 terminated) and its length is stored
+ * in len. buf and len may be NULL, if the content is not required.
+ * The connection is returned, so the response headers can be checked.
+ * It must be closed by the caller. */
+static struct mg_connection *
+test_http_request(int expected_status,
+                  char *buf,
+                  size_t bufsize,
+                  int *len,
+                  const char *fmt,
+                  ...)
+{
+	struct mg_connection *client_conn;
+	const struct mg_response_info *client_ri;
+	char request[1024], ebuf[256];
+	va_list ap;
+	int n, total = 0;
+
+	va_start(ap, fmt);
+	n = vsnprintf(request, sizeof(request), fmt, ap);
+	va_end(ap);
+	ck_assert((n > 0) && (n < (int)sizeof(request)));
+
+	client_conn =
+	    mg_download("127.0.0.1", 8080, 0, ebuf, sizeof(ebuf), "%s", request);
+	ck_assert(client_conn != NULL);
+	client_ri = mg_get_response_info(client_conn);
+	ck_assert(client_ri != NULL);
+	if (expected_status != 0) {
+		ck_assert_int_eq(client_ri->status_code, expected_status);
+	}
+
+	if ((buf != NULL) && (bufsize > 0)) {
+		while ((n = mg_read(client_conn,
+		                    buf + total,
+		                    bufsize - 1 - (size_t)total))
+		       > 0) {
+			total += n;
+		}
+		buf[total] = 0;
+	}
+	if (len != NULL) {
+		*len = total;
+	}
+	return client_conn;
+}
+
+
 static void
 test_mg_start_stop_http_server_impl(int ipv6, int bound)
 {
@@ -2704,145 +2758,1119 @@ send_chunk_string(struct mg_connection *conn, const char *chunk)
 }
 
 
-START_TEST(test_handle_form)
+static char writev_payload[100000];
+
+
+static int
+writev_handler(struct mg_connection *conn, void *cbdata)
+{
+	struct mg_iovec iov[4];
+	char content_length[32];
+	int ret;
+
+	(void)cbdata;
+
+	sprintf(content_length, "%i", (int)sizeof(writev_payload) + 10);
+	mg_response_header_start(conn, 200);
+	mg_response_header_add(conn, "Content-Type", "text/plain", -1);
+	mg_response_header_add(conn, "Content-Length", content_length, -1);
+	mg_response_header_send(conn);
+
+	iov[0].buf = "start";
+	iov[0].len = 5;
+	iov[1].buf = NULL;
+	iov[1].len = 0;
+	iov[2].buf = writev_payload;
+	iov[2].len = sizeof(writev_payload);
+	iov[3].buf = "end\r\n";
+	iov[3].len = 5;
+	ret = mg_writev(conn, iov, 4);
+	ck_assert_int_eq(ret, (int)sizeof(writev_payload) + 10);
+
+	return 200;
+}
+
+
+START_TEST(test_mg_writev)
 {
 	struct mg_context *ctx;
+	const char *OPTIONS[] = {"listening_ports", "8080", NULL};
 	struct mg_connection *client_conn;
+	char client_err[256];
 	const struct mg_response_info *client_ri;
-	const char *OPTIONS[8];
-	const char *opt;
-	int opt_idx = 0;
-	char ebuf[1024];
-	const char *multipart_body;
-	const char *boundary;
-	size_t body_len, body_sent, chunk_len, bound_len;
-	int sleep_cnt;
+	static char buf[sizeof(writev_payload) + 16];
+	int client_res, len, n;
+	size_t i;
 
 	mark_point();
 
-	memset((void *)OPTIONS, 0, sizeof(OPTIONS));
-	OPTIONS[opt_idx++] = "listening_ports";
-	OPTIONS[opt_idx++] = "8884";
-	ck_assert_int_le(opt_idx, (int)(sizeof(OPTIONS) / sizeof(OPTIONS[0])));
-	ck_assert(OPTIONS[sizeof(OPTIONS) / sizeof(OPTIONS[0]) - 1] == NULL);
-	ck_assert(OPTIONS[sizeof(OPTIONS) / sizeof(OPTIONS[0]) - 2] == NULL);
-
-	ctx = test_mg_start(NULL, &g_ctx, OPTIONS, __LINE__);
+	for (i = 0; i < sizeof(writev_payload); i++) {
+		writev_payload[i] = (char)('a' + (i % 26));
+	}
 
+	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
 	ck_assert(ctx != NULL);
-	g_ctx = ctx;
+	mg_set_request_handler(ctx, "/writev", writev_handler, NULL);
 
-	opt = mg_get_option(ctx, "listening_ports");
-	ck_assert_str_eq(opt, "8884");
+	memset(client_err, 0, sizeof(client_err));
+	client_conn =
+	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+	ck_assert_str_eq(client_err, "");
+	ck_assert(client_conn != NULL);
 
-	mg_set_request_handler(ctx, "/handle_form", FormGet, NULL);
-	mg_set_request_handler(ctx, "/handle_form_store", FormStore1, NULL);
-	mg_set_request_handler(ctx, "/handle_form_store2", FormStore2, NULL);
+	mg_printf(client_conn, "GET /writev HTTP/1.0\r\nHost: localhost\r\n\r\n");
+	client_res =
+	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
+	ck_assert_int_ge(client_res, 0);
+	client_ri = mg_get_response_info(client_conn);
+	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 200);
+	ck_assert_int_eq((int)client_ri->content_length,
+	                 (int)sizeof(writev_payload) + 10);
 
-	test_sleep(1);
+	len = 0;
+	while ((n = mg_read(client_conn, buf + len, sizeof(buf) - (size_t)len))
+	       > 0) {
+		len += n;
+	}
+	ck_assert_int_eq(len, (int)sizeof(writev_payload) + 10);
+	ck_assert(!memcmp(buf, "start", 5));
+	ck_assert(!memcmp(buf + 5, writev_payload, sizeof(writev_payload)));
+	ck_assert(!memcmp(buf + 5 + sizeof(writev_payload), "end\r\n", 5));
+	mg_close_connection(client_conn);
 
-	/* Handle form: "GET" */
-	client_conn = mg_download("localhost",
-	                          8884,
-	                          0,
-	                          ebuf,
-	                          sizeof(ebuf),
-	                          "%s",
-	                          "GET /handle_form"
-	                          "?textin=text&passwordin=&radio1=val1"
-	                          "&radio2=val1&check1=val1&numberin=1"
-	                          "&datein=1.1.2016&colorin=%2380ff00"
-	                          "&rangein=3&monthin=&weekin=&timein="
-	                          "&datetimen=&datetimelocalin=&emailin="
-	                          "&searchin=&telin=&urlin=&filein="
-	                          "&filesin=&selectin=opt1"
-	                          "&message=Text+area+default+text. "
-	                          "HTTP/1.0\r\n"
-	                          "Host: localhost:8884\r\n"
-	                          "Connection: close\r\n\r\n");
-	ck_assert(client_conn != NULL);
-	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
-		test_sleep(1);
-		if (g_field_step == 1000) {
-			break;
-		}
+	/* Invalid parameters */
+	ck_assert_int_eq(mg_writev(NULL, NULL, 0), 0);
+
+	test_mg_stop(ctx, __LINE__);
+
+	mark_point();
+}
+END_TEST
+
+
+static int
+output_buffering_handler(struct mg_connection *conn, void *cbdata)
+{
+	int i;
+
+	(void)cbdata;
+
+	mg_printf(conn, "HTTP/1.0 200 OK\r\nConnection: close\r\n\r\n");
+	for (i = 0; i < 1000; i++) {
+		ck_assert_int_eq(mg_printf(conn, "line %04i\n", i), 10);
 	}
-	client_ri = mg_get_response_info(client_conn);
+	ck_assert_int_eq(mg_write(conn, writev_payload, sizeof(writev_payload)),
+	                 (int)sizeof(writev_payload));
+
+	/* Change the buffer size within the request */
+	ck_assert_int_eq(mg_set_output_buffering(conn, 16), 0);
+	ck_assert_int_eq(mg_printf(conn, "%s", "0123456789"), 10);
+	ck_assert_int_eq(mg_flush(conn), 0);
+	ck_assert_int_eq(mg_printf(conn, "%s", "end\n"), 4);
+
+	return 200;
+}
+
+
+START_TEST(test_output_buffering)
+{
+	struct mg_context *ctx;
+	const char *OPTIONS[] =
+	    {"listening_ports", "8080", "output_buffer_size", "4096", NULL};
+	struct mg_connection *client_conn;
+	char client_err[256];
+	const struct mg_response_info *client_ri;
+	static char buf[10000 + sizeof(writev_payload) + 32];
+	char line[16];
+	int client_res, len, n, i;
+	size_t j;
+
+	mark_point();
+
+	for (j = 0; j < sizeof(writev_payload); j++) {
+		writev_payload[j] = (char)('a' + (j % 26));
+	}
+
+	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
+	ck_assert_str_eq(mg_get_option(ctx, "output_buffer_size"), "4096");
+	mg_set_request_handler(ctx, "/obuf", output_buffering_handler, NULL);
+
+	memset(client_err, 0, sizeof(client_err));
+	client_conn =
+	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+	ck_assert_str_eq(client_err, "");
+	ck_assert(client_conn != NULL);
 
+	mg_printf(client_conn, "GET /obuf HTTP/1.0\r\nHost: localhost\r\n\r\n");
+	client_res =
+	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
+	ck_assert_int_ge(client_res, 0);
+	client_ri = mg_get_response_info(client_conn);
 	ck_assert(client_ri != NULL);
 	ck_assert_int_eq(client_ri->status_code, 200);
+
+	len = 0;
+	while ((n = mg_read(client_conn, buf + len, sizeof(buf) - (size_t)len))
+	       > 0) {
+		len += n;
+	}
+	ck_assert_int_eq(len, 10000 + (int)sizeof(writev_payload) + 14);
+	for (i = 0; i < 1000; i++) {
+		sprintf(line, "line %04i\n", i);
+		ck_assert(!memcmp(buf + 10 * i, line, 10));
+	}
+	ck_assert(!memcmp(buf + 10000, writev_payload, sizeof(writev_payload)));
+	ck_assert(!memcmp(buf + 10000 + sizeof(writev_payload),
+	                  "0123456789end\n",
+	                  14));
 	mg_close_connection(client_conn);
 
-	/* Handle form: "POST x-www-form-urlencoded" */
-	client_conn =
-	    mg_download("localhost",
-	                8884,
-	                0,
-	                ebuf,
-	                sizeof(ebuf),
-	                "%s",
-	                "POST /handle_form HTTP/1.1\r\n"
-	                "Host: localhost:8884\r\n"
-	                "Connection: close\r\n"
-	                "Content-Type: application/x-www-form-urlencoded\r\n"
-	                "Content-Length: 263\r\n"
-	                "\r\n"
-	                "textin=text&passwordin=&radio1=val1&radio2=val1"
-	                "&check1=val1&numberin=1&datein=1.1.2016"
-	                "&colorin=%2380ff00&rangein=3&monthin=&weekin="
-	                "&timein=&datetimen=&datetimelocalin=&emailin="
-	                "&searchin=&telin=&urlin=&filein=&filesin="
-	                "&selectin=opt1&message=Text+area+default+text.");
-	ck_assert(client_conn != NULL);
-	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
-		test_sleep(1);
-		if (g_field_step == 1000) {
-			break;
+	/* Invalid parameters */
+	ck_assert_int_eq(mg_set_output_buffering(NULL, 0), -1);
+	ck_assert_int_eq(mg_flush(NULL), -1);
+
+	test_mg_stop(ctx, __LINE__);
+
+	mark_point();
+}
+END_TEST
+
+
+#if !defined(NO_FILES) && !defined(NO_FILE_CACHE) && !defined(_WIN32)
+START_TEST(test_file_cache)
+{
+	struct mg_context *ctx;
+	const char *OPTIONS[] = {"listening_ports",
+	                         "8080",
+	                         "document_root",
+	                         ".",
+	                         "static_file_cache_entries",
+	                         "64",
+	                         "static_file_cache_ttl_ms",
+	                         "500",
+#if defined(__linux__)
+	                         "allow_sendfile_call",
+	                         "yes",
+#endif
+	                         NULL};
+	const char *content = "Content of the file cache test file\n";
+	const char *request = "GET /file_cache_test.txt HTTP/1.0\r\n\r\n";
+	struct mg_connection *client_conn;
+	char buf[1000];
+	int len, i, round;
+	FILE *f;
+
+	mark_point();
+
+	for (round = 0; round < 2; round++) {
+		f = fopen("file_cache_test.txt", "w");
+		ck_assert(f != NULL);
+		fputs(content, f);
+		fclose(f);
+
+#if defined(__linux__)
+		/* Send using sendfile, then using pread */
+		OPTIONS[9] = (round == 0) ? "yes" : "no";
+#endif
+		ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+		ck_assert(ctx != NULL);
+		ck_assert_str_eq(mg_get_option(ctx, "static_file_cache_entries"), "64");
+
+		/* The first request fills the cache, the others use it */
+		for (i = 0; i < 3; i++) {
+			client_conn =
+			    test_http_request(200, buf, sizeof(buf), &len, "%s", request);
+			ck_assert_int_eq(len, (int)strlen(content));
+			ck_assert(!memcmp(buf, content, strlen(content)));
+			mg_close_connection(client_conn);
+		}
+
+		/* Range request for a cached file */
+		client_conn = test_http_request(206,
+		                                buf,
+		                                sizeof(buf),
+		                                &len,
+		                                "GET /file_cache_test.txt HTTP/1.0\r\n"
+		                                "Range: bytes=11-15\r\n\r\n");
+		ck_assert_int_eq(len, 5);
+		ck_assert(!memcmp(buf, "the f", 5));
+		mg_close_connection(client_conn);
+
+		/* Not existing files are cached as well */
+		for (i = 0; i < 2; i++) {
+			client_conn = test_http_request(
+			    404,
+			    NULL,
+			    0,
+			    NULL,
+			    "GET /file_cache_missing.txt HTTP/1.0\r\n\r\n");
+			mg_close_connection(client_conn);
 		}
+
+		/* Removed files are not found anymore, once the entry expired */
+		ck_assert_int_eq(remove("file_cache_test.txt"), 0);
+		test_sleep(1);
+		client_conn = test_http_request(404, NULL, 0, NULL, "%s", request);
+		mg_close_connection(client_conn);
+
+		test_mg_stop(ctx, __LINE__);
 	}
+
+	mark_point();
+}
+END_TEST
+#endif
+
+
+#if defined(USE_ZLIB) && !defined(NO_FILES)
+static int
+compression_cache_request(const char *encoding, char *buf, int bufsize)
+{
+	struct mg_connection *client_conn;
+	const struct mg_response_info *client_ri;
+	const char *hdr;
+	int i, len, content_length = -1;
+
+	client_conn =
+	    test_http_request(200,
+	                      buf,
+	                      (size_t)bufsize,
+	                      &len,
+	                      "GET /compression_cache_test.txt HTTP/1.1\r\n"
+	                      "Host: localhost\r\n"
+	                      "Accept-Encoding: %s\r\n"
+	                      "Connection: close\r\n\r\n",
+	                      encoding);
 	client_ri = mg_get_response_info(client_conn);
 
-	ck_assert(client_ri != NULL);
-	ck_assert_int_eq(client_ri->status_code, 200);
+	/* Compressed files from the cache have a known size */
+	hdr = NULL;
+	for (i = 0; i < client_ri->num_headers; i++) {
+		if (!mg_strcasecmp(client_ri->http_headers[i].name,
+		                   "Content-Encoding")) {
+			hdr = client_ri->http_headers[i].value;
+		}
+		if (!mg_strcasecmp(client_ri->http_headers[i].name,
+		                   "Content-Length")) {
+			content_length = atoi(client_ri->http_headers[i].value);
+		}
+	}
+	ck_assert(hdr != NULL);
+	ck_assert_str_eq(hdr, encoding);
+	ck_assert_int_gt(content_length, 0);
 	mg_close_connection(client_conn);
 
-	/* Handle form: "POST multipart/form-data" */
-	multipart_body =
-	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
-	    "Content-Disposition: form-data; name=\"textin\"\r\n"
-	    "\r\n"
-	    "text\r\n"
-	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
-	    "Content-Disposition: form-data; name=\"passwordin\"\r\n"
-	    "\r\n"
-	    "\r\n"
-	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
-	    "Content-Disposition: form-data; name=\"radio1\"\r\n"
-	    "\r\n"
-	    "val1\r\n"
-	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
-	    "Content-Disposition: form-data; name=radio2\r\n"
-	    "\r\n"
-	    "val1\r\n"
-	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
-	    "Content-Disposition: form-data; name=\"check1\"\r\n"
-	    "\r\n"
-	    "val1\r\n"
-	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
-	    "Content-Disposition: form-data; name=\"numberin\"\r\n"
-	    "\r\n"
-	    "1\r\n"
-	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
-	    "Content-Disposition: form-data; name=\"datein\"\r\n"
-	    "\r\n"
-	    "1.1.2016\r\n"
-	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
-	    "Content-Disposition: form-data; name=\"colorin\"\r\n"
-	    "\r\n"
-	    "#80ff00\r\n"
-	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
-	    "Content-Disposition: form-data; name=\"rangein\"\r\n"
-	    "\r\n"
+	ck_assert_int_eq(len, content_length);
+	if (!strcmp(encoding, "gzip")) {
+		/* GZIP header */
+		ck_assert_int_eq((unsigned char)buf[0], 0x1f);
+		ck_assert_int_eq((unsigned char)buf[1], 0x8b);
+	} else if (!strcmp(encoding, "zstd")) {
+		/* Zstandard frame magic number */
+		ck_assert_int_eq((unsigned char)buf[0], 0x28);
+		ck_assert_int_eq((unsigned char)buf[3], 0xfd);
+	}
+	return len;
+}
+
+
+START_TEST(test_compression_cache)
+{
+	struct mg_context *ctx;
+	const char *OPTIONS[] = {"listening_ports",
+	                         "8080",
+	                         "document_root",
+	                         ".",
+	                         "compression_level",
+	                         "1",
+	                         "compression_cache_size",
+	                         "100000",
+	                         NULL};
+	char buf1[4096], buf2[4096];
+	int len1, len2, i;
+	FILE *f;
+
+	mark_point();
+
+	f = fopen("compression_cache_test.txt", "w");
+	ck_assert(f != NULL);
+	for (i = 0; i < 200; i++) {
+		fprintf(f, "Line %i of the compression cache test file\n", i);
+	}
+	fclose(f);
+
+	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
+	ck_assert_str_eq(mg_get_option(ctx, "compression_level"), "1");
+
+	/* The first request compresses the file, the second one uses the
+	 * cached result */
+	len1 = compression_cache_request("gzip", buf1, sizeof(buf1));
+	len2 = compression_cache_request("gzip", buf2, sizeof(buf2));
+	ck_assert_int_eq(len1, len2);
+	ck_assert(!memcmp(buf1, buf2, (size_t)len1));
+
+	/* A modified file is compressed again */
+	f = fopen("compression_cache_test.txt", "a");
+	ck_assert(f != NULL);
+	for (i = 0; i < 200; i++) {
+		fprintf(f, "%i\n", i * 7919);
+	}
+	fclose(f);
+	len2 = compression_cache_request("gzip", buf2, sizeof(buf2));
+	ck_assert_int_gt(len2, len1);
+
+	/* Every encoding has its own cache entry */
+#if defined(USE_BROTLI)
+	len1 = compression_cache_request("br", buf1, sizeof(buf1));
+	ck_assert_int_eq(compression_cache_request("br", buf2, sizeof(buf2)), len1);
+	ck_assert(!memcmp(buf1, buf2, (size_t)len1));
+#endif
+#if defined(USE_ZSTD)
+	len1 = compression_cache_request("zstd", buf1, sizeof(buf1));
+	ck_assert_int_eq(compression_cache_request("zstd", buf2, sizeof(buf2)),
+	                 len1);
+	ck_assert(!memcmp(buf1, buf2, (size_t)len1));
+#endif
+
+	test_mg_stop(ctx, __LINE__);
+	(void)remove("compression_cache_test.txt");
+
+	mark_point();
+}
+END_TEST
+#endif
+
+
+#if !defined(NO_FILES)
+static void
+write_precompressed_test_file(const char *name, const char *content)
+{
+	FILE *f = fopen(name, "w");
+	int i;
+
+	ck_assert(f != NULL);
+	/* Above the size limit for compression */
+	for (i = 0; i < 100; i++) {
+		fprintf(f, "%s %02i ----------------\n", content, i);
+	}
+	fclose(f);
+}
+
+
+/* Request precompressed.txt with an Accept-Encoding header, check the
+ * selected encoding by the content of the file sent */
+static void
+precompressed_request(const char *uri,
+                      const char *accept_encoding,
+                      int expected_status,
+                      const char *expected_content,
+                      const char *expected_encoding)
+{
+	struct mg_connection *client_conn;
+	const struct mg_response_info *client_ri;
+	const char *encoding = NULL;
+	char buf[64];
+	int i;
+
+	client_conn = test_http_request(expected_status,
+	                                buf,
+	                                sizeof(buf),
+	                                NULL,
+	                                "GET %s HTTP/1.0\r\n"
+	                                "Accept-Encoding: %s\r\n\r\n",
+	                                uri,
+	                                accept_encoding);
+	client_ri = mg_get_response_info(client_conn);
+	for (i = 0; i < client_ri->num_headers; i++) {
+		if (!mg_strcasecmp(client_ri->http_headers[i].name,
+		                   "Content-Encoding")) {
+			encoding = client_ri->http_headers[i].value;
+		}
+	}
+	if (expected_encoding != NULL) {
+		ck_assert(encoding != NULL);
+		ck_assert_str_eq(encoding, expected_encoding);
+	} else {
+		ck_assert(encoding == NULL);
+	}
+	mg_close_connection(client_conn);
+	if (expected_content != NULL) {
+		ck_assert(!strncmp(buf, expected_content, strlen(expected_content)));
+	}
+}
+
+
+START_TEST(test_precompressed_files)
+{
+	struct mg_context *ctx;
+	const char *OPTIONS[] = {"listening_ports",
+	                         "8080",
+	                         "document_root",
+	                         ".",
+	                         NULL};
+	const char *uri = "/precompressed.txt";
+
+	mark_point();
+
+	/* The server does not look into the files, plain text is sufficient */
+	write_precompressed_test_file("precompressed.txt", "identity");
+	write_precompressed_test_file("precompressed.txt.gz", "gzip");
+	write_precompressed_test_file("precompressed.txt.br", "br");
+	write_precompressed_test_file("precompressed.txt.zst", "zstd");
+	write_precompressed_test_file("precompressed_br_only.txt.br", "br");
+
+	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
+
+	/* Best encoding by q-value, then by server preference (br, zstd, gzip) */
+	precompressed_request(uri, "gzip, deflate, br, zstd", 200, "br", "br");
+	precompressed_request(uri, "gzip, zstd", 200, "zstd", "zstd");
+	precompressed_request(uri, "br;q=0.5, gzip", 200, "gzip", "gzip");
+	precompressed_request(uri, "*", 200, "br", "br");
+	precompressed_request(uri, "br;q=0, zstd;q=0.1", 200, "zstd", "zstd");
+
+	/* Not accepted encodings */
+	precompressed_request(uri, "br;q=0, gzip;q=0, zstd;q=0", 200, "id", NULL);
+	precompressed_request(uri, "identity", 200, "identity", NULL);
+
+	/* A missing variant is skipped */
+	(void)remove("precompressed.txt.br");
+	precompressed_request(uri, "br, gzip;q=0.5", 200, "gzip", "gzip");
+
+	/* Only the precompressed file exists */
+	precompressed_request(
+	    "/precompressed_br_only.txt", "gzip, br", 200, "br", "br");
+	precompressed_request("/precompressed_br_only.txt", "gzip", 404, NULL, NULL);
+
+	test_mg_stop(ctx, __LINE__);
+
+	(void)remove("precompressed.txt");
+	(void)remove("precompressed.txt.gz");
+	(void)remove("precompressed.txt.zst");
+	(void)remove("precompressed_br_only.txt.br");
+
+	mark_point();
+}
+END_TEST
+#endif
+
+
+#if !defined(NO_FILES)
+/* Request response_cache_test.txt and check the complete response.
+ * Return the length of the content received. */
+static int
+response_cache_request(const char *method, char *buf, int bufsize)
+{
+	struct mg_connection *client_conn;
+	const struct mg_response_info *client_ri;
+	int i, len, content_length = -1, has_date = 0, has_connection = 0;
+	const char *added = NULL;
+
+	client_conn = test_http_request(200,
+	                                buf,
+	                                (size_t)bufsize,
+	                                &len,
+	                                "%s /response_cache_test.txt HTTP/1.1\r\n"
+	                                "Host: localhost\r\n"
+	                                "Connection: close\r\n\r\n",
+	                                method);
+	client_ri = mg_get_response_info(client_conn);
+
+	for (i = 0; i < client_ri->num_headers; i++) {
+		const char *name = client_ri->http_headers[i].name;
+		if (!mg_strcasecmp(name, "Content-Length")) {
+			content_length = atoi(client_ri->http_headers[i].value);
+		} else if (!mg_strcasecmp(name, "Date")) {
+			has_date++;
+		} else if (!mg_strcasecmp(name, "Connection")) {
+			has_connection++;
+			ck_assert_str_eq(client_ri->http_headers[i].value, "close");
+		} else if (!mg_strcasecmp(name, "X-Response-Cache")) {
+			added = client_ri->http_headers[i].value;
+		}
+	}
+	ck_assert_int_eq(has_date, 1);
+	ck_assert_int_eq(has_connection, 1);
+	ck_assert(added != NULL);
+	ck_assert_str_eq(added, "test");
+	ck_assert_int_gt(content_length, 0);
+	mg_close_connection(client_conn);
+
+	if (strcmp(method, "HEAD")) {
+		ck_assert_int_eq(len, content_length);
+	}
+	return len;
+}
+
+
+START_TEST(test_response_cache)
+{
+	struct mg_context *ctx;
+	const char *OPTIONS[] = {"listening_ports",
+	                         "8080",
+	                         "document_root",
+	                         ".",
+	                         "additional_header",
+	                         "X-Response-Cache: test",
+	                         "response_cache_size",
+	                         "100000",
+	                         "response_cache_max_file_size",
+	                         "100",
+	                         NULL};
+	const char *content1 = "Content of the response cache test file\n";
+	const char *content2 = "Modified content of the response cache test\n";
+	char buf[256];
+	int len, i;
+	FILE *f;
+
+	mark_point();
+
+	f = fopen("response_cache_test.txt", "w");
+	ck_assert(f != NULL);
+	fputs(content1, f);
+	fclose(f);
+
+	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
+
+	/* The first request creates the cache entry, the following requests
+	 * are answered from the cache */
+	for (i = 0; i < 3; i++) {
+		len = response_cache_request("GET", buf, sizeof(buf));
+		ck_assert_int_eq(len, (int)strlen(content1));
+		ck_assert(!memcmp(buf, content1, (size_t)len));
+	}
+
+	/* HEAD requests use the same entry, without sending the content */
+	ck_assert_int_eq(response_cache_request("HEAD", buf, sizeof(buf)), 0);
+
+	/* A modified file is read again */
+	f = fopen("response_cache_test.txt", "w");
+	ck_assert(f != NULL);
+	fputs(content2, f);
+	fclose(f);
+	for (i = 0; i < 2; i++) {
+		len = response_cache_request("GET", buf, sizeof(buf));
+		ck_assert_int_eq(len, (int)strlen(content2));
+		ck_assert(!memcmp(buf, content2, (size_t)len));
+	}
+
+	/* Files above the size limit are not cached, but still sent */
+	f = fopen("response_cache_test.txt", "w");
+	ck_assert(f != NULL);
+	for (i = 0; i < 4; i++) {
+		fputs(content1, f);
+	}
+	fclose(f);
+	len = response_cache_request("GET", buf, sizeof(buf));
+	ck_assert_int_eq(len, 4 * (int)strlen(content1));
+
+	test_mg_stop(ctx, __LINE__);
+	(void)remove("response_cache_test.txt");
+
+	mark_point();
+}
+END_TEST
+#endif
+
+
+#if !defined(NO_FILES) && !defined(_WIN32)
+static int
+dir_listing_request(const char *query, char *buf, int bufsize)
+{
+	struct mg_connection *client_conn;
+	int len;
+
+	client_conn = test_http_request(200,
+	                                buf,
+	                                (size_t)bufsize,
+	                                &len,
+	                                "GET /dir_listing_test/%s HTTP/1.1\r\n"
+	                                "Host: localhost\r\n"
+	                                "Connection: close\r\n\r\n",
+	                                query);
+	mg_close_connection(client_conn);
+	return len;
+}
+
+
+START_TEST(test_directory_listing)
+{
+	struct mg_context *ctx;
+	const char *OPTIONS[] = {"listening_ports",
+	                         "8080",
+	                         "document_root",
+	                         ".",
+	                         "directory_listing_cache_size",
+	                         "100000",
+	                         NULL};
+	const char *files[] = {"a.txt", "b.txt", "c.txt"};
+	const char *json_head = "{\"path\":\"/dir_listing_test/\",\"total\":4,"
+	                        "\"offset\":0,\"entries\":[{\"name\":\"d\","
+	                        "\"type\":\"directory\"";
+	char buf[4096], path[64];
+	const char *a, *b, *c, *d;
+	int i;
+	FILE *f;
+
+	mark_point();
+
+	/* A directory with a subdirectory and files of 3, 1 and 2 bytes */
+	ck_assert_int_eq(mkdir("dir_listing_test", 0755), 0);
+	ck_assert_int_eq(mkdir("dir_listing_test/d", 0755), 0);
+	for (i = 0; i < 3; i++) {
+		sprintf(path, "dir_listing_test/%s", files[i]);
+		f = fopen(path, "w");
+		ck_assert(f != NULL);
+		fputs(i == 0 ? "aaa" : (i == 1 ? "b" : "cc"), f);
+		fclose(f);
+	}
+
+	/* Recently modified directories are not cached */
+	test_sleep(2);
+
+	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
+
+	/* JSON listing: directories first, then sorted by name */
+	dir_listing_request("?format=json", buf, sizeof(buf));
+	ck_assert(!strncmp(buf, json_head, strlen(json_head)));
+	a = strstr(buf, "{\"name\":\"a.txt\",\"type\":\"file\",\"size\":3,");
+	b = strstr(buf, "{\"name\":\"b.txt\",\"type\":\"file\",\"size\":1,");
+	c = strstr(buf, "{\"name\":\"c.txt\",\"type\":\"file\",\"size\":2,");
+	ck_assert(a != NULL);
+	ck_assert(b != NULL);
+	ck_assert(c != NULL);
+	ck_assert(a < b);
+	ck_assert(b < c);
+
+	/* A page of the listing sorted by size */
+	dir_listing_request("?sa&format=json&offset=1&limit=2", buf, sizeof(buf));
+	ck_assert(strstr(buf, "\"total\":4,\"offset\":1,") != NULL);
+	b = strstr(buf, "\"b.txt\"");
+	c = strstr(buf, "\"c.txt\"");
+	ck_assert(b != NULL);
+	ck_assert(c != NULL);
+	ck_assert(b < c);
+	ck_assert(strstr(buf, "\"a.txt\"") == NULL);
+	ck_assert(strstr(buf, "\"d\"") == NULL);
+
+	/* HTML listing, sorted by size in descending order */
+	dir_listing_request("?sd&offset=1&limit=2", buf, sizeof(buf));
+	ck_assert(!strncmp(buf, "<html>", 6));
+	a = strstr(buf, "<a href=\"a.txt\">a.txt</a>");
+	c = strstr(buf, "<a href=\"c.txt\">c.txt</a>");
+	ck_assert(a != NULL);
+	ck_assert(c != NULL);
+	ck_assert(a < c);
+	ck_assert(strstr(buf, "b.txt") == NULL);
+	ck_assert(strstr(buf, "Parent directory") == NULL);
+	ck_assert(strstr(buf, "<a href=\"?sd&offset=0&limit=2\">Previous page")
+	          != NULL);
+	ck_assert(strstr(buf, "<a href=\"?sd&offset=3&limit=2\">Next page")
+	          != NULL);
+
+	/* The first page links to the parent directory */
+	dir_listing_request("", buf, sizeof(buf));
+	d = strstr(buf, "<a href=\"d/\">d/</a>");
+	ck_assert(strstr(buf, "Parent directory") != NULL);
+	ck_assert(d != NULL);
+	ck_assert(d < strstr(buf, "a.txt"));
+	ck_assert(strstr(buf, "</table></pre></body></html>") != NULL);
+
+	/* A new file modifies the directory: the cached index is not used */
+	f = fopen("dir_listing_test/e.txt", "w");
+	ck_assert(f != NULL);
+	fclose(f);
+	dir_listing_request("?format=json", buf, sizeof(buf));
+	ck_assert(strstr(buf, "\"total\":5,") != NULL);
+	ck_assert(strstr(buf, "{\"name\":\"e.txt\",\"type\":\"file\",\"size\":0,")
+	          != NULL);
+
+	test_mg_stop(ctx, __LINE__);
+
+	(void)remove("dir_listing_test/e.txt");
+	for (i = 0; i < 3; i++) {
+		sprintf(path, "dir_listing_test/%s", files[i]);
+		(void)remove(path);
+	}
+	(void)rmdir("dir_listing_test/d");
+	(void)rmdir("dir_listing_test");
+
+	mark_point();
+}
+END_TEST
+#endif
+
+
+#if !defined(NO_FILES)
+static struct mg_connection *
+byte_range_request(const char *headers,
+                   int expected_status,
+                   char *buf,
+                   size_t bufsize,
+                   int *len)
+{
+	return test_http_request(expected_status,
+	                         buf,
+	                         bufsize,
+	                         len,
+	                         "GET /byte_range_test.txt HTTP/1.1\r\n"
+	                         "Host: localhost\r\n"
+	                         "Connection: close\r\n%s\r\n",
+	                         headers);
+}
+
+
+START_TEST(test_byte_ranges)
+{
+	struct mg_context *ctx;
+	const char *OPTIONS[] = {"listening_ports",
+	                         "8080",
+	                         "document_root",
+	                         ".",
+#if defined(__linux__)
+	                         "allow_sendfile_call",
+	                         "yes",
+#endif
+	                         NULL};
+	const char *content = "0123456789abcdefghij";
+	struct mg_connection *client_conn;
+	const char *type, *boundary;
+	char buf[1024], expected[1024], etag[64], lm[64], hdr[128];
+	int len;
+	FILE *f;
+
+	mark_point();
+
+	f = fopen("byte_range_test.txt", "w");
+	ck_assert(f != NULL);
+	fputs(content, f);
+	fclose(f);
+
+	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
+
+	/* Complete file, with the validators for If-Range */
+	client_conn = byte_range_request("", 200, buf, sizeof(buf), &len);
+	ck_assert_str_eq(buf, content);
+	ck_assert(mg_get_header(client_conn, "Etag") != NULL);
+	ck_assert(mg_get_header(client_conn, "Last-Modified") != NULL);
+	strcpy(etag, mg_get_header(client_conn, "Etag"));
+	strcpy(lm, mg_get_header(client_conn, "Last-Modified"));
+	mg_close_connection(client_conn);
+
+	/* One range, and the last bytes of the file */
+	client_conn = byte_range_request(
+	    "Range: bytes=10-12\r\n", 206, buf, sizeof(buf), &len);
+	ck_assert_str_eq(buf, "abc");
+	ck_assert_str_eq(mg_get_header(client_conn, "Content-Range"),
+	                 "bytes 10-12/20");
+	mg_close_connection(client_conn);
+	client_conn =
+	    byte_range_request("Range: bytes=-5\r\n", 206, buf, sizeof(buf), &len);
+	ck_assert_str_eq(buf, "fghij");
+	ck_assert_str_eq(mg_get_header(client_conn, "Content-Range"),
+	                 "bytes 15-19/20");
+	mg_close_connection(client_conn);
+
+	/* Several ranges: multipart/byteranges */
+	client_conn = byte_range_request(
+	    "Range: bytes=12-13,0-3\r\n", 206, buf, sizeof(buf), &len);
+	type = mg_get_header(client_conn, "Content-Type");
+	ck_assert(type != NULL);
+	ck_assert(!strncmp(type, "multipart/byteranges; boundary=", 31));
+	boundary = type + 31;
+	sprintf(expected,
+	        "\r\n--%s\r\nContent-Type: text/plain\r\n"
+	        "Content-Range: bytes 12-13/20\r\n\r\ncd"
+	        "\r\n--%s\r\nContent-Type: text/plain\r\n"
+	        "Content-Range: bytes 0-3/20\r\n\r\n0123"
+	        "\r\n--%s--\r\n",
+	        boundary,
+	        boundary,
+	        boundary);
+	ck_assert_str_eq(buf, expected);
+	ck_assert_int_eq(atoi(mg_get_header(client_conn, "Content-Length")), len);
+	mg_close_connection(client_conn);
+
+	/* No satisfiable range */
+	client_conn =
+	    byte_range_request("Range: bytes=30-\r\n", 416, buf, sizeof(buf), &len);
+	ck_assert_int_eq(len, 0);
+	ck_assert_str_eq(mg_get_header(client_conn, "Content-Range"),
+	                 "bytes */20");
+	mg_close_connection(client_conn);
+
+	/* If-Range: ranges of an unmodified file */
+	sprintf(hdr, "Range: bytes=0-3\r\nIf-Range: %s\r\n", etag);
+	client_conn = byte_range_request(hdr, 206, buf, sizeof(buf), &len);
+	ck_assert_str_eq(buf, "0123");
+	mg_close_connection(client_conn);
+	sprintf(hdr, "Range: bytes=0-3\r\nIf-Range: %s\r\n", lm);
+	client_conn = byte_range_request(hdr, 206, buf, sizeof(buf), &len);
+	ck_assert_str_eq(buf, "0123");
+	mg_close_connection(client_conn);
+
+	/* If-Range: the complete file, if it has been modified */
+	client_conn = byte_range_request("Range: bytes=0-3\r\nIf-Range: \"1.2\"\r\n",
+	                                 200,
+	                                 buf,
+	                                 sizeof(buf),
+	                                 &len);
+	ck_assert_str_eq(buf, content);
+	mg_close_connection(client_conn);
+	client_conn = byte_range_request(
+	    "Range: bytes=0-3\r\nIf-Range: Thu, 01 Jan 1970 00:00:01 GMT\r\n",
+	    200,
+	    buf,
+	    sizeof(buf),
+	    &len);
+	ck_assert_str_eq(buf, content);
+	mg_close_connection(client_conn);
+
+	test_mg_stop(ctx, __LINE__);
+	(void)remove("byte_range_test.txt");
+
+	mark_point();
+}
+END_TEST
+#endif
+
+
+#if !defined(NO_FILES) && !defined(_WIN32)
+START_TEST(test_send_file_mmap)
+{
+	/* Without sendfile, large files are sent from memory mapped windows of
+	 * 1 MB (if supported), in the same way as for TLS connections. */
+	struct mg_context *ctx;
+	const char *OPTIONS[] = {"listening_ports",
+	                         "8080",
+	                         "document_root",
+	                         ".",
+	                         "allow_sendfile_call",
+	                         "no",
+	                         NULL};
+	struct mg_connection *client_conn;
+	const struct mg_response_info *client_ri;
+	const int file_size = 1536 * 1024 + 123;
+	char *content, *buf, ebuf[256];
+	int i, n, len;
+	FILE *f;
+
+	mark_point();
+
+	content = (char *)malloc((size_t)file_size);
+	buf = (char *)malloc((size_t)file_size);
+	ck_assert(content != NULL);
+	ck_assert(buf != NULL);
+	for (i = 0; i < file_size; i++) {
+		content[i] = (char)('a' + (i * 7 + i / 4096) % 26);
+	}
+	f = fopen("send_file_mmap_test.bin", "wb");
+	ck_assert(f != NULL);
+	ck_assert_int_eq((int)fwrite(content, 1, (size_t)file_size, f), file_size);
+	fclose(f);
+
+	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
+
+	/* Complete file */
+	client_conn = mg_download("localhost",
+	                          8080,
+	                          0,
+	                          ebuf,
+	                          sizeof(ebuf),
+	                          "%s",
+	                          "GET /send_file_mmap_test.bin HTTP/1.0\r\n\r\n");
+	ck_assert(client_conn != NULL);
+	client_ri = mg_get_response_info(client_conn);
+	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 200);
+	len = 0;
+	while ((n = mg_read(client_conn, buf + len, (size_t)(file_size - len)))
+	       > 0) {
+		len += n;
+	}
+	mg_close_connection(client_conn);
+	ck_assert_int_eq(len, file_size);
+	ck_assert(!memcmp(buf, content, (size_t)file_size));
+
+	/* A range starting within a page, crossing the end of a window */
+	client_conn = mg_download("localhost",
+	                          8080,
+	                          0,
+	                          ebuf,
+	                          sizeof(ebuf),
+	                          "%s",
+	                          "GET /send_file_mmap_test.bin HTTP/1.0\r\n"
+	                          "Range: bytes=1000001-1148575\r\n\r\n");
+	ck_assert(client_conn != NULL);
+	client_ri = mg_get_response_info(client_conn);
+	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 206);
+	len = 0;
+	while ((n = mg_read(client_conn, buf + len, (size_t)(file_size - len)))
+	       > 0) {
+		len += n;
+	}
+	mg_close_connection(client_conn);
+	ck_assert_int_eq(len, 148575);
+	ck_assert(!memcmp(buf, content + 1000001, 148575));
+
+	test_mg_stop(ctx, __LINE__);
+	(void)remove("send_file_mmap_test.bin");
+	free(content);
+	free(buf);
+
+	mark_point();
+}
+END_TEST
+#endif
+
+
+START_TEST(test_handle_form)
+{
+	struct mg_context *ctx;
+	struct mg_connection *client_conn;
+	const struct mg_response_info *client_ri;
+	const char *OPTIONS[8];
+	const char *opt;
+	int opt_idx = 0;
+	char ebuf[1024];
+	const char *multipart_body;
+	const char *boundary;
+	size_t body_len, body_sent, chunk_len, bound_len;
+	int sleep_cnt;
+
+	mark_point();
+
+	memset((void *)OPTIONS, 0, sizeof(OPTIONS));
+	OPTIONS[opt_idx++] = "listening_ports";
+	OPTIONS[opt_idx++] = "8884";
+	ck_assert_int_le(opt_idx, (int)(sizeof(OPTIONS) / sizeof(OPTIONS[0])));
+	ck_assert(OPTIONS[sizeof(OPTIONS) / sizeof(OPTIONS[0]) - 1] == NULL);
+	ck_assert(OPTIONS[sizeof(OPTIONS) / sizeof(OPTIONS[0]) - 2] == NULL);
+
+	ctx = test_mg_start(NULL, &g_ctx, OPTIONS, __LINE__);
+
+	ck_assert(ctx != NULL);
+	g_ctx = ctx;
+
+	opt = mg_get_option(ctx, "listening_ports");
+	ck_assert_str_eq(opt, "8884");
+
+	mg_set_request_handler(ctx, "/handle_form", FormGet, NULL);
+	mg_set_request_handler(ctx, "/handle_form_store", FormStore1, NULL);
+	mg_set_request_handler(ctx, "/handle_form_store2", FormStore2, NULL);
+
+	test_sleep(1);
+
+	/* Handle form: "GET" */
+	client_conn = mg_download("localhost",
+	                          8884,
+	                          0,
+	                          ebuf,
+	                          sizeof(ebuf),
+	                          "%s",
+	                          "GET /handle_form"
+	                          "?textin=text&passwordin=&radio1=val1"
+	                          "&radio2=val1&check1=val1&numberin=1"
+	                          "&datein=1.1.2016&colorin=%2380ff00"
+	                          "&rangein=3&monthin=&weekin=&timein="
+	                          "&datetimen=&datetimelocalin=&emailin="
+	                          "&searchin=&telin=&urlin=&filein="
+	                          "&filesin=&selectin=opt1"
+	                          "&message=Text+area+default+text. "
+	                          "HTTP/1.0\r\n"
+	                          "Host: localhost:8884\r\n"
+	                          "Connection: close\r\n\r\n");
+	ck_assert(client_conn != NULL);
+	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
+		test_sleep(1);
+		if (g_field_step == 1000) {
+			break;
+		}
+	}
+	client_ri = mg_get_response_info(client_conn);
+
+	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 200);
+	mg_close_connection(client_conn);
+
+	/* Handle form: "POST x-www-form-urlencoded" */
+	client_conn =
+	    mg_download("localhost",
+	                8884,
+	                0,
+	                ebuf,
+	                sizeof(ebuf),
+	                "%s",
+	                "POST /handle_form HTTP/1.1\r\n"
+	                "Host: localhost:8884\r\n"
+	                "Connection: close\r\n"
+	                "Content-Type: application/x-www-form-urlencoded\r\n"
+	                "Content-Length: 263\r\n"
+	                "\r\n"
+	                "textin=text&passwordin=&radio1=val1&radio2=val1"
+	                "&check1=val1&numberin=1&datein=1.1.2016"
+	                "&colorin=%2380ff00&rangein=3&monthin=&weekin="
+	                "&timein=&datetimen=&datetimelocalin=&emailin="
+	                "&searchin=&telin=&urlin=&filein=&filesin="
+	                "&selectin=opt1&message=Text+area+default+text.");
+	ck_assert(client_conn != NULL);
+	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
+		test_sleep(1);
+		if (g_field_step == 1000) {
+			break;
+		}
+	}
+	client_ri = mg_get_response_info(client_conn);
+
+	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 200);
+	mg_close_connection(client_conn);
+
+	/* Handle form: "POST multipart/form-data" */
+	multipart_body =
+	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
+	    "Content-Disposition: form-data; name=\"textin\"\r\n"
+	    "\r\n"
+	    "text\r\n"
+	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
+	    "Content-Disposition: form-data; name=\"passwordin\"\r\n"
+	    "\r\n"
+	    "\r\n"
+	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
+	    "Content-Disposition: form-data; name=\"radio1\"\r\n"
+	    "\r\n"
+	    "val1\r\n"
+	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
+	    "Content-Disposition: form-data; name=radio2\r\n"
+	    "\r\n"
+	    "val1\r\n"
+	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
+	    "Content-Disposition: form-data; name=\"check1\"\r\n"
+	    "\r\n"
+	    "val1\r\n"
+	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
+	    "Content-Disposition: form-data; name=\"numberin\"\r\n"
+	    "\r\n"
+	    "1\r\n"
+	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
+	    "Content-Disposition: form-data; name=\"datein\"\r\n"
+	    "\r\n"
+	    "1.1.2016\r\n"
+	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
+	    "Content-Disposition: form-data; name=\"colorin\"\r\n"
+	    "\r\n"
+	    "#80ff00\r\n"
+	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
+	    "Content-Disposition: form-data; name=\"rangein\"\r\n"
+	    "\r\n"
 	    "3\r\n"
 	    "--multipart-form-data-boundary--see-RFC-2388\r\n"
 	    "Content-Disposition: form-data; name=\"monthin\"\r\n"
@@ -2903,431 +3931,1164 @@ START_TEST(test_handle_form)
 	ck_assert_uint_eq(body_len, 2368); /* not required */
 
 	client_conn =
-	    mg_download("localhost",
-	                8884,
-	                0,
-	                ebuf,
-	                sizeof(ebuf),
-	                "POST /handle_form HTTP/1.1\r\n"
-	                "Host: localhost:8884\r\n"
-	                "Connection: close\r\n"
-	                "Content-Type: multipart/form-data; "
-	                "boundary=multipart-form-data-boundary--see-RFC-2388\r\n"
-	                "Content-Length: %u\r\n"
-	                "\r\n%s",
-	                (unsigned int)body_len,
-	                multipart_body);
+	    mg_download("localhost",
+	                8884,
+	                0,
+	                ebuf,
+	                sizeof(ebuf),
+	                "POST /handle_form HTTP/1.1\r\n"
+	                "Host: localhost:8884\r\n"
+	                "Connection: close\r\n"
+	                "Content-Type: multipart/form-data; "
+	                "boundary=multipart-form-data-boundary--see-RFC-2388\r\n"
+	                "Content-Length: %u\r\n"
+	                "\r\n%s",
+	                (unsigned int)body_len,
+	                multipart_body);
+
+	ck_assert(client_conn != NULL);
+	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
+		test_sleep(1);
+		if (g_field_step == 1000) {
+			break;
+		}
+	}
+	client_ri = mg_get_response_info(client_conn);
+
+	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 200);
+	mg_close_connection(client_conn);
+
+
+	/* Handle form: "POST multipart/form-data" with chunked transfer encoding */
+	client_conn =
+	    mg_download("localhost",
+	                8884,
+	                0,
+	                ebuf,
+	                sizeof(ebuf),
+	                "%s",
+	                "POST /handle_form HTTP/1.1\r\n"
+	                "Host: localhost:8884\r\n"
+	                "Connection: close\r\n"
+	                "Content-Type: multipart/form-data; "
+	                "boundary=multipart-form-data-boundary--see-RFC-2388\r\n"
+	                "Transfer-Encoding: chunked\r\n"
+	                "\r\n");
+
+	ck_assert(client_conn != NULL);
+
+	body_len = strlen(multipart_body);
+	chunk_len = 1;
+	body_sent = 0;
+	while (body_len > body_sent) {
+		if (chunk_len > (body_len - body_sent)) {
+			chunk_len = body_len - body_sent;
+		}
+		ck_assert_int_gt((int)chunk_len, 0);
+		mg_printf(client_conn, "%x\r\n", (unsigned int)chunk_len);
+		mg_write(client_conn, multipart_body + body_sent, chunk_len);
+		mg_printf(client_conn, "\r\n");
+		body_sent += chunk_len;
+		chunk_len = (chunk_len % 40) + 1;
+	}
+	mg_printf(client_conn, "0\r\n\r\n");
+
+	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
+		test_sleep(1);
+		if (g_field_step == 1000) {
+			break;
+		}
+	}
+	client_ri = mg_get_response_info(client_conn);
+
+	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 200);
+	mg_close_connection(client_conn);
+
+	/* Handle form: "POST multipart/form-data" with chunked transfer
+	 * encoding, using a quoted boundary string */
+	client_conn = mg_download(
+	    "localhost",
+	    8884,
+	    0,
+	    ebuf,
+	    sizeof(ebuf),
+	    "%s",
+	    "POST /handle_form HTTP/1.1\r\n"
+	    "Host: localhost:8884\r\n"
+	    "Connection: close\r\n"
+	    "Content-Type: multipart/form-data; "
+	    "boundary=\"multipart-form-data-boundary--see-RFC-2388\"\r\n"
+	    "Transfer-Encoding: chunked\r\n"
+	    "\r\n");
+
+	ck_assert(client_conn != NULL);
+
+	body_len = strlen(multipart_body);
+	chunk_len = 1;
+	body_sent = 0;
+	while (body_len > body_sent) {
+		if (chunk_len > (body_len - body_sent)) {
+			chunk_len = body_len - body_sent;
+		}
+		ck_assert_int_gt((int)chunk_len, 0);
+		mg_printf(client_conn, "%x\r\n", (unsigned int)chunk_len);
+		mg_write(client_conn, multipart_body + body_sent, chunk_len);
+		mg_printf(client_conn, "\r\n");
+		body_sent += chunk_len;
+		chunk_len = (chunk_len % 40) + 1;
+	}
+	mg_printf(client_conn, "0\r\n\r\n");
+
+	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
+		test_sleep(1);
+		if (g_field_step == 1000) {
+			break;
+		}
+	}
+	client_ri = mg_get_response_info(client_conn);
+
+	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 200);
+	mg_close_connection(client_conn);
+
+
+	/* Now test form_store */
+
+	/* First test with GET */
+	client_conn = mg_download("localhost",
+	                          8884,
+	                          0,
+	                          ebuf,
+	                          sizeof(ebuf),
+	                          "%s",
+	                          "GET /handle_form_store"
+	                          "?storeme=storetest"
+	                          "&continue_field_handler=ignore"
+	                          "&break_field_handler=abort"
+	                          "&dontread=xyz "
+	                          "HTTP/1.0\r\n"
+	                          "Host: localhost:8884\r\n"
+	                          "Connection: close\r\n\r\n");
+
+	ck_assert(client_conn != NULL);
+
+	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
+		test_sleep(1);
+		if (g_field_step == 1000) {
+			break;
+		}
+	}
+	client_ri = mg_get_response_info(client_conn);
+
+	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 200);
+	mg_close_connection(client_conn);
+
+
+	/* Handle form: "POST x-www-form-urlencoded", chunked, store */
+	client_conn =
+	    mg_download("localhost",
+	                8884,
+	                0,
+	                ebuf,
+	                sizeof(ebuf),
+	                "%s",
+	                "POST /handle_form_store HTTP/1.0\r\n"
+	                "Host: localhost:8884\r\n"
+	                "Connection: close\r\n"
+	                "Content-Type: application/x-www-form-urlencoded\r\n"
+	                "Transfer-Encoding: chunked\r\n"
+	                "\r\n");
+	ck_assert(client_conn != NULL);
+
+	send_chunk_string(client_conn, "storeme=store");
+	send_chunk_string(client_conn, "test&");
+	send_chunk_string(client_conn, "continue_field_handler=ignore");
+	send_chunk_string(client_conn, "&br");
+	test_sleep(1);
+	send_chunk_string(client_conn, "eak_field_handler=abort&");
+	send_chunk_string(client_conn, "dontread=xyz");
+	mg_printf(client_conn, "0\r\n\r\n");
+
+	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
+		test_sleep(1);
+		if (g_field_step == 1000) {
+			break;
+		}
+	}
+	client_ri = mg_get_response_info(client_conn);
+
+	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 200);
+	mg_close_connection(client_conn);
+
+	/* Handle form: "POST multipart/form-data", chunked, store */
+	client_conn =
+	    mg_download("localhost",
+	                8884,
+	                0,
+	                ebuf,
+	                sizeof(ebuf),
+	                "%s",
+	                "POST /handle_form_store HTTP/1.0\r\n"
+	                "Host: localhost:8884\r\n"
+	                "Connection: close\r\n"
+	                "Content-Type: multipart/form-data; "
+	                "boundary=multipart-form-data-boundary--see-RFC-2388\r\n"
+	                "Transfer-Encoding: chunked\r\n"
+	                "\r\n");
+	ck_assert(client_conn != NULL);
+
+	send_chunk_string(client_conn, "--multipart-form-data-boundary");
+	send_chunk_string(client_conn, "--see-RFC-2388\r\n");
+	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
+	send_chunk_string(client_conn, "name=\"storeme\"\r\n");
+	send_chunk_string(client_conn, "\r\n");
+	send_chunk_string(client_conn, "storetest\r\n");
+
+	send_chunk_string(client_conn, "--multipart-form-data-boundary-");
+	send_chunk_string(client_conn, "-see-RFC-2388\r\n");
+	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
+	send_chunk_string(client_conn, "name=\"continue_field_handler\"\r\n");
+	send_chunk_string(client_conn, "\r\n");
+	send_chunk_string(client_conn, "ignore\r\n");
+
+	send_chunk_string(client_conn, "--multipart-form-data-boundary-");
+	send_chunk_string(client_conn, "-see-RFC-2388\r\n");
+	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
+	send_chunk_string(client_conn, "name=\"break_field_handler\"\r\n");
+	send_chunk_string(client_conn, "\r\n");
+	send_chunk_string(client_conn, "abort\r\n");
+
+	send_chunk_string(client_conn, "--multipart-form-data-boundary-");
+	send_chunk_string(client_conn, "-see-RFC-2388\r\n");
+	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
+	send_chunk_string(client_conn, "name=\"dontread\"\r\n");
+	send_chunk_string(client_conn, "\r\n");
+	send_chunk_string(client_conn, "xyz\r\n");
+	send_chunk_string(client_conn, "--multipart-form-data-boundary");
+	send_chunk_string(client_conn, "--see-RFC-2388--\r\n");
+	mg_printf(client_conn, "0\r\n\r\n");
+
+	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
+		test_sleep(1);
+		if (g_field_step == 1000) {
+			break;
+		}
+	}
+	client_ri = mg_get_response_info(client_conn);
+
+	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 200);
+	mg_close_connection(client_conn);
+
+
+	/* Handle form: "POST multipart/form-data", chunked, store, with files */
+	client_conn =
+	    mg_download("localhost",
+	                8884,
+	                0,
+	                ebuf,
+	                sizeof(ebuf),
+	                "%s",
+	                "POST /handle_form_store2 HTTP/1.0\r\n"
+	                "Host: localhost:8884\r\n"
+	                "Connection: close\r\n"
+	                "Content-Type: multipart/form-data; "
+	                "boundary=multipart-form-data-boundary--see-RFC-2388\r\n"
+	                "Transfer-Encoding: chunked\r\n"
+	                "\r\n");
+	ck_assert(client_conn != NULL);
+
+	boundary = "--multipart-form-data-boundary--see-RFC-2388\r\n";
+
+	send_chunk_string(client_conn, boundary);
+	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
+	send_chunk_string(client_conn, "name=\"storeme\"\r\n");
+	send_chunk_string(client_conn, "\r\n");
+	send_chunk_string(client_conn, "storetest\r\n");
+
+	send_chunk_string(client_conn, boundary);
+	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
+	send_chunk_string(client_conn, "name=\"continue_field_handler\";");
+	send_chunk_string(client_conn, "filename=\"file_ignored.txt\"\r\n");
+	send_chunk_string(client_conn, "Content-Type: ");
+	send_chunk_string(client_conn, "application/octet-stream\r\n");
+	send_chunk_string(client_conn, "X-Ignored-Header: xyz\r\n");
+	send_chunk_string(client_conn, "\r\n");
+
+	/* send some kilobyte of data */
+	/* sending megabytes to localhost does not always work in CI test
+	 * environments (depending on the network stack) */
+	body_sent = 0;
+	bound_len = strlen(boundary);
+	do {
+		send_chunk_string(client_conn, "ignore\r\n");
+		body_sent += 8;
+		/* send some strings that are almost boundaries */
+		for (chunk_len = 1; chunk_len < bound_len; chunk_len++) {
+			/* chunks from 1 byte to strlen(boundary)-1 */
+			send_chunk_stringl(client_conn, boundary, (unsigned int)chunk_len);
+			body_sent += chunk_len;
+		}
+	} while (body_sent < 8 * 1024);
+	send_chunk_string(client_conn, "\r\n");
+
+	send_chunk_string(client_conn, boundary);
+	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
+	send_chunk_string(client_conn, "name=\"file2store\";");
+	send_chunk_string(client_conn, "filename=\"myfile.txt\"\r\n");
+	send_chunk_string(client_conn, "Content-Type: ");
+	send_chunk_string(client_conn, "application/octet-stream\r\n");
+	send_chunk_string(client_conn, "X-Ignored-Header: xyz\r\n");
+	send_chunk_string(client_conn, "\r\n");
+	for (body_sent = 0; (int)body_sent < (int)myfile_content_rep; body_sent++) {
+		send_chunk_string(client_conn, myfile_content);
+	}
+	send_chunk_string(client_conn, "\r\n");
+
+	send_chunk_string(client_conn, boundary);
+	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
+	send_chunk_string(client_conn, "name=\"break_field_handler\"\r\n");
+	send_chunk_string(client_conn, "\r\n");
+	send_chunk_string(client_conn, "abort\r\n");
+
+	send_chunk_string(client_conn, boundary);
+	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
+	send_chunk_string(client_conn, "name=\"dontread\"\r\n");
+	send_chunk_string(client_conn, "\r\n");
+	send_chunk_string(client_conn, "xyz\r\n");
+	send_chunk_string(client_conn, "--multipart-form-data-boundary");
+	send_chunk_string(client_conn, "--see-RFC-2388--\r\n");
+	mg_printf(client_conn, "0\r\n\r\n");
+
+	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
+		test_sleep(1);
+		if (g_field_step == 1000) {
+			break;
+		}
+	}
+	client_ri = mg_get_response_info(client_conn);
+
+	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 200);
+	mg_close_connection(client_conn);
+
+
+	/* Close the server */
+	g_ctx = NULL;
+	test_mg_stop(ctx, __LINE__);
+	mark_point();
+}
+END_TEST
+
+
+START_TEST(test_http_auth)
+{
+#if !defined(NO_FILES)
+	const char *OPTIONS[] = {
+		"document_root",
+		".",
+		"listening_ports",
+		"8080",
+#if !defined(NO_CACHING)
+		"static_file_max_age",
+		"0",
+#endif
+		"put_delete_auth_file",
+		"put_delete_auth_file.csv",
+		NULL,
+	};
+
+	struct mg_context *ctx;
+	struct mg_connection *client_conn;
+	char client_err[256], nonce[256];
+	const struct mg_response_info *client_ri;
+	int client_res;
+	FILE *f;
+	const char *passwd_file = ".htpasswd";
+	const char *test_file = "test_http_auth.test_file.txt";
+	const char *test_content = "test_http_auth test_file content";
+	const char *domain;
+	const char *doc_root;
+	const char *auth_request;
+	const char *str;
+	size_t len;
+	int i;
+	char HA1[256], HA2[256];
+	char HA1_md5_buf[33], HA2_md5_buf[33], HA_md5_buf[33];
+	char *HA1_md5_ret, *HA2_md5_ret, *HA_md5_ret;
+	const char *nc = "00000001";
+	const char *cnonce = "6789ABCD";
+
+	mark_point();
+
+	/* Start with default options */
+	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+
+	ck_assert(ctx != NULL);
+	domain = mg_get_option(ctx, "authentication_domain");
+	ck_assert(domain != NULL);
+	len = strlen(domain);
+	ck_assert_uint_gt(len, 0);
+	ck_assert_uint_lt(len, 64);
+	doc_root = mg_get_option(ctx, "document_root");
+	ck_assert_str_eq(doc_root, ".");
+
+	/* Create a default file in the document root */
+	f = fopen(test_file, "w");
+	if (f) {
+		fprintf(f, "%s", test_content);
+		fclose(f);
+	} else {
+		ck_abort_msg("Cannot create file %s", test_file);
+	}
+
+	(void)remove(passwd_file);
+	(void)remove("put_delete_auth_file.csv");
+
+	client_res = mg_modify_passwords_file("put_delete_auth_file.csv",
+	                                      domain,
+	                                      "admin",
+	                                      "adminpass");
+	ck_assert_int_eq(client_res, 1);
+
+	/* Read file before a .htpasswd file has been created */
+	memset(client_err, 0, sizeof(client_err));
+	client_conn =
+	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+
+	ck_assert_str_eq(client_err, "");
+	ck_assert(client_conn != NULL);
+
+	mg_printf(client_conn, "GET /%s HTTP/1.0\r\n\r\n", test_file);
+	client_res =
+	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
+	ck_assert_int_ge(client_res, 0);
+	ck_assert_str_eq(client_err, "");
+	client_ri = mg_get_response_info(client_conn);
+	ck_assert(client_ri != NULL);
+
+	ck_assert_int_eq(client_ri->status_code, 200);
+	client_res = (int)mg_read(client_conn, client_err, sizeof(client_err));
+	ck_assert_int_gt(client_res, 0);
+	ck_assert_int_le(client_res, sizeof(client_err));
+	ck_assert_str_eq(client_err, test_content);
+	mg_close_connection(client_conn);
+
+	test_sleep(1);
+
+	/* Create a .htpasswd file */
+	client_res = mg_modify_passwords_file(passwd_file, domain, "user", "pass");
+	ck_assert_int_eq(client_res, 1);
+
+	client_res = mg_modify_passwords_file(NULL, domain, "user", "pass");
+	ck_assert_int_eq(client_res, 0); /* Filename is required */
+
+	test_sleep(1);
+
+	/* Repeat test after .htpasswd is created */
+	memset(client_err, 0, sizeof(client_err));
+	client_conn =
+	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+
+	ck_assert_str_eq(client_err, "");
+	ck_assert(client_conn != NULL);
+
+	mg_printf(client_conn, "GET /%s HTTP/1.0\r\n\r\n", test_file);
+	client_res =
+	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
+	ck_assert_int_ge(client_res, 0);
+	ck_assert_str_eq(client_err, "");
+	client_ri = mg_get_response_info(client_conn);
+	ck_assert(client_ri != NULL);
+
+	ck_assert_int_eq(client_ri->status_code, 401);
+
+	auth_request = NULL;
+	for (i = 0; i < client_ri->num_headers; i++) {
+		if (!mg_strcasecmp(client_ri->http_headers[i].name,
+		                   "WWW-Authenticate")) {
+			ck_assert_ptr_eq(auth_request, NULL);
+			auth_request = client_ri->http_headers[i].value;
+			ck_assert_ptr_ne(auth_request, NULL);
+		}
+	}
+	ck_assert_ptr_ne(auth_request, NULL);
+	str = "Digest qop=\"auth\", realm=\"";
+	len = strlen(str);
+	ck_assert(!mg_strncasecmp(auth_request, str, len));
+	ck_assert(!strncmp(auth_request + len, domain, strlen(domain)));
+	len += strlen(domain);
+	str = "\", nonce=\"";
+	ck_assert(!strncmp(auth_request + len, str, strlen(str)));
+	len += strlen(str);
+	str = strchr(auth_request + len, '\"');
+	ck_assert_ptr_ne(str, NULL);
+	ck_assert_ptr_ne(str, auth_request + len);
+	/* nonce is from including (auth_request + len) to excluding (str) */
+	ck_assert_int_gt((ptrdiff_t)(str) - (ptrdiff_t)(auth_request + len), 0);
+	ck_assert_int_lt((ptrdiff_t)(str) - (ptrdiff_t)(auth_request + len),
+	                 (ptrdiff_t)sizeof(nonce));
+	memset(nonce, 0, sizeof(nonce));
+	memcpy(nonce,
+	       auth_request + len,
+	       (size_t)((ptrdiff_t)(str) - (ptrdiff_t)(auth_request + len)));
+	memset(HA1, 0, sizeof(HA1));
+	memset(HA2, 0, sizeof(HA2));
+	memset(HA1_md5_buf, 0, sizeof(HA1_md5_buf));
+	memset(HA2_md5_buf, 0, sizeof(HA2_md5_buf));
+	memset(HA_md5_buf, 0, sizeof(HA_md5_buf));
+
+	sprintf(HA1, "%s:%s:%s", "user", domain, "pass");
+	sprintf(HA2, "%s:/%s", "GET", test_file);
+	HA1_md5_ret = mg_md5(HA1_md5_buf, HA1, NULL);
+	HA2_md5_ret = mg_md5(HA2_md5_buf, HA2, NULL);
+
+	ck_assert_ptr_eq(HA1_md5_ret, HA1_md5_buf);
+	ck_assert_ptr_eq(HA2_md5_ret, HA2_md5_buf);
+
+	HA_md5_ret = mg_md5(HA_md5_buf, "user", ":", domain, ":", "pass", NULL);
+	ck_assert_ptr_eq(HA_md5_ret, HA_md5_buf);
+	ck_assert_str_eq(HA1_md5_ret, HA_md5_buf);
+
+	HA_md5_ret = mg_md5(HA_md5_buf, "GET", ":", "/", test_file, NULL);
+	ck_assert_ptr_eq(HA_md5_ret, HA_md5_buf);
+	ck_assert_str_eq(HA2_md5_ret, HA_md5_buf);
+
+	HA_md5_ret = mg_md5(HA_md5_buf,
+	                    HA1_md5_buf,
+	                    ":",
+	                    nonce,
+	                    ":",
+	                    nc,
+	                    ":",
+	                    cnonce,
+	                    ":",
+	                    "auth",
+	                    ":",
+	                    HA2_md5_buf,
+	                    NULL);
+	ck_assert_ptr_eq(HA_md5_ret, HA_md5_buf);
+
+	mg_close_connection(client_conn);
+
+	/* Retry with authorization */
+	memset(client_err, 0, sizeof(client_err));
+	client_conn =
+	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+
+	ck_assert_str_eq(client_err, "");
+	ck_assert(client_conn != NULL);
+
+	mg_printf(client_conn, "GET /%s HTTP/1.0\r\n", test_file);
+	mg_printf(client_conn,
+	          "Authorization: Digest "
+	          "username=\"%s\", "
+	          "realm=\"%s\", "
+	          "nonce=\"%s\", "
+	          "uri=\"/%s\", "
+	          "qop=auth, "
+	          "nc=%s, "
+	          "cnonce=\"%s\", "
+	          "response=\"%s\"\r\n\r\n",
+	          "user",
+	          domain,
+	          nonce,
+	          test_file,
+	          nc,
+	          cnonce,
+	          HA_md5_buf);
+	client_res =
+	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
+	ck_assert_int_ge(client_res, 0);
+	ck_assert_str_eq(client_err, "");
+	client_ri = mg_get_response_info(client_conn);
+	ck_assert(client_ri != NULL);
+
+	ck_assert_int_eq(client_ri->status_code, 200);
+	client_res = (int)mg_read(client_conn, client_err, sizeof(client_err));
+	ck_assert_int_gt(client_res, 0);
+	ck_assert_int_le(client_res, sizeof(client_err));
+	ck_assert_str_eq(client_err, test_content);
+	mg_close_connection(client_conn);
+
+	test_sleep(1);
+
+	/* Retry DELETE with authorization of a user not authorized for DELETE */
+	memset(client_err, 0, sizeof(client_err));
+	client_conn =
+	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+
+	ck_assert_str_eq(client_err, "");
+	ck_assert(client_conn != NULL);
+
+	mg_printf(client_conn, "DELETE /%s HTTP/1.0\r\n", test_file);
+	mg_printf(client_conn,
+	          "Authorization: Digest "
+	          "username=\"%s\", "
+	          "realm=\"%s\", "
+	          "nonce=\"%s\", "
+	          "uri=\"/%s\", "
+	          "qop=auth, "
+	          "nc=%s, "
+	          "cnonce=\"%s\", "
+	          "response=\"%s\"\r\n\r\n",
+	          "user",
+	          domain,
+	          nonce,
+	          test_file,
+	          nc,
+	          cnonce,
+	          HA_md5_buf);
+	client_res =
+	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
+	ck_assert_int_ge(client_res, 0);
+	ck_assert_str_eq(client_err, "");
+	client_ri = mg_get_response_info(client_conn);
+	ck_assert(client_ri != NULL);
+
+	ck_assert_int_eq(client_ri->status_code, 401);
+	mg_close_connection(client_conn);
+
+	test_sleep(1);
+
+	/* Remove the user from the .htpasswd file again */
+	client_res = mg_modify_passwords_file(passwd_file, domain, "user", NULL);
+	ck_assert_int_eq(client_res, 1);
+
+	test_sleep(1);
+
+
+	/* Try to access the file again. Expected: 401 error */
+	memset(client_err, 0, sizeof(client_err));
+	client_conn =
+	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+
+	ck_assert_str_eq(client_err, "");
+	ck_assert(client_conn != NULL);
+
+	mg_printf(client_conn, "GET /%s HTTP/1.0\r\n\r\n", test_file);
+	client_res =
+	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
+	ck_assert_int_ge(client_res, 0);
+	ck_assert_str_eq(client_err, "");
+	client_ri = mg_get_response_info(client_conn);
+	ck_assert(client_ri != NULL);
+
+	ck_assert_int_eq(client_ri->status_code, 401);
+	mg_close_connection(client_conn);
+
+	test_sleep(1);
+
+
+	/* Now remove the password file */
+	(void)remove(passwd_file);
+	test_sleep(1);
+
+
+	/* Access to the file must work like before */
+	memset(client_err, 0, sizeof(client_err));
+	client_conn =
+	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+
+	ck_assert_str_eq(client_err, "");
+	ck_assert(client_conn != NULL);
+
+	mg_printf(client_conn, "GET /%s HTTP/1.0\r\n\r\n", test_file);
+	client_res =
+	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
+	ck_assert_int_ge(client_res, 0);
+	ck_assert_str_eq(client_err, "");
+	client_ri = mg_get_response_info(client_conn);
+	ck_assert(client_ri != NULL);
+
+	ck_assert_int_eq(client_ri->status_code, 200);
+	client_res = (int)mg_read(client_conn, client_err, sizeof(client_err));
+	ck_assert_int_gt(client_res, 0);
+	ck_assert_int_le(client_res, sizeof(client_err));
+	ck_assert_str_eq(client_err, test_content);
+	mg_close_connection(client_conn);
+
+	test_sleep(1);
+
+
+	/* Stop the server and clean up */
+	test_mg_stop(ctx, __LINE__);
+	(void)remove(test_file);
+	(void)remove(passwd_file);
+	(void)remove("put_delete_auth_file.csv");
+
+#endif
+	mark_point();
+}
+END_TEST
+
+
+START_TEST(test_keep_alive)
+{
+	struct mg_context *ctx;
+	const char *OPTIONS[] =
+	{ "listening_ports",
+	  "8081",
+	  "request_timeout_ms",
+	  "10000",
+	  "enable_keep_alive",
+	  "yes",
+#if !defined(NO_FILES)
+	  "document_root",
+	  ".",
+	  "enable_directory_listing",
+	  "no",
+#endif
+	  NULL };
+
+	struct mg_connection *client_conn;
+	char client_err[256];
+	const struct mg_response_info *client_ri;
+	int client_res, i;
+	const char *connection_header;
+
+	mark_point();
+
+	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+
+	ck_assert(ctx != NULL);
+
+	/* HTTP 1.1 GET request */
+	memset(client_err, 0, sizeof(client_err));
+	client_conn =
+	    mg_connect_client("127.0.0.1", 8081, 0, client_err, sizeof(client_err));
+
+	ck_assert_str_eq(client_err, "");
+	ck_assert(client_conn != NULL);
+
+	mg_printf(client_conn,
+	          "GET / HTTP/1.1\r\nHost: "
+	          "localhost:8081\r\nConnection: keep-alive\r\n\r\n");
+	client_res =
+	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
+	ck_assert_int_ge(client_res, 0);
+	ck_assert_str_eq(client_err, "");
+	client_ri = mg_get_response_info(client_conn);
+	ck_assert(client_ri != NULL);
+
+#if defined(NO_FILES)
+	ck_assert_int_eq(client_ri->status_code, 404);
+#else
+	ck_assert_int_eq(client_ri->status_code, 403);
+#endif
 
-	ck_assert(client_conn != NULL);
-	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
-		test_sleep(1);
-		if (g_field_step == 1000) {
-			break;
+	connection_header = 0;
+	for (i = 0; i < client_ri->num_headers; i++) {
+		if (!mg_strcasecmp(client_ri->http_headers[i].name, "Connection")) {
+			ck_assert_ptr_eq(connection_header, NULL);
+			connection_header = client_ri->http_headers[i].value;
+			ck_assert_ptr_ne(connection_header, NULL);
 		}
 	}
-	client_ri = mg_get_response_info(client_conn);
-
-	ck_assert(client_ri != NULL);
-	ck_assert_int_eq(client_ri->status_code, 200);
+	/* Error replies will close the connection, even if keep-alive is set. */
+	ck_assert_ptr_ne(connection_header, NULL);
+	ck_assert_str_eq(connection_header, "close");
 	mg_close_connection(client_conn);
 
+	test_sleep(1);
 
-	/* Handle form: "POST multipart/form-data" with chunked transfer encoding */
-	client_conn =
-	    mg_download("localhost",
-	                8884,
-	                0,
-	                ebuf,
-	                sizeof(ebuf),
-	                "%s",
-	                "POST /handle_form HTTP/1.1\r\n"
-	                "Host: localhost:8884\r\n"
-	                "Connection: close\r\n"
-	                "Content-Type: multipart/form-data; "
-	                "boundary=multipart-form-data-boundary--see-RFC-2388\r\n"
-	                "Transfer-Encoding: chunked\r\n"
-	                "\r\n");
+	/* TODO: request a file and keep alive
+	 * (will only work if NO_FILES is not set). */
 
-	ck_assert(client_conn != NULL);
+	/* Stop the server and clean up */
+	test_mg_stop(ctx, __LINE__);
 
-	body_len = strlen(multipart_body);
-	chunk_len = 1;
-	body_sent = 0;
-	while (body_len > body_sent) {
-		if (chunk_len > (body_len - body_sent)) {
-			chunk_len = body_len - body_sent;
-		}
-		ck_assert_int_gt((int)chunk_len, 0);
-		mg_printf(client_conn, "%x\r\n", (unsigned int)chunk_len);
-		mg_write(client_conn, multipart_body + body_sent, chunk_len);
-		mg_printf(client_conn, "\r\n");
-		body_sent += chunk_len;
-		chunk_len = (chunk_len % 40) + 1;
-	}
-	mg_printf(client_conn, "0\r\n\r\n");
+	mark_point();
+}
+END_TEST
 
-	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
-		test_sleep(1);
-		if (g_field_step == 1000) {
-			break;
-		}
-	}
-	client_ri = mg_get_response_info(client_conn);
 
-	ck_assert(client_ri != NULL);
-	ck_assert_int_eq(client_ri->status_code, 200);
-	mg_close_connection(client_conn);
+/* Same default as in civetweb.c */
+#if defined(__linux__) && !defined(NO_KEEP_ALIVE_PARKING)                     \
+    && !defined(USE_KEEP_ALIVE_PARKING)
+#define USE_KEEP_ALIVE_PARKING
+#endif
+#if defined(__linux__) && !defined(NO_REUSEPORT_ACCEPTORS)                    \
+    && !defined(USE_REUSEPORT_ACCEPTORS)
+#define USE_REUSEPORT_ACCEPTORS
+#endif
 
-	/* Handle form: "POST multipart/form-data" with chunked transfer
-	 * encoding, using a quoted boundary string */
-	client_conn = mg_download(
-	    "localhost",
-	    8884,
-	    0,
-	    ebuf,
-	    sizeof(ebuf),
-	    "%s",
-	    "POST /handle_form HTTP/1.1\r\n"
-	    "Host: localhost:8884\r\n"
-	    "Connection: close\r\n"
-	    "Content-Type: multipart/form-data; "
-	    "boundary=\"multipart-form-data-boundary--see-RFC-2388\"\r\n"
-	    "Transfer-Encoding: chunked\r\n"
-	    "\r\n");
+#if defined(USE_KEEP_ALIVE_PARKING) || defined(USE_REUSEPORT_ACCEPTORS)
+static int
+keep_alive_parking_handler(struct mg_connection *conn, void *cbdata)
+{
+	(void)cbdata;
+	mg_printf(conn,
+	          "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n"
+	          "Content-Type: text/plain\r\n\r\nOK");
+	return 200;
+}
 
-	ck_assert(client_conn != NULL);
 
-	body_len = strlen(multipart_body);
-	chunk_len = 1;
-	body_sent = 0;
-	while (body_len > body_sent) {
-		if (chunk_len > (body_len - body_sent)) {
-			chunk_len = body_len - body_sent;
-		}
-		ck_assert_int_gt((int)chunk_len, 0);
-		mg_printf(client_conn, "%x\r\n", (unsigned int)chunk_len);
-		mg_write(client_conn, multipart_body + body_sent, chunk_len);
-		mg_printf(client_conn, "\r\n");
-		body_sent += chunk_len;
-		chunk_len = (chunk_len % 40) + 1;
-	}
-	mg_printf(client_conn, "0\r\n\r\n");
+#if defined(USE_KEEP_ALIVE_PARKING)
+static int parking_close_count;
 
-	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
-		test_sleep(1);
-		if (g_field_step == 1000) {
-			break;
-		}
-	}
-	client_ri = mg_get_response_info(client_conn);
 
-	ck_assert(client_ri != NULL);
-	ck_assert_int_eq(client_ri->status_code, 200);
-	mg_close_connection(client_conn);
+static void
+parking_connection_close(const struct mg_connection *conn)
+{
+	(void)conn;
+	parking_close_count++;
+}
 
 
-	/* Now test form_store */
+START_TEST(test_keep_alive_parking)
+{
+	struct mg_context *ctx;
+	const char *OPTIONS[] = {"listening_ports",
+	                         "8081",
+	                         "num_threads",
+	                         "1",
+	                         "enable_keep_alive",
+	                         "yes",
+	                         "keep_alive_timeout_ms",
+	                         "10000",
+	                         "enable_keep_alive_parking",
+	                         "yes",
+	                         NULL};
 
-	/* First test with GET */
-	client_conn = mg_download("localhost",
-	                          8884,
-	                          0,
-	                          ebuf,
-	                          sizeof(ebuf),
-	                          "%s",
-	                          "GET /handle_form_store"
-	                          "?storeme=storetest"
-	                          "&continue_field_handler=ignore"
-	                          "&break_field_handler=abort"
-	                          "&dontread=xyz "
-	                          "HTTP/1.0\r\n"
-	                          "Host: localhost:8884\r\n"
-	                          "Connection: close\r\n\r\n");
+	struct mg_callbacks callbacks;
+	struct mg_connection *client_conn1, *client_conn2;
+	char client_err[256];
+	const struct mg_response_info *client_ri;
+	char buf[8];
+	int client_res;
 
-	ck_assert(client_conn != NULL);
+	mark_point();
 
-	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
-		test_sleep(1);
-		if (g_field_step == 1000) {
-			break;
-		}
-	}
-	client_ri = mg_get_response_info(client_conn);
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.connection_close = parking_connection_close;
+	parking_close_count = 0;
+
+	ctx = test_mg_start(&callbacks, NULL, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
+	mg_set_request_handler(ctx, "/parking", keep_alive_parking_handler, NULL);
+
+	/* First client: one request, then keep the connection open */
+	memset(client_err, 0, sizeof(client_err));
+	client_conn1 =
+	    mg_connect_client("127.0.0.1", 8081, 0, client_err, sizeof(client_err));
+	ck_assert_str_eq(client_err, "");
+	ck_assert(client_conn1 != NULL);
 
+	mg_printf(client_conn1,
+	          "GET /parking HTTP/1.1\r\nHost: localhost:8081\r\n\r\n");
+	client_res =
+	    mg_get_response(client_conn1, client_err, sizeof(client_err), 3000);
+	ck_assert_int_ge(client_res, 0);
+	client_ri = mg_get_response_info(client_conn1);
 	ck_assert(client_ri != NULL);
 	ck_assert_int_eq(client_ri->status_code, 200);
-	mg_close_connection(client_conn);
+	ck_assert_int_eq(mg_read(client_conn1, buf, sizeof(buf)), 2);
 
+	/* The only worker thread must not be blocked by the idle
+	 * keep-alive connection of the first client. */
+	client_conn2 =
+	    mg_connect_client("127.0.0.1", 8081, 0, client_err, sizeof(client_err));
+	ck_assert_str_eq(client_err, "");
+	ck_assert(client_conn2 != NULL);
 
-	/* Handle form: "POST x-www-form-urlencoded", chunked, store */
-	client_conn =
-	    mg_download("localhost",
-	                8884,
-	                0,
-	                ebuf,
-	                sizeof(ebuf),
-	                "%s",
-	                "POST /handle_form_store HTTP/1.0\r\n"
-	                "Host: localhost:8884\r\n"
-	                "Connection: close\r\n"
-	                "Content-Type: application/x-www-form-urlencoded\r\n"
-	                "Transfer-Encoding: chunked\r\n"
-	                "\r\n");
-	ck_assert(client_conn != NULL);
+	mg_printf(client_conn2,
+	          "GET /parking HTTP/1.1\r\nHost: localhost:8081\r\n\r\n");
+	client_res =
+	    mg_get_response(client_conn2, client_err, sizeof(client_err), 3000);
+	ck_assert_int_ge(client_res, 0);
+	client_ri = mg_get_response_info(client_conn2);
+	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 200);
+	ck_assert_int_eq(mg_read(client_conn2, buf, sizeof(buf)), 2);
 
-	send_chunk_string(client_conn, "storeme=store");
-	send_chunk_string(client_conn, "test&");
-	send_chunk_string(client_conn, "continue_field_handler=ignore");
-	send_chunk_string(client_conn, "&br");
+	/* The parked connection of the first client is still usable */
+	mg_printf(client_conn1,
+	          "GET /parking HTTP/1.1\r\nHost: localhost:8081\r\n\r\n");
+	client_res =
+	    mg_get_response(client_conn1, client_err, sizeof(client_err), 3000);
+	ck_assert_int_ge(client_res, 0);
+	client_ri = mg_get_response_info(client_conn1);
+	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 200);
+	ck_assert_int_eq(mg_read(client_conn1, buf, sizeof(buf)), 2);
+
+	/* Stop the server while both connections are parked: each of them
+	 * is closed once */
 	test_sleep(1);
-	send_chunk_string(client_conn, "eak_field_handler=abort&");
-	send_chunk_string(client_conn, "dontread=xyz");
-	mg_printf(client_conn, "0\r\n\r\n");
+	test_mg_stop(ctx, __LINE__);
+	ck_assert_int_eq(parking_close_count, 2);
 
-	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
-		test_sleep(1);
-		if (g_field_step == 1000) {
-			break;
-		}
-	}
-	client_ri = mg_get_response_info(client_conn);
+	mg_close_connection(client_conn1);
+	mg_close_connection(client_conn2);
 
-	ck_assert(client_ri != NULL);
-	ck_assert_int_eq(client_ri->status_code, 200);
-	mg_close_connection(client_conn);
+	mark_point();
+}
+END_TEST
+#endif
 
-	/* Handle form: "POST multipart/form-data", chunked, store */
-	client_conn =
-	    mg_download("localhost",
-	                8884,
-	                0,
-	                ebuf,
-	                sizeof(ebuf),
-	                "%s",
-	                "POST /handle_form_store HTTP/1.0\r\n"
-	                "Host: localhost:8884\r\n"
-	                "Connection: close\r\n"
-	                "Content-Type: multipart/form-data; "
-	                "boundary=multipart-form-data-boundary--see-RFC-2388\r\n"
-	                "Transfer-Encoding: chunked\r\n"
-	                "\r\n");
-	ck_assert(client_conn != NULL);
 
-	send_chunk_string(client_conn, "--multipart-form-data-boundary");
-	send_chunk_string(client_conn, "--see-RFC-2388\r\n");
-	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
-	send_chunk_string(client_conn, "name=\"storeme\"\r\n");
-	send_chunk_string(client_conn, "\r\n");
-	send_chunk_string(client_conn, "storetest\r\n");
+#if defined(USE_REUSEPORT_ACCEPTORS)
+/* Thread pointers of the master and acceptor threads that rejected a
+ * connection. Connections are made one after the other, so the log
+ * messages are not written concurrently. */
+static void *acceptor_seen[8];
+static int acceptor_seen_count;
 
-	send_chunk_string(client_conn, "--multipart-form-data-boundary-");
-	send_chunk_string(client_conn, "-see-RFC-2388\r\n");
-	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
-	send_chunk_string(client_conn, "name=\"continue_field_handler\"\r\n");
-	send_chunk_string(client_conn, "\r\n");
-	send_chunk_string(client_conn, "ignore\r\n");
 
-	send_chunk_string(client_conn, "--multipart-form-data-boundary-");
-	send_chunk_string(client_conn, "-see-RFC-2388\r\n");
-	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
-	send_chunk_string(client_conn, "name=\"break_field_handler\"\r\n");
-	send_chunk_string(client_conn, "\r\n");
-	send_chunk_string(client_conn, "abort\r\n");
+static void *
+acceptor_init_thread(const struct mg_context *ctx, int thread_type)
+{
+	(void)ctx;
+	/* A unique pointer for every master and acceptor thread */
+	return (thread_type == 0) ? malloc(1) : NULL;
+}
+
+
+static void
+acceptor_exit_thread(const struct mg_context *ctx,
+                     int thread_type,
+                     void *thread_pointer)
+{
+	(void)ctx;
+	(void)thread_type;
+	free(thread_pointer);
+}
+
 
-	send_chunk_string(client_conn, "--multipart-form-data-boundary-");
-	send_chunk_string(client_conn, "-see-RFC-2388\r\n");
-	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
-	send_chunk_string(client_conn, "name=\"dontread\"\r\n");
-	send_chunk_string(client_conn, "\r\n");
-	send_chunk_string(client_conn, "xyz\r\n");
-	send_chunk_string(client_conn, "--multipart-form-data-boundary");
-	send_chunk_string(client_conn, "--see-RFC-2388--\r\n");
-	mg_printf(client_conn, "0\r\n\r\n");
+static int
+acceptor_log_message(const struct mg_connection *conn, const char *message)
+{
+	/* Rejected by the access control list in the accepting thread */
+	void *p = mg_get_thread_pointer(NULL);
+	int i;
 
-	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
-		test_sleep(1);
-		if (g_field_step == 1000) {
-			break;
+	(void)conn;
+	if ((p == NULL) || (strstr(message, "is not allowed to connect") == NULL)) {
+		return 1;
+	}
+	for (i = 0; i < acceptor_seen_count; i++) {
+		if (acceptor_seen[i] == p) {
+			return 1;
 		}
 	}
-	client_ri = mg_get_response_info(client_conn);
+	if (acceptor_seen_count < 8) {
+		acceptor_seen[acceptor_seen_count++] = p;
+	}
+	return 1;
+}
 
-	ck_assert(client_ri != NULL);
-	ck_assert_int_eq(client_ri->status_code, 200);
-	mg_close_connection(client_conn);
 
+START_TEST(test_acceptor_threads)
+{
+	struct mg_context *ctx;
+	const char *OPTIONS[] = {"listening_ports",
+	                         "8081",
+	                         "num_threads",
+	                         "4",
+	                         "acceptor_threads",
+	                         "4",
+	                         NULL,
+	                         NULL,
+	                         NULL};
+	struct mg_callbacks callbacks;
 
-	/* Handle form: "POST multipart/form-data", chunked, store, with files */
-	client_conn =
-	    mg_download("localhost",
-	                8884,
-	                0,
-	                ebuf,
-	                sizeof(ebuf),
-	                "%s",
-	                "POST /handle_form_store2 HTTP/1.0\r\n"
-	                "Host: localhost:8884\r\n"
-	                "Connection: close\r\n"
-	                "Content-Type: multipart/form-data; "
-	                "boundary=multipart-form-data-boundary--see-RFC-2388\r\n"
-	                "Transfer-Encoding: chunked\r\n"
-	                "\r\n");
-	ck_assert(client_conn != NULL);
+	struct mg_connection *client_conn;
+	char client_err[256];
+	const struct mg_response_info *client_ri;
+	struct mg_server_port portinfo[8];
+	char buf[8];
+	int client_res, ret, i;
 
-	boundary = "--multipart-form-data-boundary--see-RFC-2388\r\n";
+	mark_point();
 
-	send_chunk_string(client_conn, boundary);
-	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
-	send_chunk_string(client_conn, "name=\"storeme\"\r\n");
-	send_chunk_string(client_conn, "\r\n");
-	send_chunk_string(client_conn, "storetest\r\n");
+	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
+	mg_set_request_handler(ctx, "/acceptor", keep_alive_parking_handler, NULL);
 
-	send_chunk_string(client_conn, boundary);
-	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
-	send_chunk_string(client_conn, "name=\"continue_field_handler\";");
-	send_chunk_string(client_conn, "filename=\"file_ignored.txt\"\r\n");
-	send_chunk_string(client_conn, "Content-Type: ");
-	send_chunk_string(client_conn, "application/octet-stream\r\n");
-	send_chunk_string(client_conn, "X-Ignored-Header: xyz\r\n");
-	send_chunk_string(client_conn, "\r\n");
+	/* The SO_REUSEPORT twins are not reported as additional ports */
+	memset(portinfo, 0, sizeof(portinfo));
+	ret = mg_get_server_ports(ctx, 8, portinfo);
+	ck_assert_int_eq(ret, 1);
+	ck_assert_int_eq(portinfo[0].port, 8081);
+
+	/* The kernel distributes the connections to all acceptors */
+	for (i = 0; i < 32; i++) {
+		memset(client_err, 0, sizeof(client_err));
+		client_conn = mg_connect_client(
+		    "127.0.0.1", 8081, 0, client_err, sizeof(client_err));
+		ck_assert_str_eq(client_err, "");
+		ck_assert(client_conn != NULL);
+
+		mg_printf(client_conn,
+		          "GET /acceptor HTTP/1.0\r\nHost: localhost:8081\r\n\r\n");
+		client_res =
+		    mg_get_response(client_conn, client_err, sizeof(client_err), 3000);
+		ck_assert_int_ge(client_res, 0);
+		client_ri = mg_get_response_info(client_conn);
+		ck_assert(client_ri != NULL);
+		ck_assert_int_eq(client_ri->status_code, 200);
+		ck_assert_int_eq(mg_read(client_conn, buf, sizeof(buf)), 2);
+		mg_close_connection(client_conn);
+	}
 
-	/* send some kilobyte of data */
-	/* sending megabytes to localhost does not always work in CI test
-	 * environments (depending on the network stack) */
-	body_sent = 0;
-	bound_len = strlen(boundary);
-	do {
-		send_chunk_string(client_conn, "ignore\r\n");
-		body_sent += 8;
-		/* send some strings that are almost boundaries */
-		for (chunk_len = 1; chunk_len < bound_len; chunk_len++) {
-			/* chunks from 1 byte to strlen(boundary)-1 */
-			send_chunk_stringl(client_conn, boundary, (unsigned int)chunk_len);
-			body_sent += chunk_len;
-		}
-	} while (body_sent < 8 * 1024);
-	send_chunk_string(client_conn, "\r\n");
+	test_mg_stop(ctx, __LINE__);
 
-	send_chunk_string(client_conn, boundary);
-	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
-	send_chunk_string(client_conn, "name=\"file2store\";");
-	send_chunk_string(client_conn, "filename=\"myfile.txt\"\r\n");
-	send_chunk_string(client_conn, "Content-Type: ");
-	send_chunk_string(client_conn, "application/octet-stream\r\n");
-	send_chunk_string(client_conn, "X-Ignored-Header: xyz\r\n");
-	send_chunk_string(client_conn, "\r\n");
-	for (body_sent = 0; (int)body_sent < (int)myfile_content_rep; body_sent++) {
-		send_chunk_string(client_conn, myfile_content);
-	}
-	send_chunk_string(client_conn, "\r\n");
+	/* Reject all clients, to see which thread accepted a connection */
+	OPTIONS[6] = "access_control_list";
+	OPTIONS[7] = "-0.0.0.0/0";
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.init_thread = acceptor_init_thread;
+	callbacks.exit_thread = acceptor_exit_thread;
+	callbacks.log_message = acceptor_log_message;
+	acceptor_seen_count = 0;
 
-	send_chunk_string(client_conn, boundary);
-	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
-	send_chunk_string(client_conn, "name=\"break_field_handler\"\r\n");
-	send_chunk_string(client_conn, "\r\n");
-	send_chunk_string(client_conn, "abort\r\n");
+	ctx = test_mg_start(&callbacks, NULL, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
 
-	send_chunk_string(client_conn, boundary);
-	send_chunk_string(client_conn, "Content-Disposition: form-data; ");
-	send_chunk_string(client_conn, "name=\"dontread\"\r\n");
-	send_chunk_string(client_conn, "\r\n");
-	send_chunk_string(client_conn, "xyz\r\n");
-	send_chunk_string(client_conn, "--multipart-form-data-boundary");
-	send_chunk_string(client_conn, "--see-RFC-2388--\r\n");
-	mg_printf(client_conn, "0\r\n\r\n");
+	for (i = 0; (i < 64) && (acceptor_seen_count < 2); i++) {
+		client_conn = mg_connect_client(
+		    "127.0.0.1", 8081, 0, client_err, sizeof(client_err));
+		ck_assert(client_conn != NULL);
 
-	for (sleep_cnt = 0; sleep_cnt < 30; sleep_cnt++) {
-		test_sleep(1);
-		if (g_field_step == 1000) {
-			break;
-		}
+		/* The server closes the connection without a response */
+		mg_printf(client_conn,
+		          "GET /acceptor HTTP/1.0\r\nHost: localhost:8081\r\n\r\n");
+		client_res =
+		    mg_get_response(client_conn, client_err, sizeof(client_err), 3000);
+		ck_assert_int_lt(client_res, 0);
+		mg_close_connection(client_conn);
 	}
-	client_ri = mg_get_response_info(client_conn);
-
-	ck_assert(client_ri != NULL);
-	ck_assert_int_eq(client_ri->status_code, 200);
-	mg_close_connection(client_conn);
 
+	/* The connections are distributed to more than one acceptor */
+	ck_assert_int_ge(acceptor_seen_count, 2);
 
-	/* Close the server */
-	g_ctx = NULL;
+	/* Stop the server and clean up */
 	test_mg_stop(ctx, __LINE__);
+
 	mark_point();
 }
 END_TEST
+#endif
+#endif
 
 
-START_TEST(test_http_auth)
+START_TEST(test_error_handling)
 {
-#if !defined(NO_FILES)
-	const char *OPTIONS[] = {
-		"document_root",
-		".",
-		"listening_ports",
-		"8080",
-#if !defined(NO_CACHING)
-		"static_file_max_age",
-		"0",
-#endif
-		"put_delete_auth_file",
-		"put_delete_auth_file.csv",
-		NULL,
-	};
-
 	struct mg_context *ctx;
+	FILE *f;
+
+	char bad_thread_num[32] = "badnumber";
+
+	struct mg_callbacks callbacks;
+	char errmsg[256];
+
 	struct mg_connection *client_conn;
-	char client_err[256], nonce[256];
+	char client_err[256];
 	const struct mg_response_info *client_ri;
-	int client_res;
-	FILE *f;
-	const char *passwd_file = ".htpasswd";
-	const char *test_file = "test_http_auth.test_file.txt";
-	const char *test_content = "test_http_auth test_file content";
-	const char *domain;
-	const char *doc_root;
-	const char *auth_request;
-	const char *str;
-	size_t len;
-	int i;
-	char HA1[256], HA2[256];
-	char HA1_md5_buf[33], HA2_md5_buf[33], HA_md5_buf[33];
-	char *HA1_md5_ret, *HA2_md5_ret, *HA_md5_ret;
-	const char *nc = "00000001";
-	const char *cnonce = "6789ABCD";
+	int client_res, i;
+
+	const char *OPTIONS[32];
+	int opt_cnt = 0;
 
 	mark_point();
 
-	/* Start with default options */
-	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+#if !defined(NO_FILES)
+	OPTIONS[opt_cnt++] = "document_root";
+	OPTIONS[opt_cnt++] = ".";
+#endif
+	OPTIONS[opt_cnt++] = "error_pages";
+	OPTIONS[opt_cnt++] = "./";
+	OPTIONS[opt_cnt++] = "listening_ports";
+	OPTIONS[opt_cnt++] = "8080";
+	OPTIONS[opt_cnt++] = "num_threads";
+	OPTIONS[opt_cnt++] = bad_thread_num;
+	OPTIONS[opt_cnt++] = "unknown_option";
+	OPTIONS[opt_cnt++] = "unknown_option_value";
+	OPTIONS[opt_cnt] = NULL;
+
+	memset(&callbacks, 0, sizeof(callbacks));
+
+	callbacks.log_message = log_msg_func;
+
+	/* test with unknown option */
+	memset(errmsg, 0, sizeof(errmsg));
+	ctx = test_mg_start(&callbacks, (void *)errmsg, OPTIONS, 0);
+
+	/* Details of errmsg may vary, but it may not be empty */
+	ck_assert_str_ne(errmsg, "");
+	ck_assert(ctx == NULL);
+	ck_assert_str_eq(errmsg, "Invalid option: unknown_option");
+
+	/* Remove invalid option */
+	for (i = 0; OPTIONS[i]; i++) {
+		if (strstr(OPTIONS[i], "unknown_option")) {
+			OPTIONS[i] = 0;
+		}
+	}
+
+	/* Test with bad num_thread option */
+	memset(errmsg, 0, sizeof(errmsg));
+	ctx = test_mg_start(&callbacks, (void *)errmsg, OPTIONS, 0);
+
+	/* Details of errmsg may vary, but it may not be empty */
+	ck_assert_str_ne(errmsg, "");
+	ck_assert(ctx == NULL);
+	ck_assert_str_eq(errmsg, "Invalid number of worker threads");
+
+/* Set to a number - but use a number above the limit */
+#if defined(MAX_WORKER_THREADS)
+	sprintf(bad_thread_num, "%u", MAX_WORKER_THREADS + 1);
+#else
+	sprintf(bad_thread_num, "%lu", 1000000000lu);
+#endif
+
+	/* Test with bad num_thread option */
+	memset(errmsg, 0, sizeof(errmsg));
+	ctx = test_mg_start(&callbacks, (void *)errmsg, OPTIONS, 0);
+
+	/* Details of errmsg may vary, but it may not be empty */
+	ck_assert_str_ne(errmsg, "");
+	ck_assert(ctx == NULL);
+	ck_assert_str_eq(errmsg, "Too many worker threads");
+
+
+	/* HTTP 1.0 GET request - server is not running */
+	memset(client_err, 0, sizeof(client_err));
+	client_conn =
+	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+	ck_assert(client_conn == NULL);
+
+	/* Error message detail may vary - it may not be empty and should contain
+	 * some information "connect" failed */
+	ck_assert_str_ne(client_err, "");
+	ck_assert(strstr(client_err, "connect"));
+
+
+	/* This time start the server with a valid configuration */
+	sprintf(bad_thread_num, "%i", 1);
+	memset(errmsg, 0, sizeof(errmsg));
+	ctx = test_mg_start(&callbacks, (void *)errmsg, OPTIONS, __LINE__);
 
+	ck_assert_str_eq(errmsg, "");
 	ck_assert(ctx != NULL);
-	domain = mg_get_option(ctx, "authentication_domain");
-	ck_assert(domain != NULL);
-	len = strlen(domain);
-	ck_assert_uint_gt(len, 0);
-	ck_assert_uint_lt(len, 64);
-	doc_root = mg_get_option(ctx, "document_root");
-	ck_assert_str_eq(doc_root, ".");
 
-	/* Create a default file in the document root */
-	f = fopen(test_file, "w");
-	if (f) {
-		fprintf(f, "%s", test_content);
-		fclose(f);
-	} else {
-		ck_abort_msg("Cannot create file %s", test_file);
-	}
 
-	(void)remove(passwd_file);
-	(void)remove("put_delete_auth_file.csv");
+	/* Server is running now */
+	test_sleep(1);
 
-	client_res = mg_modify_passwords_file("put_delete_auth_file.csv",
-	                                      domain,
-	                                      "admin",
-	                                      "adminpass");
-	ck_assert_int_eq(client_res, 1);
+	/* Remove error files (in case they exist) */
+	(void)remove("error.htm");
+	(void)remove("error4xx.htm");
+	(void)remove("error404.htm");
 
-	/* Read file before a .htpasswd file has been created */
+
+	/* Ask for something not existing - should get default 404 */
 	memset(client_err, 0, sizeof(client_err));
 	client_conn =
 	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
@@ -3335,7 +5096,7 @@ START_TEST(test_http_auth)
 	ck_assert_str_eq(client_err, "");
 	ck_assert(client_conn != NULL);
 
-	mg_printf(client_conn, "GET /%s HTTP/1.0\r\n\r\n", test_file);
+	mg_printf(client_conn, "GET /something/not/existing HTTP/1.0\r\n\r\n");
 	client_res =
 	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
 	ck_assert_int_ge(client_res, 0);
@@ -3343,25 +5104,18 @@ START_TEST(test_http_auth)
 	client_ri = mg_get_response_info(client_conn);
 	ck_assert(client_ri != NULL);
 
-	ck_assert_int_eq(client_ri->status_code, 200);
-	client_res = (int)mg_read(client_conn, client_err, sizeof(client_err));
-	ck_assert_int_gt(client_res, 0);
-	ck_assert_int_le(client_res, sizeof(client_err));
-	ck_assert_str_eq(client_err, test_content);
+	ck_assert_int_eq(client_ri->status_code, 404);
 	mg_close_connection(client_conn);
-
 	test_sleep(1);
 
-	/* Create a .htpasswd file */
-	client_res = mg_modify_passwords_file(passwd_file, domain, "user", "pass");
-	ck_assert_int_eq(client_res, 1);
-
-	client_res = mg_modify_passwords_file(NULL, domain, "user", "pass");
-	ck_assert_int_eq(client_res, 0); /* Filename is required */
+	/* Create an error.htm file */
+	f = fopen("error.htm", "wt");
+	ck_assert(f != NULL);
+	(void)fprintf(f, "err-all");
+	(void)fclose(f);
 
-	test_sleep(1);
 
-	/* Repeat test after .htpasswd is created */
+	/* Ask for something not existing - should get error.htm */
 	memset(client_err, 0, sizeof(client_err));
 	client_conn =
 	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
@@ -3369,7 +5123,7 @@ START_TEST(test_http_auth)
 	ck_assert_str_eq(client_err, "");
 	ck_assert(client_conn != NULL);
 
-	mg_printf(client_conn, "GET /%s HTTP/1.0\r\n\r\n", test_file);
+	mg_printf(client_conn, "GET /something/not/existing HTTP/1.0\r\n\r\n");
 	client_res =
 	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
 	ck_assert_int_ge(client_res, 0);
@@ -3377,77 +5131,55 @@ START_TEST(test_http_auth)
 	client_ri = mg_get_response_info(client_conn);
 	ck_assert(client_ri != NULL);
 
-	ck_assert_int_eq(client_ri->status_code, 401);
+	ck_assert_int_eq(client_ri->status_code, 200);
 
-	auth_request = NULL;
-	for (i = 0; i < client_ri->num_headers; i++) {
-		if (!mg_strcasecmp(client_ri->http_headers[i].name,
-		                   "WWW-Authenticate")) {
-			ck_assert_ptr_eq(auth_request, NULL);
-			auth_request = client_ri->http_headers[i].value;
-			ck_assert_ptr_ne(auth_request, NULL);
-		}
-	}
-	ck_assert_ptr_ne(auth_request, NULL);
-	str = "Digest qop=\"auth\", realm=\"";
-	len = strlen(str);
-	ck_assert(!mg_strncasecmp(auth_request, str, len));
-	ck_assert(!strncmp(auth_request + len, domain, strlen(domain)));
-	len += strlen(domain);
-	str = "\", nonce=\"";
-	ck_assert(!strncmp(auth_request + len, str, strlen(str)));
-	len += strlen(str);
-	str = strchr(auth_request + len, '\"');
-	ck_assert_ptr_ne(str, NULL);
-	ck_assert_ptr_ne(str, auth_request + len);
-	/* nonce is from including (auth_request + len) to excluding (str) */
-	ck_assert_int_gt((ptrdiff_t)(str) - (ptrdiff_t)(auth_request + len), 0);
-	ck_assert_int_lt((ptrdiff_t)(str) - (ptrdiff_t)(auth_request + len),
-	                 (ptrdiff_t)sizeof(nonce));
-	memset(nonce, 0, sizeof(nonce));
-	memcpy(nonce,
-	       auth_request + len,
-	       (size_t)((ptrdiff_t)(str) - (ptrdiff_t)(auth_request + len)));
-	memset(HA1, 0, sizeof(HA1));
-	memset(HA2, 0, sizeof(HA2));
-	memset(HA1_md5_buf, 0, sizeof(HA1_md5_buf));
-	memset(HA2_md5_buf, 0, sizeof(HA2_md5_buf));
-	memset(HA_md5_buf, 0, sizeof(HA_md5_buf));
+	client_res = (int)mg_read(client_conn, client_err, sizeof(client_err));
+	mg_close_connection(client_conn);
+	ck_assert_int_eq(client_res, 7);
+	client_err[8] = 0;
+	ck_assert_str_eq(client_err, "err-all");
+	test_sleep(1);
 
-	sprintf(HA1, "%s:%s:%s", "user", domain, "pass");
-	sprintf(HA2, "%s:/%s", "GET", test_file);
-	HA1_md5_ret = mg_md5(HA1_md5_buf, HA1, NULL);
-	HA2_md5_ret = mg_md5(HA2_md5_buf, HA2, NULL);
+	/* Create an error4xx.htm file */
+	f = fopen("error4xx.htm", "wt");
+	ck_assert(f != NULL);
+	(void)fprintf(f, "err-4xx");
+	(void)fclose(f);
 
-	ck_assert_ptr_eq(HA1_md5_ret, HA1_md5_buf);
-	ck_assert_ptr_eq(HA2_md5_ret, HA2_md5_buf);
 
-	HA_md5_ret = mg_md5(HA_md5_buf, "user", ":", domain, ":", "pass", NULL);
-	ck_assert_ptr_eq(HA_md5_ret, HA_md5_buf);
-	ck_assert_str_eq(HA1_md5_ret, HA_md5_buf);
+	/* Ask for something not existing - should get error4xx.htm */
+	memset(client_err, 0, sizeof(client_err));
+	client_conn =
+	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
 
-	HA_md5_ret = mg_md5(HA_md5_buf, "GET", ":", "/", test_file, NULL);
-	ck_assert_ptr_eq(HA_md5_ret, HA_md5_buf);
-	ck_assert_str_eq(HA2_md5_ret, HA_md5_buf);
+	ck_assert_str_eq(client_err, "");
+	ck_assert(client_conn != NULL);
 
-	HA_md5_ret = mg_md5(HA_md5_buf,
-	                    HA1_md5_buf,
-	                    ":",
-	                    nonce,
-	                    ":",
-	                    nc,
-	                    ":",
-	                    cnonce,
-	                    ":",
-	                    "auth",
-	                    ":",
-	                    HA2_md5_buf,
-	                    NULL);
-	ck_assert_ptr_eq(HA_md5_ret, HA_md5_buf);
+	mg_printf(client_conn, "GET /something/not/existing HTTP/1.0\r\n\r\n");
+	client_res =
+	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
+	ck_assert_int_ge(client_res, 0);
+	ck_assert_str_eq(client_err, "");
+	client_ri = mg_get_response_info(client_conn);
+	ck_assert(client_ri != NULL);
+
+	ck_assert_int_eq(client_ri->status_code, 200);
 
+	client_res = (int)mg_read(client_conn, client_err, sizeof(client_err));
 	mg_close_connection(client_conn);
+	ck_assert_int_eq(client_res, 7);
+	client_err[8] = 0;
+	ck_assert_str_eq(client_err, "err-4xx");
+	test_sleep(1);
 
-	/* Retry with authorization */
+	/* Create an error404.htm file */
+	f = fopen("error404.htm", "wt");
+	ck_assert(f != NULL);
+	(void)fprintf(f, "err-404");
+	(void)fclose(f);
+
+
+	/* Ask for something not existing - should get error404.htm */
 	memset(client_err, 0, sizeof(client_err));
 	client_conn =
 	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
@@ -3455,24 +5187,7 @@ START_TEST(test_http_auth)
 	ck_assert_str_eq(client_err, "");
 	ck_assert(client_conn != NULL);
 
-	mg_printf(client_conn, "GET /%s HTTP/1.0\r\n", test_file);
-	mg_printf(client_conn,
-	          "Authorization: Digest "
-	          "username=\"%s\", "
-	          "realm=\"%s\", "
-	          "nonce=\"%s\", "
-	          "uri=\"/%s\", "
-	          "qop=auth, "
-	          "nc=%s, "
-	          "cnonce=\"%s\", "
-	          "response=\"%s\"\r\n\r\n",
-	          "user",
-	          domain,
-	          nonce,
-	          test_file,
-	          nc,
-	          cnonce,
-	          HA_md5_buf);
+	mg_printf(client_conn, "GET /something/not/existing HTTP/1.0\r\n\r\n");
 	client_res =
 	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
 	ck_assert_int_ge(client_res, 0);
@@ -3481,15 +5196,16 @@ START_TEST(test_http_auth)
 	ck_assert(client_ri != NULL);
 
 	ck_assert_int_eq(client_ri->status_code, 200);
+
 	client_res = (int)mg_read(client_conn, client_err, sizeof(client_err));
-	ck_assert_int_gt(client_res, 0);
-	ck_assert_int_le(client_res, sizeof(client_err));
-	ck_assert_str_eq(client_err, test_content);
 	mg_close_connection(client_conn);
-
+	ck_assert_int_eq(client_res, 7);
+	client_err[8] = 0;
+	ck_assert_str_eq(client_err, "err-404");
 	test_sleep(1);
 
-	/* Retry DELETE with authorization of a user not authorized for DELETE */
+
+	/* Ask in a malformed way - should get error4xx.htm */
 	memset(client_err, 0, sizeof(client_err));
 	client_conn =
 	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
@@ -3497,24 +5213,7 @@ START_TEST(test_http_auth)
 	ck_assert_str_eq(client_err, "");
 	ck_assert(client_conn != NULL);
 
-	mg_printf(client_conn, "DELETE /%s HTTP/1.0\r\n", test_file);
-	mg_printf(client_conn,
-	          "Authorization: Digest "
-	          "username=\"%s\", "
-	          "realm=\"%s\", "
-	          "nonce=\"%s\", "
-	          "uri=\"/%s\", "
-	          "qop=auth, "
-	          "nc=%s, "
-	          "cnonce=\"%s\", "
-	          "response=\"%s\"\r\n\r\n",
-	          "user",
-	          domain,
-	          nonce,
-	          test_file,
-	          nc,
-	          cnonce,
-	          HA_md5_buf);
+	mg_printf(client_conn, "Gimme some file!\r\n\r\n");
 	client_res =
 	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
 	ck_assert_int_ge(client_res, 0);
@@ -3522,743 +5221,1456 @@ START_TEST(test_http_auth)
 	client_ri = mg_get_response_info(client_conn);
 	ck_assert(client_ri != NULL);
 
-	ck_assert_int_eq(client_ri->status_code, 401);
-	mg_close_connection(client_conn);
+	ck_assert_int_eq(client_ri->status_code, 200);
+
+	client_res = (int)mg_read(client_conn, client_err, sizeof(client_err));
+	mg_close_connection(client_conn);
+	ck_assert_int_eq(client_res, 7);
+	client_err[8] = 0;
+	ck_assert_str_eq(client_err, "err-4xx");
+	test_sleep(1);
+
+
+	/* Remove all error files created by this test */
+	(void)remove("error.htm");
+	(void)remove("error4xx.htm");
+	(void)remove("error404.htm");
+
+
+	/* Stop the server */
+	test_mg_stop(ctx, __LINE__);
+
+
+	/* HTTP 1.1 GET request - must not work, since server is already stopped  */
+	memset(client_err, 0, sizeof(client_err));
+	client_conn =
+	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+
+	ck_assert(client_conn == NULL);
+	ck_assert_str_ne(client_err, "");
+
+	test_sleep(1);
+
+	mark_point();
+}
+END_TEST
+
+
+START_TEST(test_error_log_file)
+{
+	/* Server var */
+	struct mg_context *ctx;
+	const char *OPTIONS[32];
+	int opt_cnt = 0;
+
+	/* Client var */
+	struct mg_connection *client;
+	char client_err_buf[256];
+	char client_data_buf[256];
+	const struct mg_response_info *client_ri;
+
+	/* File content check var */
+	FILE *f;
+	char buf[1024];
+	int len, ok;
 
-	test_sleep(1);
+	mark_point();
 
-	/* Remove the user from the .htpasswd file again */
-	client_res = mg_modify_passwords_file(passwd_file, domain, "user", NULL);
-	ck_assert_int_eq(client_res, 1);
+	/* Set options and start server */
+	OPTIONS[opt_cnt++] = "listening_ports";
+	OPTIONS[opt_cnt++] = "8080";
+	OPTIONS[opt_cnt++] = "error_log_file";
+	OPTIONS[opt_cnt++] = "error.log";
+	OPTIONS[opt_cnt++] = "access_log_file";
+	OPTIONS[opt_cnt++] = "access.log";
+#if !defined(NO_FILES)
+	OPTIONS[opt_cnt++] = "document_root";
+	OPTIONS[opt_cnt++] = ".";
+#endif
+	OPTIONS[opt_cnt] = NULL;
 
-	test_sleep(1);
+	ctx = test_mg_start(NULL, 0, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
+
+	/* Remove log files (they may exist from previous incomplete runs of
+	 * this test) */
+	(void)remove("error.log");
+	(void)remove("access.log");
 
+	/* connect client */
+	memset(client_err_buf, 0, sizeof(client_err_buf));
+	memset(client_data_buf, 0, sizeof(client_data_buf));
 
-	/* Try to access the file again. Expected: 401 error */
-	memset(client_err, 0, sizeof(client_err));
-	client_conn =
-	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+	client = mg_download("127.0.0.1",
+	                     8080,
+	                     0,
+	                     client_err_buf,
+	                     sizeof(client_err_buf),
+	                     "GET /not_existing_file.ext HTTP/1.0\r\n\r\n");
 
-	ck_assert_str_eq(client_err, "");
-	ck_assert(client_conn != NULL);
+	ck_assert(ctx != NULL);
+	ck_assert_str_eq(client_err_buf, "");
 
-	mg_printf(client_conn, "GET /%s HTTP/1.0\r\n\r\n", test_file);
-	client_res =
-	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
-	ck_assert_int_ge(client_res, 0);
-	ck_assert_str_eq(client_err, "");
-	client_ri = mg_get_response_info(client_conn);
+	client_ri = mg_get_response_info(client);
+
+	/* Check status - should be 404 Not Found */
 	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 404);
 
-	ck_assert_int_eq(client_ri->status_code, 401);
-	mg_close_connection(client_conn);
+	/* Get body data (could exist, but does not have to) */
+	len = mg_read(client, client_data_buf, sizeof(client_data_buf));
+	ck_assert_int_ge(len, 0);
 
-	test_sleep(1);
+	/* Close the client connection */
+	mg_close_connection(client);
 
+	/* Stop the server */
+	test_mg_stop(ctx, __LINE__);
 
-	/* Now remove the password file */
-	(void)remove(passwd_file);
-	test_sleep(1);
 
+	/* Check access.log */
+	memset(buf, 0, sizeof(buf));
+	f = fopen("access.log", "r");
+	ck_assert_msg(f != NULL, "Cannot open access log file");
+	ok = (NULL != fgets(buf, sizeof(buf) - 1, f));
+	(void)fclose(f);
+	ck_assert_msg(ok, "Cannot read access log file");
+	len = (int)strlen(buf);
+	ck_assert_int_gt(len, 0);
+	ok = (NULL != strstr(buf, "not_existing_file.ext"));
+	ck_assert_msg(ok, "Did not find uri in access log file");
+	ok = (NULL != strstr(buf, "404"));
+	ck_assert_msg(ok, "Did not find HTTP status code in access log file");
 
-	/* Access to the file must work like before */
-	memset(client_err, 0, sizeof(client_err));
-	client_conn =
-	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+	/* Check error.log */
+	memset(buf, 0, sizeof(buf));
+	f = fopen("error.log", "r");
+	if (f) {
+		(void)fgets(buf, sizeof(buf) - 1, f);
+		fclose(f);
+	}
+	ck_assert_msg(f == NULL,
+	              "Should not create error log file on 404, but got [%s]",
+	              buf);
 
-	ck_assert_str_eq(client_err, "");
-	ck_assert(client_conn != NULL);
+	/* Remove log files */
+	(void)remove("error.log");
+	(void)remove("access.log");
 
-	mg_printf(client_conn, "GET /%s HTTP/1.0\r\n\r\n", test_file);
-	client_res =
-	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
-	ck_assert_int_ge(client_res, 0);
-	ck_assert_str_eq(client_err, "");
-	client_ri = mg_get_response_info(client_conn);
-	ck_assert(client_ri != NULL);
+	/* Start server with bad options */
+	ck_assert_str_eq(OPTIONS[0], "listening_ports");
+	OPTIONS[1] = "bad !"; /* no r or s in string */
 
-	ck_assert_int_eq(client_ri->status_code, 200);
-	client_res = (int)mg_read(client_conn, client_err, sizeof(client_err));
-	ck_assert_int_gt(client_res, 0);
-	ck_assert_int_le(client_res, sizeof(client_err));
-	ck_assert_str_eq(client_err, test_content);
-	mg_close_connection(client_conn);
+	ctx = test_mg_start(NULL, 0, OPTIONS, 0);
+	ck_assert_msg(
+	    ctx == NULL,
+	    "Should not be able to start server with bad port configuration");
 
-	test_sleep(1);
+	/* Check access.log */
+	memset(buf, 0, sizeof(buf));
+	f = fopen("access.log", "r");
+	if (f) {
+		(void)fgets(buf, sizeof(buf) - 1, f);
+		fclose(f);
+	}
+	ck_assert_msg(
+	    f == NULL,
+	    "Should not create access log file if start fails, but got [%s]",
+	    buf);
+
+	/* Check error.log */
+	memset(buf, 0, sizeof(buf));
+	f = fopen("error.log", "r");
+	ck_assert_msg(f != NULL, "Cannot open access log file");
+	ok = (NULL != fgets(buf, sizeof(buf) - 1, f));
+	(void)fclose(f);
+	ck_assert_msg(ok, "Cannot read access log file");
+	len = (int)strlen(buf);
+	ck_assert_int_gt(len, 0);
+	ok = (NULL != strstr(buf, "port"));
+	ck_assert_msg(ok, "Did not find port as error reason in error log file");
 
 
-	/* Stop the server and clean up */
-	test_mg_stop(ctx, __LINE__);
-	(void)remove(test_file);
-	(void)remove(passwd_file);
-	(void)remove("put_delete_auth_file.csv");
+	/* Remove log files */
+	(void)remove("error.log");
+	(void)remove("access.log");
 
-#endif
 	mark_point();
 }
 END_TEST
 
 
-START_TEST(test_keep_alive)
+static int
+test_throttle_begin_request(struct mg_connection *conn)
 {
-	struct mg_context *ctx;
-	const char *OPTIONS[] =
-	{ "listening_ports",
-	  "8081",
-	  "request_timeout_ms",
-	  "10000",
-	  "enable_keep_alive",
-	  "yes",
-#if !defined(NO_FILES)
-	  "document_root",
-	  ".",
-	  "enable_directory_listing",
-	  "no",
-#endif
-	  NULL };
-
-	struct mg_connection *client_conn;
-	char client_err[256];
-	const struct mg_response_info *client_ri;
-	int client_res, i;
-	const char *connection_header;
+	const struct mg_request_info *ri;
+	long unsigned len = 1024 * 10;
+	const char *block = "0123456789";
+	unsigned long i, blocklen;
 
-	mark_point();
+	ck_assert(conn != NULL);
+	ri = mg_get_request_info(conn);
+	ck_assert(ri != NULL);
 
-	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+	ck_assert_str_eq(ri->request_method, "GET");
+	ck_assert_str_eq(ri->request_uri, "/throttle");
+	ck_assert_str_eq(ri->local_uri, "/throttle");
+	ck_assert_str_eq(ri->http_version, "1.0");
+	ck_assert_str_eq(ri->query_string, "q");
+	ck_assert_str_eq(ri->remote_addr, "127.0.0.1");
 
-	ck_assert(ctx != NULL);
+	mg_printf(conn,
+	          "HTTP/1.1 200 OK\r\n"
+	          "Content-Length: %lu\r\n"
+	          "Connection: close\r\n\r\n",
+	          len);
 
-	/* HTTP 1.1 GET request */
-	memset(client_err, 0, sizeof(client_err));
-	client_conn =
-	    mg_connect_client("127.0.0.1", 8081, 0, client_err, sizeof(client_err));
+	blocklen = (unsigned long)strlen(block);
 
-	ck_assert_str_eq(client_err, "");
-	ck_assert(client_conn != NULL);
+	for (i = 0; i < len; i += blocklen) {
+		mg_write(conn, block, blocklen);
+	}
 
-	mg_printf(client_conn,
-	          "GET / HTTP/1.1\r\nHost: "
-	          "localhost:8081\r\nConnection: keep-alive\r\n\r\n");
-	client_res =
-	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
-	ck_assert_int_ge(client_res, 0);
-	ck_assert_str_eq(client_err, "");
-	client_ri = mg_get_response_info(client_conn);
-	ck_assert(client_ri != NULL);
+	mark_point();
 
-#if defined(NO_FILES)
-	ck_assert_int_eq(client_ri->status_code, 404);
-#else
-	ck_assert_int_eq(client_ri->status_code, 403);
-#endif
+	return 987; /* Not a valid HTTP response code,
+	             * but it should be written to the log and passed to
+	             * end_request. */
+}
 
-	connection_header = 0;
-	for (i = 0; i < client_ri->num_headers; i++) {
-		if (!mg_strcasecmp(client_ri->http_headers[i].name, "Connection")) {
-			ck_assert_ptr_eq(connection_header, NULL);
-			connection_header = client_ri->http_headers[i].value;
-			ck_assert_ptr_ne(connection_header, NULL);
-		}
-	}
-	/* Error replies will close the connection, even if keep-alive is set. */
-	ck_assert_ptr_ne(connection_header, NULL);
-	ck_assert_str_eq(connection_header, "close");
-	mg_close_connection(client_conn);
 
-	test_sleep(1);
+static void
+test_throttle_end_request(const struct mg_connection *conn,
+                          int reply_status_code)
+{
+	const struct mg_request_info *ri;
 
-	/* TODO: request a file and keep alive
-	 * (will only work if NO_FILES is not set). */
+	ck_assert(conn != NULL);
+	ri = mg_get_request_info(conn);
+	ck_assert(ri != NULL);
 
-	/* Stop the server and clean up */
-	test_mg_stop(ctx, __LINE__);
+	ck_assert_str_eq(ri->request_method, "GET");
+	ck_assert_str_eq(ri->request_uri, "/throttle");
+	ck_assert_str_eq(ri->local_uri, "/throttle");
+	ck_assert_str_eq(ri->http_version, "1.0");
+	ck_assert_str_eq(ri->query_string, "q");
+	ck_assert_str_eq(ri->remote_addr, "127.0.0.1");
 
-	mark_point();
+	ck_assert_int_eq(reply_status_code, 987);
 }
-END_TEST
 
 
-START_TEST(test_error_handling)
+START_TEST(test_throttle)
 {
+	/* Server var */
 	struct mg_context *ctx;
-	FILE *f;
-
-	char bad_thread_num[32] = "badnumber";
-
 	struct mg_callbacks callbacks;
-	char errmsg[256];
+	const char *OPTIONS[32];
+	int opt_cnt = 0;
 
-	struct mg_connection *client_conn;
-	char client_err[256];
+	/* Client var */
+	struct mg_connection *client;
+	char client_err_buf[256];
+	char client_data_buf[256];
 	const struct mg_response_info *client_ri;
-	int client_res, i;
 
-	const char *OPTIONS[32];
-	int opt_cnt = 0;
+	/* timing test */
+	int r, data_read;
+	time_t t0, t1;
+	double dt;
 
 	mark_point();
 
+
+/* Set options and start server */
 #if !defined(NO_FILES)
 	OPTIONS[opt_cnt++] = "document_root";
 	OPTIONS[opt_cnt++] = ".";
 #endif
-	OPTIONS[opt_cnt++] = "error_pages";
-	OPTIONS[opt_cnt++] = "./";
 	OPTIONS[opt_cnt++] = "listening_ports";
 	OPTIONS[opt_cnt++] = "8080";
-	OPTIONS[opt_cnt++] = "num_threads";
-	OPTIONS[opt_cnt++] = bad_thread_num;
-	OPTIONS[opt_cnt++] = "unknown_option";
-	OPTIONS[opt_cnt++] = "unknown_option_value";
+	OPTIONS[opt_cnt++] = "throttle";
+	OPTIONS[opt_cnt++] = "*=1k";
 	OPTIONS[opt_cnt] = NULL;
 
 	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.begin_request = test_throttle_begin_request;
+	callbacks.end_request = test_throttle_end_request;
 
-	callbacks.log_message = log_msg_func;
-
-	/* test with unknown option */
-	memset(errmsg, 0, sizeof(errmsg));
-	ctx = test_mg_start(&callbacks, (void *)errmsg, OPTIONS, 0);
-
-	/* Details of errmsg may vary, but it may not be empty */
-	ck_assert_str_ne(errmsg, "");
-	ck_assert(ctx == NULL);
-	ck_assert_str_eq(errmsg, "Invalid option: unknown_option");
-
-	/* Remove invalid option */
-	for (i = 0; OPTIONS[i]; i++) {
-		if (strstr(OPTIONS[i], "unknown_option")) {
-			OPTIONS[i] = 0;
-		}
-	}
-
-	/* Test with bad num_thread option */
-	memset(errmsg, 0, sizeof(errmsg));
-	ctx = test_mg_start(&callbacks, (void *)errmsg, OPTIONS, 0);
-
-	/* Details of errmsg may vary, but it may not be empty */
-	ck_assert_str_ne(errmsg, "");
-	ck_assert(ctx == NULL);
-	ck_assert_str_eq(errmsg, "Invalid number of worker threads");
-
-/* Set to a number - but use a number above the limit */
-#if defined(MAX_WORKER_THREADS)
-	sprintf(bad_thread_num, "%u", MAX_WORKER_THREADS + 1);
-#else
-	sprintf(bad_thread_num, "%lu", 1000000000lu);
-#endif
-
-	/* Test with bad num_thread option */
-	memset(errmsg, 0, sizeof(errmsg));
-	ctx = test_mg_start(&callbacks, (void *)errmsg, OPTIONS, 0);
-
-	/* Details of errmsg may vary, but it may not be empty */
-	ck_assert_str_ne(errmsg, "");
-	ck_assert(ctx == NULL);
-	ck_assert_str_eq(errmsg, "Too many worker threads");
-
-
-	/* HTTP 1.0 GET request - server is not running */
-	memset(client_err, 0, sizeof(client_err));
-	client_conn =
-	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
-	ck_assert(client_conn == NULL);
-
-	/* Error message detail may vary - it may not be empty and should contain
-	 * some information "connect" failed */
-	ck_assert_str_ne(client_err, "");
-	ck_assert(strstr(client_err, "connect"));
+	ctx = test_mg_start(&callbacks, 0, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
 
+	/* connect client */
+	memset(client_err_buf, 0, sizeof(client_err_buf));
+	memset(client_data_buf, 0, sizeof(client_data_buf));
 
-	/* This time start the server with a valid configuration */
-	sprintf(bad_thread_num, "%i", 1);
-	memset(errmsg, 0, sizeof(errmsg));
-	ctx = test_mg_start(&callbacks, (void *)errmsg, OPTIONS, __LINE__);
+	strcpy(client_err_buf, "reset-content");
+	client = mg_download("127.0.0.1",
+	                     8080,
+	                     0,
+	                     client_err_buf,
+	                     sizeof(client_err_buf),
+	                     "GET /throttle?q HTTP/1.0\r\n\r\n");
 
-	ck_assert_str_eq(errmsg, "");
 	ck_assert(ctx != NULL);
+	ck_assert_str_eq(client_err_buf, "");
 
+	client_ri = mg_get_response_info(client);
 
-	/* Server is running now */
-	test_sleep(1);
-
-	/* Remove error files (in case they exist) */
-	(void)remove("error.htm");
-	(void)remove("error4xx.htm");
-	(void)remove("error404.htm");
-
+	ck_assert(client_ri != NULL);
+	ck_assert_int_eq(client_ri->status_code, 200);
 
-	/* Ask for something not existing - should get default 404 */
-	memset(client_err, 0, sizeof(client_err));
-	client_conn =
-	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+	ck_assert_int_eq(client_ri->content_length, 1024 * 10);
 
-	ck_assert_str_eq(client_err, "");
-	ck_assert(client_conn != NULL);
+	data_read = 0;
+	t0 = time(NULL);
+	while (data_read < client_ri->content_length) {
+		r = mg_read(client, client_data_buf, sizeof(client_data_buf));
+		ck_assert_int_ge(r, 0);
+		data_read += r;
+	}
+	t1 = time(NULL);
+	dt = difftime(t1, t0) * 1000.0; /* Elapsed time in ms - in most systems
+	                                 * only with second resolution */
 
-	mg_printf(client_conn, "GET /something/not/existing HTTP/1.0\r\n\r\n");
-	client_res =
-	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
-	ck_assert_int_ge(client_res, 0);
-	ck_assert_str_eq(client_err, "");
-	client_ri = mg_get_response_info(client_conn);
-	ck_assert(client_ri != NULL);
+	/* Time estimation: Data size is 10 kB, with 1 kB/s speed limit.
+	 * The first block (1st kB) is transferred immediately, the second
+	 * block (2nd kB) one second later, the third block (3rd kB) two
+	 * seconds later, .. the last block (10th kB) nine seconds later.
+	 * The resolution of time measurement using the "time" C library
+	 * function is 1 second, so we should add +/- one second tolerance.
+	 * Thus, download of 10 kB with 1 kB/s should not be faster than
+	 * 8 seconds. */
 
-	ck_assert_int_eq(client_ri->status_code, 404);
-	mg_close_connection(client_conn);
-	test_sleep(1);
+	/* Check if there are at least 8 seconds */
+	ck_assert_int_ge((int)dt, 8 * 1000);
 
-	/* Create an error.htm file */
-	f = fopen("error.htm", "wt");
-	ck_assert(f != NULL);
-	(void)fprintf(f, "err-all");
-	(void)fclose(f);
+	/* Nothing left to read */
+	r = mg_read(client, client_data_buf, sizeof(client_data_buf));
+	ck_assert_int_eq(r, 0);
 
+	/* Close the client connection */
+	mg_close_connection(client);
 
-	/* Ask for something not existing - should get error.htm */
-	memset(client_err, 0, sizeof(client_err));
-	client_conn =
-	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+	/* Stop the server */
+	test_mg_stop(ctx, __LINE__);
 
-	ck_assert_str_eq(client_err, "");
-	ck_assert(client_conn != NULL);
+	mark_point();
+}
+END_TEST
 
-	mg_printf(client_conn, "GET /something/not/existing HTTP/1.0\r\n\r\n");
-	client_res =
-	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
-	ck_assert_int_ge(client_res, 0);
-	ck_assert_str_eq(client_err, "");
-	client_ri = mg_get_response_info(client_conn);
-	ck_assert(client_ri != NULL);
 
-	ck_assert_int_eq(client_ri->status_code, 200);
+#if !defined(NO_FILES)
+START_TEST(test_throttle_shared)
+{
+	/* Two downloads of a static file share a limit of 20 kB/s. The file is
+	 * sent in slices, using sendfile if available. */
+	struct mg_context *ctx;
+	const char *OPTIONS[] = {"listening_ports",
+	                         "8080",
+	                         "document_root",
+	                         ".",
+	                         "throttle",
+	                         "/throttle_shared=20k/shared",
+	                         NULL};
+	struct mg_connection *client[2];
+	const struct mg_response_info *client_ri;
+	const int file_size = 40 * 1024;
+	char *content, *buf, ebuf[256];
+	int i, n, len;
+	time_t t0, t1;
+	FILE *f;
 
-	client_res = (int)mg_read(client_conn, client_err, sizeof(client_err));
-	mg_close_connection(client_conn);
-	ck_assert_int_eq(client_res, 7);
-	client_err[8] = 0;
-	ck_assert_str_eq(client_err, "err-all");
-	test_sleep(1);
+	mark_point();
 
-	/* Create an error4xx.htm file */
-	f = fopen("error4xx.htm", "wt");
+	content = (char *)malloc((size_t)file_size);
+	buf = (char *)malloc((size_t)file_size);
+	ck_assert(content != NULL);
+	ck_assert(buf != NULL);
+	for (i = 0; i < file_size; i++) {
+		content[i] = (char)('a' + (i * 7 + i / 4096) % 26);
+	}
+	f = fopen("throttle_shared.bin", "wb");
 	ck_assert(f != NULL);
-	(void)fprintf(f, "err-4xx");
-	(void)fclose(f);
+	ck_assert_int_eq((int)fwrite(content, 1, (size_t)file_size, f), file_size);
+	fclose(f);
 
+	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
 
-	/* Ask for something not existing - should get error4xx.htm */
-	memset(client_err, 0, sizeof(client_err));
-	client_conn =
-	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+	t0 = time(NULL);
+	for (i = 0; i < 2; i++) {
+		client[i] = mg_connect_client("127.0.0.1", 8080, 0, ebuf, sizeof(ebuf));
+		ck_assert(client[i] != NULL);
+		mg_printf(client[i],
+		          "GET /throttle_shared.bin HTTP/1.0\r\n\r\n");
+	}
+	for (i = 0; i < 2; i++) {
+		ck_assert_int_ge(mg_get_response(client[i], ebuf, sizeof(ebuf), 10000),
+		                 0);
+		client_ri = mg_get_response_info(client[i]);
+		ck_assert(client_ri != NULL);
+		ck_assert_int_eq(client_ri->status_code, 200);
+		len = 0;
+		while ((n = mg_read(client[i], buf + len, (size_t)(file_size - len)))
+		       > 0) {
+			len += n;
+		}
+		mg_close_connection(client[i]);
+		ck_assert_int_eq(len, file_size);
+		ck_assert(!memcmp(buf, content, (size_t)file_size));
+	}
+	t1 = time(NULL);
 
-	ck_assert_str_eq(client_err, "");
-	ck_assert(client_conn != NULL);
+	/* 80 kB at 20 kB/s for both downloads together take 4 seconds, less
+	 * the initial burst. The resolution of time() is 1 second. */
+	ck_assert_int_ge((int)(t1 - t0), 3);
 
-	mg_printf(client_conn, "GET /something/not/existing HTTP/1.0\r\n\r\n");
-	client_res =
-	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
-	ck_assert_int_ge(client_res, 0);
-	ck_assert_str_eq(client_err, "");
-	client_ri = mg_get_response_info(client_conn);
-	ck_assert(client_ri != NULL);
+	test_mg_stop(ctx, __LINE__);
+	(void)remove("throttle_shared.bin");
+	free(content);
+	free(buf);
 
-	ck_assert_int_eq(client_ri->status_code, 200);
+	mark_point();
+}
+END_TEST
+#endif
 
-	client_res = (int)mg_read(client_conn, client_err, sizeof(client_err));
-	mg_close_connection(client_conn);
-	ck_assert_int_eq(client_res, 7);
-	client_err[8] = 0;
-	ck_assert_str_eq(client_err, "err-4xx");
-	test_sleep(1);
 
-	/* Create an error404.htm file */
-	f = fopen("error404.htm", "wt");
-	ck_assert(f != NULL);
-	(void)fprintf(f, "err-404");
-	(void)fclose(f);
+static int
+client_limits_get(void)
+{
+	struct mg_connection *conn;
+	int status;
 
+	conn = test_http_request(
+	    0, NULL, 0, NULL, "GET /client_limits_test.txt HTTP/1.0\r\n\r\n");
+	status = mg_get_response_info(conn)->status_code;
+	mg_close_connection(conn);
+	return status;
+}
 
-	/* Ask for something not existing - should get error404.htm */
-	memset(client_err, 0, sizeof(client_err));
-	client_conn =
-	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
 
-	ck_assert_str_eq(client_err, "");
-	ck_assert(client_conn != NULL);
+START_TEST(test_client_limits)
+{
+	struct mg_context *ctx;
+	const char *OPTIONS[] = {"listening_ports",
+	                         "8080",
+	                         "document_root",
+	                         ".",
+	                         "max_connections_per_ip",
+	                         "2",
+	                         NULL,
+	                         NULL,
+	                         NULL};
+	struct mg_connection *idle[2];
+	char ebuf[256];
+	int i, status[6], num_429;
+	FILE *f;
 
-	mg_printf(client_conn, "GET /something/not/existing HTTP/1.0\r\n\r\n");
-	client_res =
-	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
-	ck_assert_int_ge(client_res, 0);
-	ck_assert_str_eq(client_err, "");
-	client_ri = mg_get_response_info(client_conn);
-	ck_assert(client_ri != NULL);
+	mark_point();
 
-	ck_assert_int_eq(client_ri->status_code, 200);
+	f = fopen("client_limits_test.txt", "w");
+	ck_assert(f != NULL);
+	fputs("ok", f);
+	fclose(f);
 
-	client_res = (int)mg_read(client_conn, client_err, sizeof(client_err));
-	mg_close_connection(client_conn);
-	ck_assert_int_eq(client_res, 7);
-	client_err[8] = 0;
-	ck_assert_str_eq(client_err, "err-404");
+	/* Two idle connections from 127.0.0.1 are allowed, the third one is
+	 * rejected without being handled by a worker thread */
+	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
+	for (i = 0; i < 2; i++) {
+		idle[i] = mg_connect_client("127.0.0.1", 8080, 0, ebuf, sizeof(ebuf));
+		ck_assert(idle[i] != NULL);
+	}
 	test_sleep(1);
+	ck_assert_int_eq(client_limits_get(), 503);
 
+	/* Connections are counted until they are closed */
+	mg_close_connection(idle[0]);
+	test_sleep(1);
+	ck_assert_int_eq(client_limits_get(), 200);
+	mg_close_connection(idle[1]);
+	test_mg_stop(ctx, __LINE__);
 
-	/* Ask in a malformed way - should get error4xx.htm */
-	memset(client_err, 0, sizeof(client_err));
-	client_conn =
-	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+	/* Three requests per second: new connections are rejected */
+	OPTIONS[4] = "max_request_rate_per_ip";
+	OPTIONS[5] = "3";
+	OPTIONS[6] = "enable_keep_alive";
+	OPTIONS[7] = "yes";
+	ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
+	num_429 = 0;
+	for (i = 0; i < 6; i++) {
+		status[i] = client_limits_get();
+		if (status[i] == 429) {
+			num_429++;
+		} else {
+			ck_assert_int_eq(status[i], 200);
+		}
+	}
+	ck_assert_int_eq(status[0], 200);
+	ck_assert_int_eq(status[1], 200);
+	ck_assert_int_eq(status[2], 200);
+	ck_assert_int_ge(num_429, 1);
+
+	/* The rate is lower again after some time. Requests on a keep-alive
+	 * connection are rejected as well, and the connection is closed. */
+	test_sleep(3);
+	idle[0] = mg_connect_client("127.0.0.1", 8080, 0, ebuf, sizeof(ebuf));
+	ck_assert(idle[0] != NULL);
+	num_429 = 0;
+	for (i = 0; (i < 6) && (num_429 == 0); i++) {
+		mg_printf(idle[0],
+		          "GET /client_limits_test.txt HTTP/1.1\r\n"
+		          "Host: 127.0.0.1\r\n\r\n");
+		ck_assert_int_ge(mg_get_response(idle[0], ebuf, sizeof(ebuf), 10000),
+		                 0);
+		status[i] = mg_get_response_info(idle[0])->status_code;
+		if (status[i] == 429) {
+			num_429++;
+		} else {
+			ck_assert_int_eq(status[i], 200);
+			while (mg_read(idle[0], ebuf, sizeof(ebuf)) > 0) {
+				/* skip the body */
+			}
+		}
+	}
+	ck_assert_int_ge(i, 4);
+	ck_assert_int_eq(num_429, 1);
+	mg_close_connection(idle[0]);
+	test_mg_stop(ctx, __LINE__);
+	(void)remove("client_limits_test.txt");
 
-	ck_assert_str_eq(client_err, "");
-	ck_assert(client_conn != NULL);
+	mark_point();
+}
+END_TEST
 
-	mg_printf(client_conn, "Gimme some file!\r\n\r\n");
-	client_res =
-	    mg_get_response(client_conn, client_err, sizeof(client_err), 10000);
-	ck_assert_int_ge(client_res, 0);
-	ck_assert_str_eq(client_err, "");
-	client_ri = mg_get_response_info(client_conn);
-	ck_assert(client_ri != NULL);
 
-	ck_assert_int_eq(client_ri->status_code, 200);
+#if defined(USE_WEBSOCKET) && defined(__linux__)
+static int reactor_close_count;
+static int reactor_closed_count;
 
-	client_res = (int)mg_read(client_conn, client_err, sizeof(client_err));
-	mg_close_connection(client_conn);
-	ck_assert_int_eq(client_res, 7);
-	client_err[8] = 0;
-	ck_assert_str_eq(client_err, "err-4xx");
-	test_sleep(1);
 
+static int
+reactor_is_websocket(const struct mg_connection *conn)
+{
+	const struct mg_request_info *ri = mg_get_request_info(conn);
 
-	/* Remove all error files created by this test */
-	(void)remove("error.htm");
-	(void)remove("error4xx.htm");
-	(void)remove("error404.htm");
+	return (ri != NULL) && (ri->local_uri != NULL)
+	       && !strcmp(ri->local_uri, "/websocket");
+}
 
 
-	/* Stop the server */
-	test_mg_stop(ctx, __LINE__);
+static void
+reactor_connection_close(const struct mg_connection *conn)
+{
+	if (reactor_is_websocket(conn)) {
+		mg_lock_context(mg_get_context(conn));
+		reactor_close_count++;
+		mg_unlock_context(mg_get_context(conn));
+	}
+}
 
 
-	/* HTTP 1.1 GET request - must not work, since server is already stopped  */
-	memset(client_err, 0, sizeof(client_err));
-	client_conn =
-	    mg_connect_client("127.0.0.1", 8080, 0, client_err, sizeof(client_err));
+static void
+reactor_connection_closed(const struct mg_connection *conn)
+{
+	if (reactor_is_websocket(conn)) {
+		mg_lock_context(mg_get_context(conn));
+		reactor_closed_count++;
+		mg_unlock_context(mg_get_context(conn));
+	}
+}
 
-	ck_assert(client_conn == NULL);
-	ck_assert_str_ne(client_err, "");
 
-	test_sleep(1);
+START_TEST(test_websocket_reactor)
+{
+	struct mg_context *ctx;
+	struct mg_callbacks callbacks;
+	const char *OPTIONS[] = {"listening_ports",
+	                         "8080",
+	                         "num_threads",
+	                         "2",
+	                         "websocket_dispatch_threads",
+	                         "2",
+	                         NULL};
+	struct tclient_data client_data[4];
+	struct mg_connection *client[4];
+	struct mg_connection *conn;
+	char ebuf[256];
+	int i;
 
 	mark_point();
-}
-END_TEST
 
+	/* Count the callbacks of the websocket connections */
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.connection_close = reactor_connection_close;
+	callbacks.connection_closed = reactor_connection_closed;
+	reactor_close_count = 0;
+	reactor_closed_count = 0;
 
-START_TEST(test_error_log_file)
-{
-	/* Server var */
-	struct mg_context *ctx;
-	const char *OPTIONS[32];
-	int opt_cnt = 0;
+	ctx = test_mg_start(&callbacks, NULL, OPTIONS, __LINE__);
+	ck_assert(ctx != NULL);
+	mg_set_websocket_handler(ctx,
+	                         "/websocket",
+	                         websock_server_connect,
+	                         websock_server_ready,
+	                         websock_server_data,
+	                         websock_server_close,
+	                         (void *)(ptrdiff_t)7531);
+	for (i = 0; i < long_ws_buf_len_64; i++) {
+		long_ws_buf[i] = (char)(i * 7);
+	}
 
-	/* Client var */
-	struct mg_connection *client;
-	char client_err_buf[256];
-	char client_data_buf[256];
-	const struct mg_response_info *client_ri;
+	/* More websocket clients than worker threads */
+	for (i = 0; i < 4; i++) {
+		memset(&client_data[i], 0, sizeof(client_data[i]));
+		client_data[i].clientId = i + 1;
+		client[i] = mg_connect_websocket_client("127.0.0.1",
+		                                        8080,
+		                                        0,
+		                                        ebuf,
+		                                        sizeof(ebuf),
+		                                        "/websocket",
+		                                        NULL,
+		                                        websocket_client_data_handler,
+		                                        websocket_client_close_handler,
+		                                        &client_data[i]);
+		ck_assert(client[i] != NULL);
+		wait_not_null(&(client_data[i].data)); /* welcome message */
+		ck_assert_uint_eq(client_data[i].len, websocket_welcome_msg_len);
+		free(client_data[i].data);
+		client_data[i].data = NULL;
+	}
 
-	/* File content check var */
-	FILE *f;
-	char buf[1024];
-	int len, ok;
+	/* The worker threads are still available for HTTP requests */
+	conn = mg_download("127.0.0.1",
+	                   8080,
+	                   0,
+	                   ebuf,
+	                   sizeof(ebuf),
+	                   "%s",
+	                   "GET /websocket_reactor_missing.txt HTTP/1.0\r\n\r\n");
+	ck_assert(conn != NULL);
+	ck_assert_int_eq(mg_get_response_info(conn)->status_code, 404);
+	mg_close_connection(conn);
 
-	mark_point();
+	for (i = 0; i < 4; i++) {
+		mg_websocket_client_write(client[i],
+		                          MG_WEBSOCKET_OPCODE_TEXT,
+		                          "data1",
+		                          5);
+	}
+	for (i = 0; i < 4; i++) {
+		wait_not_null(&(client_data[i].data));
+		ck_assert_uint_eq(client_data[i].len, 3);
+		ck_assert(!memcmp(client_data[i].data, "ok1", 3));
+		free(client_data[i].data);
+		client_data[i].data = NULL;
+	}
 
-	/* Set options and start server */
-	OPTIONS[opt_cnt++] = "listening_ports";
-	OPTIONS[opt_cnt++] = "8080";
-	OPTIONS[opt_cnt++] = "error_log_file";
-	OPTIONS[opt_cnt++] = "error.log";
-	OPTIONS[opt_cnt++] = "access_log_file";
-	OPTIONS[opt_cnt++] = "access.log";
-#if !defined(NO_FILES)
-	OPTIONS[opt_cnt++] = "document_root";
-	OPTIONS[opt_cnt++] = ".";
+	/* A message received in several parts */
+	mg_websocket_client_write(client[0],
+	                          MG_WEBSOCKET_OPCODE_BINARY,
+	                          long_ws_buf,
+	                          long_ws_buf_len_64);
+	wait_not_null(&(client_data[0].data));
+	ck_assert_uint_eq(client_data[0].len, long_ws_buf_len_64);
+	ck_assert(!memcmp(client_data[0].data, long_ws_buf, long_ws_buf_len_64));
+	free(client_data[0].data);
+	client_data[0].data = NULL;
+
+	/* Close the first two clients, the server closes the others */
+	for (i = 0; i < 2; i++) {
+		mg_websocket_client_write(client[i], MG_WEBSOCKET_OPCODE_TEXT, "bye", 3);
+		wait_not_null(&(client_data[i].data));
+		ck_assert_uint_eq(client_data[i].len, websocket_goodbye_msg_len);
+		free(client_data[i].data);
+		client_data[i].data = NULL;
+		mg_close_connection(client[i]);
+		ck_assert_int_eq(client_data[i].closed, 1);
+	}
+	test_sleep(1);
+	ck_assert_int_eq(reactor_close_count, 2);
+	ck_assert_int_eq(reactor_closed_count, 2);
+	test_mg_stop(ctx, __LINE__);
+
+	/* Exactly one close/closed pair for every websocket */
+	ck_assert_int_eq(reactor_close_count, 4);
+	ck_assert_int_eq(reactor_closed_count, 4);
+
+	for (i = 2; i < 4; i++) {
+		mg_close_connection(client[i]);
+	}
+
+	mark_point();
+}
+END_TEST
 #endif
-	OPTIONS[opt_cnt] = NULL;
 
-	ctx = test_mg_start(NULL, 0, OPTIONS, __LINE__);
-	ck_assert(ctx != NULL);
 
-	/* Remove log files (they may exist from previous incomplete runs of
-	 * this test) */
-	(void)remove("error.log");
-	(void)remove("access.log");
+#if defined(USE_WEBSOCKET)
+static struct mg_connection *bcast_conns[8];
+static int bcast_num_conns;
 
-	/* connect client */
-	memset(client_err_buf, 0, sizeof(client_err_buf));
-	memset(client_data_buf, 0, sizeof(client_data_buf));
 
-	client = mg_download("127.0.0.1",
-	                     8080,
-	                     0,
-	                     client_err_buf,
-	                     sizeof(client_err_buf),
-	                     "GET /not_existing_file.ext HTTP/1.0\r\n\r\n");
+static void
+bcast_server_ready(struct mg_connection *conn, void *udata)
+{
+	struct mg_context *ctx = mg_get_context(conn);
 
-	ck_assert(ctx != NULL);
-	ck_assert_str_eq(client_err_buf, "");
+	ck_assert_int_eq(mg_websocket_channel_join(conn, "news"), 0);
+	ck_assert_int_eq(mg_websocket_channel_join(conn, "news"), 0);
+	mg_lock_context(ctx);
+	if (bcast_num_conns < 8) {
+		bcast_conns[bcast_num_conns++] = conn;
+	}
+	mg_unlock_context(ctx);
+	(void)udata;
+}
 
-	client_ri = mg_get_response_info(client);
 
-	/* Check status - should be 404 Not Found */
-	ck_assert(client_ri != NULL);
-	ck_assert_int_eq(client_ri->status_code, 404);
+static int
+bcast_server_data(struct mg_connection *conn,
+                  int bits,
+                  char *data,
+                  size_t data_len,
+                  void *udata)
+{
+	if ((data_len == 5) && !memcmp(data, "leave", 5)) {
+		ck_assert_int_eq(mg_websocket_channel_leave(conn, "news"), 0);
+		ck_assert_int_eq(mg_websocket_channel_leave(conn, "news"), -1);
+		mg_websocket_write(conn, MG_WEBSOCKET_OPCODE_TEXT, "left", 4);
+	}
+	(void)bits;
+	(void)udata;
+	return 1;
+}
 
-	/* Get body data (could exist, but does not have to) */
-	len = mg_read(client, client_data_buf, sizeof(client_data_buf));
-	ck_assert_int_ge(len, 0);
 
-	/* Close the client connection */
-	mg_close_connection(client);
+/* Lock the connections by another thread: the mutex is recursive */
+static void *volatile bcast_locked;
+static volatile int bcast_release;
 
-	/* Stop the server */
-	test_mg_stop(ctx, __LINE__);
 
+static void *
+bcast_lock_thread(void *param)
+{
+	int i;
 
-	/* Check access.log */
-	memset(buf, 0, sizeof(buf));
-	f = fopen("access.log", "r");
-	ck_assert_msg(f != NULL, "Cannot open access log file");
-	ok = (NULL != fgets(buf, sizeof(buf) - 1, f));
-	(void)fclose(f);
-	ck_assert_msg(ok, "Cannot read access log file");
-	len = (int)strlen(buf);
-	ck_assert_int_gt(len, 0);
-	ok = (NULL != strstr(buf, "not_existing_file.ext"));
-	ck_assert_msg(ok, "Did not find uri in access log file");
-	ok = (NULL != strstr(buf, "404"));
-	ck_assert_msg(ok, "Did not find HTTP status code in access log file");
+	for (i = 0; i < 3; i++) {
+		mg_lock_connection(bcast_conns[i]);
+	}
+	bcast_locked = param;
+	while (!bcast_release) {
+		test_sleep(1);
+	}
+	for (i = 0; i < 3; i++) {
+		mg_unlock_connection(bcast_conns[i]);
+	}
+	bcast_locked = NULL;
+	return NULL;
+}
 
-	/* Check error.log */
-	memset(buf, 0, sizeof(buf));
-	f = fopen("error.log", "r");
-	if (f) {
-		(void)fgets(buf, sizeof(buf) - 1, f);
-		fclose(f);
+
+static int
+bcast_wait_conns(struct mg_context *ctx, int num)
+{
+	int i, n = 0;
+
+	for (i = 0; i < 10; i++) {
+		mg_lock_context(ctx);
+		n = bcast_num_conns;
+		mg_unlock_context(ctx);
+		if (n >= num) {
+			break;
+		}
+		test_sleep(1);
 	}
-	ck_assert_msg(f == NULL,
-	              "Should not create error log file on 404, but got [%s]",
-	              buf);
+	return n;
+}
 
-	/* Remove log files */
-	(void)remove("error.log");
-	(void)remove("access.log");
 
-	/* Start server with bad options */
-	ck_assert_str_eq(OPTIONS[0], "listening_ports");
-	OPTIONS[1] = "bad !"; /* no r or s in string */
+START_TEST(test_websocket_broadcast)
+{
+	struct mg_context *ctx;
+	const char *OPTIONS[] = {"listening_ports",
+	                         "8080",
+	                         "websocket_broadcast_timeout_ms",
+	                         "500",
+	                         NULL,
+	                         NULL,
+	                         NULL};
+	struct tclient_data client_data[3];
+	struct mg_connection *client[3];
+	struct mg_connection *slow;
+	char ebuf[256];
+	char *big;
+	int i, run, ret;
 
-	ctx = test_mg_start(NULL, 0, OPTIONS, 0);
-	ck_assert_msg(
-	    ctx == NULL,
-	    "Should not be able to start server with bad port configuration");
+	mark_point();
 
-	/* Check access.log */
-	memset(buf, 0, sizeof(buf));
-	f = fopen("access.log", "r");
-	if (f) {
-		(void)fgets(buf, sizeof(buf) - 1, f);
-		fclose(f);
+	for (i = 0; i < long_ws_buf_len_64; i++) {
+		long_ws_buf[i] = (char)(i * 7);
 	}
-	ck_assert_msg(
-	    f == NULL,
-	    "Should not create access log file if start fails, but got [%s]",
-	    buf);
+	big = (char *)malloc(1024 * 1024);
+	ck_assert(big != NULL);
+	memset(big, 'x', 1024 * 1024);
+
+	/* Connections served by worker threads, and by the event loop */
+	for (run = 0; run < 2; run++) {
+#if defined(__linux__)
+		if (run == 1) {
+			OPTIONS[4] = "websocket_dispatch_threads";
+			OPTIONS[5] = "2";
+		}
+#else
+		if (run == 1) {
+			break;
+		}
+#endif
+		bcast_num_conns = 0;
+		ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+		ck_assert(ctx != NULL);
+		mg_set_websocket_handler(ctx,
+		                         "/broadcast",
+		                         NULL,
+		                         bcast_server_ready,
+		                         bcast_server_data,
+		                         NULL,
+		                         NULL);
+
+		ck_assert_int_eq(
+		    mg_websocket_channel_broadcast(ctx, "news", 1, "none", 4), 0);
+
+		for (i = 0; i < 3; i++) {
+			memset(&client_data[i], 0, sizeof(client_data[i]));
+			client_data[i].clientId = i + 1;
+			client[i] =
+			    mg_connect_websocket_client("127.0.0.1",
+			                                8080,
+			                                0,
+			                                ebuf,
+			                                sizeof(ebuf),
+			                                "/broadcast",
+			                                NULL,
+			                                websocket_client_data_handler,
+			                                websocket_client_close_handler,
+			                                &client_data[i]);
+			ck_assert(client[i] != NULL);
+		}
+		ck_assert_int_eq(bcast_wait_conns(ctx, 3), 3);
+
+		/* Send to all members of a channel */
+		ret = mg_websocket_channel_broadcast(
+		    ctx, "news", MG_WEBSOCKET_OPCODE_TEXT, "hello", 5);
+		ck_assert_int_eq(ret, 3);
+		for (i = 0; i < 3; i++) {
+			wait_not_null(&(client_data[i].data));
+			ck_assert_uint_eq(client_data[i].len, 5);
+			ck_assert(!memcmp(client_data[i].data, "hello", 5));
+			free(client_data[i].data);
+			client_data[i].data = NULL;
+		}
 
-	/* Check error.log */
-	memset(buf, 0, sizeof(buf));
-	f = fopen("error.log", "r");
-	ck_assert_msg(f != NULL, "Cannot open access log file");
-	ok = (NULL != fgets(buf, sizeof(buf) - 1, f));
-	(void)fclose(f);
-	ck_assert_msg(ok, "Cannot read access log file");
-	len = (int)strlen(buf);
-	ck_assert_int_gt(len, 0);
-	ok = (NULL != strstr(buf, "port"));
-	ck_assert_msg(ok, "Did not find port as error reason in error log file");
+		/* Send to a list of connections */
+		ret = mg_websocket_broadcast(bcast_conns,
+		                             3,
+		                             MG_WEBSOCKET_OPCODE_BINARY,
+		                             long_ws_buf,
+		                             long_ws_buf_len_64);
+		ck_assert_int_eq(ret, 3);
+		for (i = 0; i < 3; i++) {
+			wait_not_null(&(client_data[i].data));
+			ck_assert_uint_eq(client_data[i].len, long_ws_buf_len_64);
+			ck_assert(
+			    !memcmp(client_data[i].data, long_ws_buf, long_ws_buf_len_64));
+			free(client_data[i].data);
+			client_data[i].data = NULL;
+		}
 
+		/* Leave the channel */
+		mg_websocket_client_write(client[0],
+		                          MG_WEBSOCKET_OPCODE_TEXT,
+		                          "leave",
+		                          5);
+		wait_not_null(&(client_data[0].data));
+		ck_assert_uint_eq(client_data[0].len, 4);
+		free(client_data[0].data);
+		client_data[0].data = NULL;
+		ret = mg_websocket_channel_broadcast(
+		    ctx, "news", MG_WEBSOCKET_OPCODE_TEXT, "again", 5);
+		ck_assert_int_eq(ret, 2);
+		for (i = 1; i < 3; i++) {
+			wait_not_null(&(client_data[i].data));
+			free(client_data[i].data);
+			client_data[i].data = NULL;
+		}
 
-	/* Remove log files */
-	(void)remove("error.log");
-	(void)remove("access.log");
+		/* Members that cannot be locked miss the message, but they are
+		 * not closed */
+		bcast_locked = NULL;
+		bcast_release = 0;
+		ck_assert_int_eq(mg_start_thread(bcast_lock_thread, &bcast_locked),
+		                 0);
+		wait_not_null(&bcast_locked);
+		ret = mg_websocket_channel_broadcast(
+		    ctx, "news", MG_WEBSOCKET_OPCODE_TEXT, "skip", 4);
+		ck_assert_int_eq(ret, 0);
+		bcast_release = 1;
+		for (i = 0; (i < 10) && (bcast_locked != NULL); i++) {
+			test_sleep(1);
+		}
+		ck_assert(bcast_locked == NULL);
+		ret = mg_websocket_channel_broadcast(
+		    ctx, "news", MG_WEBSOCKET_OPCODE_TEXT, "after", 5);
+		ck_assert_int_eq(ret, 2);
+		for (i = 1; i < 3; i++) {
+			wait_not_null(&(client_data[i].data));
+			ck_assert_uint_eq(client_data[i].len, 5);
+			ck_assert(!memcmp(client_data[i].data, "after", 5));
+			free(client_data[i].data);
+			client_data[i].data = NULL;
+		}
+
+		/* Closed connections leave all channels */
+		for (i = 0; i < 3; i++) {
+			mg_close_connection(client[i]);
+		}
+		test_sleep(1);
+		ck_assert_int_eq(mg_websocket_channel_broadcast(
+		                     ctx, "news", MG_WEBSOCKET_OPCODE_TEXT, "x", 1),
+		                 0);
+
+		/* A client not reading any data is closed */
+		slow = mg_connect_client("127.0.0.1", 8080, 0, ebuf, sizeof(ebuf));
+		ck_assert(slow != NULL);
+		mg_printf(slow,
+		          "GET /broadcast HTTP/1.1\r\n"
+		          "Host: 127.0.0.1\r\n"
+		          "Upgrade: websocket\r\n"
+		          "Connection: Upgrade\r\n"
+		          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+		          "Sec-WebSocket-Version: 13\r\n\r\n");
+		ck_assert_int_ge(mg_get_response(slow, ebuf, sizeof(ebuf), 10000), 0);
+		ck_assert_int_eq(mg_get_response_info(slow)->status_code, 101);
+		ck_assert_int_eq(bcast_wait_conns(ctx, 4), 4);
+		for (i = 0; i < 100; i++) {
+			ret = mg_websocket_channel_broadcast(
+			    ctx, "news", MG_WEBSOCKET_OPCODE_BINARY, big, 1024 * 1024);
+			if (ret != 1) {
+				break;
+			}
+		}
+		ck_assert_int_eq(ret, 0);
+		test_sleep(1);
+		ck_assert_int_eq(mg_websocket_channel_broadcast(
+		                     ctx, "news", MG_WEBSOCKET_OPCODE_TEXT, "x", 1),
+		                 0);
+		mg_close_connection(slow);
+
+		test_mg_stop(ctx, __LINE__);
+	}
+	free(big);
 
 	mark_point();
 }
 END_TEST
+#endif
+
+
+#if defined(USE_WEBSOCKET)
+static volatile int sq_received;
+static volatile int sq_errors;
 
 
 static int
-test_throttle_begin_request(struct mg_connection *conn)
+sq_client_data(struct mg_connection *conn,
+               int flags,
+               char *data,
+               size_t data_len,
+               void *udata)
 {
-	const struct mg_request_info *ri;
-	long unsigned len = 1024 * 10;
-	const char *block = "0123456789";
-	unsigned long i, blocklen;
+	if (flags == (int)(128 | MG_WEBSOCKET_OPCODE_BINARY)) {
+		/* Messages must arrive complete and in order */
+		if ((data_len != 10000)
+		    || ((unsigned char)data[0] != (unsigned char)sq_received)) {
+			sq_errors++;
+		}
+		sq_received++;
+	}
+	(void)conn;
+	(void)udata;
+	return 1;
+}
 
-	ck_assert(conn != NULL);
-	ri = mg_get_request_info(conn);
-	ck_assert(ri != NULL);
 
-	ck_assert_str_eq(ri->request_method, "GET");
-	ck_assert_str_eq(ri->request_uri, "/throttle");
-	ck_assert_str_eq(ri->local_uri, "/throttle");
-	ck_assert_str_eq(ri->http_version, "1.0");
-	ck_assert_str_eq(ri->query_string, "q");
-	ck_assert_str_eq(ri->remote_addr, "127.0.0.1");
+START_TEST(test_websocket_send_queue)
+{
+	struct mg_context *ctx;
+	const char *OPTIONS[] = {"listening_ports",
+	                         "8080",
+	                         "websocket_send_queue_size",
+	                         "65536",
+	                         "websocket_send_queue_policy",
+	                         "block",
+	                         NULL};
+	static const char *policies[] = {"block", "drop", "close"};
+	struct mg_websocket_send_queue_info info;
+	struct mg_connection *client, *slow;
+	char ebuf[256];
+	char msg[10000];
+	char *big;
+	int i, run, ret;
+	time_t t0;
 
-	mg_printf(conn,
-	          "HTTP/1.1 200 OK\r\n"
-	          "Content-Length: %lu\r\n"
-	          "Connection: close\r\n\r\n",
-	          len);
+	mark_point();
 
-	blocklen = (unsigned long)strlen(block);
+	big = (char *)malloc(1024 * 1024);
+	ck_assert(big != NULL);
+	memset(big, 'x', 1024 * 1024);
+
+	for (run = 0; run < 3; run++) {
+		OPTIONS[5] = policies[run];
+		bcast_num_conns = 0;
+		ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+		ck_assert(ctx != NULL);
+		mg_set_websocket_handler(ctx,
+		                         "/queue",
+		                         NULL,
+		                         bcast_server_ready,
+		                         bcast_server_data,
+		                         NULL,
+		                         NULL);
+
+		if (run == 0) {
+			/* A client reading all data gets all messages in order */
+			sq_received = 0;
+			sq_errors = 0;
+			client = mg_connect_websocket_client("127.0.0.1",
+			                                     8080,
+			                                     0,
+			                                     ebuf,
+			                                     sizeof(ebuf),
+			                                     "/queue",
+			                                     NULL,
+			                                     sq_client_data,
+			                                     NULL,
+			                                     NULL);
+			ck_assert(client != NULL);
+			ck_assert_int_eq(bcast_wait_conns(ctx, 1), 1);
+
+			ck_assert_int_eq(
+			    mg_websocket_get_send_queue_info(bcast_conns[0], &info), 0);
+			ck_assert_uint_eq(info.high_water, 65536);
+			for (i = 0; i < 200; i++) {
+				memset(msg, i, sizeof(msg));
+				ret = mg_websocket_write(bcast_conns[0],
+				                         MG_WEBSOCKET_OPCODE_BINARY,
+				                         msg,
+				                         sizeof(msg));
+				ck_assert_int_eq(ret, (int)sizeof(msg));
+			}
+			for (i = 0; (i < 100) && (sq_received < 200); i++) {
+				test_sleep(1);
+			}
+			ck_assert_int_eq(sq_received, 200);
+			ck_assert_int_eq(sq_errors, 0);
+			ck_assert_int_eq(
+			    mg_websocket_get_send_queue_info(bcast_conns[0], &info), 0);
+			ck_assert_uint_eq(info.queued_bytes, 0);
+			ck_assert_uint_eq(info.queued_frames, 0);
+			ck_assert(info.dropped_frames == 0);
+			mg_close_connection(client);
 
-	for (i = 0; i < len; i += blocklen) {
-		mg_write(conn, block, blocklen);
+		} else {
+			/* A client not reading any data */
+			slow = mg_connect_client("127.0.0.1", 8080, 0, ebuf, sizeof(ebuf));
+			ck_assert(slow != NULL);
+			mg_printf(slow,
+			          "GET /queue HTTP/1.1\r\n"
+			          "Host: 127.0.0.1\r\n"
+			          "Upgrade: websocket\r\n"
+			          "Connection: Upgrade\r\n"
+			          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+			          "Sec-WebSocket-Version: 13\r\n\r\n");
+			ck_assert_int_ge(mg_get_response(slow, ebuf, sizeof(ebuf), 10000),
+			                 0);
+			ck_assert_int_eq(mg_get_response_info(slow)->status_code, 101);
+			ck_assert_int_eq(bcast_wait_conns(ctx, 1), 1);
+
+			/* Writing does not block */
+			t0 = time(NULL);
+			for (i = 0; i < 100; i++) {
+				ret = mg_websocket_write(bcast_conns[0],
+				                         MG_WEBSOCKET_OPCODE_BINARY,
+				                         big,
+				                         1024 * 1024);
+				if (ret != 1024 * 1024) {
+					break;
+				}
+			}
+			ck_assert_int_lt(i, 100);
+			ck_assert(difftime(time(NULL), t0) < 5.0);
+
+			if (run == 1) {
+				/* Dropped, the connection remains open */
+				ck_assert_int_eq(ret, 0);
+				ck_assert_int_eq(
+				    mg_websocket_get_send_queue_info(bcast_conns[0], &info),
+				    0);
+				ck_assert_uint_gt(info.queued_frames, 0);
+				ck_assert_uint_gt(info.queued_bytes, 0);
+				ck_assert(info.dropped_frames == 1);
+			} else {
+				/* Closed as a slow consumer */
+				ck_assert_int_eq(ret, -1);
+			}
+			mg_close_connection(slow);
+		}
+
+		test_mg_stop(ctx, __LINE__);
 	}
+	free(big);
 
 	mark_point();
-
-	return 987; /* Not a valid HTTP response code,
-	             * but it should be written to the log and passed to
-	             * end_request. */
 }
+END_TEST
+#endif
 
 
-static void
-test_throttle_end_request(const struct mg_connection *conn,
-                          int reply_status_code)
-{
-	const struct mg_request_info *ri;
+#if defined(USE_WEBSOCKET)
+static unsigned long long stream_received;
+static int stream_slices;
+static int stream_errors;
 
-	ck_assert(conn != NULL);
-	ri = mg_get_request_info(conn);
-	ck_assert(ri != NULL);
 
-	ck_assert_str_eq(ri->request_method, "GET");
-	ck_assert_str_eq(ri->request_uri, "/throttle");
-	ck_assert_str_eq(ri->local_uri, "/throttle");
-	ck_assert_str_eq(ri->http_version, "1.0");
-	ck_assert_str_eq(ri->query_string, "q");
-	ck_assert_str_eq(ri->remote_addr, "127.0.0.1");
+static int
+stream_server_data(struct mg_connection *conn,
+                   int bits,
+                   char *data,
+                   size_t data_len,
+                   unsigned long long offset,
+                   int final,
+                   void *udata)
+{
+	char reply[64];
+	size_t i;
 
-	ck_assert_int_eq(reply_status_code, 987);
+	if ((bits & 0x0f) != MG_WEBSOCKET_OPCODE_BINARY) {
+		return 1;
+	}
+	if (offset == 0) {
+		stream_received = 0;
+		stream_slices = 0;
+		stream_errors = 0;
+	}
+	/* Slices arrive in order, with the mask applied */
+	if (offset != stream_received) {
+		stream_errors++;
+	}
+	for (i = 0; i < data_len; i++) {
+		if (data[i] != (char)((offset + i) * 7)) {
+			stream_errors++;
+			break;
+		}
+	}
+	stream_received += data_len;
+	stream_slices++;
+
+	if (final) {
+		sprintf(reply,
+		        "%lu %i %i",
+		        (unsigned long)stream_received,
+		        stream_slices > 1,
+		        stream_errors);
+		mg_websocket_write(conn, MG_WEBSOCKET_OPCODE_TEXT, reply, strlen(reply));
+	}
+	(void)udata;
+	return 1;
 }
 
 
-START_TEST(test_throttle)
+static int
+stream_client_data(struct mg_connection *conn,
+                   int flags,
+                   char *data,
+                   size_t data_len,
+                   void *udata)
 {
-	/* Server var */
-	struct mg_context *ctx;
-	struct mg_callbacks callbacks;
-	const char *OPTIONS[32];
-	int opt_cnt = 0;
-
-	/* Client var */
-	struct mg_connection *client;
-	char client_err_buf[256];
-	char client_data_buf[256];
-	const struct mg_response_info *client_ri;
-
-	/* timing test */
-	int r, data_read;
-	time_t t0, t1;
-	double dt;
+	struct tclient_data *pclient_data = (struct tclient_data *)udata;
 
-	mark_point();
+	/* Store replies, the close frame (status 1009) is not checked */
+	if (flags == (int)(128 | MG_WEBSOCKET_OPCODE_TEXT)) {
+		char *reply = (char *)malloc(data_len + 1);
+		ck_assert(reply != NULL);
+		memcpy(reply, data, data_len);
+		pclient_data->len = data_len;
+		pclient_data->data = reply;
+	}
+	(void)conn;
+	return 1;
+}
 
 
-/* Set options and start server */
-#if !defined(NO_FILES)
-	OPTIONS[opt_cnt++] = "document_root";
-	OPTIONS[opt_cnt++] = ".";
-#endif
-	OPTIONS[opt_cnt++] = "listening_ports";
-	OPTIONS[opt_cnt++] = "8080";
-	OPTIONS[opt_cnt++] = "throttle";
-	OPTIONS[opt_cnt++] = "*=1k";
-	OPTIONS[opt_cnt] = NULL;
+#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+/* Compress data for permessage-deflate, as the server does: raw deflate,
+ * flushed, without the final 0x00 0x00 0xff 0xff bytes (RFC 7692, 7.2.1).
+ * Returns the size. */
+static size_t
+deflate_stream_data(unsigned char *out, size_t out_size, char *data, size_t len)
+{
+	zng_stream zs;
+	size_t n;
+
+	memset(&zs, 0, sizeof(zs));
+	ck_assert_int_eq(zng_deflateInit2(&zs,
+	                                  Z_BEST_COMPRESSION,
+	                                  Z_DEFLATED,
+	                                  -15,
+	                                  8,
+	                                  Z_DEFAULT_STRATEGY),
+	                 Z_OK);
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = (uInt)len;
+	zs.next_out = out;
+	zs.avail_out = (uInt)out_size;
+	ck_assert_int_eq(zng_deflate(&zs, Z_SYNC_FLUSH), Z_OK);
+	ck_assert_uint_eq(zs.avail_in, 0);
+	ck_assert_uint_gt(zs.avail_out, 0);
+	n = out_size - zs.avail_out - 4;
+	zng_deflateEnd(&zs);
+	return n;
+}
 
-	memset(&callbacks, 0, sizeof(callbacks));
-	callbacks.begin_request = test_throttle_begin_request;
-	callbacks.end_request = test_throttle_end_request;
 
-	ctx = test_mg_start(&callbacks, 0, OPTIONS, __LINE__);
-	ck_assert(ctx != NULL);
+/* Send a frame of less than 64 kB (with a zero mask). Return the result
+ * of mg_write. */
+static int
+deflate_stream_frame(struct mg_connection *conn,
+                     unsigned char bits,
+                     const unsigned char *data,
+                     size_t len)
+{
+	unsigned char *frame = (unsigned char *)malloc(len + 8);
+	int ret;
 
-	/* connect client */
-	memset(client_err_buf, 0, sizeof(client_err_buf));
-	memset(client_data_buf, 0, sizeof(client_data_buf));
+	ck_assert(frame != NULL);
+	ck_assert_uint_lt(len, 65536);
+	frame[0] = bits;
+	frame[1] = 0x80 | 126;
+	frame[2] = (unsigned char)(len >> 8);
+	frame[3] = (unsigned char)len;
+	memset(frame + 4, 0, 4);
+	memcpy(frame + 8, data, len);
+	mg_lock_connection(conn);
+	ret = mg_write(conn, frame, len + 8);
+	mg_unlock_connection(conn);
+	free(frame);
+	return ret;
+}
 
-	strcpy(client_err_buf, "reset-content");
-	client = mg_download("127.0.0.1",
-	                     8080,
-	                     0,
-	                     client_err_buf,
-	                     sizeof(client_err_buf),
-	                     "GET /throttle?q HTTP/1.0\r\n\r\n");
 
-	ck_assert(ctx != NULL);
-	ck_assert_str_eq(client_err_buf, "");
+/* Send the first len bytes of data as a compressed message, split into
+ * num_frames frames. Only the first frame has RSV1 set. If client_data is
+ * not NULL, wait for the reply to the first frame (stream_server_data does
+ * not reply to continuation frames). */
+static void
+deflate_stream_send(struct mg_connection *conn,
+                    char *data,
+                    size_t len,
+                    int num_frames,
+                    struct tclient_data *client_data)
+{
+	size_t out_size = len / 100 + 1024;
+	unsigned char *out = (unsigned char *)malloc(out_size);
+	size_t n, pos, frame_len;
+	int i, ret;
+
+	ck_assert(out != NULL);
+	n = deflate_stream_data(out, out_size, data, len);
+	for (i = 0, pos = 0; i < num_frames; i++, pos += frame_len) {
+		frame_len = (i < num_frames - 1) ? (n / num_frames) : (n - pos);
+		ret = deflate_stream_frame(
+		    conn,
+		    (unsigned char)(((i == num_frames - 1) ? 0x80 : 0)
+		                    | ((i == 0) ? 0x42 : 0)),
+		    out + pos,
+		    frame_len);
+		if (i < num_frames - 1) {
+			/* The last frame may fail, if the server closes the
+			 * connection at once */
+			ck_assert_int_eq(ret, (int)(frame_len + 8));
+		}
+		if ((client_data != NULL) && (i == 0) && (num_frames > 1)) {
+			/* The first frame is inflated on its own */
+			wait_not_null(&(client_data->data));
+			ck_assert_int_gt(atoi((char *)client_data->data), (int)n);
+			free(client_data->data);
+			client_data->data = NULL;
+		}
+	}
+	free(out);
+}
+#endif
 
-	client_ri = mg_get_response_info(client);
 
-	ck_assert(client_ri != NULL);
-	ck_assert_int_eq(client_ri->status_code, 200);
+START_TEST(test_websocket_stream)
+{
+	struct mg_context *ctx;
+	const char *OPTIONS[] = {"listening_ports",
+	                         "8080",
+	                         "websocket_max_message_size",
+	                         "1000000",
+	                         NULL,
+	                         NULL,
+	                         NULL};
+	struct tclient_data client_data;
+	struct mg_connection *client;
+	char ebuf[256];
+	char *big;
+	int i, run;
 
-	ck_assert_int_eq(client_ri->content_length, 1024 * 10);
+	mark_point();
 
-	data_read = 0;
-	t0 = time(NULL);
-	while (data_read < client_ri->content_length) {
-		r = mg_read(client, client_data_buf, sizeof(client_data_buf));
-		ck_assert_int_ge(r, 0);
-		data_read += r;
+	big = (char *)malloc(2000000);
+	ck_assert(big != NULL);
+	for (i = 0; i < 2000000; i++) {
+		big[i] = (char)(i * 7);
 	}
-	t1 = time(NULL);
-	dt = difftime(t1, t0) * 1000.0; /* Elapsed time in ms - in most systems
-	                                 * only with second resolution */
 
-	/* Time estimation: Data size is 10 kB, with 1 kB/s speed limit.
-	 * The first block (1st kB) is transferred immediately, the second
-	 * block (2nd kB) one second later, the third block (3rd kB) two
-	 * seconds later, .. the last block (10th kB) nine seconds later.
-	 * The resolution of time measurement using the "time" C library
-	 * function is 1 second, so we should add +/- one second tolerance.
-	 * Thus, download of 10 kB with 1 kB/s should not be faster than
-	 * 8 seconds. */
+	/* Connections served by worker threads, and by the event loop */
+	for (run = 0; run < 2; run++) {
+#if defined(__linux__)
+		if (run == 1) {
+			OPTIONS[4] = "websocket_dispatch_threads";
+			OPTIONS[5] = "2";
+		}
+#else
+		if (run == 1) {
+			break;
+		}
+#endif
+		ctx = test_mg_start(NULL, NULL, OPTIONS, __LINE__);
+		ck_assert(ctx != NULL);
+		mg_set_websocket_stream_handler(
+		    ctx, "/stream", NULL, NULL, stream_server_data, NULL, NULL);
+
+		memset(&client_data, 0, sizeof(client_data));
+		client = mg_connect_websocket_client("127.0.0.1",
+		                                     8080,
+		                                     0,
+		                                     ebuf,
+		                                     sizeof(ebuf),
+		                                     "/stream",
+		                                     NULL,
+		                                     stream_client_data,
+		                                     websocket_client_close_handler,
+		                                     &client_data);
+		ck_assert(client != NULL);
 
-	/* Check if there are at least 8 seconds */
-	ck_assert_int_ge((int)dt, 8 * 1000);
+		/* A message larger than the receive buffer arrives in slices */
+		mg_websocket_client_write(client,
+		                          MG_WEBSOCKET_OPCODE_BINARY,
+		                          big,
+		                          900000);
+		wait_not_null(&(client_data.data));
+		ck_assert_uint_eq(client_data.len, 10);
+		ck_assert(!memcmp(client_data.data, "900000 1 0", 10));
+		free(client_data.data);
+		client_data.data = NULL;
+
+		/* An empty message */
+		mg_websocket_client_write(client, MG_WEBSOCKET_OPCODE_BINARY, "", 0);
+		wait_not_null(&(client_data.data));
+		ck_assert_uint_eq(client_data.len, 5);
+		ck_assert(!memcmp(client_data.data, "0 0 0", 5));
+		free(client_data.data);
+		client_data.data = NULL;
+
+		/* A message exceeding websocket_max_message_size: the server
+		 * closes the connection */
+		mg_websocket_client_write(client,
+		                          MG_WEBSOCKET_OPCODE_BINARY,
+		                          big,
+		                          2000000);
+		for (i = 0; (i < 10) && (client_data.closed == 0); i++) {
+			test_sleep(1);
+		}
+		ck_assert_int_eq(client_data.closed, 1);
+		ck_assert_ptr_eq(client_data.data, NULL);
+		mg_close_connection(client);
 
-	/* Nothing left to read */
-	r = mg_read(client, client_data_buf, sizeof(client_data_buf));
-	ck_assert_int_eq(r, 0);
+#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+		/* Compressed messages: the inflated size counts for
+		 * websocket_max_message_size, not the size of the frame */
+		memset(&client_data, 0, sizeof(client_data));
+		client = mg_connect_websocket_client_extensions(
+		    "127.0.0.1",
+		    8080,
+		    0,
+		    ebuf,
+		    sizeof(ebuf),
+		    "/stream",
+		    NULL,
+		    "permessage-deflate",
+		    stream_client_data,
+		    websocket_client_close_handler,
+		    &client_data);
+		ck_assert(client != NULL);
 
-	/* Close the client connection */
-	mg_close_connection(client);
+		deflate_stream_send(client, big, 900000, 1, NULL);
+		wait_not_null(&(client_data.data));
+		ck_assert_uint_eq(client_data.len, 10);
+		ck_assert(!memcmp(client_data.data, "900000 0 0", 10));
+		free(client_data.data);
+		client_data.data = NULL;
+
+		/* Less than 20 kB, but 2 MB when inflated */
+		deflate_stream_send(client, big, 2000000, 1, NULL);
+		for (i = 0; (i < 10) && (client_data.closed == 0); i++) {
+			test_sleep(1);
+		}
+		ck_assert_int_eq(client_data.closed, 1);
+		ck_assert_ptr_eq(client_data.data, NULL);
+		mg_close_connection(client);
 
-	/* Stop the server */
-	test_mg_stop(ctx, __LINE__);
+		/* The inflated frames of a fragmented message count together:
+		 * each frame is about 400 kB when inflated, the message is
+		 * 1.2 MB. The last frame exceeds the limit, if the continuation
+		 * frames are inflated as well. */
+		memset(&client_data, 0, sizeof(client_data));
+		client = mg_connect_websocket_client_extensions(
+		    "127.0.0.1",
+		    8080,
+		    0,
+		    ebuf,
+		    sizeof(ebuf),
+		    "/stream",
+		    NULL,
+		    "permessage-deflate",
+		    stream_client_data,
+		    websocket_client_close_handler,
+		    &client_data);
+		ck_assert(client != NULL);
+		deflate_stream_send(client, big, 1200000, 3, &client_data);
+		for (i = 0; (i < 10) && (client_data.closed == 0); i++) {
+			test_sleep(1);
+		}
+		ck_assert_int_eq(client_data.closed, 1);
+		ck_assert_ptr_eq(client_data.data, NULL);
+		mg_close_connection(client);
+#endif
+
+		test_mg_stop(ctx, __LINE__);
+	}
+	free(big);
 
 	mark_point();
 }
 END_TEST
+#endif
 
 
 START_TEST(test_init_library)
@@ -5167,6 +7579,17 @@ make_public_server_suite(void)
 	TCase *const tcase_error_handling = tcase_create("Error handling");
 	TCase *const tcase_error_log = tcase_create("Error logging");
 	TCase *const tcase_throttle = tcase_create("Limit speed");
+	TCase *const tcase_client_limits = tcase_create("Client limits");
+#if defined(USE_WEBSOCKET) && defined(__linux__)
+	TCase *const tcase_websocket_reactor = tcase_create("Websocket reactor");
+#endif
+#if defined(USE_WEBSOCKET)
+	TCase *const tcase_websocket_broadcast =
+	    tcase_create("Websocket broadcast");
+	TCase *const tcase_websocket_send_queue =
+	    tcase_create("Websocket send queue");
+	TCase *const tcase_websocket_stream = tcase_create("Websocket stream");
+#endif
 	TCase *const tcase_large_file = tcase_create("Large file");
 	TCase *const tcase_file_in_mem = tcase_create("File in memory");
 
@@ -5202,6 +7625,9 @@ make_public_server_suite(void)
 	suite_add_tcase(suite, tcase_minimal_https_cli);
 
 	tcase_add_test(tcase_startstophttp, test_mg_start_stop_http_server);
+#if defined(USE_REUSEPORT_ACCEPTORS)
+	tcase_add_test(tcase_startstophttp, test_acceptor_threads);
+#endif
 	tcase_set_timeout(tcase_startstophttp, civetweb_min_server_test_timeout);
 	suite_add_tcase(suite, tcase_startstophttp);
 
@@ -5221,6 +7647,29 @@ make_public_server_suite(void)
 	suite_add_tcase(suite, tcase_serverandclienttls);
 
 	tcase_add_test(tcase_serverrequests, test_request_handlers);
+	tcase_add_test(tcase_serverrequests, test_mg_writev);
+	tcase_add_test(tcase_serverrequests, test_output_buffering);
+#if !defined(NO_FILES) && !defined(NO_FILE_CACHE) && !defined(_WIN32)
+	tcase_add_test(tcase_serverrequests, test_file_cache);
+#endif
+#if defined(USE_ZLIB) && !defined(NO_FILES)
+	tcase_add_test(tcase_serverrequests, test_compression_cache);
+#endif
+#if !defined(NO_FILES)
+	tcase_add_test(tcase_serverrequests, test_precompressed_files);
+#endif
+#if !defined(NO_FILES) && !defined(NO_RESPONSE_CACHE)
+	tcase_add_test(tcase_serverrequests, test_response_cache);
+#endif
+#if !defined(NO_FILES) && !defined(_WIN32)
+	tcase_add_test(tcase_serverrequests, test_directory_listing);
+#endif
+#if !defined(NO_FILES)
+	tcase_add_test(tcase_serverrequests, test_byte_ranges);
+#endif
+#if !defined(NO_FILES) && !defined(_WIN32)
+	tcase_add_test(tcase_serverrequests, test_send_file_mmap);
+#endif
 	tcase_set_timeout(tcase_serverrequests, civetweb_mid_server_test_timeout);
 	suite_add_tcase(suite, tcase_serverrequests);
 
@@ -5237,6 +7686,9 @@ make_public_server_suite(void)
 	suite_add_tcase(suite, tcase_http_auth);
 
 	tcase_add_test(tcase_keep_alive, test_keep_alive);
+#if defined(USE_KEEP_ALIVE_PARKING)
+	tcase_add_test(tcase_keep_alive, test_keep_alive_parking);
+#endif
 	tcase_set_timeout(tcase_keep_alive, civetweb_mid_server_test_timeout);
 	suite_add_tcase(suite, tcase_keep_alive);
 
@@ -5249,9 +7701,42 @@ make_public_server_suite(void)
 	suite_add_tcase(suite, tcase_error_log);
 
 	tcase_add_test(tcase_throttle, test_throttle);
+#if !defined(NO_FILES)
+	tcase_add_test(tcase_throttle, test_throttle_shared);
+#endif
 	tcase_set_timeout(tcase_throttle, civetweb_mid_server_test_timeout);
 	suite_add_tcase(suite, tcase_throttle);
 
+	tcase_add_test(tcase_client_limits, test_client_limits);
+	tcase_set_timeout(tcase_client_limits, civetweb_min_server_test_timeout);
+	suite_add_tcase(suite, tcase_client_limits);
+
+#if defined(USE_WEBSOCKET) && defined(__linux__)
+	tcase_add_test(tcase_websocket_reactor, test_websocket_reactor);
+	tcase_set_timeout(tcase_websocket_reactor, civetweb_mid_server_test_timeout);
+	suite_add_tcase(suite, tcase_websocket_reactor);
+#endif
+
+#if defined(USE_WEBSOCKET)
+	tcase_add_test(tcase_websocket_broadcast, test_websocket_broadcast);
+	tcase_set_timeout(tcase_websocket_broadcast,
+	                  civetweb_mid_server_test_timeout);
+	suite_add_tcase(suite, tcase_websocket_broadcast);
+#endif
+
+#if defined(USE_WEBSOCKET)
+	tcase_add_test(tcase_websocket_send_queue, test_websocket_send_queue);
+	tcase_set_timeout(tcase_websocket_send_queue,
+	                  civetweb_mid_server_test_timeout);
+	suite_add_tcase(suite, tcase_websocket_send_queue);
+#endif
+
+#if defined(USE_WEBSOCKET)
+	tcase_add_test(tcase_websocket_stream, test_websocket_stream);
+	tcase_set_timeout(tcase_websocket_stream, civetweb_mid_server_test_timeout);
+	suite_add_tcase(suite, tcase_websocket_stream);
+#endif
+
 	tcase_add_test(tcase_large_file, test_large_file);
 	tcase_set_timeout(tcase_large_file, civetweb_mid_server_test_timeout);
 	suite_add_tcase(suite, tcase_large_file);